@@ -0,0 +1,324 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zahead.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+
+#define KB (1024)
+#define ZAHEAD_BUFSZ	(256*KB)
+
+static cookie_read_function_t zahead_read;
+static cookie_seek_function_t zahead_seek;
+static cookie_close_function_t zahead_close;
+
+static const cookie_io_functions_t zahead_io = {
+	.read = zahead_read,
+	.write = NULL,
+	.seek = zahead_seek,
+	.close = zahead_close,
+};
+
+struct zahead_buf {
+	char *data;
+	size_t len, pos;
+	int error;		// errno if the read failed, else 0
+};
+
+struct zahead {
+	void *cookie;		// Wrapped stream
+	cookie_io_functions_t io;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t produce_cv;	// Room in the ring, unpaused, shutdown
+	pthread_cond_t consume_cv;	// Buffer filled, or producer idle
+
+	struct zahead_buf *bufs;
+	unsigned nbufs;
+	/*
+	 * Buffers [head, tail) hold data; one with len == 0 marks EOF or an
+	 * error, after which the producer stops until the next seek.
+	 */
+	uint64_t head, tail;
+	uint64_t pos;		// Logical offset of the reader
+
+	bool paused;		// A seek is in progress
+	bool busy;		// Producer is inside io.read
+	bool end;		// Producer has queued the EOF/error marker
+	bool shutdown;
+};
+
+static void *
+zahead_producer(void *ah_)
+{
+	struct zahead *ah = ah_;
+	struct zahead_buf *b;
+	ssize_t n;
+	int error;
+
+	pthread_mutex_lock(&ah->lock);
+	for (;;) {
+		while (!ah->shutdown && (ah->paused || ah->end ||
+		    ah->tail - ah->head == ah->nbufs))
+			pthread_cond_wait(&ah->produce_cv, &ah->lock);
+		if (ah->shutdown)
+			break;
+
+		b = &ah->bufs[ah->tail % ah->nbufs];
+		ah->busy = true;
+		pthread_mutex_unlock(&ah->lock);
+
+		n = ah->io.read(ah->cookie, b->data, ZAHEAD_BUFSZ);
+		error = n < 0 ? errno : 0;
+
+		pthread_mutex_lock(&ah->lock);
+		ah->busy = false;
+		b->len = n > 0 ? n : 0;
+		b->pos = 0;
+		b->error = error;
+		if (n <= 0)
+			ah->end = true;
+		ah->tail++;
+		pthread_cond_broadcast(&ah->consume_cv);
+	}
+	pthread_mutex_unlock(&ah->lock);
+	return (NULL);
+}
+
+FILE *
+zahead_fopencookie(void *cookie, const char *mode, cookie_io_functions_t io,
+    unsigned nbufs)
+{
+	struct zahead *ah;
+	unsigned i;
+	FILE *res;
+	int error;
+
+	assert(nbufs > 0);
+
+	ah = calloc(1, sizeof *ah);
+	if (ah == NULL)
+		return (NULL);
+	ah->cookie = cookie;
+	ah->io = io;
+	ah->nbufs = nbufs;
+	pthread_mutex_init(&ah->lock, NULL);
+	pthread_cond_init(&ah->produce_cv, NULL);
+	pthread_cond_init(&ah->consume_cv, NULL);
+
+	res = NULL;
+	ah->bufs = calloc(nbufs, sizeof *ah->bufs);
+	if (ah->bufs == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nbufs; i++) {
+		ah->bufs[i].data = malloc(ZAHEAD_BUFSZ);
+		if (ah->bufs[i].data == NULL) {
+			errno = ENOMEM;
+			goto out;
+		}
+	}
+
+	/* Nothing is read until the stream exists, so failure is clean. */
+	ah->paused = true;
+	error = pthread_create(&ah->thread, NULL, zahead_producer, ah);
+	if (error != 0) {
+		errno = error;
+		goto out;
+	}
+	res = fopencookie(ah, mode, zahead_io);
+
+	pthread_mutex_lock(&ah->lock);
+	if (res == NULL)
+		ah->shutdown = true;
+	ah->paused = false;
+	pthread_cond_signal(&ah->produce_cv);
+	pthread_mutex_unlock(&ah->lock);
+	if (res == NULL)
+		pthread_join(ah->thread, NULL);
+
+out:
+	if (res == NULL) {
+		if (ah->bufs != NULL)
+			for (i = 0; i < nbufs; i++)
+				free(ah->bufs[i].data);
+		free(ah->bufs);
+		pthread_cond_destroy(&ah->consume_cv);
+		pthread_cond_destroy(&ah->produce_cv);
+		pthread_mutex_destroy(&ah->lock);
+		free(ah);
+	}
+	return (res);
+}
+
+// Return number of bytes into buf, 0 on EOF, -1 on error.
+static ssize_t
+zahead_read(void *ah_, char *buf, size_t size)
+{
+	struct zahead *ah = ah_;
+	struct zahead_buf *b;
+	ssize_t total = 0;
+	size_t n;
+
+	pthread_mutex_lock(&ah->lock);
+	while (size > 0) {
+		while (ah->head == ah->tail)
+			pthread_cond_wait(&ah->consume_cv, &ah->lock);
+
+		b = &ah->bufs[ah->head % ah->nbufs];
+		if (b->len == 0) {
+			/*
+			 * EOF, or an error: report it once, as the wrapped
+			 * stream would, and EOF after that.
+			 */
+			if (total == 0 && b->error != 0) {
+				errno = b->error;
+				b->error = 0;
+				total = -1;
+			}
+			break;
+		}
+
+		/* The producer never touches the head buffer. */
+		pthread_mutex_unlock(&ah->lock);
+		n = min(size, b->len - b->pos);
+		memcpy(buf, b->data + b->pos, n);
+		buf += n;
+		size -= n;
+		total += n;
+		b->pos += n;
+		pthread_mutex_lock(&ah->lock);
+
+		ah->pos += n;
+		if (b->pos == b->len) {
+			ah->head++;
+			pthread_cond_signal(&ah->produce_cv);
+		}
+	}
+	pthread_mutex_unlock(&ah->lock);
+	return (total);
+}
+
+static int
+zahead_seek(void *ah_, off64_t *offset, int whence)
+{
+	struct zahead *ah = ah_;
+	struct zahead_buf *b;
+	uint64_t ahead, skip, i;
+	off64_t target;
+	int rc;
+
+	pthread_mutex_lock(&ah->lock);
+	ah->paused = true;
+	while (ah->busy)
+		pthread_cond_wait(&ah->consume_cv, &ah->lock);
+
+	ahead = 0;
+	for (i = ah->head; i < ah->tail; i++) {
+		b = &ah->bufs[i % ah->nbufs];
+		ahead += b->len - b->pos;
+	}
+
+	rc = 0;
+	target = *offset;
+	if (whence == SEEK_CUR)
+		target += (off64_t)ah->pos;
+	if (whence != SEEK_END && target >= (off64_t)ah->pos &&
+	    (uint64_t)target - ah->pos <= ahead) {
+		/* Within what we've already read ahead (including ftell(3)) */
+		skip = target - ah->pos;
+		ah->pos = target;
+		while (skip > 0) {
+			b = &ah->bufs[ah->head % ah->nbufs];
+			if (skip < b->len - b->pos) {
+				b->pos += skip;
+				break;
+			}
+			skip -= b->len - b->pos;
+			ah->head++;
+		}
+		*offset = target;
+	} else {
+		/*
+		 * The wrapped stream is 'ahead' bytes past the reader; only
+		 * throw the read-ahead away once its seek has succeeded.
+		 */
+		if (whence != SEEK_END)
+			whence = SEEK_SET;
+		else
+			target = *offset;
+		rc = ah->io.seek(ah->cookie, &target, whence);
+		if (rc == 0) {
+			ah->head = ah->tail;
+			ah->end = false;
+			ah->pos = target;
+			*offset = target;
+		} else {
+			/* A failed forward skip can still move the stream. */
+			target = 0;
+			if (ah->io.seek(ah->cookie, &target, SEEK_CUR) == 0 &&
+			    (uint64_t)target != ah->pos + ahead) {
+				ah->head = ah->tail;
+				ah->end = false;
+				ah->pos = target;
+			}
+		}
+	}
+
+	ah->paused = false;
+	pthread_cond_signal(&ah->produce_cv);
+	pthread_mutex_unlock(&ah->lock);
+	return (rc);
+}
+
+static int
+zahead_close(void *ah_)
+{
+	struct zahead *ah = ah_;
+	unsigned i;
+	int rc;
+
+	pthread_mutex_lock(&ah->lock);
+	ah->shutdown = true;
+	pthread_cond_signal(&ah->produce_cv);
+	pthread_mutex_unlock(&ah->lock);
+	pthread_join(ah->thread, NULL);
+
+	rc = ah->io.close(ah->cookie);
+
+	for (i = 0; i < ah->nbufs; i++)
+		free(ah->bufs[i].data);
+	free(ah->bufs);
+	pthread_cond_destroy(&ah->consume_cv);
+	pthread_cond_destroy(&ah->produce_cv);
+	pthread_mutex_destroy(&ah->lock);
+	free(ah);
+	return (rc);
+}
@@ -0,0 +1,27 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZAHEAD_H
+#define ZAHEAD_H
+
+#include <stdio.h>
+
+/*
+ * Read-ahead wrapper for a read-only cookie stream: a producer thread calls
+ * the wrapped read function into a ring of 'nbufs' buffers while the
+ * caller's fread() just copies out whatever is ready.  Seeks pause the
+ * producer; those landing inside the read-ahead data are satisfied from it,
+ * others are handed to the wrapped seek function.
+ *
+ * On success the returned FILE owns 'cookie' (its close function is called
+ * by fclose()).  On failure, NULL is returned and 'cookie' is untouched.
+ */
+FILE *zahead_fopencookie(void *cookie, const char *mode,
+    cookie_io_functions_t io, unsigned nbufs);
+
+#endif
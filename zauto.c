@@ -0,0 +1,228 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zauto.h"
+#include "zfile.h"
+#include "zstdfile.h"
+
+#define KB		1024
+
+/* Enough to tell the formats below apart (xz's magic is the longest). */
+#define ZAUTO_PEEK	6
+
+/*
+ * Inner layers read their input at least this much at a time, which covers
+ * the readers' default output buffers (so the layer underneath can decode
+ * straight into the reads).
+ */
+#define ZAUTO_LINK	(256*KB)
+
+static const struct {
+	enum zauto_codec codec;
+	const char *name;
+	unsigned char magic[ZAUTO_PEEK];
+	size_t len;
+} zauto_magic[] = {
+	{ ZAUTO_GZIP, "gzip", { 0x1f, 0x8b, 0x08 }, 3 },
+	{ ZAUTO_ZSTD, "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4 },
+	{ ZAUTO_XZ, "xz", { 0xfd, '7', 'z', 'X', 'Z', 0x00 }, 6 },
+	{ ZAUTO_LZ4, "lz4", { 0x04, 0x22, 0x4d, 0x18 }, 4 },
+	/* ... followed by the block size, '1' to '9' */
+	{ ZAUTO_BZIP2, "bzip2", { 'B', 'Z', 'h' }, 3 },
+};
+
+#define nitems(x)	(sizeof(x) / sizeof((x)[0]))
+
+const char *
+zauto_codec_name(enum zauto_codec codec)
+{
+	size_t i;
+
+	for (i = 0; i < nitems(zauto_magic); i++)
+		if (zauto_magic[i].codec == codec)
+			return (zauto_magic[i].name);
+	return ("none");
+}
+
+enum zauto_codec
+zauto_sniff(const void *buf, size_t len)
+{
+	const unsigned char *peek = buf;
+	size_t i;
+
+	for (i = 0; i < nitems(zauto_magic); i++) {
+		if (len < zauto_magic[i].len ||
+		    memcmp(peek, zauto_magic[i].magic, zauto_magic[i].len) != 0)
+			continue;
+		if (zauto_magic[i].codec == ZAUTO_BZIP2 &&
+		    (len <= 3 || peek[3] < '1' || peek[3] > '9'))
+			continue;
+		return (zauto_magic[i].codec);
+	}
+	return (ZAUTO_NONE);
+}
+
+static size_t
+zauto_max(size_t a, size_t b)
+{
+
+	return (a > b ? a : b);
+}
+
+/*
+ * Peel layers off 'in' (opened from 'path', if non-NULL, and then closed on
+ * failure as well).
+ */
+static FILE *
+zauto_stack(FILE *in, const char *mode, const struct zauto_opts *opts,
+    struct zauto_info *info, const char *path)
+{
+	struct zfile_opts gz;
+	struct zstdfile_opts zs;
+	struct zauto_info dflt_info;
+	unsigned char peek[ZAUTO_PEEK];
+	char *idxpath, *gzipath;
+	enum zauto_codec codec;
+	unsigned max;
+	size_t n, link;
+	FILE *top, *next;
+	int serrno;
+
+	if (info == NULL)
+		info = &dflt_info;
+	memset(info, 0, sizeof *info);
+
+	memset(&gz, 0, sizeof gz);
+	memset(&zs, 0, sizeof zs);
+	max = ZAUTO_LAYERS_MAX;
+	if (opts != NULL) {
+		if (opts->gzip != NULL)
+			gz = *opts->gzip;
+		if (opts->zstd != NULL)
+			zs = *opts->zstd;
+		if (opts->max_layers != 0 && opts->max_layers < max)
+			max = opts->max_layers;
+	}
+
+	/* As zopen_opts() / zstdopen_opts(), for the file itself. */
+	idxpath = gzipath = NULL;
+	if (path != NULL) {
+		if (asprintf(&idxpath, "%s.idx", path) < 0)
+			idxpath = NULL;
+		if (asprintf(&gzipath, "%s.gzi", path) < 0)
+			gzipath = NULL;
+		if (gz.index_path == NULL)
+			gz.index_path = idxpath;
+		if (zs.index_path == NULL)
+			zs.index_path = idxpath;
+		if (gz.gzi_path == NULL)
+			gz.gzi_path = gzipath;
+	}
+
+	top = in;
+	link = 0;
+	for (;;) {
+		n = fread(peek, 1, sizeof peek, top);
+		if (ferror(top)) {
+			errno = EIO;
+			goto fail;
+		}
+		codec = zauto_sniff(peek, n);
+		if ((codec != ZAUTO_GZIP && codec != ZAUTO_ZSTD) ||
+		    info->nlayers == max) {
+			/*
+			 * Give the innermost stream its bytes back.  (More
+			 * than one byte of push-back is an extension, but
+			 * glibc and the BSDs all have it.)
+			 */
+			while (n > 0)
+				if (ungetc(peek[--n], top) == EOF) {
+					errno = EIO;
+					goto fail;
+				}
+			info->rest = codec;
+			break;
+		}
+
+		if (info->nlayers > 0) {
+			gz.inbuf_size = zauto_max(gz.inbuf_size, link);
+			zs.inbuf_size = zauto_max(zs.inbuf_size, link);
+		}
+		if (codec == ZAUTO_GZIP) {
+			next = zopenfile_peek(top, mode, &gz, peek, n);
+			link = zauto_max(gz.outbuf_size, ZAUTO_LINK);
+			gz.header = NULL;
+		} else {
+			next = zstdopenfile_peek(top, mode, &zs, peek, n);
+			link = zauto_max(zs.outbuf_size, ZAUTO_LINK);
+		}
+		if (next == NULL)
+			goto fail;
+		info->layer[info->nlayers++] = codec;
+		top = next;
+
+		/* The rest are read from a reader, not from a file. */
+		gz.index_path = zs.index_path = NULL;
+		gz.index_save = zs.index_save = false;
+		gz.gzi_path = NULL;
+		gz.use_mmap = zs.use_mmap = false;
+		gz.prefetch = zs.prefetch = 0;
+	}
+
+	free(idxpath);
+	free(gzipath);
+	return (top);
+
+fail:
+	serrno = errno;
+	if (top != in)
+		fclose(top);
+	else if (path != NULL)
+		fclose(in);
+	free(idxpath);
+	free(gzipath);
+	errno = serrno;
+	return (NULL);
+}
+
+FILE *
+zauto_openfile(FILE *in, const char *mode, const struct zauto_opts *opts,
+    struct zauto_info *info)
+{
+
+	if (strstr(mode, "w") || strstr(mode, "a")) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	return (zauto_stack(in, mode, opts, info, NULL));
+}
+
+FILE *
+zauto_open(const char *path, const char *mode, const struct zauto_opts *opts,
+    struct zauto_info *info)
+{
+	FILE *in;
+
+	if (strstr(mode, "w") || strstr(mode, "a")) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	in = fopen(path, mode);
+	if (in == NULL)
+		return (NULL);
+	return (zauto_stack(in, mode, opts, info, path));
+}
@@ -0,0 +1,91 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZAUTO_H
+#define ZAUTO_H
+
+#include <stdio.h>
+
+#include "zfile.h"
+#include "zstdfile.h"
+
+/*
+ * One opener for any stack of compression layers (gzip of zstd of ...).
+ * Each layer's magic is sniffed once, from a few bytes read ahead that are
+ * then handed to the layer's reader (zopenfile_peek() / zstdopenfile_peek())
+ * rather than reread, so the input need not be seekable.  Where the layers
+ * end, the bytes read ahead are pushed back onto the innermost stream with
+ * ungetc(3).
+ *
+ * Inner layers are sized so that each reader's input reads are at least as
+ * large as the output buffer of the layer under it, which then decodes
+ * straight into them: the stack makes about one copy in all, not one per
+ * layer.
+ */
+enum zauto_codec {
+	ZAUTO_NONE = 0,		// Not (or no longer) compressed
+	ZAUTO_GZIP,
+	ZAUTO_ZSTD,
+	/* Recognized, but there is no decoder for these */
+	ZAUTO_XZ,
+	ZAUTO_LZ4,
+	ZAUTO_BZIP2,
+};
+
+#define ZAUTO_LAYERS_MAX	8
+
+/* Optional tunables for zauto_open() / zauto_openfile(). */
+struct zauto_opts {
+	/*
+	 * Options for the gzip and zstd layers (either may be NULL).  Those
+	 * tied to the file itself (index sidecars, 'gzi_path', 'use_mmap',
+	 * 'prefetch') apply only to the outermost layer, and 'header' to
+	 * the outermost gzip one.
+	 */
+	const struct zfile_opts *gzip;
+	const struct zstdfile_opts *zstd;
+
+	/* Decode at most this many layers; 0 (or more) is ZAUTO_LAYERS_MAX. */
+	unsigned max_layers;
+};
+
+/* What zauto_open() / zauto_openfile() found. */
+struct zauto_info {
+	unsigned nlayers;
+	enum zauto_codec layer[ZAUTO_LAYERS_MAX];	// Outermost first
+	/*
+	 * The format of the stream returned, as far as its magic tells: a
+	 * layer that was left encoded (no decoder, or 'max_layers' reached),
+	 * else ZAUTO_NONE.
+	 */
+	enum zauto_codec rest;
+};
+
+/*
+ * Open 'path' (or 'in') for reading, decoding every layer of compression
+ * found.  'opts' and 'info' may be NULL.  An uncompressed input is returned
+ * as is.  Closing the result closes all layers, 'in' included.
+ *
+ * On failure, NULL is returned with errno set.  Layers already opened are
+ * closed, and 'in' with them; if there were none, 'in' is left open.
+ */
+FILE *zauto_open(const char *path, const char *mode,
+    const struct zauto_opts *opts, struct zauto_info *info);
+FILE *zauto_openfile(FILE *in, const char *mode,
+    const struct zauto_opts *opts, struct zauto_info *info);
+
+/* "gzip", "zstd", ..., or "none". */
+const char *zauto_codec_name(enum zauto_codec);
+
+/*
+ * Which format do the first 'len' bytes of a stream, 'buf', start?  6 bytes
+ * are enough to tell.
+ */
+enum zauto_codec zauto_sniff(const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,463 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+#include <zstd.h>
+
+#include "zbatch.h"
+
+#define KB		1024
+#define ZBATCH_INBUF	(128*KB)
+#define ZBATCH_OUTBUF	(256*KB)
+
+struct zbatch {
+	const char *const *paths;
+	size_t npaths;
+	size_t next;		// Next file to hand out
+	int stop;		// The callback's value that stopped the run
+	zbatch_fn *fn;
+	void *arg;
+	size_t insz, outsz;
+	unsigned ring;		// Files a worker holds: 1 + 'prefetch'
+};
+
+/* A file a worker has taken, opened unless 'fd' is -1 ('error' then). */
+struct zbatch_ahead {
+	size_t idx;
+	int fd;
+	int error;
+};
+
+struct zbatch_worker {
+	struct zbatch *b;
+	pthread_t thr;
+	bool started;
+
+	/* Kept for the whole run */
+	z_stream strm;
+	bool strm_init;
+	ZSTD_DCtx *dctx;
+	uint8_t *in, *out;
+	struct zbatch_ahead *ahead;	// Ring of 'b->ring'
+	unsigned ahead_first, nahead;
+
+	/* The file being decoded */
+	struct zbatch_file f;
+	int fd;
+	uint64_t inbase;	// Input offset of 'in'
+	size_t inlen, inpos;	// ... bytes in it, and used
+	bool ineof;
+	size_t outlen;		// Output waiting in 'out'
+};
+
+static void
+zbatch_fail(struct zbatch_worker *w, enum zerror_kind kind, int code,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	zerror_vset(&w->f.err, kind, code, w->inbase + w->inpos,
+	    w->f.offset + w->outlen, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Pass a buffer of output to the callback.  Returns its value; the first
+ * non-zero one stops the run.
+ */
+static int
+zbatch_emit(struct zbatch_worker *w, const void *buf, size_t len, bool end)
+{
+	struct zbatch *b = w->b;
+	int rc, zero;
+
+	w->f.end = end;
+	rc = b->fn(b->arg, &w->f, buf, len);
+	w->f.offset += len;
+	if (rc != 0) {
+		zero = 0;
+		(void)__atomic_compare_exchange_n(&b->stop, &zero, rc, false,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	return (rc);
+}
+
+/* Refill 'in' with the file's next bytes.  Returns -1 on a read error. */
+static int
+zbatch_fill(struct zbatch_worker *w)
+{
+	size_t len;
+	ssize_t n;
+
+	w->inbase += w->inlen;
+	w->inlen = w->inpos = 0;
+	for (len = 0; len < w->b->insz; len += n) {
+		n = read(w->fd, w->in + len, w->b->insz - len);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0) {
+			zbatch_fail(w, ZERROR_IO, errno, "%s: read: %s",
+			    w->f.path, strerror(errno));
+			return (-1);
+		}
+		if (n == 0) {
+			w->ineof = true;
+			break;
+		}
+	}
+	w->inlen = len;
+	return (0);
+}
+
+/*
+ * The decoders return 0 at the end of the file, with the rest of the output
+ * in 'out'; -1 if the file failed (likewise); or 1 if the callback stopped
+ * the run, or already had the end.
+ */
+
+/* Not compressed (that we can decode): hand out the input as it is. */
+static int
+zbatch_copy(struct zbatch_worker *w)
+{
+
+	while (!w->ineof) {
+		if (zbatch_emit(w, w->in, w->inlen, false) != 0)
+			return (1);
+		if (zbatch_fill(w) != 0)
+			return (-1);
+	}
+	(void)zbatch_emit(w, w->in, w->inlen, true);
+	return (1);
+}
+
+/* Every gzip member; trailing bytes that don't start one are ignored. */
+static int
+zbatch_inflate(struct zbatch_worker *w)
+{
+	z_stream *s = &w->strm;
+	int ret;
+
+	(void)inflateReset(s);
+	s->next_in = w->in;
+	s->avail_in = w->inlen;
+	for (;;) {
+		if (s->avail_in == 0 && !w->ineof) {
+			if (zbatch_fill(w) != 0)
+				return (-1);
+			s->next_in = w->in;
+			s->avail_in = w->inlen;
+		}
+		s->next_out = w->out + w->outlen;
+		s->avail_out = w->b->outsz - w->outlen;
+		ret = inflate(s, Z_NO_FLUSH);
+		w->outlen = s->next_out - w->out;
+		w->inpos = s->next_in - w->in;
+
+		if (ret == Z_STREAM_END) {
+			if (s->avail_in == 0 && !w->ineof) {
+				if (zbatch_fill(w) != 0)
+					return (-1);
+				s->next_in = w->in;
+				s->avail_in = w->inlen;
+			}
+			if (s->avail_in == 0 || s->next_in[0] != 0x1f)
+				return (0);
+			(void)inflateReset(s);
+		} else if (ret == Z_BUF_ERROR) {
+			/* No progress: out of input, as 'out' has room. */
+			if (w->ineof) {
+				zbatch_fail(w, ZERROR_TRUNCATED, ENOBUFS,
+				    "%s: gzip: unexpected end of input",
+				    w->f.path);
+				return (-1);
+			}
+		} else if (ret == Z_MEM_ERROR) {
+			zbatch_fail(w, ZERROR_NOMEM, ENOMEM, "%s: gzip: %s",
+			    w->f.path, zError(ret));
+			return (-1);
+		} else if (ret != Z_OK) {
+			zbatch_fail(w, s->msg != NULL &&
+			    strstr(s->msg, "check") != NULL ? ZERROR_CHECKSUM :
+			    ZERROR_CORRUPT, EBADMSG, "%s: gzip: %s", w->f.path,
+			    s->msg != NULL ? s->msg : zError(ret));
+			return (-1);
+		}
+
+		if (w->outlen == w->b->outsz) {
+			if (zbatch_emit(w, w->out, w->outlen, false) != 0)
+				return (1);
+			w->outlen = 0;
+		}
+	}
+}
+
+/* Every zstd frame (and skippable frame). */
+static int
+zbatch_zstd(struct zbatch_worker *w)
+{
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+	enum zerror_kind kind;
+	size_t ret;
+	int code;
+
+	(void)ZSTD_DCtx_reset(w->dctx, ZSTD_reset_session_only);
+	ib.src = w->in;
+	ib.size = w->inlen;
+	ib.pos = 0;
+	ret = 1;
+	for (;;) {
+		if (ib.pos == ib.size && !w->ineof) {
+			if (zbatch_fill(w) != 0)
+				return (-1);
+			ib.size = w->inlen;
+			ib.pos = 0;
+		}
+		/* The last frame ended (and was flushed) with the input. */
+		if (ib.pos == ib.size && w->ineof && ret == 0)
+			return (0);
+		ob.dst = w->out;
+		ob.size = w->b->outsz;
+		ob.pos = w->outlen;
+		ret = ZSTD_decompressStream(w->dctx, &ob, &ib);
+		w->outlen = ob.pos;
+		w->inpos = ib.pos;
+
+		if (ZSTD_isError(ret)) {
+			kind = zstdfile_error_kind(ret, &code);
+			zbatch_fail(w, kind, code, "%s: zstd: %s", w->f.path,
+			    ZSTD_getErrorName(ret));
+			return (-1);
+		}
+		if (ib.pos == ib.size && w->ineof && ob.pos < ob.size &&
+		    ret != 0) {
+			zbatch_fail(w, ZERROR_TRUNCATED, ENOBUFS,
+			    "%s: zstd: unexpected end of input", w->f.path);
+			return (-1);
+		}
+
+		if (w->outlen == w->b->outsz) {
+			if (zbatch_emit(w, w->out, w->outlen, false) != 0)
+				return (1);
+			w->outlen = 0;
+		}
+	}
+}
+
+static void
+zbatch_file(struct zbatch_worker *w, const struct zbatch_ahead *a)
+{
+	struct zbatch_file *f = &w->f;
+	int rc;
+
+	f->idx = a->idx;
+	f->path = w->b->paths[a->idx];
+	f->codec = ZAUTO_NONE;
+	f->offset = 0;
+	memset(&f->err, 0, sizeof f->err);
+	w->fd = a->fd;
+	w->inbase = 0;
+	w->inlen = w->inpos = 0;
+	w->ineof = false;
+	w->outlen = 0;
+
+	if (w->fd < 0) {
+		zbatch_fail(w, ZERROR_IO, a->error, "%s: %s", f->path,
+		    strerror(a->error));
+		rc = -1;
+	} else if (zbatch_fill(w) != 0)
+		rc = -1;
+	else {
+		f->codec = zauto_sniff(w->in, w->inlen);
+		switch (f->codec) {
+		case ZAUTO_GZIP:
+			rc = zbatch_inflate(w);
+			break;
+		case ZAUTO_ZSTD:
+			rc = zbatch_zstd(w);
+			break;
+		default:
+			rc = zbatch_copy(w);
+			break;
+		}
+	}
+	if (rc <= 0)
+		(void)zbatch_emit(w, w->out, w->outlen, true);
+	if (w->fd >= 0)
+		close(w->fd);
+}
+
+/* Take the next file to the end of the worker's ring, and open it. */
+static bool
+zbatch_take(struct zbatch_worker *w)
+{
+	struct zbatch *b = w->b;
+	struct zbatch_ahead *a;
+	size_t idx;
+
+	if (__atomic_load_n(&b->stop, __ATOMIC_RELAXED) != 0)
+		return (false);
+	idx = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+	if (idx >= b->npaths)
+		return (false);
+
+	a = &w->ahead[(w->ahead_first + w->nahead++) % b->ring];
+	a->idx = idx;
+	a->fd = open(b->paths[idx], O_RDONLY | O_CLOEXEC);
+	a->error = a->fd < 0 ? errno : 0;
+	/* Have the kernel read it in while we decode those before it. */
+	if (a->fd >= 0 && b->ring > 1)
+		(void)posix_fadvise(a->fd, 0, b->insz, POSIX_FADV_WILLNEED);
+	return (true);
+}
+
+static void *
+zbatch_work(void *arg)
+{
+	struct zbatch_worker *w = arg;
+	struct zbatch_ahead a;
+
+	for (;;) {
+		while (w->nahead < w->b->ring && zbatch_take(w))
+			;
+		if (w->nahead == 0)
+			break;
+		a = w->ahead[w->ahead_first];
+		w->ahead_first = (w->ahead_first + 1) % w->b->ring;
+		w->nahead--;
+		/* Once stopped, only close what was taken. */
+		if (__atomic_load_n(&w->b->stop, __ATOMIC_RELAXED) != 0) {
+			if (a.fd >= 0)
+				close(a.fd);
+			continue;
+		}
+		zbatch_file(w, &a);
+	}
+	return (NULL);
+}
+
+static void
+zbatch_worker_free(struct zbatch_worker *w)
+{
+
+	if (w->strm_init)
+		(void)inflateEnd(&w->strm);
+	ZSTD_freeDCtx(w->dctx);
+	free(w->in);
+	free(w->out);
+	free(w->ahead);
+}
+
+static int
+zbatch_worker_init(struct zbatch_worker *w, struct zbatch *b,
+    const struct zbatch_opts *opts, unsigned id)
+{
+
+	memset(w, 0, sizeof *w);
+	w->b = b;
+	w->f.worker = id;
+	w->in = malloc(b->insz);
+	w->out = malloc(b->outsz);
+	w->ahead = malloc(b->ring * sizeof *w->ahead);
+	w->dctx = ZSTD_createDCtx();
+	if (w->in == NULL || w->out == NULL || w->ahead == NULL ||
+	    w->dctx == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (zstdfile_dctx_setup(w->dctx, opts != NULL ? opts->zstd : NULL) != 0)
+		return (-1);
+	/* gzip only (15 + 16): headers and trailers are checked by zlib. */
+	if (inflateInit2(&w->strm, 15 + 16) != Z_OK) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	w->strm_init = true;
+	return (0);
+}
+
+int
+zbatch_run(const char *const *paths, size_t npaths,
+    const struct zbatch_opts *opts, zbatch_fn *fn, void *arg)
+{
+	struct zbatch_worker *w;
+	struct zbatch b;
+	unsigned i, nthreads;
+	long ncpu;
+	int serrno;
+
+	memset(&b, 0, sizeof b);
+	b.paths = paths;
+	b.npaths = npaths;
+	b.fn = fn;
+	b.arg = arg;
+	b.insz = opts != NULL && opts->inbuf_size != 0 ? opts->inbuf_size :
+	    ZBATCH_INBUF;
+	b.outsz = opts != NULL && opts->outbuf_size != 0 ? opts->outbuf_size :
+	    ZBATCH_OUTBUF;
+	b.ring = 1 + (opts != NULL ? opts->prefetch : 0);
+
+	nthreads = opts != NULL ? opts->threads : 0;
+	if (nthreads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? ncpu : 1;
+	}
+	if (nthreads > npaths)
+		nthreads = npaths > 0 ? npaths : 1;
+
+	w = calloc(nthreads, sizeof *w);
+	if (w == NULL)
+		return (-1);
+	for (i = 0; i < nthreads; i++)
+		if (zbatch_worker_init(&w[i], &b, opts, i) != 0)
+			goto fail;
+
+	/*
+	 * The caller's thread is worker 0.  Should a thread not start, the
+	 * others do its share.
+	 */
+	for (i = 1; i < nthreads; i++)
+		w[i].started = pthread_create(&w[i].thr, NULL, zbatch_work,
+		    &w[i]) == 0;
+	(void)zbatch_work(&w[0]);
+	for (i = 1; i < nthreads; i++)
+		if (w[i].started)
+			pthread_join(w[i].thr, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		zbatch_worker_free(&w[i]);
+	free(w);
+	return (b.stop);
+
+fail:
+	serrno = errno;
+	/* (Those not reached are still zeroed.) */
+	for (i = 0; i < nthreads; i++)
+		zbatch_worker_free(&w[i]);
+	free(w);
+	errno = serrno;
+	return (-1);
+}
@@ -0,0 +1,88 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZBATCH_H
+#define ZBATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zauto.h"
+#include "zerror.h"
+#include "zstdfile.h"
+
+/*
+ * Decode many (typically small) gzip or zstd files, for callers that would
+ * otherwise zopen() each one in turn and find that the per-file setup (a
+ * FILE, a cookie and its buffers, sniffing and rewinding) costs more than
+ * the decoding.  zbatch_run() hands the files out to worker threads, each of
+ * which keeps one inflate stream, one DCtx and one set of buffers for the
+ * whole run.  A worker opens the next 'prefetch' files it will take as soon
+ * as it claims them and asks the kernel to read them in (posix_fadvise(2)
+ * WILLNEED) while it decodes the current one.
+ *
+ * Each file's output is passed to the callback in order, a buffer at a time,
+ * on the worker's thread; the last call for a file has 'end' set (with what
+ * output is left, possibly none).  A file that fits the buffers, as a small
+ * one does, takes that one call.  The buffer is lent until the callback
+ * returns.  Files are taken in the order given but, with several workers,
+ * run concurrently and finish in any order.
+ *
+ * Each file is sniffed (see zauto_sniff()): one layer of gzip (all members)
+ * or zstd (all frames) is decoded, and anything else is passed through as
+ * it is.  A file that fails (can't be opened or read, or is corrupt,
+ * truncated, etc.) ends with 'err' set as a stream's zerror would be, and
+ * the run goes on with the next one.
+ */
+struct zbatch_file {
+	size_t idx;		// Index into 'paths'
+	const char *path;
+	unsigned worker;	// 0 to 'threads' - 1
+	enum zauto_codec codec;	// As sniffed; decoded if gzip or zstd
+	uint64_t offset;	// Output offset of this buffer
+	bool end;		// Last call for this file
+	struct zerror err;	// If 'end', the file's error (kind ZERROR_NONE)
+};
+
+/*
+ * Return 0 to carry on, or anything else to stop the run: workers finish the
+ * call they are in and take no more files.
+ */
+typedef int zbatch_fn(void *arg, const struct zbatch_file *,
+    const void *buf, size_t len);
+
+struct zbatch_opts {
+	/* Worker threads; 0 is one per online CPU.  1 runs on the caller's. */
+	unsigned threads;
+	/* Files each worker opens and reads ahead of the one it decodes. */
+	unsigned prefetch;
+	/*
+	 * Input and output buffer sizes per worker; 0 selects 128 kB and
+	 * 256 kB.  Files up to 'inbuf_size' are read in one read(2).
+	 */
+	size_t inbuf_size, outbuf_size;
+	/*
+	 * Reading options for zstd ('verify', 'dicts' and 'window_log_max';
+	 * see zstdfile_dctx_setup()).  gzip CRCs are always checked, and a
+	 * mismatch fails the file.
+	 */
+	const struct zstdfile_opts *zstd;
+};
+
+/*
+ * Decode the 'npaths' files at 'paths' (see above); 'opts' may be NULL.
+ * Returns 0 once every file has been through the callback, whether or not
+ * it decoded; the callback's non-zero value if it stopped the run; or -1 with
+ * errno set if the run couldn't start (e.g. out of memory, or the zstd
+ * options are refused).
+ */
+int zbatch_run(const char *const *paths, size_t npaths,
+    const struct zbatch_opts *opts, zbatch_fn *fn, void *arg);
+
+#endif
@@ -0,0 +1,696 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+/*
+ * zbench: measure the gzip and zstd readers.  For each file of a corpus it
+ * generates (or the files named on the command line), report sequential
+ * throughput next to 'gzip -dc' / 'zstd -dc', the latency distribution of
+ * random seeks, the cost of a rewind, memory per open handle, and scaling
+ * with decoder threads and with concurrent streams.
+ *
+ *	zbench [-d dir] [-s MB[,MB...]] [-r runs] [-k seeks] [-j threads]
+ *	    [-t secs] [-i zlib|isal|libdeflate] [file ...]
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
+#include "zfile.h"
+#include "zstdfile.h"
+
+#define KB		(1024)
+#define MB		(1024 * KB)
+
+#define ZBENCH_BUF	(256 * KB)	// Sequential read size
+#define ZBENCH_SEEKLEN	(4 * KB)	// Read after each random seek
+#define ZBENCH_SPAN	(1 * MB)	// gzip index span for seeks
+#define ZBENCH_FRAME	(1 * MB)	// Member / frame size in the corpus
+#define ZBENCH_HANDLES	32		// Handles open for the memory test
+
+enum zbench_codec {
+	ZBENCH_GZIP,
+	ZBENCH_ZSTD,
+};
+
+struct zbench_file {
+	char *path;
+	const char *desc;
+	enum zbench_codec codec;
+};
+
+static unsigned runs = 3;
+static unsigned nseeks = 200;
+static unsigned maxjobs;
+static double budget = 5.0;		// Seconds per seek test, at most
+static enum zfile_inflate inflate_impl;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (*s);
+}
+
+/*
+ * Log-like text: repetitive enough to compress about as well as real logs,
+ * random enough not to collapse.
+ */
+static void
+gen_data(char *buf, size_t len, uint64_t seed)
+{
+	static const char *paths[] = { "users", "orders", "items", "search",
+	    "login", "cart", "health", "metrics" };
+	uint64_t s = seed | 1, r;
+	size_t off = 0;
+	char line[160];
+	int n;
+
+	while (off < len) {
+		r = xorshift(&s);
+		n = snprintf(line, sizeof line, "2013-%02u-%02u %02u:%02u:%02u "
+		    "web%02u app[%u]: GET /api/v%u/%s/%u id=%08x status=%u "
+		    "took=%ums\n", (unsigned)(r % 12) + 1,
+		    (unsigned)(r >> 4) % 28 + 1, (unsigned)(r >> 9) % 24,
+		    (unsigned)(r >> 14) % 60, (unsigned)(r >> 20) % 60,
+		    (unsigned)(r >> 26) % 16, (unsigned)(r >> 30) % 5000,
+		    (unsigned)(r >> 43) % 3 + 1, paths[(r >> 45) % 8],
+		    (unsigned)(r >> 48) % 100000, (unsigned)xorshift(&s),
+		    (r >> 60) == 0 ? 500 : 200, (unsigned)(r >> 52) % 900);
+		if ((size_t)n > len - off)
+			n = len - off;
+		memcpy(buf + off, line, n);
+		off += n;
+	}
+}
+
+static void
+write_gzip(const char *path, const char *data, size_t len,
+    const struct zfile_opts *o, const char *mode)
+{
+	FILE *f;
+
+	f = zopen_opts(path, mode, o, NULL);
+	if (f == NULL)
+		err(1, "%s", path);
+	if (fwrite(data, 1, len, f) != len || fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+static void
+write_zstd(const char *path, const char *data, size_t len,
+    const struct zstdfile_opts *o, const char *mode)
+{
+	FILE *f;
+
+	f = zstdopen_opts(path, mode, o, NULL);
+	if (f == NULL)
+		err(1, "%s", path);
+	if (fwrite(data, 1, len, f) != len || fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+/*
+ * Copy single-member gzip 'src' to 'dst' with an FNAME field, as gzip(1)
+ * writes for a named file.  The CRC covers only the data, so the rest is
+ * unchanged.
+ */
+static void
+add_fname(const char *src, const char *dst)
+{
+	unsigned char hdr[GZ_HDR_SZ];
+	char buf[64 * KB];
+	FILE *in, *out;
+	size_t n;
+
+	in = fopen(src, "r");
+	out = fopen(dst, "w");
+	if (in == NULL || out == NULL)
+		err(1, "%s", dst);
+	if (fread(hdr, 1, sizeof hdr, in) != sizeof hdr)
+		errx(1, "%s: short", src);
+	hdr[3] |= 0x08;
+	fwrite(hdr, 1, sizeof hdr, out);
+	fwrite("corpus.log", 1, sizeof "corpus.log", out);
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+		fwrite(buf, 1, n, out);
+	if (ferror(in) || fclose(out) != 0)
+		err(1, "%s", dst);
+	fclose(in);
+}
+
+static char *
+corpus_path(const char *dir, unsigned mb, const char *name)
+{
+	char *p;
+
+	if (asprintf(&p, "%s/%uM-%s", dir, mb, name) < 0)
+		err(1, "asprintf");
+	return (p);
+}
+
+/*
+ * Write the corpus for 'mb' MB of input into 'dir', appending its files to
+ * 'files'.
+ */
+static size_t
+gen_corpus(const char *dir, unsigned mb, struct zbench_file *files, size_t n)
+{
+	struct zstdfile_opts zo;
+	struct zfile_opts go;
+	size_t len = (size_t)mb * MB;
+	char *data;
+
+	data = malloc(len);
+	if (data == NULL)
+		err(1, "malloc");
+	gen_data(data, len, mb);
+
+	memset(&go, 0, sizeof go);
+	go.threads = maxjobs;
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "single.gz"),
+	    "gzip single-member", ZBENCH_GZIP };
+	write_gzip(files[n++].path, data, len, &go, "w");
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "fname.gz"),
+	    "gzip FNAME", ZBENCH_GZIP };
+	add_fname(files[n - 1].path, files[n].path);
+	n++;
+	go.frame_size = ZBENCH_FRAME;
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "multi.gz"),
+	    "gzip multi-member", ZBENCH_GZIP };
+	write_gzip(files[n++].path, data, len, &go, "w");
+	go.frame_size = 0;
+	go.bgzf = true;
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "bgzf.gz"),
+	    "gzip BGZF", ZBENCH_GZIP };
+	write_gzip(files[n++].path, data, len, &go, "w");
+
+	memset(&zo, 0, sizeof zo);
+	zo.threads = maxjobs;
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "single.zst"),
+	    "zstd single-frame", ZBENCH_ZSTD };
+	write_zstd(files[n++].path, data, len, &zo, "w");
+	/* Appending to a new file: frames, but no seek table. */
+	zo.frame_size = ZBENCH_FRAME;
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "multi.zst"),
+	    "zstd multi-frame", ZBENCH_ZSTD };
+	(void)unlink(files[n].path);
+	write_zstd(files[n++].path, data, len, &zo, "a");
+	files[n] = (struct zbench_file){ corpus_path(dir, mb, "seekable.zst"),
+	    "zstd seekable", ZBENCH_ZSTD };
+	write_zstd(files[n++].path, data, len, &zo, "w");
+
+	free(data);
+	return (n);
+}
+
+static FILE *
+bench_open(const struct zbench_file *bf, unsigned threads, bool index)
+{
+	struct zstdfile_opts zo;
+	struct zfile_opts go;
+	FILE *f;
+
+	if (bf->codec == ZBENCH_GZIP) {
+		memset(&go, 0, sizeof go);
+		go.threads = threads;
+		go.inflate = inflate_impl;
+		if (index)
+			go.index_span = ZBENCH_SPAN;
+		f = zopen_opts(bf->path, "r", &go, NULL);
+	} else {
+		memset(&zo, 0, sizeof zo);
+		zo.threads = threads;
+		f = zstdopen_opts(bf->path, "r", &zo, NULL);
+	}
+	if (f == NULL)
+		err(1, "%s", bf->path);
+	return (f);
+}
+
+static uint64_t
+drain(FILE *f, char *buf)
+{
+	uint64_t total = 0;
+	size_t n;
+
+	while ((n = fread(buf, 1, ZBENCH_BUF, f)) > 0)
+		total += n;
+	if (ferror(f))
+		errx(1, "read error");
+	return (total);
+}
+
+/* Best time to decode all of 'bf', over 'runs' runs. */
+static double
+bench_seq(const struct zbench_file *bf, unsigned threads, uint64_t *lenp)
+{
+	double best = 0, t0, t;
+	unsigned i;
+	char *buf;
+	FILE *f;
+
+	buf = malloc(ZBENCH_BUF);
+	if (buf == NULL)
+		err(1, "malloc");
+	for (i = 0; i < runs; i++) {
+		t0 = now();
+		f = bench_open(bf, threads, false);
+		*lenp = drain(f, buf);
+		fclose(f);
+		t = now() - t0;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	free(buf);
+	return (best);
+}
+
+/* Best time for the command-line tool, or a negative value if missing. */
+static double
+bench_tool(const struct zbench_file *bf)
+{
+	const char *tool = bf->codec == ZBENCH_GZIP ? "gzip" : "zstd";
+	double best = 0, t0, t;
+	char *cmd;
+	unsigned i;
+
+	if (asprintf(&cmd, "command -v %s >/dev/null 2>&1", tool) < 0)
+		err(1, "asprintf");
+	if (system(cmd) != 0) {
+		free(cmd);
+		return (-1);
+	}
+	free(cmd);
+	if (asprintf(&cmd, "%s -dc '%s' >/dev/null", tool, bf->path) < 0)
+		err(1, "asprintf");
+	for (i = 0; i < runs; i++) {
+		t0 = now();
+		if (system(cmd) != 0) {
+			free(cmd);
+			return (-1);
+		}
+		t = now() - t0;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	free(cmd);
+	return (best);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Random seeks, each followed by a small read, after a first pass that
+ * builds the gzip index (BGZF and zstd seek tables need none).  A backward
+ * seek the reader refuses (a single zstd frame) is done the way a caller
+ * would have to, by rewinding first.
+ */
+static void
+bench_seek(const struct zbench_file *bf, uint64_t len)
+{
+	double *lat, t0, tstop, tpass;
+	uint64_t s = 0x9e3779b97f4a7c15ULL, off;
+	unsigned i, n, nrew = 0;
+	char *buf;
+	FILE *f;
+
+	buf = malloc(ZBENCH_BUF);
+	lat = calloc(nseeks, sizeof *lat);
+	if (buf == NULL || lat == NULL)
+		err(1, "malloc");
+
+	t0 = now();
+	f = bench_open(bf, 0, true);
+	(void)drain(f, buf);
+	tpass = now() - t0;
+
+	tstop = now() + budget;
+	for (n = 0; n < nseeks && now() < tstop; n++) {
+		off = len > ZBENCH_SEEKLEN ?
+		    xorshift(&s) % (len - ZBENCH_SEEKLEN) : 0;
+		t0 = now();
+		if (fseeko(f, off, SEEK_SET) != 0) {
+			nrew++;
+			rewind(f);
+			if (fseeko(f, off, SEEK_SET) != 0)
+				err(1, "%s: fseeko", bf->path);
+		}
+		if (fread(buf, 1, ZBENCH_SEEKLEN, f) != ZBENCH_SEEKLEN &&
+		    len > ZBENCH_SEEKLEN)
+			errx(1, "%s: short read after seek", bf->path);
+		lat[n] = now() - t0;
+	}
+	fclose(f);
+
+	qsort(lat, n, sizeof *lat, cmp_double);
+	printf("  seek+%u kB      ", ZBENCH_SEEKLEN / KB);
+	if (n == 0)
+		printf("-\n");
+	else {
+		i = n - 1;
+		printf("p50 %.3f  p90 %.3f  p99 %.3f  max %.3f ms "
+		    "(%u seeks, %u by rewinding; first pass %.2f s)\n",
+		    lat[n / 2] * 1e3, lat[n * 9 / 10] * 1e3,
+		    lat[n * 99 / 100] * 1e3, lat[i] * 1e3, n, nrew, tpass);
+	}
+	free(lat);
+	free(buf);
+}
+
+/* Rewind after reading to the end, and read the first buffer again. */
+static void
+bench_rewind(const struct zbench_file *bf)
+{
+	double best = 0, t0, t;
+	unsigned i;
+	char *buf;
+	FILE *f;
+
+	buf = malloc(ZBENCH_BUF);
+	if (buf == NULL)
+		err(1, "malloc");
+	f = bench_open(bf, 0, false);
+	for (i = 0; i < runs; i++) {
+		(void)drain(f, buf);
+		t0 = now();
+		rewind(f);
+		if (fread(buf, 1, ZBENCH_BUF, f) == 0)
+			errx(1, "%s: nothing after rewind", bf->path);
+		t = now() - t0;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	fclose(f);
+	free(buf);
+	printf("  rewind          %.3f ms\n", best * 1e3);
+}
+
+/*
+ * Heap in use (glibc), else resident set size, in bytes; 0 if unknown.  The
+ * RSS misses buffers allocated but not yet touched and counts freed memory
+ * the allocator kept, so it is only a rough guide.
+ */
+static size_t
+rss(void)
+{
+	unsigned long size, res;
+	FILE *f;
+	int n;
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 mi;
+
+	mi = mallinfo2();
+	return (mi.uordblks + mi.hblkhd);
+#endif
+
+	f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return (0);
+	n = fscanf(f, "%lu %lu", &size, &res);
+	fclose(f);
+	return (n == 2 ? res * (size_t)sysconf(_SC_PAGESIZE) : 0);
+}
+
+/* Memory growth per handle opened and read from (see rss()). */
+static void
+bench_mem(const struct zbench_file *bf)
+{
+	FILE *f[ZBENCH_HANDLES];
+	size_t r0, r1;
+	unsigned i;
+	char c;
+
+	zfile_pool_flush();
+	zstdfile_pool_flush();
+	r0 = rss();
+	for (i = 0; i < ZBENCH_HANDLES; i++) {
+		f[i] = bench_open(bf, 0, false);
+		if (fread(&c, 1, 1, f[i]) != 1)
+			errx(1, "%s: empty", bf->path);
+	}
+	r1 = rss();
+	for (i = 0; i < ZBENCH_HANDLES; i++)
+		fclose(f[i]);
+	if (r0 == 0 || r1 < r0)
+		printf("  memory/handle   -\n");
+	else
+		printf("  memory/handle   %zu kB\n",
+		    (r1 - r0) / ZBENCH_HANDLES / KB);
+}
+
+struct zbench_stream {
+	const struct zbench_file *bf;
+	pthread_t td;
+	uint64_t len;
+};
+
+static void *
+stream_main(void *arg)
+{
+	struct zbench_stream *st = arg;
+	char *buf;
+	FILE *f;
+
+	buf = malloc(ZBENCH_BUF);
+	if (buf == NULL)
+		err(1, "malloc");
+	f = bench_open(st->bf, 0, false);
+	st->len = drain(f, buf);
+	fclose(f);
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Throughput with 1, 2, 4, ... decoder threads on one stream, and with as
+ * many streams decoding at once (one thread each), in aggregate.
+ */
+static void
+bench_scaling(const struct zbench_file *bf)
+{
+	struct zbench_stream *st;
+	uint64_t len, total;
+	double t0, t;
+	unsigned j, i;
+
+	printf("  threads        ");
+	for (j = 1; j <= maxjobs; j *= 2) {
+		t = bench_seq(bf, j, &len);
+		printf(" %u: %.0f", j, len / t / MB);
+	}
+	printf(" MB/s\n");
+
+	st = calloc(maxjobs, sizeof *st);
+	if (st == NULL)
+		err(1, "calloc");
+	printf("  streams        ");
+	for (j = 1; j <= maxjobs; j *= 2) {
+		t0 = now();
+		for (i = 0; i < j; i++) {
+			st[i].bf = bf;
+			if (pthread_create(&st[i].td, NULL, stream_main,
+			    &st[i]) != 0)
+				errx(1, "pthread_create");
+		}
+		total = 0;
+		for (i = 0; i < j; i++) {
+			pthread_join(st[i].td, NULL);
+			total += st[i].len;
+		}
+		t = now() - t0;
+		printf(" %u: %.0f", j, total / t / MB);
+	}
+	printf(" MB/s\n");
+	free(st);
+}
+
+static void
+bench_file(const struct zbench_file *bf)
+{
+	struct stat sb;
+	uint64_t len;
+	double t, tt;
+
+	if (stat(bf->path, &sb) != 0)
+		err(1, "%s", bf->path);
+	t = bench_seq(bf, 0, &len);
+	printf("%s (%s): %.1f MB from %.1f MB\n", bf->path, bf->desc,
+	    (double)len / MB, (double)sb.st_size / MB);
+	printf("  sequential      %.1f MB/s", len / t / MB);
+	tt = bench_tool(bf);
+	if (tt >= 0)
+		printf("  (%s -dc %.1f MB/s)", bf->codec == ZBENCH_GZIP ?
+		    "gzip" : "zstd", len / tt / MB);
+	printf("\n");
+	bench_seek(bf, len);
+	bench_rewind(bf);
+	bench_mem(bf);
+	bench_scaling(bf);
+	fflush(stdout);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: zbench [-d dir] [-s MB[,MB...]] [-r runs] "
+	    "[-k seeks] [-j threads]\n"
+	    "              [-t secs] [-i zlib|isal|libdeflate] [file ...]\n");
+	exit(1);
+}
+
+static enum zbench_codec
+sniff(const char *path)
+{
+	unsigned char m[4];
+	FILE *f;
+	size_t n;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		err(1, "%s", path);
+	n = fread(m, 1, sizeof m, f);
+	fclose(f);
+	if (n == 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f &&
+	    m[3] == 0xfd)
+		return (ZBENCH_ZSTD);
+	if (n < sizeof gz_magic || memcmp(m, gz_magic, sizeof gz_magic) != 0)
+		errx(1, "%s: neither gzip nor zstd", path);
+	return (ZBENCH_GZIP);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct zbench_file *files;
+	const char *dir = NULL, *sizes = "1,16,64";
+	char *list, *tok, *end, tmpl[] = "/tmp/zbench.XXXXXX";
+	size_t nfiles = 0, i;
+	unsigned long mb;
+	long ncpu;
+	int ch;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	maxjobs = ncpu > 0 ? (unsigned)ncpu : 1;
+
+	while ((ch = getopt(argc, argv, "d:i:j:k:r:s:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'i':
+			if (strcmp(optarg, "zlib") == 0)
+				inflate_impl = ZFILE_INFLATE_ZLIB;
+			else if (strcmp(optarg, "isal") == 0)
+				inflate_impl = ZFILE_INFLATE_ISAL;
+			else if (strcmp(optarg, "libdeflate") == 0)
+				inflate_impl = ZFILE_INFLATE_LIBDEFLATE;
+			else
+				usage();
+			break;
+		case 'j':
+			maxjobs = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			nseeks = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 't':
+			budget = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (runs == 0 || maxjobs == 0)
+		usage();
+
+	if (argc > 0) {
+		files = calloc(argc, sizeof *files);
+		if (files == NULL)
+			err(1, "calloc");
+		for (i = 0; i < (size_t)argc; i++) {
+			files[i].path = argv[i];
+			files[i].codec = sniff(argv[i]);
+			files[i].desc = files[i].codec == ZBENCH_GZIP ?
+			    "gzip" : "zstd";
+		}
+		nfiles = argc;
+	} else {
+		if (dir == NULL) {
+			dir = mkdtemp(tmpl);
+			if (dir == NULL)
+				err(1, "mkdtemp");
+		}
+		list = strdup(sizes);
+		if (list == NULL)
+			err(1, "strdup");
+		/* Seven files per size */
+		files = calloc(7 * (strlen(list) + 1), sizeof *files);
+		if (files == NULL)
+			err(1, "calloc");
+		for (tok = strtok(list, ","); tok != NULL;
+		    tok = strtok(NULL, ",")) {
+			mb = strtoul(tok, &end, 10);
+			if (*end != '\0' || mb == 0 || mb > UINT_MAX / MB)
+				usage();
+			fprintf(stderr, "zbench: writing %lu MB corpus in %s\n",
+			    mb, dir);
+			nfiles = gen_corpus(dir, mb, files, nfiles);
+		}
+		free(list);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		bench_file(&files[i]);
+	return (0);
+}
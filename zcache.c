@@ -0,0 +1,343 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zcache.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+
+#define ZCACHE_BUCKETS	4096
+
+struct zcache_ent {
+	struct zcache_id id;
+	uint64_t blk;
+	uint8_t *data;
+	size_t len;
+	unsigned refs;		// Readers copying out of 'data'
+	bool dead;		// Evicted while in use; freed on last release
+	struct zcache_ent *hnext;
+	struct zcache_ent *prev, *next;	// LRU list, most recent first
+};
+
+/*
+ * One lock covers the table, the LRU list and the reference counts; data is
+ * copied out of an entry with the lock dropped and the entry referenced.
+ */
+static struct zcache_ent *zcache_tab[ZCACHE_BUCKETS];
+static struct zcache_ent *zcache_head, *zcache_tail;
+static size_t zcache_budget = ZCACHE_BUDGET, zcache_used;
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+zcache_cost(const struct zcache_ent *e)
+{
+
+	return (sizeof *e + e->len);
+}
+
+static bool
+zcache_id_eq(const struct zcache_id *a, const struct zcache_id *b)
+{
+
+	return (a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	    a->mtime_ns == b->mtime_ns && a->codec == b->codec);
+}
+
+static struct zcache_ent **
+zcache_bucket(const struct zcache_id *id, uint64_t blk)
+{
+	uint64_t h;
+
+	h = (uint64_t)id->ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)id->dev ^
+	    (uint64_t)id->mtime_ns ^ ((uint64_t)id->codec << 56);
+	h ^= blk * 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 31;
+	return (&zcache_tab[h % ZCACHE_BUCKETS]);
+}
+
+/* Called locked.  A hit becomes the most recently used. */
+static struct zcache_ent *
+zcache_find(const struct zcache_id *id, uint64_t blk)
+{
+	struct zcache_ent *e;
+
+	for (e = *zcache_bucket(id, blk); e != NULL; e = e->hnext)
+		if (e->blk == blk && zcache_id_eq(&e->id, id))
+			break;
+	if (e == NULL || e == zcache_head)
+		return (e);
+
+	e->prev->next = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		zcache_tail = e->prev;
+	e->prev = NULL;
+	e->next = zcache_head;
+	zcache_head->prev = e;
+	zcache_head = e;
+	return (e);
+}
+
+static void
+zcache_free_ent(struct zcache_ent *e)
+{
+
+	free(e->data);
+	free(e);
+}
+
+/* Called locked: take 'e' out of the cache, freeing it if unused. */
+static void
+zcache_unlink(struct zcache_ent *e)
+{
+	struct zcache_ent **p;
+
+	for (p = zcache_bucket(&e->id, e->blk); *p != e; p = &(*p)->hnext)
+		;
+	*p = e->hnext;
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		zcache_head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		zcache_tail = e->prev;
+	zcache_used -= zcache_cost(e);
+
+	if (e->refs == 0)
+		zcache_free_ent(e);
+	else
+		e->dead = true;
+}
+
+/* Called locked. */
+static void
+zcache_evict(void)
+{
+
+	while (zcache_used > zcache_budget && zcache_tail != NULL)
+		zcache_unlink(zcache_tail);
+}
+
+void
+zcache_set_budget(size_t bytes)
+{
+
+	pthread_mutex_lock(&zcache_lock);
+	__atomic_store_n(&zcache_budget, bytes, __ATOMIC_RELAXED);
+	zcache_evict();
+	pthread_mutex_unlock(&zcache_lock);
+}
+
+/* Add a block, taking over 'data' (of 'len' bytes, malloc(3)ed). */
+static void
+zcache_insert(const struct zcache_id *id, uint64_t blk, uint8_t *data,
+    size_t len)
+{
+	struct zcache_ent *e, **b;
+
+	e = malloc(sizeof *e);
+	if (e == NULL) {
+		free(data);
+		return;
+	}
+	e->id = *id;
+	e->blk = blk;
+	e->data = data;
+	e->len = len;
+	e->refs = 0;
+	e->dead = false;
+
+	pthread_mutex_lock(&zcache_lock);
+	/* Another reader may have got there first. */
+	if (zcache_find(id, blk) != NULL ||
+	    zcache_cost(e) > zcache_budget) {
+		pthread_mutex_unlock(&zcache_lock);
+		zcache_free_ent(e);
+		return;
+	}
+	b = zcache_bucket(id, blk);
+	e->hnext = *b;
+	*b = e;
+	e->prev = NULL;
+	e->next = zcache_head;
+	if (zcache_head != NULL)
+		zcache_head->prev = e;
+	else
+		zcache_tail = e;
+	zcache_head = e;
+	zcache_used += zcache_cost(e);
+	zcache_evict();
+	pthread_mutex_unlock(&zcache_lock);
+}
+
+void
+zcache_file_init(struct zcache_file *f, FILE *in, unsigned codec)
+{
+	struct stat sb;
+
+	memset(f, 0, sizeof *f);
+	f->len = SIZE_MAX;
+	if (in == NULL || fstat(fileno(in), &sb) != 0 ||
+	    !S_ISREG(sb.st_mode))
+		return;
+	f->id.dev = sb.st_dev;
+	f->id.ino = sb.st_ino;
+	f->id.size = sb.st_size;
+	f->id.mtime_ns = (int64_t)sb.st_mtim.tv_sec * 1000000000 +
+	    sb.st_mtim.tv_nsec;
+	f->id.codec = codec;
+	f->on = true;
+}
+
+void
+zcache_file_free(struct zcache_file *f)
+{
+
+	free(f->buf);
+	f->buf = NULL;
+	f->on = false;
+}
+
+/* Hand the assembled block to the cache. */
+static void
+zcache_flush(struct zcache_file *f)
+{
+	uint8_t *data;
+
+	if (!f->skip && f->len > 0) {
+		data = f->buf;
+		/* Only the last block is short; trimming it is optional. */
+		if (f->len < ZCACHE_BLOCK &&
+		    (data = realloc(f->buf, f->len)) == NULL)
+			data = f->buf;
+		f->buf = NULL;
+		zcache_insert(&f->id, f->blk, data, f->len);
+	}
+	f->len = SIZE_MAX;
+}
+
+void
+zcache_feed(struct zcache_file *f, uint64_t off, const void *p, size_t len)
+{
+	const uint8_t *src = p;
+	uint64_t blk;
+	size_t boff, n;
+
+	if (!f->on || __atomic_load_n(&zcache_budget, __ATOMIC_RELAXED) == 0)
+		return;
+	while (len > 0) {
+		blk = off / ZCACHE_BLOCK;
+		boff = off % ZCACHE_BLOCK;
+		if (f->len == SIZE_MAX || f->blk != blk || f->len != boff) {
+			if (boff != 0) {
+				/* Entered part way through; try the next. */
+				n = min(len, ZCACHE_BLOCK - boff);
+				f->len = SIZE_MAX;
+				src += n;
+				off += n;
+				len -= n;
+				continue;
+			}
+			f->blk = blk;
+			f->len = 0;
+			f->skip = zcache_has(f, off);
+			if (!f->skip && f->buf == NULL &&
+			    (f->buf = malloc(ZCACHE_BLOCK)) == NULL)
+				f->skip = true;
+		}
+
+		n = min(len, ZCACHE_BLOCK - f->len);
+		if (!f->skip)
+			memcpy(f->buf + f->len, src, n);
+		f->len += n;
+		src += n;
+		off += n;
+		len -= n;
+		if (f->len == ZCACHE_BLOCK)
+			zcache_flush(f);
+	}
+}
+
+void
+zcache_feed_end(struct zcache_file *f, uint64_t off)
+{
+
+	if (f->on && f->len != SIZE_MAX &&
+	    f->blk * ZCACHE_BLOCK + f->len == off)
+		zcache_flush(f);
+}
+
+size_t
+zcache_read(struct zcache_file *f, uint64_t off, void *buf, size_t len,
+    bool *endp)
+{
+	struct zcache_ent *e;
+	uint8_t *dst = buf;
+	size_t boff, n, total;
+
+	*endp = false;
+	if (!f->on)
+		return (0);
+	for (total = 0; len > 0; total += n) {
+		boff = off % ZCACHE_BLOCK;
+		pthread_mutex_lock(&zcache_lock);
+		e = zcache_find(&f->id, off / ZCACHE_BLOCK);
+		if (e == NULL || boff >= e->len) {
+			/* Only the last block is short. */
+			*endp = e != NULL && boff == e->len;
+			pthread_mutex_unlock(&zcache_lock);
+			break;
+		}
+		e->refs++;
+		pthread_mutex_unlock(&zcache_lock);
+
+		n = min(len, e->len - boff);
+		memcpy(dst, e->data + boff, n);
+		dst += n;
+		off += n;
+		len -= n;
+
+		pthread_mutex_lock(&zcache_lock);
+		if (--e->refs == 0 && e->dead)
+			zcache_free_ent(e);
+		pthread_mutex_unlock(&zcache_lock);
+	}
+	return (total);
+}
+
+bool
+zcache_has(struct zcache_file *f, uint64_t off)
+{
+	struct zcache_ent *e;
+	bool has;
+
+	if (!f->on)
+		return (false);
+	pthread_mutex_lock(&zcache_lock);
+	e = zcache_find(&f->id, off / ZCACHE_BLOCK);
+	has = e != NULL && off % ZCACHE_BLOCK < e->len;
+	pthread_mutex_unlock(&zcache_lock);
+	return (has);
+}
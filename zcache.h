@@ -0,0 +1,75 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZCACHE_H
+#define ZCACHE_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Process-wide LRU cache of decoded output, shared by every reader opened
+ * with 'cache' in its options, so that handles reading the same file (from
+ * any thread) decode each stretch of it once.  Output is cached in aligned
+ * ZCACHE_BLOCK-byte blocks, keyed by the file's identity (device, inode,
+ * size and mtime, so a rewritten file misses), the codec, and the block's
+ * output offset.  Readers add blocks as they decode them, and serve reads
+ * and seeks from the cache before decoding, restarting at a checkpoint only
+ * when they miss.
+ *
+ * The cache holds at most the budget's worth of blocks (ZCACHE_BUDGET by
+ * default), evicting the least recently used.  zcache_set_budget(0) empties
+ * it and turns it off, e.g. before checking for leaks at exit.
+ */
+#define ZCACHE_BLOCK	(128 * 1024)
+#define ZCACHE_BUDGET	(64 * 1024 * 1024)
+
+void zcache_set_budget(size_t bytes);
+
+/*
+ * For the readers, which each keep a 'struct zcache_file': the identity of
+ * their input, and the block being assembled from their output.
+ * zcache_file_init() leaves it off unless 'in' is a regular file.  Output is
+ * fed in at its offset as decoded (blocks entered part way through are
+ * skipped), and the end of the stream flushes the short last block.
+ * zcache_read() copies out what the cache holds from 'off' on (up to 'len'
+ * bytes, stopping at a missing block, or the end of the output, which sets
+ * '*endp' if the last block is short and cached), and zcache_has() tells if
+ * 'off' is there.
+ */
+struct zcache_id {
+	dev_t dev;
+	ino_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	unsigned codec;		// ZINDEX_GZIP or ZINDEX_ZSTD
+};
+
+struct zcache_file {
+	bool on;
+	bool skip;		// 'blk' is cached already; don't assemble it
+	struct zcache_id id;
+	uint8_t *buf;		// ZCACHE_BLOCK bytes, allocated as needed
+	uint64_t blk;		// Block being assembled
+	size_t len;		// ... bytes of it so far, or SIZE_MAX if none
+};
+
+void zcache_file_init(struct zcache_file *, FILE *in, unsigned codec);
+void zcache_file_free(struct zcache_file *);
+void zcache_feed(struct zcache_file *, uint64_t off, const void *p,
+    size_t len);
+void zcache_feed_end(struct zcache_file *, uint64_t off);
+size_t zcache_read(struct zcache_file *, uint64_t off, void *buf, size_t len,
+    bool *endp);
+bool zcache_has(struct zcache_file *, uint64_t off);
+
+#endif
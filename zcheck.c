@@ -0,0 +1,711 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+/*
+ * zcheck: the tests run by 'make check'.  In a temporary directory it
+ *
+ *  - writes data with each writer configuration (serial, parallel,
+ *    'frame_size', BGZF) and reads it back, serially and with threads, and
+ *    with gzip -dc / zstd -dc;
+ *  - writes gzip streams made only of stored, fixed-Huffman or RLE blocks,
+ *    or a mix of all kinds, and zstd streams of raw, RLE, compressed or
+ *    mixed blocks, and compares what the threaded readers make of them
+ *    byte for byte with gzip -dc / zstd -dc;
+ *  - seeks at random, backward included, through a gzip index, a saved
+ *    sidecar, a BGZF .gzi and a zstd seek table, checking each read against
+ *    the data.
+ *
+ * The directory is removed if every check passes.  A missing gzip or zstd
+ * tool skips the comparisons with it.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "zfile.h"
+#include "zstdfile.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+
+#define KB		(1024)
+#define MB		(1024 * KB)
+
+#define ZCHECK_LEN	(8 * MB)	// Data for the writer and seek checks
+#define ZCHECK_BLOCKS	(24 * MB)	// Data for the block corpora
+#define ZCHECK_PIECE	(256 * KB)	// Block kinds change this often
+#define ZCHECK_FRAME	(256 * KB)	// Writers' 'frame_size'
+#define ZCHECK_SPAN	(1 * MB)	// gzip index span
+#define ZCHECK_THREADS	4
+#define ZCHECK_SEEKS	200
+#define ZCHECK_SEEKLEN	(4 * KB)
+
+enum zcheck_codec {
+	ZCHECK_GZIP,
+	ZCHECK_ZSTD,
+};
+
+static const char *tools[] = { "gzip", "zstd" };
+static bool have_tool[2];
+
+static char *dir;
+static char **paths;
+static size_t npaths;
+static unsigned nchecks, nfail;
+
+static void
+check(bool ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	nchecks++;
+	if (!ok)
+		nfail++;
+	printf("%s ", ok ? "ok  " : "FAIL");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	fflush(stdout);
+}
+
+/* 'name' in the directory, to be removed at the end. */
+static const char *
+tmp_path(const char *name)
+{
+	char *p;
+
+	paths = realloc(paths, (npaths + 2) * sizeof *paths);
+	if (paths == NULL || asprintf(&p, "%s/%s", dir, name) < 0)
+		err(1, "malloc");
+	paths[npaths++] = p;
+	/* Indexes the readers and writers may leave beside it */
+	if (asprintf(&paths[npaths++], "%s.idx", p) < 0)
+		err(1, "malloc");
+	return (p);
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (*s);
+}
+
+/* Log-like text, as zbench generates it. */
+static void
+gen_text(char *buf, size_t len, uint64_t seed)
+{
+	static const char *words[] = { "users", "orders", "items", "search",
+	    "login", "cart", "health", "metrics" };
+	uint64_t s = seed | 1, r;
+	size_t off = 0;
+	char line[160];
+	int n;
+
+	while (off < len) {
+		r = xorshift(&s);
+		n = snprintf(line, sizeof line, "2013-%02u-%02u %02u:%02u:%02u "
+		    "web%02u app[%u]: GET /api/v%u/%s/%u id=%08x status=%u\n",
+		    (unsigned)(r % 12) + 1, (unsigned)(r >> 4) % 28 + 1,
+		    (unsigned)(r >> 9) % 24, (unsigned)(r >> 14) % 60,
+		    (unsigned)(r >> 20) % 60, (unsigned)(r >> 26) % 16,
+		    (unsigned)(r >> 30) % 5000, (unsigned)(r >> 43) % 3 + 1,
+		    words[(r >> 45) % 8], (unsigned)(r >> 48) % 100000,
+		    (unsigned)xorshift(&s), (r >> 60) == 0 ? 500 : 200);
+		if ((size_t)n > len - off)
+			n = len - off;
+		memcpy(buf + off, line, n);
+		off += n;
+	}
+}
+
+static void
+gen_random(char *buf, size_t len, uint64_t seed)
+{
+	uint64_t s = seed | 1, r;
+	size_t off;
+
+	for (off = 0; off < len; off += sizeof r) {
+		r = xorshift(&s);
+		memcpy(buf + off, &r, min(sizeof r, len - off));
+	}
+}
+
+/* Runs of a random byte, 1 to 'maxrun' long. */
+static void
+gen_runs(char *buf, size_t len, uint64_t seed, size_t maxrun)
+{
+	uint64_t s = seed | 1, r;
+	size_t off, n;
+
+	for (off = 0; off < len; off += n) {
+		r = xorshift(&s);
+		n = min((size_t)(r >> 8) % maxrun + 1, len - off);
+		memset(buf + off, (int)(r & 0xff), n);
+	}
+}
+
+/* Pieces of text, random bytes and runs in turn. */
+static void
+gen_mixed(char *buf, size_t len, uint64_t seed, size_t maxrun)
+{
+	size_t off, n, i;
+
+	for (off = i = 0; off < len; off += n, i++) {
+		n = min((size_t)ZCHECK_PIECE, len - off);
+		switch (i % 3) {
+		case 0:
+			gen_text(buf + off, n, seed + i);
+			break;
+		case 1:
+			gen_random(buf + off, n, seed + i);
+			break;
+		default:
+			gen_runs(buf + off, n, seed + i, maxrun);
+			break;
+		}
+	}
+}
+
+/* All of 'f', in '*bufp' and '*lenp'; fails if reading does. */
+static int
+drain(FILE *f, char **bufp, size_t *lenp)
+{
+	size_t len = 0, cap = 1 * MB, n;
+	char *buf, *nbuf;
+
+	buf = malloc(cap);
+	if (buf == NULL)
+		err(1, "malloc");
+	while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			nbuf = realloc(buf, cap);
+			if (nbuf == NULL)
+				err(1, "realloc");
+			buf = nbuf;
+		}
+	}
+	if (ferror(f)) {
+		free(buf);
+		return (-1);
+	}
+	*bufp = buf;
+	*lenp = len;
+	return (0);
+}
+
+/* The output of 'gzip -dc' or 'zstd -dc' on 'path'. */
+static int
+tool_read(enum zcheck_codec codec, const char *path, char **bufp,
+    size_t *lenp)
+{
+	char *cmd;
+	FILE *p;
+	int rc, status;
+
+	if (asprintf(&cmd, "%s -dc '%s'", tools[codec], path) < 0)
+		err(1, "asprintf");
+	p = popen(cmd, "r");
+	free(cmd);
+	if (p == NULL)
+		err(1, "popen");
+	rc = drain(p, bufp, lenp);
+	status = pclose(p);
+	if (rc == 0 && (status == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)) {
+		free(*bufp);
+		rc = -1;
+	}
+	return (rc);
+}
+
+/* All of 'path' through our reader, on 'threads' threads. */
+static int
+reader_read(enum zcheck_codec codec, const char *path, unsigned threads,
+    char **bufp, size_t *lenp)
+{
+	struct zstdfile_opts zo;
+	struct zfile_opts go;
+	FILE *f;
+	int rc;
+
+	if (codec == ZCHECK_GZIP) {
+		memset(&go, 0, sizeof go);
+		go.threads = threads;
+		f = zopen_opts(path, "r", &go, NULL);
+	} else {
+		memset(&zo, 0, sizeof zo);
+		zo.threads = threads;
+		f = zstdopen_opts(path, "r", &zo, NULL);
+	}
+	if (f == NULL)
+		return (-1);
+	rc = drain(f, bufp, lenp);
+	if (fclose(f) != 0)
+		rc = -1;
+	return (rc);
+}
+
+static bool
+same(const char *a, size_t alen, const char *b, size_t blen)
+{
+
+	return (alen == blen && memcmp(a, b, alen) == 0);
+}
+
+/*
+ * Read 'path' back serially, with threads and with the tool, and compare
+ * each with 'data'.
+ */
+static void
+check_file(enum zcheck_codec codec, const char *path, const char *desc,
+    const char *data, size_t len)
+{
+	unsigned threads;
+	size_t outlen;
+	char *out;
+
+	for (threads = 0; threads <= ZCHECK_THREADS;
+	    threads += ZCHECK_THREADS) {
+		if (reader_read(codec, path, threads, &out, &outlen) != 0) {
+			check(false, "%s: read back, threads=%u: %s", desc,
+			    threads, strerror(errno));
+			continue;
+		}
+		check(same(out, outlen, data, len),
+		    "%s: read back, threads=%u", desc, threads);
+		free(out);
+	}
+	if (!have_tool[codec])
+		return;
+	if (tool_read(codec, path, &out, &outlen) != 0) {
+		check(false, "%s: %s -dc failed", desc, tools[codec]);
+		return;
+	}
+	check(same(out, outlen, data, len), "%s: %s -dc", desc, tools[codec]);
+	free(out);
+}
+
+static void
+write_gzip(const char *path, const char *data, size_t len,
+    const struct zfile_opts *o)
+{
+	FILE *f;
+
+	f = zopen_opts(path, "w", o, NULL);
+	if (f == NULL)
+		err(1, "%s", path);
+	if (fwrite(data, 1, len, f) != len || fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+static void
+write_zstd(const char *path, const char *data, size_t len,
+    const struct zstdfile_opts *o)
+{
+	FILE *f;
+
+	f = zstdopen_opts(path, "w", o, NULL);
+	if (f == NULL)
+		err(1, "%s", path);
+	if (fwrite(data, 1, len, f) != len || fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+/* Round trips through each writer configuration. */
+static void
+check_writers(const char *data, size_t len)
+{
+	struct zstdfile_opts zo;
+	struct zfile_opts go;
+	const char *path;
+
+	memset(&go, 0, sizeof go);
+	path = tmp_path("serial.gz");
+	write_gzip(path, data, len, &go);
+	check_file(ZCHECK_GZIP, path, "gzip writer, serial", data, len);
+
+	go.threads = ZCHECK_THREADS;
+	path = tmp_path("parallel.gz");
+	write_gzip(path, data, len, &go);
+	check_file(ZCHECK_GZIP, path, "gzip writer, threads", data, len);
+
+	go.threads = 0;
+	go.frame_size = ZCHECK_FRAME;
+	path = tmp_path("frames.gz");
+	write_gzip(path, data, len, &go);
+	check_file(ZCHECK_GZIP, path, "gzip writer, frame_size", data, len);
+
+	go.frame_size = 0;
+	go.bgzf = true;
+	path = tmp_path("bgzf.gz");
+	write_gzip(path, data, len, &go);
+	check_file(ZCHECK_GZIP, path, "gzip writer, BGZF", data, len);
+
+	go.threads = ZCHECK_THREADS;
+	path = tmp_path("bgzf-parallel.gz");
+	write_gzip(path, data, len, &go);
+	check_file(ZCHECK_GZIP, path, "gzip writer, BGZF threads", data, len);
+
+	memset(&zo, 0, sizeof zo);
+	path = tmp_path("serial.zst");
+	write_zstd(path, data, len, &zo);
+	check_file(ZCHECK_ZSTD, path, "zstd writer, serial", data, len);
+
+	zo.threads = ZCHECK_THREADS;
+	path = tmp_path("parallel.zst");
+	write_zstd(path, data, len, &zo);
+	check_file(ZCHECK_ZSTD, path, "zstd writer, threads", data, len);
+
+	zo.threads = 0;
+	zo.frame_size = ZCHECK_FRAME;
+	path = tmp_path("frames.zst");
+	write_zstd(path, data, len, &zo);
+	check_file(ZCHECK_ZSTD, path, "zstd writer, frame_size", data, len);
+}
+
+/*
+ * Deflate 'data' into gzip file 'path' with zlib directly, so as to choose
+ * the blocks: with 'level' and 'strategy', or if 'level' is negative,
+ * changing both every ZCHECK_PIECE bytes.
+ */
+static void
+write_deflate(const char *path, const char *data, size_t len, int level,
+    int strategy)
+{
+	static const int mix[][2] = {
+		{ 0, Z_DEFAULT_STRATEGY },
+		{ 6, Z_FIXED },
+		{ 6, Z_RLE },
+		{ 6, Z_DEFAULT_STRATEGY },
+		{ 1, Z_HUFFMAN_ONLY },
+	};
+	unsigned char out[64 * KB];
+	size_t off, n, i;
+	z_stream zs;
+	FILE *f;
+	int rc;
+
+	memset(&zs, 0, sizeof zs);
+	if (deflateInit2(&zs, level < 0 ? mix[0][0] : level, Z_DEFLATED,
+	    MAX_WBITS + 16, 8, level < 0 ? mix[0][1] : strategy) != Z_OK)
+		errx(1, "deflateInit2");
+	f = fopen(path, "w");
+	if (f == NULL)
+		err(1, "%s", path);
+	for (off = i = 0; off <= len; off += n, i++) {
+		n = min((size_t)ZCHECK_PIECE, len - off);
+		if (level < 0 && i > 0 && n > 0) {
+			zs.next_out = out;
+			zs.avail_out = sizeof out;
+			if (deflateParams(&zs, mix[i % 5][0],
+			    mix[i % 5][1]) != Z_OK)
+				errx(1, "deflateParams");
+			fwrite(out, 1, sizeof out - zs.avail_out, f);
+		}
+		zs.next_in = (unsigned char *)data + off;
+		zs.avail_in = n;
+		do {
+			zs.next_out = out;
+			zs.avail_out = sizeof out;
+			rc = deflate(&zs, n == 0 ? Z_FINISH : Z_BLOCK);
+			fwrite(out, 1, sizeof out - zs.avail_out, f);
+		} while (zs.avail_out == 0 || (n == 0 && rc != Z_STREAM_END));
+		if (n == 0)
+			break;
+	}
+	deflateEnd(&zs);
+	if (ferror(f) || fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+/*
+ * Compare the threaded reader's output on 'path' byte for byte with the
+ * tool's, and the tool's with 'data'.
+ */
+static void
+check_tool(enum zcheck_codec codec, const char *path, const char *desc,
+    const char *data, size_t len)
+{
+	char *out, *ref;
+	size_t outlen, reflen;
+
+	if (reader_read(codec, path, ZCHECK_THREADS, &out, &outlen) != 0) {
+		check(false, "%s: threads=%u: %s", desc, ZCHECK_THREADS,
+		    strerror(errno));
+		return;
+	}
+	if (!have_tool[codec]) {
+		check(same(out, outlen, data, len), "%s: threads=%u (no %s)",
+		    desc, ZCHECK_THREADS, tools[codec]);
+		free(out);
+		return;
+	}
+	if (tool_read(codec, path, &ref, &reflen) != 0) {
+		check(false, "%s: %s -dc failed", desc, tools[codec]);
+		free(out);
+		return;
+	}
+	check(same(ref, reflen, data, len) &&
+	    same(out, outlen, ref, reflen), "%s: threads=%u vs %s -dc",
+	    desc, ZCHECK_THREADS, tools[codec]);
+	free(ref);
+	free(out);
+}
+
+static void
+check_blocks(void)
+{
+	struct zstdfile_opts zo;
+	const char *path;
+	size_t len = ZCHECK_BLOCKS;
+	char *text, *rnd, *runs, *mixed;
+
+	text = malloc(len);
+	rnd = malloc(len);
+	runs = malloc(len);
+	mixed = malloc(len);
+	if (text == NULL || rnd == NULL || runs == NULL || mixed == NULL)
+		err(1, "malloc");
+	gen_text(text, len, 1);
+	gen_random(rnd, len, 2);
+
+	/*
+	 * Short runs keep the RLE stream long enough for several parallel
+	 * inflate chunks.
+	 */
+	gen_runs(runs, len, 3, 16);
+	gen_mixed(mixed, len, 4, 16);
+	path = tmp_path("stored.gz");
+	write_deflate(path, text, len, 0, Z_DEFAULT_STRATEGY);
+	check_tool(ZCHECK_GZIP, path, "gzip stored blocks", text, len);
+	path = tmp_path("fixed.gz");
+	write_deflate(path, text, len, 6, Z_FIXED);
+	check_tool(ZCHECK_GZIP, path, "gzip fixed blocks", text, len);
+	path = tmp_path("rle.gz");
+	write_deflate(path, runs, len, 6, Z_RLE);
+	check_tool(ZCHECK_GZIP, path, "gzip RLE blocks", runs, len);
+	path = tmp_path("mixed.gz");
+	write_deflate(path, mixed, len, -1, 0);
+	check_tool(ZCHECK_GZIP, path, "gzip mixed blocks", mixed, len);
+
+	/*
+	 * zstd picks its own blocks: raw ones for random bytes, RLE ones for
+	 * runs longer than a block.  The frames are sized for the workers.
+	 */
+	gen_runs(runs, len, 3, 512 * KB);
+	gen_mixed(mixed, len, 4, 512 * KB);
+	memset(&zo, 0, sizeof zo);
+	zo.frame_size = 1 * MB;
+	path = tmp_path("raw.zst");
+	write_zstd(path, rnd, len, &zo);
+	check_tool(ZCHECK_ZSTD, path, "zstd raw blocks", rnd, len);
+	path = tmp_path("rle.zst");
+	write_zstd(path, runs, len, &zo);
+	check_tool(ZCHECK_ZSTD, path, "zstd RLE blocks", runs, len);
+	path = tmp_path("compressed.zst");
+	write_zstd(path, text, len, &zo);
+	check_tool(ZCHECK_ZSTD, path, "zstd compressed blocks", text, len);
+	path = tmp_path("mixed.zst");
+	write_zstd(path, mixed, len, &zo);
+	check_tool(ZCHECK_ZSTD, path, "zstd mixed blocks", mixed, len);
+
+	/* One frame, over the workers' cap: decoded on the caller's thread. */
+	zo.frame_size = 0;
+	path = tmp_path("single.zst");
+	write_zstd(path, mixed, len, &zo);
+	check_tool(ZCHECK_ZSTD, path, "zstd single frame", mixed, len);
+
+	free(mixed);
+	free(runs);
+	free(rnd);
+	free(text);
+}
+
+/*
+ * Random seeks in 'f', each followed by a read compared with 'data', then
+ * SEEK_END.
+ */
+static void
+check_seeks(FILE *f, const char *desc, const char *data, size_t len)
+{
+	uint64_t s = 0x9e3779b97f4a7c15ULL;
+	char buf[ZCHECK_SEEKLEN];
+	unsigned i, bad = 0;
+	uint64_t off;
+	size_t n;
+
+	if (f == NULL) {
+		check(false, "%s: open: %s", desc, strerror(errno));
+		return;
+	}
+	for (i = 0; i < ZCHECK_SEEKS && bad == 0; i++) {
+		off = xorshift(&s) % (len - ZCHECK_SEEKLEN / 2);
+		if (fseeko(f, (off_t)off, SEEK_SET) != 0) {
+			printf("     %s: seek to %ju: %s\n", desc,
+			    (uintmax_t)off, strerror(errno));
+			bad++;
+			break;
+		}
+		n = fread(buf, 1, sizeof buf, f);
+		if (n != min(sizeof buf, len - off) ||
+		    memcmp(buf, data + off, n) != 0) {
+			printf("     %s: wrong data at %ju\n", desc,
+			    (uintmax_t)off);
+			bad++;
+		}
+	}
+	check(bad == 0, "%s: %u random seeks", desc, i);
+	check(fseeko(f, 0, SEEK_END) == 0 && ftello(f) == (off_t)len,
+	    "%s: SEEK_END", desc);
+	fclose(f);
+}
+
+static bool
+exists(const char *path)
+{
+	struct stat sb;
+
+	return (stat(path, &sb) == 0 && sb.st_size > 0);
+}
+
+static void
+check_indexes(const char *data, size_t len)
+{
+	struct zstdfile_opts zo;
+	struct zfile_opts go;
+	const char *path;
+	char *idx, *out;
+	size_t outlen;
+	FILE *f;
+
+	/* An index built as the seeks go */
+	memset(&go, 0, sizeof go);
+	path = tmp_path("seek.gz");
+	write_gzip(path, data, len, &go);
+	go.index_span = ZCHECK_SPAN;
+	check_seeks(zopen_opts(path, "r", &go, NULL), "gzip index", data,
+	    len);
+
+	/* Saved by one reader, loaded by the next */
+	go.index_save = true;
+	f = zopen_opts(path, "r", &go, NULL);
+	if (f == NULL || drain(f, &out, &outlen) != 0)
+		err(1, "%s", path);
+	free(out);
+	fclose(f);
+	if (asprintf(&idx, "%s.idx", path) < 0)
+		err(1, "asprintf");
+	check(exists(idx), "gzip sidecar: saved");
+	free(idx);
+	memset(&go, 0, sizeof go);
+	check_seeks(zopen_opts(path, "r", &go, NULL), "gzip sidecar", data,
+	    len);
+
+	/* The writer's BGZF .gzi */
+	go.bgzf = true;
+	go.index_save = true;
+	path = tmp_path("seek-bgzf.gz");
+	if (asprintf(&idx, "%s.gzi", path) < 0)
+		err(1, "asprintf");
+	paths = realloc(paths, (npaths + 1) * sizeof *paths);
+	if (paths == NULL)
+		err(1, "realloc");
+	paths[npaths++] = idx;
+	write_gzip(path, data, len, &go);
+	check(exists(idx), "BGZF .gzi: saved");
+	memset(&go, 0, sizeof go);
+	check_seeks(zopen_opts(path, "r", &go, NULL), "BGZF .gzi", data, len);
+
+	/* The writer's zstd seek table */
+	memset(&zo, 0, sizeof zo);
+	zo.frame_size = ZCHECK_FRAME;
+	path = tmp_path("seek.zst");
+	write_zstd(path, data, len, &zo);
+	memset(&zo, 0, sizeof zo);
+	check_seeks(zstdopen_opts(path, "r", &zo, NULL), "zstd seek table",
+	    data, len);
+}
+
+static bool
+tool_found(const char *tool)
+{
+	char *cmd;
+	int rc;
+
+	if (asprintf(&cmd, "command -v %s >/dev/null 2>&1", tool) < 0)
+		err(1, "asprintf");
+	rc = system(cmd);
+	free(cmd);
+	return (rc == 0);
+}
+
+int
+main(void)
+{
+	char tmpl[] = "/tmp/zcheck.XXXXXX";
+	size_t len = ZCHECK_LEN, i;
+	char *data;
+
+	dir = mkdtemp(tmpl);
+	if (dir == NULL)
+		err(1, "mkdtemp");
+	have_tool[ZCHECK_GZIP] = tool_found("gzip");
+	have_tool[ZCHECK_ZSTD] = tool_found("zstd");
+	for (i = 0; i < 2; i++)
+		if (!have_tool[i])
+			printf("zcheck: no %s; skipping comparisons with it\n",
+			    tools[i]);
+
+	data = malloc(len);
+	if (data == NULL)
+		err(1, "malloc");
+	gen_text(data, len, 0);
+	check_writers(data, len);
+	check_blocks();
+	check_indexes(data, len);
+	free(data);
+
+	printf("zcheck: %u of %u checks failed\n", nfail, nchecks);
+	if (nfail != 0) {
+		printf("zcheck: files kept in %s\n", dir);
+		return (1);
+	}
+	for (i = 0; i < npaths; i++) {
+		(void)unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	if (rmdir(dir) != 0)
+		warn("%s", dir);
+	return (0);
+}
@@ -0,0 +1,226 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zerror.h"
+#include "zstats.h"
+
+/*
+ * Streams with a FILE, hashed by its address.  One lock covers the table and
+ * every registered error, which a read-ahead thread may be setting while
+ * another thread looks it up.  zstats_get() finds streams here too.
+ */
+#define ZERROR_BUCKETS	64
+
+static struct zerror_reg *zerror_tab[ZERROR_BUCKETS];
+static pthread_mutex_t zerror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct zerror_reg **
+zerror_bucket(const FILE *f)
+{
+
+	return (&zerror_tab[((uintptr_t)f >> 4) % ZERROR_BUCKETS]);
+}
+
+/* Called locked. */
+static struct zerror_reg *
+zerror_find(const FILE *f)
+{
+	struct zerror_reg *r;
+
+	for (r = *zerror_bucket(f); r != NULL; r = r->next)
+		if (r->f == f)
+			return (r);
+	return (NULL);
+}
+
+void
+zerror_register(struct zerror_reg *r, FILE *f, struct zerror *e,
+    const struct zstats *stats)
+{
+	struct zerror_reg **b;
+
+	r->f = f;
+	r->err = e;
+	r->stats = stats;
+	b = zerror_bucket(f);
+	pthread_mutex_lock(&zerror_lock);
+	r->next = *b;
+	*b = r;
+	pthread_mutex_unlock(&zerror_lock);
+}
+
+/* A no-op for a registration that was never made (r->f NULL). */
+void
+zerror_unregister(struct zerror_reg *r)
+{
+	struct zerror_reg **p;
+
+	if (r->f == NULL)
+		return;
+	pthread_mutex_lock(&zerror_lock);
+	for (p = zerror_bucket(r->f); *p != NULL; p = &(*p)->next)
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	pthread_mutex_unlock(&zerror_lock);
+	r->f = NULL;
+}
+
+void
+zerror_clear(struct zerror *e)
+{
+
+	pthread_mutex_lock(&zerror_lock);
+	memset(e, 0, sizeof *e);
+	pthread_mutex_unlock(&zerror_lock);
+}
+
+void
+zerror_vset(struct zerror *e, enum zerror_kind kind, int code, uint64_t in,
+    uint64_t out, const char *fmt, va_list ap)
+{
+	char msg[ZERROR_MSG_MAX];
+
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	warnx("%s", msg);
+
+	pthread_mutex_lock(&zerror_lock);
+	e->kind = kind;
+	e->code = code;
+	e->in_offset = in;
+	e->out_offset = out;
+	memcpy(e->msg, msg, sizeof msg);
+	pthread_mutex_unlock(&zerror_lock);
+}
+
+void
+zerror_set(struct zerror *e, enum zerror_kind kind, int code, uint64_t in,
+    uint64_t out, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	zerror_vset(e, kind, code, in, out, fmt, ap);
+	va_end(ap);
+}
+
+enum zerror_kind
+zerror_code_kind(int code)
+{
+
+	switch (code) {
+	case ENOBUFS:
+		return (ZERROR_TRUNCATED);
+	case 0:
+	case EBADMSG:
+		return (ZERROR_CORRUPT);
+	case ENOMEM:
+		return (ZERROR_NOMEM);
+	default:
+		return (ZERROR_IO);
+	}
+}
+
+void
+zerror_input(struct zerror *e, FILE *in, int code, uint64_t inoff,
+    uint64_t out)
+{
+	struct zerror inner;
+	struct zerror_reg *r;
+	enum zerror_kind kind;
+
+	inner.kind = ZERROR_NONE;
+	if (in != NULL) {
+		pthread_mutex_lock(&zerror_lock);
+		r = zerror_find(in);
+		if (r != NULL)
+			inner = *r->err;
+		pthread_mutex_unlock(&zerror_lock);
+	}
+	if (inner.kind != ZERROR_NONE) {
+		zerror_set(e, inner.kind, inner.code, inoff, out,
+		    "input: %s", inner.msg);
+		return;
+	}
+
+	/* Nested readers of old only ever failed with ENOBUFS. */
+	kind = code != 0 ? zerror_code_kind(code) : ZERROR_IO;
+	if (kind == ZERROR_TRUNCATED)
+		zerror_set(e, kind, code, inoff, out, "Error reading core "
+		    "stream, assuming truncated compression stream");
+	else
+		zerror_set(e, kind, code != 0 ? code : EIO, inoff, out,
+		    "error read core: %s", strerror(code != 0 ? code : EIO));
+}
+
+int
+zerror_get(FILE *f, struct zerror *e)
+{
+	struct zerror_reg *r;
+
+	pthread_mutex_lock(&zerror_lock);
+	r = zerror_find(f);
+	if (r != NULL)
+		*e = *r->err;
+	pthread_mutex_unlock(&zerror_lock);
+	if (r == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/* The counters are only read here; see zstats_copy(). */
+int
+zstats_get(FILE *f, struct zstats *s)
+{
+	struct zerror_reg *r;
+
+	pthread_mutex_lock(&zerror_lock);
+	r = zerror_find(f);
+	if (r != NULL)
+		zstats_copy(s, r->stats);
+	pthread_mutex_unlock(&zerror_lock);
+	if (r == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+const char *
+zerror_kind_name(enum zerror_kind kind)
+{
+
+	switch (kind) {
+	case ZERROR_NONE:
+		return ("none");
+	case ZERROR_IO:
+		return ("I/O error");
+	case ZERROR_TRUNCATED:
+		return ("truncated input");
+	case ZERROR_CORRUPT:
+		return ("corrupt input");
+	case ZERROR_CHECKSUM:
+		return ("checksum mismatch");
+	case ZERROR_NOMEM:
+		return ("out of memory");
+	}
+	return ("unknown");
+}
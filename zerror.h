@@ -0,0 +1,82 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZERROR_H
+#define ZERROR_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Errors on a decoding stream.  Bad input never ends the process: the reader
+ * records what went wrong, its reads fail from then on with the errno value
+ * below (so ferror(3) is set on the FILE), and the error can be looked up on
+ * the FILE until it is closed.  A seek or rewind that restarts the decoder
+ * lets reads go on.
+ */
+enum zerror_kind {
+	ZERROR_NONE = 0,
+	ZERROR_IO,		// Reading the input failed; errno from that
+	ZERROR_TRUNCATED,	// The input ends mid-stream; ENOBUFS
+	ZERROR_CORRUPT,		// Not valid compressed data; EBADMSG
+	ZERROR_CHECKSUM,	// A check failed under a fatal verify policy
+	ZERROR_NOMEM,		// Out of memory; ENOMEM
+};
+
+#define ZERROR_MSG_MAX	160
+
+struct zerror {
+	enum zerror_kind kind;
+	int code;		// errno value reads fail with
+	uint64_t in_offset;	// Input offset about where it happened
+	uint64_t out_offset;	// Output decoded before it
+	char msg[ZERROR_MSG_MAX];
+};
+
+/*
+ * Copy the most recent error on 'f', a stream from zopen*(), zstdopen*() or
+ * zauto_open*(), to '*e' (e->kind is ZERROR_NONE if there has been none).
+ * Returns -1 with errno EINVAL if 'f' is not such a stream.  An error from a
+ * layer underneath carries that layer's kind and message.
+ */
+int zerror_get(FILE *f, struct zerror *e);
+const char *zerror_kind_name(enum zerror_kind);
+
+/*
+ * For the readers.  Each keeps a 'struct zerror' and, for its FILE, a
+ * 'struct zerror_reg' through which zerror_get() finds it (and zstats_get()
+ * its counters).  zerror_set() replaces the error (reporting it on stderr,
+ * as the readers always have); zerror_input() records a failed read of
+ * 'in', with the errno value 'code', taking over the error of 'in' if it is
+ * one of ours.  zerror_code_kind() gives the kind for an errno value, 0
+ * meaning bad data.
+ */
+struct zstats;
+struct zerror_reg {
+	FILE *f;		// NULL if not registered
+	struct zerror *err;
+	const struct zstats *stats;
+	struct zerror_reg *next;
+};
+
+void zerror_register(struct zerror_reg *, FILE *f, struct zerror *,
+    const struct zstats *);
+void zerror_unregister(struct zerror_reg *);
+void zerror_clear(struct zerror *);
+void zerror_set(struct zerror *, enum zerror_kind, int code, uint64_t in,
+    uint64_t out, const char *fmt, ...)
+    __attribute__((__format__(__printf__, 6, 7)));
+void zerror_vset(struct zerror *, enum zerror_kind, int code, uint64_t in,
+    uint64_t out, const char *fmt, va_list ap)
+    __attribute__((__format__(__printf__, 6, 0)));
+enum zerror_kind zerror_code_kind(int code);
+void zerror_input(struct zerror *, FILE *in, int code, uint64_t inoff,
+    uint64_t out);
+
+#endif
@@ -16,21 +16,37 @@
 #include <sys/endian.h>
 #endif
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "zlib.h"
 
 #include "zfile.h"
+#include "zfilew.h"
+#include "zahead.h"
+#include "zcache.h"
+#include "zerror.h"
+#include "zindex.h"
+#include "zinflate.h"
+#include "zmap.h"
+#include "zpinflate.h"
+#include "zpool.h"
+#include "zprefetch.h"
+#include "zstats.h"
 
 #define min(a, b) ({				\
 	__typeof (a) _a = (a);			\
@@ -41,6 +57,10 @@ static cookie_read_function_t zfile_read;
 static cookie_seek_function_t zfile_seek;
 static cookie_close_function_t zfile_close;
 
+static void zfile_destroy(struct zfile *);
+static ssize_t zfile_cache_read(struct zfile *, char *buf, size_t size,
+    bool *endp);
+
 static const cookie_io_functions_t zfile_io = {
 	.read = zfile_read,
 	.write = NULL,
@@ -49,6 +69,34 @@ static const cookie_io_functions_t zfile_io = {
 };
 
 #define KB (1024)
+#define ZFILE_WINSIZE	(1U << MAX_WBITS)
+/* Compressed bytes per speculative inflate job */
+#define ZFILE_PAR_CHUNK	(4 * 1024 * KB)
+
+/* Default buffer sizes, and limits for zfile_opts.adaptive */
+#define ZFILE_INBUF	(32*KB)
+#define ZFILE_OUTBUF	(256*KB)
+#define ZFILE_INBUF_MAX	(4 * 1024 * KB)
+#define ZFILE_OUTBUF_MIN	(32*KB)
+/* A full read of the source taking this long means it is slow */
+#define ZFILE_SLOW_READ_NS	(1000 * 1000)
+/* Longest BGZF extra field the block walker reads */
+#define ZFILE_BGZF_XLEN_MAX	256
+/* Most output a BGZF block holds */
+#define ZFILE_BGZF_MAX		(64*KB)
+/* zpool_job tag: the input ended (or failed) inside this BGZF block */
+#define ZFILE_BGZF_TRUNC	0x1
+
+/* Largest output buffer we allocate to inflate a member whole */
+#define ZFILE_WHOLE_MAX	(64 * 1024 * KB)
+/* Input read at a time, and bytes of header looked at, by zfile_walk() */
+#define ZFILE_WALK_BUF		(64*KB)
+
+/* Start of a BGZF block, in the input and in the output */
+struct zfile_blk {
+	uint64_t in, out;
+};
+
 struct zfile {
 	FILE *in;		// Source FILE stream
 	uint64_t logic_offset,	// Logical offset in output (forward seeks)
@@ -57,133 +105,2425 @@ struct zfile {
 	uint32_t outbuf_start;
 
 	z_stream decomp;
+	/*
+	 * Inflate backend for 'decomp''s windows; checkpoints and restores
+	 * always go through zlib on 'decomp' itself.
+	 */
+	const struct zinflate_ops *be;
+	void *be_state;
+	bool whole_ok;		// Try zinflate_whole() on the first member
+	bool whole;		// ... and haven't yet this pass
+	/* Input offset of the end of the data in 'inbuf' */
+	uint64_t in_pos;
+	/* Output offset at which the current gzip member started */
+	uint64_t member_start;
 
 	uint32_t crc;
 
-	uint8_t inbuf[32*KB];
-	uint8_t outbuf[256*KB];
+	/*
+	 * Checkpoints (cf. zran.c in the zlib distribution) from which
+	 * inflate can be restarted without decoding anything before them.
+	 * Only taken on deflate block boundaries; 'crc' is the running CRC.
+	 */
+	struct zindex index;
+	char *index_path;	// Save index here on close, if changed
+
+	/* Parallel inflate of the first member, if enabled */
+	struct zpinflate *par;
+	bool par_active;	// 'par' rather than 'decomp' is decoding
+
+	uint8_t *inbuf;
+	uint8_t *outbuf;
+	size_t inbuf_size, outbuf_size;
+	size_t outbuf_max;	// Adaptive mode grows 'outbuf' up to this
+	bool adaptive;		// See zfile_opts
+
+	/* The whole input, if mapped (zfile_opts.use_mmap); 'inbuf' is unused */
+	const uint8_t *map;
+	size_t map_len;
+	struct zprefetch *pf;	// Else maybe read through this; ditto
+
 	bool eof;
-	bool truncated;
+	bool truncated;		// Stopped on an error, 'err'
+	struct zerror err;
+	struct zerror_reg reg;	// For our FILE, if any
+	struct zstats_rec st;
+	struct zcache_file cache;	// Shared decoded blocks, if enabled
+	bool stream_end;	// inflate() finished a member; trailer unread
+	bool crc_bad;		// Some member failed its CRC check
+	bool verify;		// Compute and check member CRCs
+	bool verify_fatal;	// ... and stop at a bad one
+	bool seekable;		// 'in' can be rewound
+
+	/*
+	 * Else the start of the input, kept (up to 'replay_max' bytes, in a
+	 * buffer grown as needed) for as long as all of what was read from
+	 * 'in' fits; reads are served from here up to 'replay_len' after a
+	 * rewind.  NULL once it no longer fits, or if not enabled.
+	 */
+	uint8_t *replay;
+	size_t replay_len, replay_cap, replay_max;
+	size_t replay_pos;	// Next byte to serve
+	bool crc_skip;		// Member CRC unknown (restarted mid-member)
+
+	/* Header of the current member, and the buffers behind it */
+	struct zfile_header hdr;
+	char *hdr_name, *hdr_comment;
+	uint8_t *hdr_extra;
+	size_t hdr_extra_cap;
+
+	/*
+	 * dictzip chunk table, from the first member's header: chunk i starts
+	 * at input offset dz_offs[i] and output offset i * dz_chlen.
+	 */
+	uint64_t *dz_offs;
+	uint32_t dz_chlen, dz_chcnt;
+
+	/*
+	 * BGZF block boundaries known so far (from a .gzi, or noted as blocks
+	 * are passed), contiguous from the start: block i runs from blk[i] to
+	 * blk[i + 1], and blk[0] is (0, 0).
+	 */
+	bool is_bgzf;		// The first member is a BGZF block
+	struct zfile_blk *blk;
+	size_t nblk, blkcap;
+	bool blk_complete;	// blk[nblk - 1] is the end of the stream
+	uint64_t member_in;	// Input offset of the current member's header
+
+	/* BGZF block-parallel decode, if enabled */
+	struct zpool *bgzf_pool;
+	bool bgzf_active;	// 'bgzf_pool' rather than 'decomp' is decoding
+	uint64_t bgzf_in;	// Input offset of the next block to queue
+	size_t bgzf_pos;	// Bytes of the head job already returned
+	bool bgzf_started;	// Head job has been accounted for
+	bool bgzf_ineof;	// No more blocks to queue
+	bool bgzf_handoff;	// ... because a plain member starts at bgzf_in
 };
 
+/* gzip header flags (RFC 1952) */
+#define GZ_FHCRC	0x02
+#define GZ_FEXTRA	0x04
+#define GZ_FNAME	0x08
+#define GZ_FCOMMENT	0x10
+#define GZ_FRESERVED	0xe0
+
+static inline uint32_t
+gz_le32(const uint8_t *p)
+{
+
+	return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+/*
+ * Keep 'len' more bytes read from an unseekable input for a later rewind, or
+ * give up on that if they don't fit.
+ */
+static void
+zfile_replay_add(struct zfile *cookie, const void *buf, size_t len)
+{
+	size_t cap;
+	void *nbuf;
+
+	if (len == 0)
+		return;
+	if (len > cookie->replay_max - cookie->replay_len)
+		goto drop;
+	if (cookie->replay_len + len > cookie->replay_cap) {
+		cap = cookie->replay_cap;
+		while (cap < cookie->replay_len + len)
+			cap *= 2;
+		cap = min(cap, cookie->replay_max);
+		nbuf = realloc(cookie->replay, cap);
+		if (nbuf == NULL)
+			goto drop;
+		cookie->replay = nbuf;
+		cookie->replay_cap = cap;
+	}
+	memcpy(cookie->replay + cookie->replay_len, buf, len);
+	cookie->replay_len += len;
+	cookie->replay_pos = cookie->replay_len;
+	return;
+
+drop:
+	free(cookie->replay);
+	cookie->replay = NULL;
+	cookie->replay_len = cookie->replay_pos = 0;
+}
+
+/*
+ * Stop on an error: reads fail with errno 'code' until a restart.  The first
+ * error since the last restart is the one kept.
+ */
+static void __attribute__((__format__(__printf__, 4, 5)))
+zfile_fail(struct zfile *cookie, enum zerror_kind kind, int code,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	if (cookie->truncated)
+		return;
+	va_start(ap, fmt);
+	zerror_vset(&cookie->err, kind, code,
+	    cookie->in_pos - cookie->decomp.avail_in, cookie->actual_len, fmt,
+	    ap);
+	va_end(ap);
+	cookie->truncated = true;
+}
+
+/* Stop on a failed read of the input, with errno 'code'. */
+static void
+zfile_fail_input(struct zfile *cookie, int code)
+{
+
+	if (cookie->truncated)
+		return;
+	zerror_input(&cookie->err, cookie->pf == NULL ? cookie->in : NULL,
+	    code, cookie->in_pos - cookie->decomp.avail_in,
+	    cookie->actual_len);
+	cookie->truncated = true;
+}
+
+/*
+ * Refill the (empty) input buffer.  Returns the number of bytes read, 0 at
+ * EOF, or -1 if reading the source fails (or it reports truncation).
+ */
+static ssize_t
+zfile_fill(struct zfile *cookie)
+{
+	struct timespec t0, t1;
+	const void *p;
+	uint64_t t;
+	ssize_t n;
+	size_t nb;
+	void *nbuf;
+
+	assert(cookie->decomp.avail_in == 0);
+
+	if (cookie->pf != NULL) {
+		/* A no-op unless we have repositioned. */
+		zprefetch_seek(cookie->pf, cookie->in_pos);
+		t = zstats_begin(&cookie->st);
+		n = zprefetch_next(cookie->pf, &p);
+		if (n < 0) {
+			zfile_fail_input(cookie, errno);
+			return (-1);
+		}
+		zstats_end(&cookie->st, ZSTATS_READ, t, n);
+		cookie->decomp.next_in = (Bytef *)p;
+		cookie->decomp.avail_in = n;
+		cookie->in_pos += n;
+		return (n);
+	}
+
+	if (cookie->map != NULL) {
+		nb = 0;
+		if (cookie->in_pos < cookie->map_len)
+			nb = min(cookie->map_len - cookie->in_pos,
+			    (size_t)UINT_MAX);
+		cookie->decomp.next_in = (Bytef *)cookie->map + cookie->in_pos;
+		cookie->decomp.avail_in = nb;
+		cookie->in_pos += nb;
+		ZSTATS_ADD(&cookie->st, in_bytes, nb);
+		return (nb);
+	}
+
+	if (cookie->replay_pos < cookie->replay_len) {
+		/* Rewound: the start of the input again, from memory. */
+		nb = min(cookie->replay_len - cookie->replay_pos,
+		    (size_t)UINT_MAX);
+		cookie->decomp.next_in = cookie->replay + cookie->replay_pos;
+		cookie->decomp.avail_in = nb;
+		cookie->replay_pos += nb;
+		cookie->in_pos += nb;
+		return (nb);
+	}
+
+	if (cookie->adaptive)
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	t = zstats_begin(&cookie->st);
+	nb = fread(cookie->inbuf, 1, cookie->inbuf_size, cookie->in);
+	zstats_end(&cookie->st, ZSTATS_READ, t, nb);
+	if (ferror(cookie->in)) {
+		/*
+		 * A nested compression stream fails with its own error (ENOBUFS
+		 * if truncated).  Could be a false positive if read(2) returned
+		 * ENOBUFS instead, but I don't see any harm.
+		 */
+		zfile_fail_input(cookie, errno);
+		return (-1);
+	}
+	cookie->decomp.next_in = cookie->inbuf;
+	cookie->decomp.avail_in = nb;
+	cookie->in_pos += nb;
+	if (cookie->replay != NULL)
+		zfile_replay_add(cookie, cookie->inbuf, nb);
+
+	/*
+	 * Slow source (network filesystem, pipe from a slow producer): ask
+	 * for more per read next time.  Failure to grow is harmless.
+	 */
+	if (cookie->adaptive && nb == cookie->inbuf_size &&
+	    cookie->inbuf_size < ZFILE_INBUF_MAX) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if ((t1.tv_sec - t0.tv_sec) * 1000000000LL +
+		    (t1.tv_nsec - t0.tv_nsec) >= ZFILE_SLOW_READ_NS) {
+			/* Keep the data just read; 'next_in' points into it. */
+			nbuf = malloc(cookie->inbuf_size * 2);
+			if (nbuf != NULL) {
+				memcpy(nbuf, cookie->inbuf, nb);
+				free(cookie->inbuf);
+				cookie->inbuf = nbuf;
+				cookie->inbuf_size *= 2;
+				cookie->decomp.next_in = cookie->inbuf;
+			}
+		}
+	}
+	return (nb);
+}
+
+/*
+ * Take up to 'len' raw bytes from the input, outside of inflate(), into 'dst'
+ * (or nowhere, if NULL).  Returns the number of bytes taken, which is short
+ * only at EOF, or -1 on truncation.
+ */
+static ssize_t
+zfile_input(struct zfile *cookie, void *dst, size_t len)
+{
+	size_t done, n;
+	ssize_t rc;
+
+	for (done = 0; done < len; done += n) {
+		if (cookie->decomp.avail_in == 0) {
+			rc = zfile_fill(cookie);
+			if (rc < 0)
+				return (-1);
+			if (rc == 0)
+				break;
+		}
+		n = min(len - done, (size_t)cookie->decomp.avail_in);
+		if (dst != NULL)
+			memcpy((char *)dst + done, cookie->decomp.next_in, n);
+		cookie->decomp.next_in += n;
+		cookie->decomp.avail_in -= n;
+	}
+	return (done);
+}
+
+/*
+ * Read a NUL-terminated header field into '*bufp' (allocated on first use),
+ * keeping at most ZFILE_HDR_STR_MAX bytes of it, and add it to '*crcp' if
+ * non-NULL.  Returns 0, or -1 at EOF/truncation.
+ */
+static int
+zfile_input_str(struct zfile *cookie, char **bufp, uint32_t *crcp)
+{
+	const uint8_t *p, *nul;
+	size_t len, n, keep;
+
+	if (*bufp == NULL && (*bufp = malloc(ZFILE_HDR_STR_MAX + 1)) == NULL)
+		return (-1);
+
+	for (len = 0; ; len += keep) {
+		if (cookie->decomp.avail_in == 0 && zfile_fill(cookie) <= 0)
+			return (-1);
+		p = cookie->decomp.next_in;
+		nul = memchr(p, 0, cookie->decomp.avail_in);
+		n = nul != NULL ? (size_t)(nul - p) + 1 : cookie->decomp.avail_in;
+		keep = min(n, ZFILE_HDR_STR_MAX - len);
+		memcpy(*bufp + len, p, keep);
+		if (crcp != NULL)
+			*crcp = crc32(*crcp, p, n);
+		cookie->decomp.next_in += n;
+		cookie->decomp.avail_in -= n;
+		if (nul != NULL)
+			break;
+	}
+	(*bufp)[min(len + keep, (size_t)ZFILE_HDR_STR_MAX)] = '\0';
+	return (0);
+}
+
+const uint8_t *
+zfile_header_field(const struct zfile_header *h, unsigned char si1,
+    unsigned char si2, size_t *lenp)
+{
+	const uint8_t *p, *end;
+	size_t len;
+
+	if (h->extra == NULL)
+		return (NULL);
+	p = h->extra;
+	end = p + h->extra_len;
+	while (end - p >= 4) {
+		len = p[2] | (p[3] << 8);
+		if ((size_t)(end - p) - 4 < len)
+			break;
+		if (p[0] == si1 && p[1] == si2) {
+			*lenp = len;
+			return (p + 4);
+		}
+		p += 4 + len;
+	}
+	return (NULL);
+}
+
+/* Recognize the blocked gzip flavors by their extra subfields. */
+static void
+zfile_header_format(struct zfile_header *h)
+{
+	const uint8_t *f;
+	size_t len;
+	uint32_t chcnt;
+
+	h->format = ZFILE_FORMAT_GZIP;
+	h->bgzf_bsize = 0;
+	h->dz_chlen = h->dz_chcnt = 0;
+
+	/* BGZF: 'BC', BSIZE (total member size - 1) */
+	f = zfile_header_field(h, 'B', 'C', &len);
+	if (f != NULL && len == 2) {
+		h->format = ZFILE_FORMAT_BGZF;
+		h->bgzf_bsize = (f[0] | (f[1] << 8)) + 1;
+		return;
+	}
+
+	/* dictzip: 'RA', VER (1), CHLEN, CHCNT, CHCNT compressed sizes */
+	f = zfile_header_field(h, 'R', 'A', &len);
+	if (f != NULL && len >= 6 && (f[0] | (f[1] << 8)) == 1) {
+		chcnt = f[4] | (f[5] << 8);
+		if ((f[2] | (f[3] << 8)) != 0 && 6 + 2 * (size_t)chcnt <= len) {
+			h->format = ZFILE_FORMAT_DICTZIP;
+			h->dz_chlen = f[2] | (f[3] << 8);
+			h->dz_chcnt = chcnt;
+		}
+	}
+}
+
+/*
+ * Consume a gzip member header from the input into cookie->hdr.  Returns 1
+ * if one was found, 0 if the input ends (or something other than a gzip
+ * member follows), and -1 if the header is truncated.
+ */
+static int
+zfile_gzhdr_read(struct zfile *cookie)
+{
+	struct zfile_header *h = &cookie->hdr;
+	unsigned char hdr[GZ_HDR_SZ], xlen[2], hcrc[2];
+	uint32_t crc, *crcp;
+	uint8_t *nbuf;
+	ssize_t n;
+
+	n = zfile_input(cookie, hdr, sizeof hdr);
+	if (n < 0)
+		return (-1);
+	if ((size_t)n < sizeof gz_magic ||
+	    memcmp(hdr, gz_magic, sizeof gz_magic) != 0)
+		return (0);
+	if ((size_t)n < sizeof hdr)
+		return (-1);
+	/* RFC 1952: reserved flags must be zero. */
+	if ((hdr[3] & GZ_FRESERVED) != 0)
+		return (0);
+
+	h->flags = hdr[3];
+	h->mtime = gz_le32(hdr + 4);
+	h->xfl = hdr[8];
+	h->os = hdr[9];
+	h->name = h->comment = NULL;
+	h->extra = NULL;
+	h->extra_len = 0;
+
+	crc = 0;
+	crcp = NULL;
+	if ((hdr[3] & GZ_FHCRC) != 0 && cookie->verify) {
+		crc = crc32(0, hdr, sizeof hdr);
+		crcp = &crc;
+	}
+
+	if ((hdr[3] & GZ_FEXTRA) != 0) {
+		if (zfile_input(cookie, xlen, sizeof xlen) != sizeof xlen)
+			return (-1);
+		n = xlen[0] | (xlen[1] << 8);
+		/* Keep a buffer even for XLEN 0, so that 'extra' is set. */
+		if (cookie->hdr_extra == NULL ||
+		    cookie->hdr_extra_cap < (size_t)n) {
+			nbuf = realloc(cookie->hdr_extra, n + 1);
+			if (nbuf == NULL)
+				return (-1);
+			cookie->hdr_extra = nbuf;
+			cookie->hdr_extra_cap = n + 1;
+		}
+		if (zfile_input(cookie, cookie->hdr_extra, n) != n)
+			return (-1);
+		h->extra = cookie->hdr_extra;
+		h->extra_len = n;
+		if (crcp != NULL) {
+			crc = crc32(crc, xlen, sizeof xlen);
+			crc = crc32(crc, h->extra, n);
+		}
+	}
+	if ((hdr[3] & GZ_FNAME) != 0) {
+		if (zfile_input_str(cookie, &cookie->hdr_name, crcp) != 0)
+			return (-1);
+		h->name = cookie->hdr_name;
+	}
+	if ((hdr[3] & GZ_FCOMMENT) != 0) {
+		if (zfile_input_str(cookie, &cookie->hdr_comment, crcp) != 0)
+			return (-1);
+		h->comment = cookie->hdr_comment;
+	}
+	if ((hdr[3] & GZ_FHCRC) != 0) {
+		if (zfile_input(cookie, hcrc, sizeof hcrc) != sizeof hcrc)
+			return (-1);
+		/* The header CRC is the low half of a CRC-32 over it. */
+		if (crcp != NULL &&
+		    (crc & 0xffff) != (uint32_t)(hcrc[0] | (hcrc[1] << 8))) {
+			cookie->crc_bad = true;
+			if (cookie->verify_fatal) {
+				zfile_fail(cookie, ZERROR_CHECKSUM, EBADMSG,
+				    "gzip header CRC mismatch");
+				return (-1);
+			}
+			warnx("gzip header CRC mismatch");
+		}
+	}
+
+	zfile_header_format(h);
+	return (1);
+}
+
+/*
+ * Take the dictzip chunk table from the first member's header, which has just
+ * been read.  Without it (out of memory), seeks work as for plain gzip.
+ */
+static void
+zfile_dz_load(struct zfile *cookie)
+{
+	const uint8_t *f;
+	uint64_t off;
+	size_t len;
+	uint32_t i;
+
+	f = zfile_header_field(&cookie->hdr, 'R', 'A', &len);
+	cookie->dz_offs = malloc(((size_t)cookie->hdr.dz_chcnt + 1) *
+	    sizeof *cookie->dz_offs);
+	if (cookie->dz_offs == NULL)
+		return;
+	cookie->dz_chlen = cookie->hdr.dz_chlen;
+	cookie->dz_chcnt = cookie->hdr.dz_chcnt;
+
+	off = cookie->in_pos - cookie->decomp.avail_in;
+	for (i = 0; i < cookie->dz_chcnt; i++) {
+		cookie->dz_offs[i] = off;
+		off += f[6 + 2 * i] | (f[7 + 2 * i] << 8);
+	}
+	cookie->dz_offs[i] = off;
+}
+
+/*
+ * The dictzip chunk start at or before output offset 'off', as a checkpoint.
+ * Chunks are separated by full flushes, so inflate can restart at one with no
+ * window.  Returns false if the chunk table doesn't cover 'off'.
+ */
+static bool
+zfile_dz_point(const struct zfile *cookie, uint64_t off,
+    struct zindex_point *pt)
+{
+	uint64_t k;
+
+	if (cookie->dz_offs == NULL)
+		return (false);
+	k = off / cookie->dz_chlen;
+	if (k >= cookie->dz_chcnt)
+		return (false);
+
+	memset(pt, 0, sizeof *pt);
+	pt->out = k * cookie->dz_chlen;
+	pt->in = cookie->dz_offs[k];
+	pt->base = 0;
+	pt->crc = crc32(0, Z_NULL, 0);
+	pt->flags = ZINDEX_RESET;
+	return (true);
+}
+
+/*
+ * Hand the first member's deflate data, which starts at the current input
+ * position, to the parallel inflater.
+ */
+static void
+zfile_par_start(struct zfile *cookie)
+{
+
+	if (cookie->truncated)
+		return;
+	/*
+	 * The workers read on from the end of the data inflate has taken; a
+	 * (nested) input that can't go back there leaves us serial.
+	 */
+	if (fseeko(cookie->in, cookie->in_pos - cookie->decomp.avail_in,
+	    SEEK_SET) != 0)
+		return;
+	cookie->in_pos -= cookie->decomp.avail_in;
+	cookie->decomp.avail_in = 0;
+	zpinflate_start(cookie->par, cookie->in, cookie->in_pos);
+	cookie->par_active = true;
+}
+
+static void
+zfile_par_stop(struct zfile *cookie)
+{
+
+	if (cookie->par_active) {
+		zpinflate_stop(cookie->par);
+		cookie->par_active = false;
+	}
+}
+
+/*
+ * BGZF (htslib's blocked gzip): a series of members of at most 64 kB each,
+ * whose 'BC' extra subfield gives the member's size.  The block table makes
+ * every block start a checkpoint, and with 'threads' the blocks are decoded
+ * on a worker pool, as they need no window from one another.
+ */
+
+/*
+ * Note that the block at 'in'/'out' ends at 'in_end'/'out_end', if it
+ * continues the table.  Failure to grow the table is harmless.
+ */
+static void
+zfile_blk_add(struct zfile *cookie, uint64_t in, uint64_t out,
+    uint64_t in_end, uint64_t out_end)
+{
+	struct zfile_blk *nblk;
+	size_t ncap;
+
+	if (cookie->nblk == 0 || cookie->blk[cookie->nblk - 1].in != in ||
+	    cookie->blk[cookie->nblk - 1].out != out || in_end <= in)
+		return;
+	if (cookie->nblk == cookie->blkcap) {
+		ncap = cookie->blkcap * 2;
+		nblk = realloc(cookie->blk, ncap * sizeof *nblk);
+		if (nblk == NULL)
+			return;
+		cookie->blk = nblk;
+		cookie->blkcap = ncap;
+	}
+	cookie->blk[cookie->nblk].in = in_end;
+	cookie->blk[cookie->nblk].out = out_end;
+	cookie->nblk++;
+}
+
+/* Index of the known block holding output offset 'off', or -1. */
+static ssize_t
+zfile_blk_find(const struct zfile *cookie, uint64_t off)
+{
+	size_t lo, hi, mid;
+
+	if (cookie->nblk < 2 || off >= cookie->blk[cookie->nblk - 1].out)
+		return (-1);
+	/* Last i (short of the end) with blk[i].out <= off */
+	lo = 0;
+	hi = cookie->nblk - 1;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (cookie->blk[mid].out <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/* Index of the known block boundary at input offset 'in', or -1. */
+static ssize_t
+zfile_blk_find_in(const struct zfile *cookie, uint64_t in)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = cookie->nblk;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cookie->blk[mid].in < in)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < cookie->nblk && cookie->blk[lo].in == in ? (ssize_t)lo :
+	    -1);
+}
+
+/*
+ * Read up to 'len' bytes at input offset 'off' without disturbing the
+ * decoder's position.  Returns the number read, or -1 if the input can't be
+ * read at random.
+ */
+static ssize_t
+zfile_pread(struct zfile *cookie, void *buf, size_t len, uint64_t off)
+{
+
+	if (cookie->map != NULL) {
+		if (off >= cookie->map_len)
+			return (0);
+		len = min(len, cookie->map_len - off);
+		memcpy(buf, cookie->map + off, len);
+		return (len);
+	}
+	return (pread(fileno(cookie->in), buf, len, off));
+}
+
+/*
+ * Extend the block table from just the headers and trailers of the blocks
+ * that follow it, until it reaches past output offset 'out' and up to input
+ * offset 'in', or the end of the stream.  Returns -1 if the input can't be
+ * read at random, or something other than a BGZF block is in the way.
+ */
+static int
+zfile_bgzf_walk(struct zfile *cookie, uint64_t out, uint64_t in)
+{
+	uint8_t hdr[GZ_HDR_SZ + 2 + ZFILE_BGZF_XLEN_MAX], tlr[4];
+	struct zfile_header h;
+	struct zfile_blk end;
+	const uint8_t *bc;
+	size_t xlen, len;
+	uint32_t bsize;
+	ssize_t n;
+
+	if (cookie->nblk == 0)
+		return (-1);
+	while (!cookie->blk_complete) {
+		end = cookie->blk[cookie->nblk - 1];
+		if (end.out > out && end.in >= in)
+			return (0);
+
+		n = zfile_pread(cookie, hdr, GZ_HDR_SZ + 2, end.in);
+		if (n < 0)
+			return (-1);
+		/* The end, perhaps with junk after it, as for zlib. */
+		if ((size_t)n < sizeof gz_magic ||
+		    memcmp(hdr, gz_magic, sizeof gz_magic) != 0) {
+			cookie->blk_complete = true;
+			break;
+		}
+		if (n != GZ_HDR_SZ + 2 || (hdr[3] & GZ_FEXTRA) == 0)
+			return (-1);
+		xlen = hdr[10] | (hdr[11] << 8);
+		if (xlen > ZFILE_BGZF_XLEN_MAX || zfile_pread(cookie,
+		    hdr + GZ_HDR_SZ + 2, xlen, end.in + GZ_HDR_SZ + 2) !=
+		    (ssize_t)xlen)
+			return (-1);
+
+		memset(&h, 0, sizeof h);
+		h.extra = hdr + GZ_HDR_SZ + 2;
+		h.extra_len = xlen;
+		bc = zfile_header_field(&h, 'B', 'C', &len);
+		if (bc == NULL || len != 2)
+			return (-1);
+		bsize = (bc[0] | (bc[1] << 8)) + 1;
+		if (bsize < GZ_HDR_SZ + 2 + xlen + 8 ||
+		    zfile_pread(cookie, tlr, sizeof tlr, end.in + bsize - 4) !=
+		    sizeof tlr)
+			return (-1);
+
+		zfile_blk_add(cookie, end.in, end.out, end.in + bsize,
+		    end.out + gz_le32(tlr));
+		if (cookie->blk[cookie->nblk - 1].in == end.in)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Load a .gzi (htslib bgzip -i) index: a little-endian 64-bit count, then
+ * that many (compressed, uncompressed) offset pairs of the block starts after
+ * the first.  Returns 0, or -1 (leaving the table alone) if there is none or
+ * it is malformed.
+ */
+static int
+zfile_gzi_load(struct zfile *cookie, const char *path)
+{
+	struct zfile_blk *blk, prev;
+	uint8_t buf[16];
+	uint64_t n, i;
+	FILE *f;
+	int rc;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			warn("could not open BGZF index %s", path);
+		return (-1);
+	}
+
+	rc = -1;
+	blk = NULL;
+	if (fread(buf, 1, 8, f) != 8)
+		goto out;
+	n = (uint64_t)gz_le32(buf) | ((uint64_t)gz_le32(buf + 4) << 32);
+	if (n >= SIZE_MAX / sizeof *blk - 1)
+		goto out;
+	blk = malloc((n + 1) * sizeof *blk);
+	if (blk == NULL)
+		goto out;
+	blk[0].in = blk[0].out = 0;
+	for (i = 1; i <= n; i++) {
+		if (fread(buf, 1, 16, f) != 16)
+			goto out;
+		prev = blk[i - 1];
+		blk[i].in = (uint64_t)gz_le32(buf) |
+		    ((uint64_t)gz_le32(buf + 4) << 32);
+		blk[i].out = (uint64_t)gz_le32(buf + 8) |
+		    ((uint64_t)gz_le32(buf + 12) << 32);
+		if (blk[i].in <= prev.in || blk[i].out < prev.out)
+			goto out;
+	}
+	rc = 0;
+
+out:
+	if (rc == 0) {
+		free(cookie->blk);
+		cookie->blk = blk;
+		cookie->nblk = cookie->blkcap = n + 1;
+	} else {
+		warnx("ignoring malformed BGZF index %s", path);
+		free(blk);
+	}
+	fclose(f);
+	return (rc);
+}
+
+static void *
+zfile_bgzf_ctx_create(void *arg)
+{
+	z_stream *strm;
+
+	(void)arg;
+	strm = calloc(1, sizeof *strm);
+	if (strm != NULL && inflateInit2(strm, -MAX_WBITS) != Z_OK) {
+		free(strm);
+		strm = NULL;
+	}
+	return (strm);
+}
+
+static void
+zfile_bgzf_ctx_free(void *ctx)
+{
+
+	if (ctx != NULL) {
+		inflateEnd(ctx);
+		free(ctx);
+	}
+}
+
+/*
+ * Worker: inflate the BGZF block in job->src, whose framing the reader has
+ * checked, into job->dst.  job->aux[0] is set if its CRC doesn't match.
+ */
 static void
-zfile_zlib_init(struct zfile *cookie)
+zfile_bgzf_decode(void *ctx, void *arg, struct zpool_job *job)
 {
+	const struct zfile *cookie = arg;
+	z_stream *strm = ctx;
+	uint8_t *p = job->src;
+	size_t hlen, dlen, used;
+	uint32_t crc, isize;
 	int rc;
 
-	cookie->logic_offset = 0;
-	cookie->decode_offset = 0;
-	cookie->actual_len = 0;
+	if (job->error != NULL || (job->tag & ZFILE_BGZF_TRUNC) != 0)
+		return;
+	if (strm == NULL) {
+		job->error = "Failed to initialize zlib";
+		job->error_code = ENOMEM;
+		return;
+	}
 
-	rc = fseeko(cookie->in, GZ_HDR_SZ, SEEK_SET);
-	assert(rc == 0);
+	hlen = GZ_HDR_SZ + 2 + (p[10] | (p[11] << 8));
+	dlen = job->srclen - hlen - 8;
+	crc = gz_le32(p + job->srclen - 8);
+	isize = gz_le32(p + job->srclen - 4);
+	/* Don't size the buffer from an ISIZE no BGZF block can have. */
+	if (isize > ZFILE_BGZF_MAX) {
+		job->error = "block length doesn't match its trailer";
+		job->error_code = EBADMSG;
+		return;
+	}
+	if (zpool_reserve(&job->dst, &job->dstcap, isize > 0 ? isize : 1) !=
+	    0) {
+		job->error = "Failed to allocate buffers";
+		job->error_code = ENOMEM;
+		return;
+	}
 
-	memset(&cookie->decomp, 0, sizeof cookie->decomp);
-	rc = inflateInit2(&cookie->decomp, -MAX_WBITS);
-	if (rc != 0) {
-		fprintf(stderr, "Failed to initialize zlib: %s\n",
-		    zError(rc));
-		exit(1);
+	/* ISIZE is exact here, which is all libdeflate needs. */
+	if (zinflate_whole(p + hlen, dlen, job->dst, isize, &used) != 0) {
+		rc = inflateReset(strm);
+		assert(rc == Z_OK);
+		strm->next_in = p + hlen;
+		strm->avail_in = dlen;
+		strm->next_out = job->dst;
+		strm->avail_out = isize;
+		rc = inflate(strm, Z_FINISH);
+		if (rc != Z_STREAM_END || strm->avail_out != 0) {
+			job->error = rc == Z_STREAM_END || rc == Z_BUF_ERROR ?
+			    "block length doesn't match its trailer" :
+			    zError(rc);
+			job->error_code = rc == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+			return;
+		}
+	}
+	job->dstlen = isize;
+
+	if (cookie->verify &&
+	    crc32(crc32(0, Z_NULL, 0), job->dst, isize) != crc)
+		job->aux[0] = 1;
+}
+
+/*
+ * Append up to 'len' bytes of input to job->src.  Returns the number of bytes
+ * read (short only at EOF), or -1 if the source reports truncation or fails
+ * (noted in job->error, for the reader to stop at).
+ */
+static ssize_t
+zfile_bgzf_input(struct zfile *cookie, struct zpool_job *job, size_t len)
+{
+	uint64_t t;
+	ssize_t n;
+	size_t nb;
+
+	if (zpool_reserve(&job->src, &job->srccap, job->srclen + len) != 0) {
+		job->error = "Failed to allocate buffers";
+		job->error_code = ENOMEM;
+		return (-1);
+	}
+	if (cookie->map != NULL) {
+		nb = 0;
+		if (cookie->bgzf_in < cookie->map_len)
+			nb = min(cookie->map_len - cookie->bgzf_in, len);
+		memcpy((char *)job->src + job->srclen,
+		    cookie->map + cookie->bgzf_in, nb);
+		job->srclen += nb;
+		cookie->bgzf_in += nb;
+		ZSTATS_ADD(&cookie->st, in_bytes, nb);
+		return (nb);
+	}
+	if (cookie->pf != NULL) {
+		zprefetch_seek(cookie->pf, cookie->bgzf_in);
+		t = zstats_begin(&cookie->st);
+		n = zprefetch_read(cookie->pf, (char *)job->src + job->srclen,
+		    len);
+		if (n < 0) {
+			job->error = "error read core";
+			job->error_code = errno;
+			return (-1);
+		}
+		zstats_end(&cookie->st, ZSTATS_READ, t, n);
+		job->srclen += n;
+		cookie->bgzf_in += n;
+		return (n);
+	}
+	t = zstats_begin(&cookie->st);
+	nb = fread((char *)job->src + job->srclen, 1, len, cookie->in);
+	zstats_end(&cookie->st, ZSTATS_READ, t, nb);
+	job->srclen += nb;
+	cookie->bgzf_in += nb;
+	if (ferror(cookie->in)) {
+		/* As in zfile_fill(). */
+		if (errno == ENOBUFS)
+			warnx("Error reading core stream, assuming truncated "
+			    "compression stream");
+		else {
+			job->error = "error read core";
+			job->error_code = errno;
+		}
+		return (-1);
+	}
+	return (nb);
+}
+
+/*
+ * Read the next BGZF block from the input into 'job', using its BSIZE to find
+ * its end.  Returns 1 on success, 0 at the end of the stream, -1 if the input
+ * ends (or fails) mid-block, and 2 if a member that isn't a plain BGZF block
+ * starts here.
+ */
+static int
+zfile_bgzf_readblock(struct zfile *cookie, struct zpool_job *job)
+{
+	struct zfile_header h;
+	const uint8_t *bc, *p;
+	size_t xlen, len, bsize;
+	ssize_t n;
+
+	job->in_off = cookie->bgzf_in;
+	n = zfile_bgzf_input(cookie, job, GZ_HDR_SZ + 2);
+	if (n < 0)
+		return (-1);
+	p = job->src;
+	if ((size_t)n < sizeof gz_magic ||
+	    memcmp(p, gz_magic, sizeof gz_magic) != 0)
+		return (0);
+	if (n != GZ_HDR_SZ + 2)
+		return (-1);
+	if ((p[3] & ~1) != GZ_FEXTRA)
+		return (2);
+
+	xlen = p[10] | (p[11] << 8);
+	if (zfile_bgzf_input(cookie, job, xlen) != (ssize_t)xlen)
+		return (-1);
+	memset(&h, 0, sizeof h);
+	h.extra = (uint8_t *)job->src + GZ_HDR_SZ + 2;
+	h.extra_len = xlen;
+	bc = zfile_header_field(&h, 'B', 'C', &len);
+	if (bc == NULL || len != 2)
+		return (2);
+	bsize = (bc[0] | (bc[1] << 8)) + 1;
+	if (bsize < job->srclen + 8) {
+		job->error = "BGZF block size too small";
+		return (1);
+	}
+
+	len = bsize - job->srclen;
+	if (zfile_bgzf_input(cookie, job, len) != (ssize_t)len)
+		return (-1);
+	return (1);
+}
+
+/*
+ * Keep the workers busy: queue blocks until the ring is full or the blocks
+ * run out.
+ */
+static void
+zfile_bgzf_queue(struct zfile *cookie)
+{
+	struct zpool_job *job;
+	int rc;
+
+	while (!cookie->bgzf_ineof &&
+	    (job = zpool_slot(cookie->bgzf_pool)) != NULL) {
+		rc = zfile_bgzf_readblock(cookie, job);
+		if (rc == 0 || rc == 2) {
+			cookie->bgzf_ineof = true;
+			cookie->bgzf_handoff = rc == 2;
+			cookie->bgzf_in = job->in_off;
+			break;
+		}
+		if (rc < 0) {
+			job->tag |= ZFILE_BGZF_TRUNC;
+			cookie->bgzf_ineof = true;
+		}
+		zpool_submit(cookie->bgzf_pool);
+	}
+}
+
+/*
+ * (Re)start the block pool at the block at input offset 'in'.  Returns -1 if
+ * the input can't be repositioned there.
+ */
+static int
+zfile_bgzf_start(struct zfile *cookie, uint64_t in)
+{
+
+	zpool_reset(cookie->bgzf_pool);
+	if (cookie->map == NULL && cookie->pf == NULL &&
+	    fseeko(cookie->in, in, SEEK_SET) != 0)
+		return (-1);
+	cookie->bgzf_in = in;
+	cookie->bgzf_pos = 0;
+	cookie->bgzf_started = false;
+	cookie->bgzf_ineof = false;
+	cookie->bgzf_handoff = false;
+	cookie->bgzf_active = true;
+	cookie->decomp.avail_in = 0;
+	return (0);
+}
+
+/*
+ * Copy decoded output into 'out' from the block pool.  Returns the number of
+ * bytes copied, 0 once the pool has run out of blocks (clearing
+ * cookie->bgzf_active), or -1 on truncation.
+ */
+static ssize_t
+zfile_bgzf_read(struct zfile *cookie, uint8_t *out, size_t outlen)
+{
+	struct zpool_job *job;
+	size_t n;
+	bool trunc;
+
+	for (;;) {
+		zfile_bgzf_queue(cookie);
+
+		job = zpool_head(cookie->bgzf_pool);
+		if (job == NULL) {
+			cookie->bgzf_active = false;
+			return (0);
+		}
+		if (job->error != NULL) {
+			zfile_fail(cookie, zerror_code_kind(job->error_code),
+			    job->error_code != 0 ? job->error_code : EBADMSG,
+			    "BGZF block at %" PRIu64 ": %s", job->in_off,
+			    job->error);
+			return (-1);
+		}
+		if (!cookie->bgzf_started) {
+			cookie->bgzf_started = true;
+			cookie->member_in = job->in_off;
+			cookie->member_start = cookie->actual_len;
+			if (job->aux[0] != 0 && cookie->verify_fatal) {
+				cookie->crc_bad = true;
+				zfile_fail(cookie, ZERROR_CHECKSUM, EBADMSG,
+				    "BGZF block at %" PRIu64 " does not match "
+				    "its CRC", job->in_off);
+				return (-1);
+			}
+			if (job->aux[0] != 0) {
+				warnx("BGZF block at %" PRIu64 " does not match "
+				    "its CRC; this stream *may* be corrupt.",
+				    job->in_off);
+				cookie->crc_bad = true;
+			}
+		}
+
+		n = min(outlen, job->dstlen - cookie->bgzf_pos);
+		memcpy(out, (uint8_t *)job->dst + cookie->bgzf_pos, n);
+		cookie->bgzf_pos += n;
+
+		if (cookie->bgzf_pos == job->dstlen) {
+			trunc = (job->tag & ZFILE_BGZF_TRUNC) != 0;
+			if (!trunc)
+				zfile_blk_add(cookie, job->in_off,
+				    cookie->member_start,
+				    job->in_off + job->srclen,
+				    cookie->member_start + job->dstlen);
+			zpool_release(cookie->bgzf_pool);
+			cookie->bgzf_pos = 0;
+			cookie->bgzf_started = false;
+			if (trunc) {
+				zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+				    "truncated gzip file -- no CRC to check");
+				return (n > 0 ? (ssize_t)n : -1);
+			}
+		}
+		if (n > 0)
+			return (n);
+	}
+}
+
+/*
+ * Restart decoding serially at the gzip member at input offset 'in', which
+ * starts at output offset 'out'.  Returns as zfile_gzhdr_read().
+ */
+static int
+zfile_member_enter(struct zfile *cookie, uint64_t in, uint64_t out)
+{
+
+	if (fseeko(cookie->in, in, SEEK_SET) != 0)
+		return (-1);
+	cookie->be->reset(cookie->be_state);
+	cookie->whole = false;
+
+	cookie->decomp.next_in = NULL;
+	cookie->decomp.avail_in = 0;
+	cookie->decomp.next_out = cookie->outbuf;
+	cookie->decomp.avail_out = cookie->outbuf_size;
+	cookie->outbuf_start = 0;
+	cookie->in_pos = in;
+	cookie->member_in = in;
+	cookie->member_start = out;
+	cookie->actual_len = out;
+	cookie->decode_offset = out;
+
+	cookie->eof = false;
+	cookie->truncated = false;
+	cookie->stream_end = false;
+	cookie->crc_skip = false;
+	cookie->crc = crc32(0, Z_NULL, 0);
+	return (zfile_gzhdr_read(cookie));
+}
+
+/*
+ * The block pool has run dry: either the stream has ended, or a member that
+ * isn't a BGZF block follows, and zlib carries on from there.  Returns as
+ * zfile_decode().
+ */
+static int
+zfile_bgzf_end(struct zfile *cookie)
+{
+	int rc;
+
+	if (cookie->truncated)
+		return (-1);
+	if (!cookie->bgzf_handoff) {
+		cookie->eof = true;
+		cookie->blk_complete = true;
+		return (0);
+	}
+
+	rc = zfile_member_enter(cookie, cookie->bgzf_in, cookie->actual_len);
+	if (rc < 0) {
+		zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+		    "truncated gzip file -- lost member header");
+		return (-1);
+	}
+	if (rc == 0)
+		cookie->eof = true;
+	return (rc);
+}
+
+/*
+ * Restart decoding at the BGZF block at input offset 'in', output offset
+ * 'out'.  Returns -1 if the input can't be repositioned there.
+ */
+static int
+zfile_bgzf_enter(struct zfile *cookie, uint64_t in, uint64_t out)
+{
+
+	zfile_par_stop(cookie);
+	if (cookie->bgzf_pool == NULL)
+		return (zfile_member_enter(cookie, in, out) == 1 ? 0 : -1);
+
+	if (zfile_bgzf_start(cookie, in) != 0)
+		return (-1);
+	cookie->decomp.next_out = cookie->outbuf;
+	cookie->decomp.avail_out = cookie->outbuf_size;
+	cookie->outbuf_start = 0;
+	cookie->member_start = out;
+	cookie->actual_len = out;
+	cookie->decode_offset = out;
+	cookie->eof = false;
+	cookie->truncated = false;
+	cookie->stream_end = false;
+	return (0);
+}
+
+/*
+ * Start decoding at the beginning of the input, reusing the inflate state and
+ * buffers we already have.  The first 'len' bytes of the input have already
+ * been read from 'in' into 'peek'; they are decoded from there.
+ */
+static void
+zfile_start(struct zfile *cookie, const void *peek, size_t len)
+{
+	int rc;
+
+	cookie->logic_offset = 0;
+	cookie->decode_offset = 0;
+	cookie->actual_len = 0;
+
+	cookie->be->reset(cookie->be_state);
+	cookie->whole = cookie->whole_ok;
+
+	cookie->decomp.next_in = NULL;
+	cookie->decomp.avail_in = 0;
+	cookie->decomp.next_out = cookie->outbuf;
+	cookie->decomp.avail_out = cookie->outbuf_size;
+	cookie->in_pos = 0;
+	/* A mapped or prefetched input is read by offset, not from 'in'. */
+	if (len > 0 && cookie->map == NULL && cookie->pf == NULL) {
+		assert(len <= cookie->inbuf_size);
+		memcpy(cookie->inbuf, peek, len);
+		cookie->decomp.next_in = cookie->inbuf;
+		cookie->decomp.avail_in = len;
+		cookie->in_pos = len;
+	}
+	cookie->member_start = 0;
+	cookie->member_in = 0;
+
+	cookie->outbuf_start = 0;
+	cookie->eof = false;
+	cookie->truncated = false;
+	cookie->stream_end = false;
+	cookie->crc_bad = false;
+
+	cookie->crc = crc32(0, Z_NULL, 0);
+
+	cookie->crc_skip = false;
+
+	if (zfile_gzhdr_read(cookie) != 1) {
+		zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+		    "truncated gzip header");
+	} else if (cookie->hdr.format == ZFILE_FORMAT_DICTZIP &&
+	    cookie->dz_offs == NULL)
+		zfile_dz_load(cookie);
+
+	if (cookie->par != NULL)
+		zfile_par_start(cookie);
+	if (cookie->bgzf_pool != NULL) {
+		rc = zfile_bgzf_start(cookie, 0);
+		assert(rc == 0);
+	}
+}
+
+/*
+ * Rewind the input (or its replay, if it can't seek) and start over.  Returns
+ * -1 (with errno ESPIPE, and the decoder left as it was) if neither is
+ * possible.
+ */
+static int
+zfile_restart(struct zfile *cookie)
+{
+
+	if (!cookie->seekable) {
+		if (cookie->replay == NULL) {
+			errno = ESPIPE;
+			return (-1);
+		}
+		cookie->replay_pos = 0;
+		zfile_start(cookie, NULL, 0);
+		ZSTATS_ADD(&cookie->st, rewinds, 1);
+		return (0);
+	}
+	zfile_par_stop(cookie);
+	if (fseeko(cookie->in, 0, SEEK_SET) != 0)
+		return (-1);
+	clearerr(cookie->in);
+	zfile_start(cookie, NULL, 0);
+	ZSTATS_ADD(&cookie->st, rewinds, 1);
+	return (0);
+}
+
+/*
+ * Called after inflate() returns on a block boundary, or at the start of a
+ * member.  Records a checkpoint if we have decoded at least 'span' bytes past
+ * the last one.  Failure to grow the index is not fatal; we just stop
+ * indexing.
+ */
+static void
+zfile_index_add(struct zfile *cookie)
+{
+	struct zindex *index = &cookie->index;
+	struct zindex_point *pt;
+	uint8_t *window;
+	uint64_t last;
+	uInt winlen;
+
+	last = index->npoints > 0 ? index->points[index->npoints - 1].out : 0;
+	if (cookie->actual_len < last + index->span)
+		return;
+
+	pt = zindex_reserve(index, &window);
+	if (pt == NULL) {
+		warnx("Out of memory growing seek index; no more checkpoints");
+		index->span = 0;
+		return;
+	}
+
+	if (cookie->actual_len == cookie->member_start) {
+		/* Fresh member; nothing to prime. */
+		memset(window, 0, ZFILE_WINSIZE);
+		pt->flags = ZINDEX_RESET;
+	} else {
+		winlen = ZFILE_WINSIZE;
+		if (inflateGetDictionary(&cookie->decomp, window, &winlen) !=
+		    Z_OK)
+			return;
+		/*
+		 * Members shorter than the window can't be primed from the
+		 * previous one; just skip the checkpoint.
+		 */
+		if (winlen != ZFILE_WINSIZE)
+			return;
+		pt->bits = cookie->decomp.data_type & 7;
+	}
+
+	pt->out = cookie->actual_len;
+	pt->in = cookie->in_pos - cookie->decomp.avail_in;
+	pt->base = cookie->member_start;
+	pt->crc = cookie->crc;
+	zindex_commit(index);
+}
+
+/*
+ * Restart inflate at checkpoint 'pt'.  Returns -1 if the input FILE cannot be
+ * repositioned, or (with errno EBADMSG) if zlib refuses the checkpoint.
+ */
+static int
+zfile_index_restore(struct zfile *cookie, const struct zindex_point *pt)
+{
+	int rc, c;
+
+	if (fseeko(cookie->in, pt->in - (pt->bits ? 1 : 0), SEEK_SET) != 0)
+		return (-1);
+
+	/* Only independent (dictzip) points are used with other backends. */
+	cookie->be->reset(cookie->be_state);
+	if (pt->bits) {
+		if (cookie->map != NULL)
+			c = pt->in <= cookie->map_len ?
+			    cookie->map[pt->in - 1] : EOF;
+		else
+			c = getc(cookie->in);
+		if (c == EOF)
+			return (-1);
+		rc = inflatePrime(&cookie->decomp, pt->bits,
+		    c >> (8 - pt->bits));
+		if (rc != Z_OK)
+			goto bad;
+	}
+	if ((pt->flags & ZINDEX_RESET) == 0) {
+		rc = inflateSetDictionary(&cookie->decomp,
+		    zindex_window(&cookie->index, pt), ZFILE_WINSIZE);
+		if (rc != Z_OK)
+			goto bad;
+	}
+
+	cookie->decomp.next_in = NULL;
+	cookie->decomp.avail_in = 0;
+	cookie->decomp.next_out = cookie->outbuf;
+	cookie->decomp.avail_out = cookie->outbuf_size;
+	cookie->in_pos = pt->in;
+	cookie->member_start = pt->base;
+	cookie->member_in = UINT64_MAX;
+	cookie->stream_end = false;
+	cookie->crc_skip = false;
+
+	cookie->logic_offset = pt->out;
+	cookie->decode_offset = pt->out;
+	cookie->actual_len = pt->out;
+	cookie->crc = pt->crc;
+
+	cookie->outbuf_start = 0;
+	cookie->eof = false;
+	cookie->truncated = false;
+	return (0);
+
+bad:
+	zfile_fail(cookie, ZERROR_CORRUPT, EBADMSG,
+	    "inflate: bad checkpoint at %" PRIu64 " in index", pt->out);
+	errno = EBADMSG;
+	return (-1);
+}
+
+/*
+ * Open gzipped FILE stream 'in' as a (forward-)seekable (and rewindable),
+ * read-only stream.
+ *
+ * If 'in' isn't a gzipped file, you still get a stream (the original one is
+ * returned).
+ */
+FILE *
+zopenfile(FILE *in, const char *mode, bool *was_gzipped)
+{
+
+	return (zopenfile_opts(in, mode, NULL, was_gzipped));
+}
+
+/*
+ * Readers that are closed go back to a small process-wide pool, inflate state
+ * and buffers intact, so programs that open many small files in turn don't
+ * pay for inflateInit2() and the buffer allocations each time.
+ */
+#define ZFILE_POOL_MAX	8
+
+static struct {
+	pthread_mutex_t lock;
+	struct zfile *free[ZFILE_POOL_MAX];
+	unsigned n;
+} zfile_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct zfile *
+zfile_pool_get(void)
+{
+	struct zfile *cookie;
+
+	cookie = NULL;
+	pthread_mutex_lock(&zfile_pool.lock);
+	if (zfile_pool.n > 0)
+		cookie = zfile_pool.free[--zfile_pool.n];
+	pthread_mutex_unlock(&zfile_pool.lock);
+	return (cookie);
+}
+
+static void
+zfile_dispose(struct zfile *cookie)
+{
+
+	inflateEnd(&cookie->decomp);
+	free(cookie->inbuf);
+	free(cookie->outbuf);
+	free(cookie->hdr_name);
+	free(cookie->hdr_comment);
+	free(cookie->hdr_extra);
+	free(cookie);
+}
+
+/*
+ * Get a reader with initialized inflate state, from the pool if possible.
+ * Its buffers may be absent or of any size.
+ */
+static struct zfile *
+zfile_alloc(void)
+{
+	struct zfile *cookie;
+	int rc;
+
+	cookie = zfile_pool_get();
+	if (cookie != NULL)
+		return (cookie);
+
+	cookie = malloc(sizeof *cookie);
+	if (cookie == NULL)
+		return (NULL);
+	cookie->inbuf = cookie->outbuf = NULL;
+	cookie->inbuf_size = cookie->outbuf_size = 0;
+	cookie->hdr_name = cookie->hdr_comment = NULL;
+	cookie->hdr_extra = NULL;
+	cookie->hdr_extra_cap = 0;
+
+	memset(&cookie->decomp, 0, sizeof cookie->decomp);
+	rc = inflateInit2(&cookie->decomp, -MAX_WBITS);
+	if (rc != Z_OK) {
+		free(cookie);
+		return (NULL);
+	}
+	return (cookie);
+}
+
+/* Return a reader to the pool, or free it if the pool is full. */
+static void
+zfile_release(struct zfile *cookie)
+{
+
+	pthread_mutex_lock(&zfile_pool.lock);
+	if (zfile_pool.n < ZFILE_POOL_MAX) {
+		zfile_pool.free[zfile_pool.n++] = cookie;
+		cookie = NULL;
+	}
+	pthread_mutex_unlock(&zfile_pool.lock);
+	if (cookie != NULL)
+		zfile_dispose(cookie);
+}
+
+void
+zfile_pool_flush(void)
+{
+	struct zfile *cookie;
+
+	while ((cookie = zfile_pool_get()) != NULL)
+		zfile_dispose(cookie);
+}
+
+/* Make '*bufp' (of '*sizep' bytes) 'want' bytes long; contents are lost. */
+static int
+zfile_buf_size(uint8_t **bufp, size_t *sizep, size_t want)
+{
+
+	if (*bufp != NULL && *sizep == want)
+		return (0);
+	free(*bufp);
+	*bufp = malloc(want);
+	*sizep = *bufp != NULL ? want : 0;
+	return (*bufp != NULL ? 0 : -1);
+}
+
+/*
+ * Size the buffers per 'opts', keeping those a pooled reader already has if
+ * they are the right size.  Returns -1 if out of memory.
+ */
+static int
+zfile_buffers(struct zfile *cookie, const struct zfile_opts *opts)
+{
+	struct stat sb;
+	size_t insz, outsz;
+
+	insz = ZFILE_INBUF;
+	outsz = ZFILE_OUTBUF;
+	cookie->adaptive = false;
+	if (opts != NULL) {
+		if (opts->inbuf_size != 0)
+			insz = min(opts->inbuf_size, (size_t)UINT_MAX);
+		if (opts->outbuf_size != 0)
+			outsz = min(opts->outbuf_size, (size_t)UINT_MAX);
+		cookie->adaptive = opts->adaptive;
+	}
+	cookie->outbuf_max = outsz;
+
+	if (cookie->adaptive) {
+		/* No point reading more than the whole (small) file. */
+		if (fstat(fileno(cookie->in), &sb) == 0 &&
+		    S_ISREG(sb.st_mode) && (uint64_t)sb.st_size < insz)
+			insz = sb.st_size > 0 ? sb.st_size : 1;
+		outsz = min(outsz, (size_t)ZFILE_OUTBUF_MIN);
+	}
+
+	if (zfile_buf_size(&cookie->inbuf, &cookie->inbuf_size, insz) != 0 ||
+	    zfile_buf_size(&cookie->outbuf, &cookie->outbuf_size, outsz) != 0)
+		return (-1);
+	return (0);
+}
+
+/* Deep-copy 'src' to 'dst'.  Returns -1 (with 'dst' empty) if out of memory. */
+static int
+zfile_header_copy(struct zfile_header *dst, const struct zfile_header *src)
+{
+
+	*dst = *src;
+	dst->name = dst->comment = NULL;
+	dst->extra = NULL;
+	if ((src->name != NULL && (dst->name = strdup(src->name)) == NULL) ||
+	    (src->comment != NULL &&
+	    (dst->comment = strdup(src->comment)) == NULL) ||
+	    (src->extra != NULL &&
+	    (dst->extra = malloc(src->extra_len + 1)) == NULL)) {
+		zfile_header_free(dst);
+		return (-1);
+	}
+	if (src->extra != NULL)
+		memcpy(dst->extra, src->extra, src->extra_len);
+	return (0);
+}
+
+void
+zfile_header_free(struct zfile_header *h)
+{
+
+	free(h->name);
+	free(h->comment);
+	free(h->extra);
+	h->name = h->comment = NULL;
+	h->extra = NULL;
+	h->extra_len = 0;
+}
+
+/*
+ * Switch from zlib to the inflate backend that 'opts' asks for, if it was
+ * compiled in.  The decoder must be at the start of a member.
+ */
+static void
+zfile_backend(struct zfile *cookie, const struct zfile_opts *opts)
+{
+	enum zfile_inflate which;
+	void *st;
+
+	which = opts != NULL ? opts->inflate : ZFILE_INFLATE_AUTO;
+
+	cookie->whole_ok = cookie->whole = cookie->map != NULL &&
+	    cookie->par == NULL && zinflate_have_whole() &&
+	    (which == ZFILE_INFLATE_AUTO || which == ZFILE_INFLATE_LIBDEFLATE);
+
+#ifdef HAVE_ISAL
+	if (which == ZFILE_INFLATE_AUTO || which == ZFILE_INFLATE_ISAL) {
+		st = zinflate_isal.create(&cookie->decomp);
+		if (st != NULL) {
+			cookie->be = &zinflate_isal;
+			cookie->be_state = st;
+		}
+	}
+#else
+	(void)st;
+#endif
+}
+
+/*
+ * Allocate and initialize the reader state for gzipped 'in'.  Returns NULL
+ * (with errno set) on failure; 'in' is left open either way.
+ */
+static struct zfile *
+zfile_create(FILE *in, const struct zfile_opts *opts, const void *peek,
+    size_t len)
+{
+	struct zfile *cookie;
+
+	cookie = zfile_alloc();
+	if (cookie == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	cookie->in = in;
+	cookie->index_path = NULL;
+	cookie->par = NULL;
+	cookie->par_active = false;
+	cookie->dz_offs = NULL;
+	cookie->is_bgzf = false;
+	cookie->blk = NULL;
+	cookie->nblk = cookie->blkcap = 0;
+	cookie->blk_complete = false;
+	cookie->bgzf_pool = NULL;
+	cookie->bgzf_active = false;
+	zerror_clear(&cookie->err);
+	cookie->reg.f = NULL;
+	zcache_file_init(&cookie->cache, opts != NULL && opts->cache ? in : NULL,
+	    ZINDEX_GZIP);
+	zstats_init(&cookie->st, opts != NULL && opts->timing,
+	    opts != NULL ? opts->trace : NULL,
+	    opts != NULL ? opts->trace_arg : NULL);
+	cookie->verify = opts == NULL || opts->verify != ZFILE_VERIFY_OFF;
+	cookie->verify_fatal = opts != NULL &&
+	    opts->verify == ZFILE_VERIFY_FRAME;
+	cookie->seekable = ftello(in) >= 0;
+	cookie->replay = NULL;
+	cookie->replay_len = cookie->replay_cap = cookie->replay_pos = 0;
+	cookie->replay_max = 0;
+	cookie->map = NULL;
+	if (opts != NULL && opts->use_mmap &&
+	    zmap_open(in, &cookie->map, &cookie->map_len) != 0)
+		cookie->map = NULL;
+	cookie->pf = NULL;
+	if (zfile_buffers(cookie, opts) != 0 || (len > cookie->inbuf_size &&
+	    zfile_buf_size(&cookie->inbuf, &cookie->inbuf_size, len) != 0)) {
+		zmap_close(cookie->map, cookie->map_len);
+		zfile_dispose(cookie);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	if (opts != NULL && opts->prefetch > 0 && cookie->map == NULL) {
+		cookie->pf = zprefetch_create(fileno(in), cookie->inbuf_size,
+		    opts->prefetch);
+		if (cookie->pf == NULL && errno != ESPIPE)
+			warn("input prefetch unavailable");
+	}
+	if (opts != NULL && opts->replay > 0 && !cookie->seekable) {
+		cookie->replay_max = opts->replay;
+		cookie->replay_cap = min(cookie->replay_max,
+		    (size_t)ZFILE_INBUF);
+		cookie->replay = malloc(cookie->replay_cap);
+		if (cookie->replay != NULL)
+			zfile_replay_add(cookie, peek, len);
+	}
+	cookie->be = &zinflate_zlib;
+	cookie->be_state = cookie->be->create(&cookie->decomp);
+	cookie->whole_ok = false;
+	zindex_init(&cookie->index, 0, ZFILE_WINSIZE);
+	zfile_start(cookie, peek, len);
+
+	if (cookie->hdr.format == ZFILE_FORMAT_BGZF && !cookie->truncated) {
+		cookie->is_bgzf = true;
+		if (opts == NULL || opts->gzi_path == NULL ||
+		    zfile_gzi_load(cookie, opts->gzi_path) != 0) {
+			cookie->blk = malloc(64 * sizeof *cookie->blk);
+			if (cookie->blk != NULL) {
+				cookie->blk[0].in = cookie->blk[0].out = 0;
+				cookie->nblk = 1;
+				cookie->blkcap = 64;
+			}
+		}
+	}
+
+	if (opts != NULL && opts->index_path != NULL &&
+	    zindex_load(&cookie->index, opts->index_path, fileno(in),
+	    ZINDEX_GZIP) == 0) {
+		/*
+		 * Keep extending a loaded index at its own span, unless it
+		 * has no windows (members only, from the writer) to go on.
+		 */
+		if (cookie->index.winsize == 0)
+			cookie->index.span = 0;
+		else if (cookie->index.span < ZFILE_WINSIZE)
+			cookie->index.span = ZFILE_WINSIZE;
+	} else if (opts != NULL && opts->index_span != 0)
+		cookie->index.span = opts->index_span < ZFILE_WINSIZE ?
+		    ZFILE_WINSIZE : opts->index_span;
+
+	if (opts != NULL && opts->index_path != NULL && opts->index_save &&
+	    cookie->index.span != 0) {
+		cookie->index_path = strdup(opts->index_path);
+		if (cookie->index_path == NULL) {
+			zfile_destroy(cookie);
+			errno = ENOMEM;
+			return (NULL);
+		}
+	}
+
+	if (opts != NULL && opts->header != NULL &&
+	    zfile_header_copy(opts->header, &cookie->hdr) != 0) {
+		zfile_destroy(cookie);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	/*
+	 * Checkpoints need inflate's window, so indexing stays serial.  Both
+	 * parallel modes reposition the input, which must be seekable.
+	 */
+	if (opts != NULL && opts->threads > 1 && cookie->seekable &&
+	    cookie->index.span == 0 && cookie->index.npoints == 0 &&
+	    cookie->is_bgzf) {
+		/* BGZF blocks are independent; no need to speculate. */
+		cookie->bgzf_pool = zpool_create(opts->threads,
+		    2 * opts->threads, zfile_bgzf_decode,
+		    zfile_bgzf_ctx_create, zfile_bgzf_ctx_free, cookie);
+		if (cookie->bgzf_pool == NULL)
+			warn("parallel inflate unavailable");
+		else if (zfile_bgzf_start(cookie, 0) != 0) {
+			zfile_destroy(cookie);
+			errno = EIO;
+			return (NULL);
+		}
+	} else if (opts != NULL && opts->threads > 1 && cookie->seekable &&
+	    cookie->index.span == 0 && cookie->index.npoints == 0) {
+		cookie->par = zpinflate_create(opts->threads, ZFILE_PAR_CHUNK);
+		if (cookie->par == NULL)
+			warn("parallel inflate unavailable");
+		else
+			zfile_par_start(cookie);
+	}
+
+	/* ... and zlib, which alone can stop at and restart from blocks. */
+	if (cookie->index.span == 0 && cookie->index.npoints == 0)
+		zfile_backend(cookie, opts);
+	return (cookie);
+}
+
+/* Free the reader state.  Does not close the input. */
+static void
+zfile_destroy(struct zfile *cookie)
+{
+
+	zerror_unregister(&cookie->reg);
+	zfile_par_stop(cookie);
+	zpinflate_destroy(cookie->par);
+	if (cookie->bgzf_pool != NULL)
+		zpool_destroy(cookie->bgzf_pool);
+	free(cookie->blk);
+	zindex_free(&cookie->index);
+	free(cookie->index_path);
+	zmap_close(cookie->map, cookie->map_len);
+	zprefetch_destroy(cookie->pf);
+	free(cookie->dz_offs);
+	free(cookie->replay);
+	zcache_file_free(&cookie->cache);
+	cookie->be->destroy(cookie->be_state);
+	zfile_release(cookie);
+}
+
+/*
+ * Is 'in' (positioned at its start) gzipped?  Returns 1 if so, with the fixed
+ * part of the header read into 'gzhdr', 0 if not, or -1 if it cannot be read.
+ * If not, what was read is pushed back onto 'in' rather than seeking back,
+ * which a pipe couldn't.  (More than one byte of push-back is an extension,
+ * but glibc and the BSDs all have it.)
+ */
+static int
+zfile_sniff(FILE *in, unsigned char gzhdr[GZ_HDR_SZ])
+{
+	size_t nbr;
+
+	nbr = fread(gzhdr, 1, GZ_HDR_SZ, in);
+	if (ferror(in))
+		return (-1);
+	if (nbr < sizeof gz_magic ||
+	    memcmp(gz_magic, gzhdr, sizeof gz_magic) != 0) {
+		while (nbr > 0)
+			if (ungetc(gzhdr[--nbr], in) == EOF)
+				return (-1);
+		return (0);
+	}
+	if (nbr < GZ_HDR_SZ) {
+		warnx("File truncated");
+		errno = ENOBUFS;
+		return (-1);
+	}
+	return (1);
+}
+
+/* Put a FILE around a new reader, or destroy it. */
+static FILE *
+zfile_fopen(struct zfile *cookie, const char *mode,
+    const struct zfile_opts *opts)
+{
+	FILE *res;
+
+	if (opts != NULL && opts->readahead > 0)
+		res = zahead_fopencookie(cookie, mode, zfile_io,
+		    opts->readahead);
+	else
+		res = fopencookie(cookie, mode, zfile_io);
+	if (res == NULL)
+		zfile_destroy(cookie);
+	else
+		zerror_register(&cookie->reg, res, &cookie->err,
+		    &cookie->st.stats);
+	return (res);
+}
+
+/*
+ * As zopenfile(), with optional tunables 'opts' (may be NULL).
+ */
+FILE *
+zopenfile_opts(FILE *in, const char *mode, const struct zfile_opts *opts,
+    bool *was_gzipped)
+{
+	unsigned char gzhdr[GZ_HDR_SZ];
+	struct zfile *cookie;
+	FILE *res;
+	int rc;
+
+	/* Writes compress (zfilew.c). */
+	if (strstr(mode, "w") || strstr(mode, "a")) {
+		res = zfilew_open(in, mode, opts);
+		if (res != NULL && was_gzipped != NULL)
+			*was_gzipped = true;
+		return (res);
+	}
+
+	/* Check if file is a compressed stream; if not, return it as is. */
+	rc = zfile_sniff(in, gzhdr);
+	if (rc < 0)
+		return (NULL);
+	if (rc == 0) {
+		if (was_gzipped != NULL)
+			*was_gzipped = false;
+		return in;
+	}
+
+	cookie = zfile_create(in, opts, gzhdr, sizeof gzhdr);
+	if (cookie == NULL)
+		return (NULL);
+
+	res = zfile_fopen(cookie, mode, opts);
+	if (res != NULL && was_gzipped != NULL)
+		*was_gzipped = true;
+	return res;
+}
+
+/*
+ * As zopenfile_opts(), for gzipped input whose first 'len' bytes have already
+ * been read into 'peek'.
+ */
+FILE *
+zopenfile_peek(FILE *in, const char *mode, const struct zfile_opts *opts,
+    const void *peek, size_t len)
+{
+	struct zfile *cookie;
+
+	if (strstr(mode, "w") || strstr(mode, "a") ||
+	    len < sizeof gz_magic || memcmp(peek, gz_magic,
+	    sizeof gz_magic) != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	cookie = zfile_create(in, opts, peek, len);
+	if (cookie == NULL)
+		return (NULL);
+	return (zfile_fopen(cookie, mode, opts));
+}
+
+/*
+ * Native interface: the same reader without a FILE around it.  Returns NULL
+ * with errno EINVAL if 'in' isn't gzipped.  zfile_free() closes 'in'.
+ */
+struct zfile *
+zfile_new(FILE *in, const struct zfile_opts *opts)
+{
+	unsigned char gzhdr[GZ_HDR_SZ];
+	int rc;
+
+	rc = zfile_sniff(in, gzhdr);
+	if (rc <= 0) {
+		if (rc == 0)
+			errno = EINVAL;
+		return (NULL);
+	}
+	return (zfile_create(in, opts, gzhdr, sizeof gzhdr));
+}
+
+void
+zfile_error(const struct zfile *cookie, struct zerror *e)
+{
+
+	*e = cookie->err;
+}
+
+void
+zfile_stats(const struct zfile *cookie, struct zstats *s)
+{
+
+	zstats_copy(s, &cookie->st.stats);
+}
+
+void
+zfile_free(struct zfile *cookie)
+{
+	FILE *in = cookie->in;
+
+	if (cookie->index_path != NULL && cookie->index.dirty &&
+	    zindex_save(&cookie->index, cookie->index_path, fileno(in),
+	    ZINDEX_GZIP) != 0)
+		warn("could not save seek index %s", cookie->index_path);
+	zfile_destroy(cookie);
+	fclose(in);
+}
+
+int
+zfile_seek_virtual(struct zfile *cookie, uint64_t voff)
+{
+	ssize_t i;
+
+	if (!cookie->is_bgzf || cookie->nblk == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	(void)zfile_bgzf_walk(cookie, 0, voff >> 16);
+	i = zfile_blk_find_in(cookie, voff >> 16);
+	if (i < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (zfile_bgzf_enter(cookie, cookie->blk[i].in, cookie->blk[i].out) !=
+	    0) {
+		zfile_restart(cookie);
+		errno = EIO;
+		return (-1);
+	}
+	cookie->logic_offset = cookie->blk[i].out + (voff & 0xffff);
+	return (0);
+}
+
+int
+zfile_tell_virtual(struct zfile *cookie, uint64_t *voff)
+{
+	const struct zfile_blk *end;
+	uint64_t off;
+	ssize_t i;
+
+	if (!cookie->is_bgzf || cookie->nblk == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	off = cookie->logic_offset;
+	(void)zfile_bgzf_walk(cookie, off, 0);
+	i = zfile_blk_find(cookie, off);
+	if (i >= 0) {
+		*voff = cookie->blk[i].in << 16 | (off - cookie->blk[i].out);
+		return (0);
+	}
+
+	/* Past the table: either at the end, or in the block after it. */
+	end = &cookie->blk[cookie->nblk - 1];
+	if (off - end->out > 0xffff ||
+	    (cookie->blk_complete && off != end->out)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	*voff = end->in << 16 | (off - end->out);
+	return (0);
+}
+
+/*
+ * Open gzipped file 'path' as a (forward-)seekable (and rewindable), read-only
+ * stream.
+ *
+ * If 'path' isn't a gzipped file, you still get a stream.
+ */
+FILE *
+zopen(const char *path, const char *mode, bool *was_gzipped)
+{
+
+	return (zopen_opts(path, mode, NULL, was_gzipped));
+}
+
+/*
+ * As zopen(), with optional tunables 'opts' (may be NULL).
+ */
+FILE *
+zopen_opts(const char *path, const char *mode, const struct zfile_opts *opts,
+    bool *was_gzipped)
+{
+	struct zfile_opts dflt;
+	char *idxpath, *gzipath;
+	FILE *in, *res;
+
+	in = fopen(path, mode);
+	if (in == NULL)
+		return (NULL);
+
+	/*
+	 * Pick up (and maybe save) the "<path>.idx" sidecar by default, and
+	 * a BGZF file's "<path>.gzi".
+	 */
+	if (opts != NULL)
+		dflt = *opts;
+	else
+		memset(&dflt, 0, sizeof dflt);
+	idxpath = gzipath = NULL;
+	if (dflt.index_path == NULL) {
+		if (asprintf(&idxpath, "%s.idx", path) >= 0)
+			dflt.index_path = idxpath;
+		else
+			idxpath = NULL;
+	}
+	if (dflt.gzi_path == NULL) {
+		if (asprintf(&gzipath, "%s.gzi", path) >= 0)
+			dflt.gzi_path = gzipath;
+		else
+			gzipath = NULL;
+	}
+
+	res = zopenfile_opts(in, mode, &dflt, was_gzipped);
+	free(idxpath);
+	free(gzipath);
+	if (res == NULL)
+		fclose(in);
+	return res;
+}
+
+/*
+ * Called once inflate() has reported the end of a member and all of its
+ * output has been consumed.  Checks the member's trailer and, if another
+ * member follows (as in 'cat a.gz b.gz' or pigz output), resets inflate for
+ * it.  Returns 1 if another member follows, 0 at the end of the stream and -1
+ * if the input is truncated or the trailer is wrong.
+ */
+static int
+zfile_member_end(struct zfile *cookie)
+{
+	uint32_t tlen = (uint32_t)(cookie->actual_len - cookie->member_start);
+	struct {
+		uint32_t crc;
+		uint32_t mlen;
+	} gztlr;
+	int rc;
+
+	assert(sizeof(gztlr) == 8);
+
+	/*
+	 * Some crap follows gz stream in vmcore-mini-gzip-prioritized.0. So
+	 * we have to wait until zlib reports end of stream before reading
+	 * trailer, which we do here:
+	 */
+	rc = zfile_input(cookie, &gztlr, sizeof gztlr);
+	if (rc < 0)
+		return (-1);
+	if (rc != sizeof gztlr) {
+		zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+		    "truncated gzip file -- lost trailer.  No CRC to check");
+		return (-1);
+	}
+	cookie->stream_end = false;
+
+	/*
+	 * GZ trailer is little endian. So is x86, but just for portability's
+	 * sake... (also zero is same in any endian, but ...)
+	 */
+	gztlr.crc = le32toh(gztlr.crc);
+	gztlr.mlen = le32toh(gztlr.mlen);
+
+	if (!cookie->verify || cookie->crc_skip)
+		gztlr.crc = 0;
+	cookie->crc_skip = false;
+	if (gztlr.crc != 0 && cookie->crc != gztlr.crc) {
+		cookie->crc_bad = true;
+		if (cookie->verify_fatal) {
+			zfile_fail(cookie, ZERROR_CHECKSUM, EBADMSG,
+			    "Actual CRC %08x does not match gzip CRC %08x",
+			    cookie->crc, gztlr.crc);
+			return (-1);
+		}
+		warnx("Actual CRC %08x does not match gzip CRC %08x; this "
+		    "stream *may* be corrupt. It may be worth investigating "
+		    "anyway.\n", cookie->crc, gztlr.crc);
+	}
+
+	if (tlen != gztlr.mlen) {
+		zfile_fail(cookie, ZERROR_CORRUPT, EBADMSG,
+		    "Length %u (%zu mod 2**32) doesn't match gzip trailer %u!",
+		    tlen, cookie->actual_len - cookie->member_start,
+		    gztlr.mlen);
+		return (-1);
+	}
+
+	if (cookie->is_bgzf)
+		zfile_blk_add(cookie, cookie->member_in, cookie->member_start,
+		    cookie->in_pos - cookie->decomp.avail_in,
+		    cookie->actual_len);
+
+	/*
+	 * Whatever follows is either another member or (as above) junk we
+	 * ignore.
+	 */
+	cookie->member_in = cookie->in_pos - cookie->decomp.avail_in;
+	rc = zfile_gzhdr_read(cookie);
+	if (rc < 0) {
+		zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+		    "truncated gzip file -- lost member header");
+	} else if (rc == 0 && gztlr.crc != 0 && !cookie->crc_bad)
+		warnx("CRC indicates this stream is good: %08x\n",
+		    cookie->crc);
+	if (rc == 0)
+		cookie->blk_complete = true;
+	if (rc <= 0)
+		return (rc);
+
+	cookie->be->reset(cookie->be_state);
+	cookie->crc = crc32(0, Z_NULL, 0);
+	cookie->member_start = cookie->actual_len;
+	if (cookie->index.span != 0)
+		zfile_index_add(cookie);
+	return (1);
+}
+
+/*
+ * Decode into 'out' from the parallel inflater.  Once it has finished the
+ * member, point the input just past the deflate data so that
+ * zfile_member_end() finds the trailer as usual.  Returns the number of bytes
+ * decoded, or -1 on truncation or error.
+ */
+static ssize_t
+zfile_par_read(struct zfile *cookie, uint8_t *out, size_t outlen)
+{
+	const char *msg;
+	ssize_t n;
+	int code;
+
+	n = zpinflate_read(cookie->par, out, outlen);
+	if (n < 0) {
+		code = zpinflate_error(cookie->par, &msg);
+		if (code != 0)
+			zfile_fail(cookie, zerror_code_kind(code), code, "%s",
+			    msg);
+		else
+			zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+			    "truncated gzip file -- no CRC to check");
+		return (-1);
+	}
+	if (n == 0) {
+		cookie->in_pos = zpinflate_end(cookie->par);
+		if (fseeko(cookie->in, cookie->in_pos, SEEK_SET) != 0) {
+			zfile_fail(cookie, ZERROR_IO, errno, "fseeko: %s",
+			    strerror(errno));
+			return (-1);
+		}
+		cookie->decomp.avail_in = 0;
+		cookie->par_active = false;
+		cookie->stream_end = true;
 	}
+	return (n);
+}
 
-	cookie->decomp.next_in = NULL;
-	cookie->decomp.avail_in = 0;
+/*
+ * In adaptive mode, double the (empty) output buffer if the last decode into
+ * it filled it.  Failure to grow is harmless.
+ */
+static void
+zfile_outbuf_grow(struct zfile *cookie)
+{
+	void *nbuf;
+
+	if (!cookie->adaptive || cookie->outbuf_size >= cookie->outbuf_max ||
+	    cookie->decomp.next_out != cookie->outbuf + cookie->outbuf_size)
+		return;
+
+	nbuf = realloc(cookie->outbuf, min(cookie->outbuf_size * 2,
+	    cookie->outbuf_max));
+	if (nbuf == NULL)
+		return;
+	cookie->outbuf = nbuf;
+	cookie->outbuf_size = min(cookie->outbuf_size * 2, cookie->outbuf_max);
 	cookie->decomp.next_out = cookie->outbuf;
-	cookie->decomp.avail_out = sizeof cookie->outbuf;
-
+	cookie->decomp.avail_out = cookie->outbuf_size;
 	cookie->outbuf_start = 0;
-	cookie->eof = false;
-	cookie->truncated = false;
+}
 
-	cookie->crc = crc32(0, Z_NULL, 0);
+/* Count (and checksum) 'len' freshly decoded bytes at 'out'. */
+static inline void
+zfile_account(struct zfile *cookie, const uint8_t *out, size_t len)
+{
+
+	cookie->actual_len += len;
+	if (cookie->verify)
+		cookie->crc = crc32(cookie->crc, out, len);
 }
 
-static void
-zfile_zlib_cleanup(struct zfile *cookie)
+/*
+ * Inflate the first member in one go with zinflate_whole(), into '*outp' (of
+ * 'outlen' bytes) if 'direct' and it fits, else into the output buffer
+ * (resized to fit; '*outp' is updated).  Only tried once per pass over a
+ * mapped input, whose trailing ISIZE is taken to be the member's length: it
+ * is right for a single member under 4 GB, and if it is wrong the decode
+ * fails, so nothing is lost but the time.  Returns the number of bytes
+ * decoded, or -1 to stream the member instead.
+ */
+static ssize_t
+zfile_decode_whole(struct zfile *cookie, bool direct, uint8_t **outp,
+    size_t outlen)
 {
+	const uint8_t *in;
+	size_t inlen, used;
+	uint32_t isize;
+	uint8_t *nbuf, *out;
+
+	cookie->whole = false;
+	if (cookie->actual_len != 0 || cookie->map_len < GZ_HDR_SZ + 8 ||
+	    cookie->map_len >= UINT32_MAX)
+		return (-1);
 
-	inflateEnd(&cookie->decomp);
+	memcpy(&isize, cookie->map + cookie->map_len - 4, sizeof isize);
+	isize = le32toh(isize);
+	if (isize == 0)
+		return (-1);
+
+	if (!(direct && outlen >= isize) && cookie->outbuf_size < isize) {
+		if (isize > ZFILE_WHOLE_MAX)
+			return (-1);
+		nbuf = malloc(isize);
+		if (nbuf == NULL)
+			return (-1);
+		free(cookie->outbuf);
+		cookie->outbuf = nbuf;
+		cookie->outbuf_size = isize;
+		if (!direct)
+			*outp = nbuf;
+	}
+	out = direct && outlen >= isize ? *outp : cookie->outbuf;
+
+	/* In a mapping, the input window runs to the end of the file. */
+	in = cookie->decomp.next_in;
+	inlen = cookie->decomp.avail_in;
+	if (zinflate_whole(in, inlen, out, isize, &used) != 0)
+		return (-1);
+
+	*outp = out;
+	cookie->decomp.next_in += used;
+	cookie->decomp.avail_in -= used;
+	cookie->stream_end = true;
+	return (isize);
 }
 
 /*
- * Open gzipped FILE stream 'in' as a (forward-)seekable (and rewindable),
- * read-only stream.
+ * Refill the (empty) output buffer: finish a member, or decode more of one.
+ * If 'dst' is non-NULL, decode straight into it instead (at most 'dstlen'
+ * bytes, reported in '*ndst'), leaving the output buffer empty.
  *
- * If 'in' isn't a gzipped file, you still get a stream (the original one is
- * returned).
+ * Returns 1 if it may have produced output, 0 at the end of the stream (with
+ * cookie->eof set) and -1 if the input is truncated.
  */
-FILE *
-zopenfile(FILE *in, const char *mode, bool *was_gzipped)
+static int
+zfile_decode(struct zfile *cookie, char *dst, size_t dstlen, size_t *ndst)
 {
-	unsigned char gzhdr[GZ_HDR_SZ];
-	struct zfile *cookie;
-	FILE *res;
-	size_t nbr;
+	uint8_t *out;
+	size_t outlen;
+	uint64_t t;
+	ssize_t rc;
+	int ret;
 
-	res = NULL;
-	cookie = NULL;
+	if (ndst != NULL)
+		*ndst = 0;
 
-	if (strstr(mode, "w") || strstr(mode, "a")) {
-		errno = EINVAL;
-		goto out;
+	if (cookie->stream_end) {
+		rc = zfile_member_end(cookie);
+		if (rc < 0)
+			return (-1);
+		if (rc == 0) {
+			cookie->eof = true;
+			if (cookie->index.span != 0)
+				zindex_set_complete(&cookie->index,
+				    cookie->actual_len);
+			zcache_feed_end(&cookie->cache, cookie->actual_len);
+			return (0);
+		}
+		/* Carry on with the next member. */
 	}
 
-	/* Check if file is a compressed stream: */
-	nbr = fread(gzhdr, 1, sizeof gzhdr, in);
-	if (ferror(in)) {
-		goto out;
-	} else if (nbr < (sizeof gzhdr)) {
-		fprintf(stderr, "File truncated\n");
-		goto out;
-	}
-	/* If not, just return the original FILE */
-	if (memcmp(gz_magic, gzhdr, sizeof gz_magic) != 0) {
-		rewind(in);
-		if (was_gzipped != NULL)
-			*was_gzipped = false;
-		return in;
+	if (dst != NULL) {
+		out = (uint8_t *)dst;
+		outlen = min(dstlen, (size_t)UINT_MAX);
+	} else {
+		zfile_outbuf_grow(cookie);
+		out = cookie->outbuf;
+		outlen = cookie->outbuf_size;
 	}
 
-	cookie = malloc(sizeof *cookie);
-	if (cookie == NULL) {
-		errno = ENOMEM;
-		goto out;
+	if (cookie->bgzf_active) {
+		t = zstats_begin(&cookie->st);
+		rc = zfile_bgzf_read(cookie, out, outlen);
+		zstats_end(&cookie->st, ZSTATS_DECODE, t, rc > 0 ? rc : 0);
+		if (rc < 0)
+			return (-1);
+		if (rc > 0) {
+			/* Blocks' CRCs are checked by the workers. */
+			cookie->actual_len += rc;
+			goto done;
+		}
+		rc = zfile_bgzf_end(cookie);
+		if (rc == 0)
+			zcache_feed_end(&cookie->cache, cookie->actual_len);
+		if (rc <= 0)
+			return (rc);
+		/* Carry on serially with the member that follows. */
 	}
 
-	cookie->in = in;
-	zfile_zlib_init(cookie);
+	if (cookie->par_active) {
+		t = zstats_begin(&cookie->st);
+		rc = zfile_par_read(cookie, out, outlen);
+		zstats_end(&cookie->st, ZSTATS_DECODE, t, rc > 0 ? rc : 0);
+		if (rc < 0)
+			return (-1);
+		zfile_account(cookie, out, rc);
+	} else {
+		/* Read more input if empty */
+		if (cookie->decomp.avail_in == 0) {
+			rc = zfile_fill(cookie);
+			if (rc < 0)
+				return (-1);
+			if (rc == 0) {
+				zfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+				    "truncated gzip file -- no CRC to check");
+				return (-1);
+			}
+		}
 
-	res = fopencookie(cookie, mode, zfile_io);
+		if (cookie->whole) {
+			t = zstats_begin(&cookie->st);
+			rc = zfile_decode_whole(cookie, dst != NULL, &out,
+			    outlen);
+			if (rc >= 0) {
+				zstats_end(&cookie->st, ZSTATS_DECODE, t, rc);
+				zfile_account(cookie, out, rc);
+				/* Too big for 'dst', so it is buffered. */
+				if (out != (uint8_t *)dst)
+					dst = NULL;
+				goto done;
+			}
+		}
 
-out:
-	if (res == NULL) {
-		if (cookie != NULL)
-			zfile_zlib_cleanup(cookie);
-		free(cookie);
-	} else if (was_gzipped != NULL)
-		*was_gzipped = true;
-	return res;
-}
+		cookie->decomp.next_out = out;
+		cookie->decomp.avail_out = outlen;
 
-/*
- * Open gzipped file 'path' as a (forward-)seekable (and rewindable), read-only
- * stream.
- *
- * If 'path' isn't a gzipped file, you still get a stream.
- */
-FILE *
-zopen(const char *path, const char *mode, bool *was_gzipped)
-{
-	FILE *in, *res;
+		/*
+		 * When indexing, stop at each deflate block boundary so that
+		 * we get a chance to take a checkpoint there.
+		 */
+		t = zstats_begin(&cookie->st);
+		if (cookie->index.span != 0)
+			ret = inflate(&cookie->decomp, Z_BLOCK);
+		else
+			ret = cookie->be->inflate(cookie->be_state,
+			    &cookie->decomp);
+		zstats_end(&cookie->st, ZSTATS_DECODE, t,
+		    cookie->decomp.next_out - out);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			if (ret == Z_MEM_ERROR)
+				zfile_fail(cookie, ZERROR_NOMEM, ENOMEM,
+				    "inflate: %s(%d)", zError(ret), ret);
+			else
+				zfile_fail(cookie, ZERROR_CORRUPT, EBADMSG,
+				    "inflate: %s(%d)", zError(ret), ret);
+			return (-1);
+		}
+		rc = cookie->decomp.next_out - out;
+		zfile_account(cookie, out, rc);
+
+		if (ret == Z_STREAM_END)
+			cookie->stream_end = true;
+		else if (cookie->index.span != 0 &&
+		    (cookie->decomp.data_type & 128) != 0 &&
+		    (cookie->decomp.data_type & 64) == 0)
+			zfile_index_add(cookie);
+	}
 
-	in = fopen(path, mode);
-	if (in == NULL)
-		return (NULL);
+done:
+	zcache_feed(&cookie->cache, cookie->actual_len - rc, out, rc);
 
-	res = zopenfile(in, mode, was_gzipped);
-	if (res == NULL)
-		fclose(in);
-	return res;
+	/* Reset stream state to beginning of output buffer */
+	cookie->outbuf_start = 0;
+	if (dst != NULL) {
+		*ndst = rc;
+		rc = 0;
+	}
+	cookie->decomp.next_out = cookie->outbuf + rc;
+	cookie->decomp.avail_out = cookie->outbuf_size - rc;
+	return (1);
 }
 
 // Return number of bytes into buf, 0 on EOF, -1 on error. Update
@@ -192,15 +2532,27 @@ static ssize_t
 zfile_read(void *cookie_, char *buf, size_t size)
 {
 	struct zfile *cookie = cookie_;
-	size_t nb, ignorebytes;
+	size_t ignorebytes, direct;
 	ssize_t total = 0;
-	int ret;
+	bool end;
+	int rc;
 
 	assert(size <= (size_t)INT_MAX);
 
 	if (size == 0)
 		return 0;
 
+	/* Before EOF: a cached seek may have left the decoder past it. */
+	if (cookie->cache.on && !cookie->truncated) {
+		total = zfile_cache_read(cookie, buf, size, &end);
+		if (total < 0)
+			return -1;
+		buf += total;
+		size -= total;
+		if (size == 0 || end || cookie->eof)
+			goto out;
+	}
+
 	if (cookie->eof)
 		return 0;
 	/*
@@ -212,15 +2564,10 @@ zfile_read(void *cookie_, char *buf, size_t size)
 	if (cookie->truncated)
 		goto out;
 
-	ret = Z_OK;
-
+	/* Bytes still to be thrown away for a forward seek */
 	ignorebytes = cookie->logic_offset - cookie->decode_offset;
-	assert(ignorebytes == 0);
-
 
 	do {
-		size_t inflated;
-
 		/* Drain output buffer first */
 		while (cookie->decomp.next_out >
 		    &cookie->outbuf[cookie->outbuf_start]) {
@@ -234,6 +2581,7 @@ zfile_read(void *cookie_, char *buf, size_t size)
 				left -= ignoreskip;
 				cookie->outbuf_start += ignoreskip;
 				cookie->decode_offset += ignoreskip;
+				ZSTATS_ADD(&cookie->st, skip_bytes, ignoreskip);
 			}
 
 			// Ran out of output before we seek()ed up.
@@ -243,6 +2591,7 @@ zfile_read(void *cookie_, char *buf, size_t size)
 			toread = min(left, size);
 			memcpy(buf, &cookie->outbuf[cookie->outbuf_start],
 			    toread);
+			ZSTATS_ADD(&cookie->st, copy_bytes, toread);
 
 			buf += toread;
 			size -= toread;
@@ -266,127 +2615,34 @@ zfile_read(void *cookie_, char *buf, size_t size)
 		assert(cookie->decomp.next_out ==
 		    &cookie->outbuf[cookie->outbuf_start]);
 
-		if (ret == Z_STREAM_END) {
-			cookie->eof = true;
-			break;
-		}
-
-		/* Read more input if empty */
-		if (cookie->decomp.avail_in == 0) {
-			nb = fread(cookie->inbuf, 1, sizeof cookie->inbuf,
-			    cookie->in);
-			if (ferror(cookie->in)) {
-				/*
-				 * Handle truncation errors from nested
-				 * compression streams.  Could be a false
-				 * positive if read(2) returned ENOBUFS
-				 * instead, but I don't see any harm.
-				 */
-				if (errno == ENOBUFS) {
-					warnx("Error reading core stream, "
-					    "assuming truncated compression "
-					    "stream");
-					cookie->truncated = true;
-					goto out;
-				} else
-					err(1, "error read core");
-			}
-			if (nb == 0 && feof(cookie->in)) {
-				warnx("truncated gzip file -- no CRC to check");
-				cookie->truncated = true;
-				goto out;
-			}
-			cookie->decomp.avail_in = nb;
-			cookie->decomp.next_in = cookie->inbuf;
-		}
-
-		/* Reset stream state to beginning of output buffer */
-		cookie->decomp.next_out = cookie->outbuf;
-		cookie->decomp.avail_out = sizeof cookie->outbuf;
-		cookie->outbuf_start = 0;
-
-		ret = inflate(&cookie->decomp, Z_NO_FLUSH);
-		if (ret != Z_OK && ret != Z_STREAM_END) {
-			warnx("inflate: %s(%d)", zError(ret), ret);
-			exit(1);
-		}
-		inflated = cookie->decomp.next_out - &cookie->outbuf[0];
-		cookie->actual_len += inflated;
-		cookie->crc = crc32(cookie->crc, cookie->outbuf, inflated);
-	} while (!ferror(cookie->in) && size > 0);
-
-	if (cookie->eof) {
-		uint32_t tlen = (uint32_t)cookie->actual_len;
-
-		struct {
-			uint32_t crc;
-			uint32_t mlen;
-		} gztlr;
-		assert(sizeof(gztlr) == 8);
-
-		/*
-		 * Some crap follows gz stream in
-		 * vmcore-mini-gzip-prioritized.0. So we have to wait until
-		 * zlib reports end of stream before reading trailer, which we
-		 * do here:
-		 */
-		size_t from_zlib_buf = min(cookie->decomp.avail_in, sizeof(gztlr));
-		memcpy((char*)&gztlr, cookie->decomp.next_in, from_zlib_buf);
-
-		/*
-		 * Probably we read it all from zlib input buffer, but just in
-		 * case, read anything remaining from input file.
-		 */
-		if (from_zlib_buf < sizeof(gztlr)) {
-			size_t rem = sizeof(gztlr) - from_zlib_buf;
-			size_t rd;
-
-			while (rem > 0 && (rd =
-				fread((char*)&gztlr + (sizeof(gztlr) - rem), 1, rem, cookie->in)) > 0) {
-				rem -= rd;
-			}
-
-			if (rem != 0) {
-				warnx("truncated gzip file -- lost trailer.  "
-				    "No CRC to check");
-				cookie->truncated = true;
-				goto out;
-			}
-		}
-
 		/*
-		 * GZ trailer is little endian. So is x86, but just for
-		 * portability's sake... (also zero is same in any endian, but
-		 * ...)
+		 * Reads at least as big as the output buffer are decoded in
+		 * place, saving a copy.
 		 */
-		gztlr.crc = le32toh(gztlr.crc);
-		gztlr.mlen = le32toh(gztlr.mlen);
-
-		if (gztlr.crc != 0) {
-			if (cookie->crc != gztlr.crc) {
-				warnx("Actual CRC %08x does not match gzip "
-				    "CRC %08x; this stream *may* be "
-				    "corrupt. It may be worth investigating "
-				    "anyway.\n", cookie->crc, gztlr.crc);
-			} else
-				warnx("CRC indicates this stream is good: %08x\n",
-				    cookie->crc);
-		}
-
-		if (tlen != gztlr.mlen) {
-			warnx("Length %u (%zu mod 2**32) doesn't match gzip trailer %u!\n",
-			    tlen, cookie->actual_len, gztlr.mlen);
-			exit(1);
-		}
-	}
+		if (size >= cookie->outbuf_size && ignorebytes == 0) {
+			rc = zfile_decode(cookie, buf, size, &direct);
+			buf += direct;
+			size -= direct;
+			total += direct;
+			cookie->decode_offset += direct;
+			cookie->logic_offset += direct;
+		} else
+			rc = zfile_decode(cookie, NULL, 0, NULL);
+		if (rc < 0)
+			goto out;
+		if (rc == 0)
+			break;
+	} while (!ferror(cookie->in) && size > 0);
 
 out:
 	assert(total <= SSIZE_MAX);
 	/*
 	 * If there's anything left to read, return it as a short read.
 	 */
-	if (total > 0)
+	if (total > 0) {
+		ZSTATS_ADD(&cookie->st, out_bytes, total);
 		return (total);
+	}
 	/*
 	 * If the stream was truncated, report an error (which will translate
 	 * into ferror() on the stream for consumers).  I checked and it seems
@@ -398,84 +2654,471 @@ out:
 		/*
 		 * Other alternatives considered were EFTYPE (does not exist on
 		 * Linux) or EILSEQ (confusing error string in glibc: "Invalid
-		 * or incomplete multibyte or wide character").
+		 * or incomplete multibyte or wide character").  Errors other
+		 * than truncation have their own errno; see zerror.h.
 		 */
-		errno = ENOBUFS;
+		errno = cookie->err.code;
 		cookie->eof = true;
 		return (-1);
 	}
 	return (0);
 }
 
+/*
+ * Native interface: lend the next stretch of output (straight out of the
+ * inflate buffer), valid until the next call.  Returns 1 with a non-empty
+ * chunk, 0 at EOF and -1 (errno ENOBUFS if the input is truncated, as
+ * zfile_error() says otherwise) on error.
+ */
+int
+zfile_next_chunk(struct zfile *cookie, const void **ptr, size_t *len)
+{
+	size_t left, skip;
+
+	for (;;) {
+		left = cookie->decomp.next_out -
+		    &cookie->outbuf[cookie->outbuf_start];
+		/* Throw away output up to a zfile_seek_virtual() target. */
+		skip = min(cookie->logic_offset - cookie->decode_offset,
+		    (uint64_t)left);
+		cookie->outbuf_start += skip;
+		cookie->decode_offset += skip;
+		ZSTATS_ADD(&cookie->st, skip_bytes, skip);
+		left -= skip;
+		if (left > 0) {
+			ZSTATS_ADD(&cookie->st, out_bytes, left);
+			*ptr = &cookie->outbuf[cookie->outbuf_start];
+			*len = left;
+			cookie->outbuf_start += left;
+			cookie->decode_offset += left;
+			cookie->logic_offset += left;
+			return (1);
+		}
+		if (cookie->eof)
+			return (0);
+		if (cookie->truncated) {
+			/* As zfile_read() */
+			errno = cookie->err.code;
+			cookie->eof = true;
+			return (-1);
+		}
+		if (zfile_decode(cookie, NULL, 0, NULL) == 0)
+			return (0);
+	}
+}
+
+/*
+ * Length of a gzip member header at 'p' ('len' bytes, which may run past it),
+ * or 0 if it isn't one (or doesn't fit), as zfile_gzhdr_read() would take it.
+ */
+static size_t
+zfile_gzhdr_len(const uint8_t *p, size_t len)
+{
+	const uint8_t *nul;
+	size_t off;
+
+	if (len < GZ_HDR_SZ || memcmp(p, gz_magic, sizeof gz_magic) != 0 ||
+	    (p[3] & GZ_FRESERVED) != 0)
+		return (0);
+	off = GZ_HDR_SZ;
+	if ((p[3] & GZ_FEXTRA) != 0) {
+		if (len - off < 2)
+			return (0);
+		off += 2 + (p[off] | (p[off + 1] << 8));
+	}
+	if ((p[3] & GZ_FNAME) != 0) {
+		if (off >= len || (nul = memchr(p + off, 0, len - off)) == NULL)
+			return (0);
+		off = nul - p + 1;
+	}
+	if ((p[3] & GZ_FCOMMENT) != 0) {
+		if (off >= len || (nul = memchr(p + off, 0, len - off)) == NULL)
+			return (0);
+		off = nul - p + 1;
+	}
+	if ((p[3] & GZ_FHCRC) != 0)
+		off += 2;
+	return (off <= len ? off : 0);
+}
+
+/*
+ * Record a checkpoint that zfile_walk() has come to, unless the index reaches
+ * that far already: a member start (with 'zs' NULL) wherever it is, or the
+ * block boundary 'zs' is at, if indexing and 'span' past the last point.  As
+ * in zfile_index_add(), failing to is harmless.
+ */
+static void
+zfile_walk_point(struct zfile *cookie, z_stream *zs, uint64_t out,
+    uint64_t in, uint64_t base, uint32_t crc)
+{
+	struct zindex *index = &cookie->index;
+	struct zindex_point *pt;
+	uint8_t *window;
+	uint64_t last;
+	uInt winlen;
+
+	last = index->npoints > 0 ? index->points[index->npoints - 1].out : 0;
+	if (out <= last || (zs != NULL && out < last + index->span))
+		return;
+
+	pt = zindex_reserve(index, &window);
+	if (pt == NULL)
+		return;
+	if (zs == NULL) {
+		if (window != NULL)
+			memset(window, 0, ZFILE_WINSIZE);
+		pt->flags = ZINDEX_RESET;
+	} else {
+		winlen = ZFILE_WINSIZE;
+		if (inflateGetDictionary(zs, window, &winlen) != Z_OK ||
+		    winlen != ZFILE_WINSIZE)
+			return;
+		pt->bits = zs->data_type & 7;
+	}
+	pt->out = out;
+	pt->in = in;
+	pt->base = base;
+	pt->crc = crc;
+	zindex_commit(index);
+}
+
+/*
+ * Find the length of a plain (not BGZF) gzip input by walking its members
+ * from the start: each member's deflate data is inflated into a scratch
+ * buffer, only to count its output and find where it ends, and its ISIZE
+ * trailer is checked against the count.  The input is read at random, so the
+ * decoder is left alone.  This costs about as much as an inflate pass, with
+ * no copy (and no CRC unless indexing), so what it learns is kept: member
+ * starts go into the index as checkpoints, as do block boundaries every
+ * 'span' when indexing, and the index is then complete.  As in decoding,
+ * what follows the last member and doesn't start another is ignored.
+ * Returns -1 if the input can't be read at random or doesn't decode.
+ */
+static int
+zfile_walk(struct zfile *cookie, uint64_t insz, uint64_t *lenp)
+{
+	uint8_t *inbuf, *scratch;
+	uint64_t pos, total, out;
+	uint32_t crc;
+	size_t hlen;
+	ssize_t n;
+	uInt avail, got;
+	z_stream zs;
+	int ret, rc;
+	bool crcs;
+
+	/* Window checkpoints carry the CRC so far, for the trailer check. */
+	crcs = cookie->index.span != 0 && cookie->verify;
+
+	inbuf = malloc(ZFILE_WALK_BUF);
+	scratch = malloc(ZFILE_WALK_BUF);
+	memset(&zs, 0, sizeof zs);
+	if (inbuf == NULL || scratch == NULL ||
+	    inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		free(inbuf);
+		free(scratch);
+		return (-1);
+	}
+
+	rc = -1;
+	pos = total = 0;
+	while (pos < insz) {
+		n = zfile_pread(cookie, inbuf, ZFILE_WALK_BUF, pos);
+		if (n <= 0)
+			goto out;
+		hlen = zfile_gzhdr_len(inbuf, n);
+		if (hlen == 0) {
+			/* Junk after a member ends the stream, as decoding. */
+			if (pos == 0)
+				goto out;
+			break;
+		}
+		pos += hlen;
+		crc = crc32(0, Z_NULL, 0);
+		zfile_walk_point(cookie, NULL, total, pos, total, crc);
+
+		/* 'pos' follows the input inflate has used. */
+		(void)inflateReset(&zs);
+		zs.avail_in = 0;
+		out = 0;
+		do {
+			if (zs.avail_in == 0) {
+				n = zfile_pread(cookie, inbuf, ZFILE_WALK_BUF,
+				    pos);
+				if (n <= 0)
+					goto out;
+				zs.next_in = inbuf;
+				zs.avail_in = n;
+			}
+			avail = zs.avail_in;
+			zs.next_out = scratch;
+			zs.avail_out = ZFILE_WALK_BUF;
+			ret = inflate(&zs, cookie->index.span != 0 ? Z_BLOCK :
+			    Z_NO_FLUSH);
+			got = ZFILE_WALK_BUF - zs.avail_out;
+			if (crcs)
+				crc = crc32(crc, scratch, got);
+			out += got;
+			pos += avail - zs.avail_in;
+			/* At a block boundary, but not the end of the member */
+			if (ret == Z_OK && cookie->index.span != 0 &&
+			    (zs.data_type & 128) != 0 &&
+			    (zs.data_type & 64) == 0)
+				zfile_walk_point(cookie, &zs, total + out, pos,
+				    total, crc);
+		} while (ret == Z_OK);
+		if (ret != Z_STREAM_END)
+			goto out;
+
+		if (zfile_pread(cookie, inbuf, 8, pos) != 8 ||
+		    gz_le32(inbuf + 4) != (uint32_t)out)
+			goto out;
+		pos += 8;
+		total += out;
+	}
+	zindex_set_complete(&cookie->index, total);
+	*lenp = total;
+	rc = 0;
+
+out:
+	(void)inflateEnd(&zs);
+	free(inbuf);
+	free(scratch);
+	return (rc);
+}
+
+/*
+ * Find the length of the output, for SEEK_END and zfile_size(): from a
+ * complete index, the BGZF block table (walked to the end), or the end of a
+ * pass that got there, none of which takes decoding.  Failing those, a
+ * dictzip file whose chunk table ends at the trailer is a single member,
+ * whose ISIZE trailer is its length (exactly, as chunks are under 4 GB in
+ * all).  Any other gzip input has its members walked (see zfile_walk()),
+ * since one member's ISIZE says nothing of others (as from 'cat a.gz b.gz')
+ * and wraps at 4 GB.  Returns -1 with errno ESPIPE if none applies.
+ */
+static int
+zfile_length(struct zfile *cookie, uint64_t *lenp)
+{
+	uint64_t insz;
+	struct stat sb;
+	uint8_t tlr[4];
+	uint32_t isize;
+
+	if (cookie->index.complete) {
+		*lenp = cookie->index.total_out;
+		return (0);
+	}
+	if (cookie->is_bgzf) {
+		if (zfile_bgzf_walk(cookie, UINT64_MAX, 0) == 0 &&
+		    cookie->blk_complete) {
+			*lenp = cookie->blk[cookie->nblk - 1].out;
+			return (0);
+		}
+		goto unknown;
+	}
+	if (cookie->eof && !cookie->truncated) {
+		*lenp = cookie->actual_len;
+		return (0);
+	}
+
+	if (cookie->map != NULL)
+		insz = cookie->map_len;
+	else if (fstat(fileno(cookie->in), &sb) == 0 && S_ISREG(sb.st_mode))
+		insz = sb.st_size;
+	else
+		goto unknown;
+
+	if (cookie->dz_offs != NULL &&
+	    cookie->dz_offs[cookie->dz_chcnt] + 8 == insz &&
+	    zfile_pread(cookie, tlr, sizeof tlr, insz - 4) == sizeof tlr) {
+		isize = gz_le32(tlr);
+		if (isize <= (uint64_t)cookie->dz_chcnt * cookie->dz_chlen &&
+		    (cookie->dz_chcnt == 0 || isize >
+		    (uint64_t)(cookie->dz_chcnt - 1) * cookie->dz_chlen)) {
+			*lenp = isize;
+			return (0);
+		}
+	}
+	if (zfile_walk(cookie, insz, lenp) == 0)
+		return (0);
+
+unknown:
+	errno = ESPIPE;
+	return (-1);
+}
+
+int
+zfile_size(struct zfile *cookie, uint64_t *lenp)
+{
+
+	return (zfile_length(cookie, lenp));
+}
+
+/*
+ * Move the decoder for a seek to 'new_offset' (lazily, if forward) and make
+ * it the logical offset.  Returns -1 if it can't get there.
+ */
+static int
+zfile_seek_to(struct zfile *cookie, off64_t new_offset)
+{
+	struct zindex_point dzpt;
+	ssize_t i;
+
+	/*
+	 * Jump to the nearest checkpoint if that gets us closer than decoding
+	 * forward from where the decoder is.  The start of the stream is an
+	 * implicit checkpoint.  BGZF block starts ahead are learned from
+	 * their headers, where the input allows, rather than by decoding.
+	 */
+	if (cookie->is_bgzf && (uint64_t)new_offset > cookie->decode_offset)
+		(void)zfile_bgzf_walk(cookie, new_offset, 0);
+
+	if (new_offset != 0 && zfile_dz_point(cookie, new_offset, &dzpt)) {
+		/* dictzip: any chunk start is a checkpoint, minus the CRC. */
+		if (dzpt.out > cookie->decode_offset ||
+		    (uint64_t)new_offset < cookie->decode_offset) {
+			zfile_par_stop(cookie);
+			if (zfile_index_restore(cookie, &dzpt) != 0) {
+				zfile_restart(cookie);
+				return -1;
+			}
+			cookie->crc_skip = dzpt.out != 0;
+			ZSTATS_ADD(&cookie->st, jumps, 1);
+		}
+	} else if (new_offset != 0 && cookie->is_bgzf &&
+	    (i = zfile_blk_find(cookie, new_offset)) >= 0) {
+		/* BGZF: any block start is a checkpoint. */
+		if (cookie->blk[i].out > cookie->decode_offset ||
+		    (uint64_t)new_offset < cookie->decode_offset) {
+			if (zfile_bgzf_enter(cookie, cookie->blk[i].in,
+			    cookie->blk[i].out) != 0) {
+				zfile_restart(cookie);
+				return -1;
+			}
+			ZSTATS_ADD(&cookie->st, jumps, 1);
+		}
+	} else if (new_offset != 0 &&
+	    (cookie->index.span != 0 || cookie->index.npoints != 0)) {
+		const struct zindex_point *pt;
+
+		pt = zindex_lookup(&cookie->index, new_offset);
+		if (pt == NULL) {
+			if ((uint64_t)new_offset < cookie->decode_offset) {
+				zfile_restart(cookie);
+			}
+		} else if (pt->out > cookie->decode_offset ||
+		    (uint64_t)new_offset < cookie->decode_offset) {
+			/* zfile_walk() may add points to a parallel read. */
+			zfile_par_stop(cookie);
+			if (zfile_index_restore(cookie, pt) != 0) {
+				/* Input position is unknown; start over. */
+				zfile_restart(cookie);
+				return -1;
+			}
+			ZSTATS_ADD(&cookie->st, jumps, 1);
+		}
+	}
+
+	/*
+	 * Backward seeks to anywhere but 0 (or a checkpoint, above) are not
+	 * ok
+	 */
+	if (new_offset < (off64_t)cookie->decode_offset && new_offset != 0) {
+		return -1;
+	}
+
+	if (new_offset == 0 && zfile_restart(cookie) != 0) {
+		/*
+		 * An unseekable input is still at its start if nothing has
+		 * been decoded yet (as for an ftell(3) before the first read).
+		 */
+		if (cookie->decode_offset != 0)
+			return -1;
+	}
+
+	/*
+	 * Forward seeks are lazy: the next read discards output up to here.
+	 * (A seek past EOF thus succeeds, as with lseek(2), and the next read
+	 * returns EOF.)
+	 */
+	cookie->logic_offset = new_offset;
+	return 0;
+}
+
+/*
+ * Serve what the block cache holds of a read at the logical offset, unless
+ * the decoder has that buffered already, then move the decoder to where the
+ * rest must come from: by the checkpoints, as for a seek, or else by starting
+ * over.  Returns the number of bytes served (setting '*endp' if the cache
+ * shows that they end the output), or -1 if the decoder can't get there.
+ */
+static ssize_t
+zfile_cache_read(struct zfile *cookie, char *buf, size_t size, bool *endp)
+{
+	uint64_t off;
+	size_t n;
+
+	*endp = false;
+	off = cookie->logic_offset;
+	if (off >= cookie->decode_offset && off < cookie->decode_offset +
+	    (cookie->decomp.next_out - &cookie->outbuf[cookie->outbuf_start]))
+		return (0);
+	n = zcache_read(&cookie->cache, off, buf, size, endp);
+	ZSTATS_ADD(&cookie->st, cache_bytes, n);
+	off += n;
+	cookie->logic_offset = off;
+	if (n == size || *endp || off == cookie->decode_offset)
+		return (n);
+
+	if (zfile_seek_to(cookie, off) != 0) {
+		if (zfile_restart(cookie) != 0)
+			return (-1);
+		cookie->logic_offset = off;
+	}
+	return (n);
+}
+
 static int
 zfile_seek(void *cookie_, off64_t *offset, int whence)
 {
 	struct zfile *cookie = cookie_;
 	off64_t new_offset = 0;
+	uint64_t len;
 
 	if (whence == SEEK_SET) {
 		new_offset = *offset;
 	} else if (whence == SEEK_CUR) {
 		new_offset = (off64_t)cookie->logic_offset + *offset;
+	} else if (zfile_length(cookie, &len) == 0) {
+		/* The checkpoints below then apply as for any other seek. */
+		new_offset = (off64_t)len + *offset;
 	} else {
-		/* SEEK_END not ok */
+		/* Input not readable at random, or corrupt: zfile_length() */
 		return -1;
 	}
 
 	if (new_offset < 0)
 		return -1;
+	zstats_seek(&cookie->st, cookie->logic_offset, new_offset);
 
-	/* Backward seeks to anywhere but 0 are not ok */
-	if (new_offset < (off64_t)cookie->logic_offset && new_offset != 0) {
+	/*
+	 * A target in the block cache is served from there (the decoder is
+	 * only moved if a read misses; see zfile_cache_read()), else the
+	 * decoder goes there now.
+	 */
+	if (zcache_has(&cookie->cache, new_offset))
+		cookie->logic_offset = new_offset;
+	else if (zfile_seek_to(cookie, new_offset) != 0)
 		return -1;
-	}
-
-	if (new_offset == 0) {
-		/* rewind(3) */
-		zfile_zlib_cleanup(cookie);
-		rewind(cookie->in);
-		zfile_zlib_init(cookie);
-	} else if ((uint64_t)new_offset > cookie->logic_offset) {
-		/* Emulate forward seek by skipping ... */
-		char *buf;
-		const size_t bsz = 32*1024;
-		fprintf(stderr, "XXX Seek: Skipping %zu bytes\n",
-		    (uint64_t)new_offset - cookie->logic_offset);
-
-		buf = malloc(bsz);
-		while ((uint64_t)new_offset > cookie->logic_offset) {
-			size_t diff = min(bsz,
-			    (uint64_t)new_offset - cookie->logic_offset);
-			ssize_t err = zfile_read(cookie_, buf, diff);
-			if (err < 0) {
-				free(buf);
-				return -1;
-			}
-
-			/* Seek past EOF gets positioned at EOF */
-			if (err == 0) {
-				assert(cookie->eof);
-				new_offset = cookie->logic_offset;
-				break;
-			}
-		}
-		free(buf);
-	}
-
-	assert(cookie->logic_offset == (uint64_t)new_offset);
 	*offset = new_offset;
-
 	return 0;
 }
 
 static int
 zfile_close(void *cookie_)
 {
-	struct zfile *cookie = cookie_;
-
-	zfile_zlib_cleanup(cookie);
-	fclose(cookie->in);
-	free(cookie);
 
+	zfile_free(cookie_);
 	return 0;
 }
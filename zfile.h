@@ -9,11 +9,285 @@
 #ifndef ZFILE_H
 #define ZFILE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zstats.h"
+
 #define GZ_HDR_SZ 10
 
 static const unsigned char gz_magic[] = { 0x1f, 0x8b, 0x08 };
 
+/* The gzip variant a member header's extra subfields mark it as */
+enum zfile_format {
+	ZFILE_FORMAT_GZIP = 0,
+	ZFILE_FORMAT_BGZF,	// htslib blocked gzip: 'BC' extra subfield
+	ZFILE_FORMAT_DICTZIP,	// dictzip: 'RA' chunk table subfield
+};
+
+#define ZFILE_HDR_STR_MAX	4096
+
+/*
+ * The fields of a gzip member header (RFC 1952).  'name', 'comment' and
+ * 'extra' are NULL if the header has none; names and comments longer than
+ * ZFILE_HDR_STR_MAX bytes are truncated.
+ */
+struct zfile_header {
+	uint8_t flags;		// FLG byte; FTEXT (0x01) is the text hint
+	uint8_t xfl, os;
+	uint32_t mtime;
+	char *name, *comment;
+	uint8_t *extra;		// FEXTRA data (a list of subfields)
+	size_t extra_len;
+
+	enum zfile_format format;
+	/* BGZF: the member's total size, from 'BC' */
+	uint32_t bgzf_bsize;
+	/* dictzip: uncompressed length and number of chunks, from 'RA' */
+	uint32_t dz_chlen, dz_chcnt;
+};
+
+/*
+ * Find extra subfield 'si1', 'si2' in 'h'.  Returns its data (with its length
+ * in '*lenp'), or NULL if there is none.
+ */
+const uint8_t *zfile_header_field(const struct zfile_header *h,
+    unsigned char si1, unsigned char si2, size_t *lenp);
+void zfile_header_free(struct zfile_header *);
+
+/*
+ * Optional tunables for zopen_opts() / zopenfile_opts().  A zeroed struct (or
+ * a NULL pointer) gives the same behavior as zopen() / zopenfile().
+ */
+enum zfile_verify {
+	ZFILE_VERIFY_END = 0,
+	ZFILE_VERIFY_OFF,
+	ZFILE_VERIFY_FRAME,
+};
+
+enum zfile_inflate {
+	ZFILE_INFLATE_AUTO = 0,
+	ZFILE_INFLATE_ZLIB,
+	ZFILE_INFLATE_ISAL,
+	ZFILE_INFLATE_LIBDEFLATE,
+};
+
+struct zfile_opts {
+	/*
+	 * If non-zero, record a random-access checkpoint (the 32 kB inflate
+	 * window and bit position) roughly every 'index_span' bytes of output
+	 * while reading.  Seeks, including backward ones, then restart inflate
+	 * at the nearest preceding checkpoint.  Values below the 32 kB window
+	 * size are rounded up.
+	 */
+	uint64_t index_span;
+
+	/*
+	 * Sidecar file holding a previously saved index.  It is used (and
+	 * overrides 'index_span') if it matches the size and mtime of the
+	 * input.  zopen() and zopen_opts() default this to "<path>.idx".
+	 */
+	const char *index_path;
+	/* Write the index back to 'index_path' on close if it grew. */
+	bool index_save;
+
+	/*
+	 * If greater than 1, inflate the first gzip member speculatively on
+	 * this many threads (see zpinflate.h); later members, and streams
+	 * being indexed, are decoded serially as usual.
+	 */
+	unsigned threads;
+	/*
+	 * If non-zero, decompress on a separate thread, keeping up to this
+	 * many 256 kB buffers of output ready ahead of the reader (see
+	 * zahead.h).
+	 */
+	unsigned readahead;
+
+	/*
+	 * Checksum policy.  ZFILE_VERIFY_END, the default, checks each
+	 * member's CRC against its trailer once the member has been read,
+	 * warning about a mismatch and reading on; ZFILE_VERIFY_FRAME makes a
+	 * mismatch fatal.  ZFILE_VERIFY_OFF neither computes nor checks CRCs
+	 * (lengths are still checked), saving the crc32() over every byte,
+	 * including any skipped by forward seeks.
+	 */
+	enum zfile_verify verify;
+
+	/*
+	 * Compressed input and decompressed output buffer sizes; 0 selects
+	 * the defaults of 32 kB and 256 kB.  Reads of at least the output
+	 * buffer size bypass it and decode straight into the caller's memory.
+	 */
+	size_t inbuf_size, outbuf_size;
+	/*
+	 * Tune the buffers to the stream: the input buffer is shrunk to fit
+	 * small files and grown (up to 4 MB) while reads from the source are
+	 * slow; the output buffer starts at 32 kB and grows up to
+	 * 'outbuf_size' for as long as decodes keep filling it.
+	 */
+	bool adaptive;
+
+	/*
+	 * If the input is a regular file, mmap(2) it whole and point inflate
+	 * straight at the mapping instead of fread()ing it; otherwise this is
+	 * ignored.  The file must not shrink while open.
+	 */
+	bool use_mmap;
+	/*
+	 * If non-zero and the input is a regular file or block device (and
+	 * not mapped), keep this many reads of 'inbuf_size' bytes in flight
+	 * ahead of the decoder (see zprefetch.h), for cold files on slow
+	 * devices.
+	 */
+	unsigned prefetch;
+	/*
+	 * If the input can't seek (a pipe or socket), keep up to this many
+	 * bytes of its start in memory, so that rewinding still works for as
+	 * long as no more than that has been read from it.  0 (the default)
+	 * keeps none, and such a rewind fails.
+	 */
+	size_t replay;
+
+	/*
+	 * Time reads of the source and calls into the decoder, for
+	 * zstats_get() (see zstats.h); its other counters are always kept.
+	 * A 'trace' hook, which implies 'timing', is called with each of them
+	 * (and each seek) as it happens, and 'trace_arg'.
+	 */
+	bool timing;
+	zstats_hook *trace;
+	void *trace_arg;
+
+	/*
+	 * Share decoded output with other readers of the same file through
+	 * the process-wide block cache (see zcache.h): reads and seeks are
+	 * served from it where it has the data, and what is decoded is added
+	 * to it.  Ignored unless the input is a regular file.
+	 */
+	bool cache;
+
+	/*
+	 * Inflate implementation (see zinflate.h).  ZFILE_INFLATE_ISAL
+	 * streams through ISA-L's igzip; ZFILE_INFLATE_LIBDEFLATE decodes a
+	 * mapped single-member file in one libdeflate call when its trailer
+	 * gives the size (up to 64 MB, or the whole of a large enough direct
+	 * read), streaming through zlib otherwise.  ZFILE_INFLATE_AUTO uses
+	 * whichever of the two were compiled in.  Anything not compiled in
+	 * falls back to zlib, as does reading with an index.
+	 */
+	enum zfile_inflate inflate;
+
+	/*
+	 * If non-NULL, filled in with the first member's header on open; the
+	 * caller frees it with zfile_header_free().  A dictzip file's chunk
+	 * table is used for seeks (see zfile_seek()) whether or not this is
+	 * set.
+	 */
+	struct zfile_header *header;
+
+	/*
+	 * BGZF block index to load, in htslib's .gzi format ("<path>.gzi"
+	 * by default for zopen*()); a missing file is not an error.  Without
+	 * one, block starts are learned from the block headers as needed.
+	 * Either way, seeks in a BGZF file (including backward ones and
+	 * SEEK_END) restart at the containing block, and 'threads' decodes
+	 * its blocks on a worker pool.
+	 */
+	const char *gzi_path;
+
+	/*
+	 * Writing (modes "w" and "a", which append a member): deflate 'level'
+	 * 1 to 9, 0 selecting zlib's default (6), and 'window_log' 9 to 15
+	 * (0 for 15).  With 'threads' greater than 1, 128 kB blocks are
+	 * compressed in parallel, pigz-style: each is primed with the 32 kB
+	 * before it and byte-aligned with a sync flush, so the output is one
+	 * ordinary deflate stream.  A non-zero 'frame_size' ends the member
+	 * and starts another every 'frame_size' bytes of input, which makes
+	 * members a reader can start at.
+	 *
+	 * 'bgzf' writes BGZF instead: blocks of up to 0xff00 bytes of input
+	 * (less with a smaller 'frame_size'), each its own member, ending
+	 * with bgzip's empty block; 'threads' compresses blocks in parallel.
+	 *
+	 * With 'index_save', unless appending, the member starts are saved on
+	 * close: a BGZF file's to 'gzi_path' as a .gzi, those of a file with
+	 * 'frame_size' to 'index_path' as a windowless sidecar (see
+	 * zindex.h), stamped with the output's size and mtime.  zopen*()
+	 * default both paths as for reading, so a reader opening the file
+	 * later picks the index up.
+	 */
+	int level;
+	unsigned window_log;
+	uint64_t frame_size;
+	bool bgzf;
+};
+
 FILE *zopen(const char *path, const char *mode, bool *was_gzipped);
 FILE *zopenfile(FILE *f, const char *mode, bool *was_gzipped);
+FILE *zopen_opts(const char *path, const char *mode,
+    const struct zfile_opts *opts, bool *was_gzipped);
+FILE *zopenfile_opts(FILE *f, const char *mode,
+    const struct zfile_opts *opts, bool *was_gzipped);
+
+/*
+ * As zopenfile_opts(), for an 'f' whose first 'len' bytes have already been
+ * read into 'peek' (to identify it, say).  They are decoded from there rather
+ * than read again, so 'f' need not be seekable, though rewinding the result
+ * then fails.  Fails with EINVAL unless they start a gzip stream.
+ */
+FILE *zopenfile_peek(FILE *f, const char *mode,
+    const struct zfile_opts *opts, const void *peek, size_t len);
+
+/*
+ * Native interface, for callers that only need to look at the output: each
+ * zfile_next_chunk() lends a pointer into the decoder's own buffer, valid
+ * until the next call, instead of copying through stdio.  'readahead' does
+ * not apply.
+ *
+ * The zfile takes ownership of 'f', and zfile_free() fclose()s it.  If
+ * zfile_new() fails (with EINVAL if 'f' isn't gzipped), 'f' stays open and
+ * is still the caller's.
+ */
+struct zfile;
+struct zfile *zfile_new(FILE *f, const struct zfile_opts *opts);
+int zfile_next_chunk(struct zfile *, const void **ptr, size_t *len);
+void zfile_free(struct zfile *);
+
+/*
+ * The most recent error on a zfile, as zerror_get() (zerror.h) gives for a
+ * FILE.  Decode errors never exit the process; they fail reads instead.
+ */
+struct zerror;
+void zfile_error(const struct zfile *, struct zerror *e);
+/* As zstats_get(), for a zfile. */
+void zfile_stats(const struct zfile *, struct zstats *s);
+
+/*
+ * Length of the output, as SEEK_END finds it: from a complete index or BGZF
+ * block table, or the ISIZE trailer of a dictzip file (one member), without
+ * decoding.  Otherwise the members are walked, inflating each (without
+ * disturbing reads) to find where it ends and checking its ISIZE; their
+ * starts (and, with 'index_span', checkpoints) go into the index, which is
+ * then complete, so later seeks restart there.  Fails with ESPIPE if the
+ * input can't be read at random or doesn't decode.
+ */
+int zfile_size(struct zfile *, uint64_t *len);
+
+/*
+ * BGZF virtual offsets (block input offset << 16 | offset within the block's
+ * output), as used by htslib.  Both fail with EINVAL if the input is not
+ * BGZF or the offset is not at a block (the seek is otherwise lazy, as for
+ * fseek(3)).
+ */
+int zfile_seek_virtual(struct zfile *, uint64_t voff);
+int zfile_tell_virtual(struct zfile *, uint64_t *voff);
+
+/*
+ * Closed readers are kept (up to a few) for reuse by later opens.  This
+ * frees them, e.g. before checking for leaks at exit.
+ */
+void zfile_pool_flush(void);
 
 #endif
@@ -0,0 +1,704 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#include "zfile.h"
+#include "zfilew.h"
+#include "zindex.h"
+#include "zpool.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+#define max(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a > _b ? _a : _b; })
+
+#define KB		1024
+#define ZFILEW_OUTBUF	(256*KB)
+#define ZFILEW_BLOCK	(128*KB)	// Unit of parallel compression
+#define ZFILEW_DICT	(32*KB)
+
+#define GZ_OS_UNIX	3
+#define GZ_FEXTRA	0x04
+
+/*
+ * BGZF blocks: members with a 'BC' subfield giving their size, which must
+ * stay within 64 kB.  bgzip's 0xff00 bytes of input always fit, as
+ * deflateBound() shows.
+ */
+#define ZFILEW_BGZF_IN	0xff00
+#define ZFILEW_BGZF_MAX	(64*KB)
+#define ZFILEW_BGZF_HDR	(GZ_HDR_SZ + 8)
+
+/* The empty block bgzip ends with, so readers can tell it wasn't cut short */
+static const uint8_t zfilew_bgzf_eof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+	0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/*
+ * zpool_job tag: the low 32 bits give the length of the dictionary at the
+ * start of 'src', ahead of the block itself.
+ */
+#define ZFILEW_FIRST	(1ULL << 32)	// Block starts a member
+#define ZFILEW_LAST	(1ULL << 33)	// ... ends it
+
+struct zfilew {
+	FILE *out;
+	int level, wbits;
+	uint64_t frame_size;
+
+	uint64_t total_in;	// Input so far, for ftell(3)
+	bool member_open;	// Current member has begun
+	uint64_t member_in;	// Its input so far
+	uint32_t crc;		// ... and their CRC (serial only)
+	bool failed;		// Output failed; refuse further writes
+	bool bgzf;		// Members are BGZF blocks
+	uint64_t out_off;	// Output so far
+
+	/*
+	 * With 'index_save' (and not appending), every member start, to save
+	 * on close: to 'index_path' as a windowless index, or for BGZF to
+	 * 'gzi_path' in bgzip's format.
+	 */
+	struct zindex index;
+	char *index_path;
+	bool indexing;
+
+	/* Serial: one deflate stream straight through. */
+	z_stream strm;
+	bool strm_init;
+	uint8_t *outbuf;
+
+	/*
+	 * Parallel: independent blocks on a zpool, each deflated after the
+	 * (up to) 32 kB preceding it.  Headers and trailers are written as
+	 * blocks come back, in order.
+	 */
+	struct zpool *pool;
+	struct zpool_job *cur;	// Block being filled, not yet submitted
+	bool first;		// 'cur' (or the next block) starts a member
+	uint8_t dict[ZFILEW_DICT];
+	size_t dictlen, dictmax;
+	uint32_t drain_crc;	// Of the member being written out
+	uint64_t drain_in;
+	uint64_t drain_out;	// Output offset of the member, for the index
+};
+
+static cookie_write_function_t zfilew_write;
+static cookie_seek_function_t zfilew_seek;
+static cookie_close_function_t zfilew_close;
+
+static const cookie_io_functions_t zfilew_io = {
+	.read = NULL,
+	.write = zfilew_write,
+	.seek = zfilew_seek,
+	.close = zfilew_close,
+};
+
+static int
+zfilew_put(struct zfilew *w, const void *buf, size_t len)
+{
+
+	if (len > 0 && fwrite(buf, 1, len, w->out) != len) {
+		w->failed = true;
+		return (-1);
+	}
+	w->out_off += len;
+	return (0);
+}
+
+/*
+ * Note that a member whose output starts at 'out' has just had its header
+ * written.  Failure to grow the index just means none is saved.
+ */
+static void
+zfilew_mark(struct zfilew *w, uint64_t out)
+{
+	struct zindex_point *pt;
+
+	if (!w->indexing)
+		return;
+	pt = zindex_reserve(&w->index, NULL);
+	if (pt == NULL) {
+		warnx("Out of memory growing seek index; not saving it");
+		w->indexing = false;
+		return;
+	}
+	pt->out = out;
+	pt->in = w->out_off;
+	pt->base = out;
+	pt->crc = crc32(0, Z_NULL, 0);
+	pt->flags = ZINDEX_RESET;
+	zindex_commit(&w->index);
+}
+
+/*
+ * Write a member header; a BGZF one needs the size of the deflate data,
+ * 'clen', to follow.
+ */
+static int
+zfilew_header(struct zfilew *w, uint64_t out, size_t clen)
+{
+	uint8_t hdr[ZFILEW_BGZF_HDR] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0,
+	    0, 0, GZ_OS_UNIX };
+	size_t bsize, len;
+
+	/* XFL: "maximum compression" or "fastest algorithm" */
+	if (w->level == 9)
+		hdr[8] = 2;
+	else if (w->level == 1)
+		hdr[8] = 4;
+	len = GZ_HDR_SZ;
+	if (w->bgzf) {
+		bsize = ZFILEW_BGZF_HDR + clen + 8;
+		assert(bsize <= ZFILEW_BGZF_MAX);
+		hdr[3] = GZ_FEXTRA;
+		hdr[10] = 6;		// XLEN
+		hdr[12] = 'B';
+		hdr[13] = 'C';
+		hdr[14] = 2;		// SLEN
+		hdr[16] = (bsize - 1) & 0xff;
+		hdr[17] = (bsize - 1) >> 8;
+		len = ZFILEW_BGZF_HDR;
+	}
+	if (zfilew_put(w, hdr, len) != 0)
+		return (-1);
+	zfilew_mark(w, out);
+	return (0);
+}
+
+static int
+zfilew_trailer(struct zfilew *w, uint32_t crc, uint64_t len)
+{
+	uint8_t tlr[8];
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		tlr[i] = crc >> (8 * i);
+		tlr[4 + i] = (uint32_t)len >> (8 * i);
+	}
+	return (zfilew_put(w, tlr, sizeof tlr));
+}
+
+/*
+ * Serial mode: run deflate() over whatever input is pending, writing out
+ * everything it produces.  A BGZF block instead collects in 'outbuf', which
+ * it always fits, to be written behind its header once complete.
+ */
+static int
+zfilew_deflate(struct zfilew *w, int flush)
+{
+	int rc;
+
+	if (w->bgzf) {
+		rc = deflate(&w->strm, flush);
+		assert(rc == (flush == Z_FINISH ? Z_STREAM_END : Z_OK) ||
+		    rc == Z_BUF_ERROR);
+		assert(w->strm.avail_in == 0 && w->strm.avail_out > 0);
+		return (0);
+	}
+	do {
+		w->strm.next_out = w->outbuf;
+		w->strm.avail_out = ZFILEW_OUTBUF;
+		rc = deflate(&w->strm, flush);
+		assert(rc == Z_OK || rc == Z_STREAM_END || rc == Z_BUF_ERROR);
+		if (zfilew_put(w, w->outbuf,
+		    ZFILEW_OUTBUF - w->strm.avail_out) != 0)
+			return (-1);
+	} while (w->strm.avail_out == 0 ||
+	    (flush == Z_FINISH && rc != Z_STREAM_END));
+	return (0);
+}
+
+static void *
+zfilew_ctx_create(void *arg)
+{
+	struct zfilew *w = arg;
+	z_stream *strm;
+
+	strm = calloc(1, sizeof *strm);
+	if (strm == NULL)
+		return (NULL);
+	if (deflateInit2(strm, w->level, Z_DEFLATED, -w->wbits, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(strm);
+		return (NULL);
+	}
+	return (strm);
+}
+
+static void
+zfilew_ctx_free(void *ctx)
+{
+
+	deflateEnd(ctx);
+	free(ctx);
+}
+
+/*
+ * Worker: deflate one block, primed with the dictionary in front of it, and
+ * end it on a byte boundary (or, for the last block of a member, with the
+ * final block) so that the outputs simply concatenate.  aux[0] is the CRC of
+ * the block.
+ */
+static void
+zfilew_par_deflate(void *ctx, void *arg, struct zpool_job *job)
+{
+	z_stream *strm = ctx;
+	size_t dl, blen, bound;
+	int flush, rc;
+
+	(void)arg;
+	if (strm == NULL) {
+		job->error = "out of memory";
+		return;
+	}
+	dl = job->tag & 0xffffffff;
+	blen = job->srclen - dl;
+	flush = (job->tag & ZFILEW_LAST) != 0 ? Z_FINISH : Z_SYNC_FLUSH;
+	job->aux[0] = crc32(crc32(0, Z_NULL, 0), (Bytef *)job->src + dl, blen);
+
+	rc = deflateReset(strm);
+	assert(rc == Z_OK);
+	if (dl > 0) {
+		rc = deflateSetDictionary(strm, job->src, dl);
+		assert(rc == Z_OK);
+	}
+
+	/* deflateBound() covers Z_FINISH; a sync flush adds a few bytes. */
+	bound = deflateBound(strm, blen) + 16;
+	if (zpool_reserve(&job->dst, &job->dstcap, bound) != 0) {
+		job->error = "out of memory";
+		return;
+	}
+	strm->next_in = (Bytef *)job->src + dl;
+	strm->avail_in = blen;
+	strm->next_out = job->dst;
+	strm->avail_out = job->dstcap;
+	rc = deflate(strm, flush);
+	assert(rc == (flush == Z_FINISH ? Z_STREAM_END : Z_OK));
+	assert(strm->avail_in == 0 && strm->avail_out > 0);
+	job->dstlen = job->dstcap - strm->avail_out;
+}
+
+/* Write out the oldest block in flight, if any. */
+static int
+zfilew_par_drain(struct zfilew *w)
+{
+	struct zpool_job *job;
+	size_t blen;
+	int rc;
+
+	job = zpool_head(w->pool);
+	if (job == NULL)
+		return (0);
+
+	rc = -1;
+	if (job->error != NULL) {
+		w->failed = true;
+		errno = ENOMEM;
+		goto out;
+	}
+	if ((job->tag & ZFILEW_FIRST) != 0) {
+		w->drain_out += w->drain_in;
+		w->drain_crc = crc32(0, Z_NULL, 0);
+		w->drain_in = 0;
+		/* A BGZF block is a whole member in one job. */
+		if (zfilew_header(w, w->drain_out, job->dstlen) != 0)
+			goto out;
+	}
+	if (zfilew_put(w, job->dst, job->dstlen) != 0)
+		goto out;
+	blen = job->srclen - (job->tag & 0xffffffff);
+	w->drain_crc = crc32_combine(w->drain_crc, job->aux[0], blen);
+	w->drain_in += blen;
+	if ((job->tag & ZFILEW_LAST) != 0 &&
+	    zfilew_trailer(w, w->drain_crc, w->drain_in) != 0)
+		goto out;
+	rc = 0;
+out:
+	zpool_release(w->pool);
+	return (rc);
+}
+
+/* Start a block in 'cur', behind the dictionary it will be primed with. */
+static int
+zfilew_par_slot(struct zfilew *w)
+{
+	struct zpool_job *job;
+
+	while ((job = zpool_slot(w->pool)) == NULL)
+		if (zfilew_par_drain(w) != 0)
+			return (-1);
+	if (zpool_reserve(&job->src, &job->srccap,
+	    w->dictlen + ZFILEW_BLOCK) != 0) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	memcpy(job->src, w->dict, w->dictlen);
+	job->srclen = w->dictlen;
+	job->tag = w->dictlen;
+	if (w->first)
+		job->tag |= ZFILEW_FIRST;
+	w->first = false;
+	w->cur = job;
+	return (0);
+}
+
+/* Hand 'cur' to the workers, keeping its tail as the next dictionary. */
+static void
+zfilew_par_submit(struct zfilew *w, bool last)
+{
+	struct zpool_job *job = w->cur;
+
+	if (last) {
+		job->tag |= ZFILEW_LAST;
+		w->dictlen = 0;
+	} else {
+		w->dictlen = min(job->srclen, w->dictmax);
+		memcpy(w->dict, (uint8_t *)job->src + job->srclen - w->dictlen,
+		    w->dictlen);
+	}
+	zpool_submit(w->pool);
+	w->cur = NULL;
+}
+
+static int
+zfilew_par_add(struct zfilew *w, const char *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (w->cur == NULL && zfilew_par_slot(w) != 0)
+			return (-1);
+		n = min(len, ZFILEW_BLOCK - (w->cur->srclen -
+		    (w->cur->tag & 0xffffffff)));
+		memcpy((char *)w->cur->src + w->cur->srclen, buf, n);
+		w->cur->srclen += n;
+		buf += n;
+		len -= n;
+		if (w->cur->srclen - (w->cur->tag & 0xffffffff) ==
+		    ZFILEW_BLOCK)
+			zfilew_par_submit(w, false);
+	}
+	return (0);
+}
+
+static int
+zfilew_begin(struct zfilew *w)
+{
+
+	w->member_open = true;
+	w->member_in = 0;
+	if (w->pool != NULL) {
+		w->first = true;
+		w->dictlen = 0;
+		return (0);
+	}
+	w->crc = crc32(0, Z_NULL, 0);
+	if (w->bgzf) {
+		w->strm.next_out = w->outbuf;
+		w->strm.avail_out = ZFILEW_OUTBUF;
+		return (0);
+	}
+	return (zfilew_header(w, w->total_in, 0));
+}
+
+static int
+zfilew_end(struct zfilew *w)
+{
+	int rc;
+
+	w->member_open = false;
+	if (w->pool != NULL) {
+		/* The last block may be empty, if the one before was full. */
+		if (w->cur == NULL && zfilew_par_slot(w) != 0)
+			return (-1);
+		zfilew_par_submit(w, true);
+		return (0);
+	}
+	if (zfilew_deflate(w, Z_FINISH) != 0)
+		return (-1);
+	if (w->bgzf && (zfilew_header(w, w->total_in - w->member_in,
+	    ZFILEW_OUTBUF - w->strm.avail_out) != 0 ||
+	    zfilew_put(w, w->outbuf, ZFILEW_OUTBUF - w->strm.avail_out) != 0))
+		return (-1);
+	if (zfilew_trailer(w, w->crc, w->member_in) != 0)
+		return (-1);
+	rc = deflateReset(&w->strm);
+	assert(rc == Z_OK);
+	return (0);
+}
+
+static ssize_t
+zfilew_write(void *cookie, const char *buf, size_t size)
+{
+	struct zfilew *w = cookie;
+	size_t done, n;
+	int rc;
+
+	if (w->failed) {
+		errno = EIO;
+		return (-1);
+	}
+	for (done = 0; done < size; done += n) {
+		if (!w->member_open && zfilew_begin(w) != 0)
+			return (-1);
+		n = size - done;
+		if (w->frame_size != 0)
+			n = min((uint64_t)n, w->frame_size - w->member_in);
+		if (w->pool != NULL)
+			rc = zfilew_par_add(w, buf + done, n);
+		else {
+			w->crc = crc32(w->crc, (const Bytef *)buf + done, n);
+			w->strm.next_in = (Bytef *)buf + done;
+			w->strm.avail_in = n;
+			rc = zfilew_deflate(w, Z_NO_FLUSH);
+		}
+		if (rc != 0)
+			return (-1);
+		w->member_in += n;
+		w->total_in += n;
+		if (w->member_in == w->frame_size && zfilew_end(w) != 0)
+			return (-1);
+	}
+	return (size);
+}
+
+/* Only ftell(3) works: the offset is in the uncompressed data written. */
+static int
+zfilew_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct zfilew *w = cookie;
+
+	if (whence != SEEK_CUR || *offset != 0) {
+		errno = ESPIPE;
+		return (-1);
+	}
+	*offset = w->total_in;
+	return (0);
+}
+
+static void
+zfilew_le64(uint8_t *p, uint64_t v)
+{
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+/*
+ * Write the BGZF block starts after the first as a .gzi (bgzip -i) index: a
+ * 64-bit count, then (compressed, uncompressed) offset pairs, the last being
+ * the start of the end-of-file block at 'eof_in'.
+ */
+static int
+zfilew_gzi_save(struct zfilew *w, uint64_t eof_in)
+{
+	const struct zindex_point *pt;
+	uint8_t buf[16];
+	FILE *f;
+	size_t i;
+	int rc;
+
+	f = fopen(w->index_path, "w");
+	if (f == NULL)
+		return (-1);
+	zfilew_le64(buf, w->index.npoints);
+	fwrite(buf, 1, 8, f);
+	for (i = 1; i <= w->index.npoints; i++) {
+		if (i < w->index.npoints) {
+			pt = &w->index.points[i];
+			zfilew_le64(buf, pt->in - ZFILEW_BGZF_HDR);
+			zfilew_le64(buf + 8, pt->out);
+		} else {
+			zfilew_le64(buf, eof_in);
+			zfilew_le64(buf + 8, w->total_in);
+		}
+		fwrite(buf, 1, 16, f);
+	}
+	rc = ferror(f) ? -1 : 0;
+	if (fclose(f) != 0)
+		rc = -1;
+	return (rc);
+}
+
+/*
+ * Save the index once the output is complete.  The plain sidecar is stamped
+ * with the output's size and mtime, so that has to be flushed first.
+ */
+static void
+zfilew_index_save(struct zfilew *w, uint64_t eof_in)
+{
+	int rc;
+
+	if (fflush(w->out) != 0) {
+		w->failed = true;
+		return;
+	}
+	if (w->bgzf)
+		rc = zfilew_gzi_save(w, eof_in);
+	else {
+		zindex_set_complete(&w->index, w->total_in);
+		rc = zindex_save(&w->index, w->index_path, fileno(w->out),
+		    ZINDEX_GZIP);
+	}
+	if (rc != 0)
+		warn("could not save seek index %s", w->index_path);
+}
+
+static void
+zfilew_free(struct zfilew *w)
+{
+
+	zindex_free(&w->index);
+	free(w->index_path);
+	if (w->pool != NULL)
+		zpool_destroy(w->pool);
+	if (w->strm_init)
+		deflateEnd(&w->strm);
+	free(w->outbuf);
+	free(w);
+}
+
+static int
+zfilew_close(void *cookie)
+{
+	struct zfilew *w = cookie;
+	uint64_t eof_in;
+	int rc;
+
+	rc = 0;
+	if (!w->failed) {
+		/*
+		 * Even empty output is a (one-member) gzip file; BGZF's
+		 * end-of-file block does for one.
+		 */
+		if (!w->member_open && w->total_in == 0 && !w->bgzf)
+			rc = zfilew_begin(w);
+		if (rc == 0 && w->member_open)
+			rc = zfilew_end(w);
+		while (rc == 0 && w->pool != NULL &&
+		    zpool_inflight(w->pool) > 0)
+			rc = zfilew_par_drain(w);
+		eof_in = w->out_off;
+		if (rc == 0 && w->bgzf)
+			rc = zfilew_put(w, zfilew_bgzf_eof,
+			    sizeof zfilew_bgzf_eof);
+		if (rc == 0 && w->indexing)
+			zfilew_index_save(w, eof_in);
+	}
+	if (w->failed)
+		rc = -1;
+	if (fclose(w->out) != 0)
+		rc = -1;
+	zfilew_free(w);
+	return (rc);
+}
+
+FILE *
+zfilew_open(FILE *out, const char *mode, const struct zfile_opts *opts)
+{
+	struct zfilew *w;
+	const char *path;
+	FILE *res;
+	int rc;
+
+	if (strchr(mode, 'r') != NULL || strchr(mode, '+') != NULL ||
+	    (opts != NULL && (opts->level < 0 || opts->level > 9 ||
+	    (opts->window_log != 0 &&
+	    (opts->window_log < 9 || opts->window_log > 15))))) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return (NULL);
+	w->out = out;
+	w->level = Z_DEFAULT_COMPRESSION;
+	w->wbits = MAX_WBITS;
+	if (opts != NULL) {
+		if (opts->level != 0)
+			w->level = opts->level;
+		if (opts->window_log != 0)
+			w->wbits = opts->window_log;
+		w->frame_size = opts->frame_size;
+	}
+	w->dictmax = min((size_t)ZFILEW_DICT, (size_t)1 << w->wbits);
+
+	/* BGZF blocks are members of (at most) bgzip's size, and stand alone. */
+	if (opts != NULL && opts->bgzf) {
+		w->bgzf = true;
+		if (w->frame_size == 0 || w->frame_size > ZFILEW_BGZF_IN)
+			w->frame_size = ZFILEW_BGZF_IN;
+		w->dictmax = 0;
+	}
+
+	/* Offsets in appended output are unknown; index fresh files only. */
+	path = w->bgzf ? opts->gzi_path : opts != NULL ? opts->index_path :
+	    NULL;
+	if (opts != NULL && opts->index_save && path != NULL &&
+	    strchr(mode, 'a') == NULL && (w->bgzf || w->frame_size != 0)) {
+		zindex_init(&w->index, max(w->frame_size, (uint64_t)ZFILEW_DICT), 0);
+		w->index_path = strdup(path);
+		if (w->index_path == NULL) {
+			zfilew_free(w);
+			errno = ENOMEM;
+			return (NULL);
+		}
+		w->indexing = true;
+	}
+
+	if (opts != NULL && opts->threads > 1) {
+		w->pool = zpool_create(opts->threads, 2 * opts->threads,
+		    zfilew_par_deflate, zfilew_ctx_create, zfilew_ctx_free, w);
+		if (w->pool == NULL)
+			warn("parallel deflate unavailable");
+	}
+	if (w->pool == NULL) {
+		w->outbuf = malloc(ZFILEW_OUTBUF);
+		rc = deflateInit2(&w->strm, w->level, Z_DEFLATED, -w->wbits, 8,
+		    Z_DEFAULT_STRATEGY);
+		w->strm_init = rc == Z_OK;
+		if (w->outbuf == NULL || !w->strm_init) {
+			zfilew_free(w);
+			errno = ENOMEM;
+			return (NULL);
+		}
+	}
+
+	res = fopencookie(w, mode, zfilew_io);
+	if (res == NULL)
+		zfilew_free(w);
+	return (res);
+}
@@ -0,0 +1,24 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZFILEW_H
+#define ZFILEW_H
+
+#include <stdio.h>
+
+#include "zfile.h"
+
+/*
+ * The gzip writer behind zopenfile_opts() in modes "w" and "a": returns a
+ * write-only stream compressing onto 'out', which it closes when closed
+ * itself.  On failure, NULL is returned (with errno set) and 'out' is left
+ * open.
+ */
+FILE *zfilew_open(FILE *out, const char *mode, const struct zfile_opts *opts);
+
+#endif
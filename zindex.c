@@ -0,0 +1,382 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#endif
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zindex.h"
+
+#define ZINDEX_VERSION	2
+#define ZINDEX_COMPLETE	0x1
+
+static const char zindex_magic[8] = { 'Z', 'F', 'I', 'L', 'E', 'I', 'D', 'X' };
+
+/* On-disk header; all fields little-endian. */
+struct zindex_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t codec;
+	uint64_t src_size;	// Size of indexed (compressed) file
+	int64_t src_mtime;	// ... and its modification time
+	uint32_t src_mtime_nsec;
+	uint32_t winsize;
+	uint64_t span;
+	uint64_t npoints;
+	uint64_t total_out;
+	uint32_t flags;
+	uint32_t pad;
+};
+
+_Static_assert(sizeof(struct zindex_hdr) == 72, "zindex_hdr layout");
+_Static_assert(sizeof(struct zindex_point) == 32, "zindex_point layout");
+
+void
+zindex_init(struct zindex *index, uint64_t span, size_t winsize)
+{
+
+	memset(index, 0, sizeof *index);
+	index->span = span;
+	index->winsize = winsize;
+}
+
+void
+zindex_free(struct zindex *index)
+{
+
+	if (index->map != NULL)
+		munmap(index->map, index->maplen);
+	else {
+		free(index->points);
+		free(index->windows);
+	}
+	index->map = NULL;
+	index->points = NULL;
+	index->windows = NULL;
+	index->npoints = index->cap = 0;
+}
+
+/*
+ * Copy a mapped index to the heap so that it can grow.
+ */
+static int
+zindex_unshare(struct zindex *index)
+{
+	struct zindex_point *np;
+	uint8_t *nw;
+	size_t ncap;
+
+	ncap = index->npoints > 8 ? index->npoints * 2 : 16;
+	np = malloc(ncap * sizeof *np);
+	nw = malloc(ncap * index->winsize);
+	if (np == NULL || (nw == NULL && index->winsize != 0)) {
+		free(np);
+		free(nw);
+		return (-1);
+	}
+	memcpy(np, index->points, index->npoints * sizeof *np);
+	memcpy(nw, index->windows, index->npoints * index->winsize);
+
+	munmap(index->map, index->maplen);
+	index->map = NULL;
+	index->points = np;
+	index->windows = nw;
+	index->cap = ncap;
+	return (0);
+}
+
+/*
+ * Reserve room for one more point.  Returns the (uninitialized) point and, in
+ * '*windowp', where its window goes; the caller fills both in and calls
+ * zindex_commit().  Returns NULL if out of memory.
+ */
+struct zindex_point *
+zindex_reserve(struct zindex *index, uint8_t **windowp)
+{
+	struct zindex_point *pt;
+
+	if (index->map != NULL && zindex_unshare(index) != 0)
+		return (NULL);
+
+	if (index->npoints == index->cap) {
+		size_t ncap = index->cap > 0 ? index->cap * 2 : 16;
+		void *np, *nw;
+
+		np = realloc(index->points, ncap * sizeof *index->points);
+		if (np == NULL)
+			return (NULL);
+		index->points = np;
+		if (index->winsize != 0) {
+			nw = realloc(index->windows, ncap * index->winsize);
+			if (nw == NULL)
+				return (NULL);
+			index->windows = nw;
+		}
+		index->cap = ncap;
+	}
+
+	pt = &index->points[index->npoints];
+	memset(pt, 0, sizeof *pt);
+	if (windowp != NULL)
+		*windowp = index->winsize != 0 ?
+		    &index->windows[index->npoints * index->winsize] : NULL;
+	return (pt);
+}
+
+void
+zindex_commit(struct zindex *index)
+{
+
+	assert(index->npoints < index->cap);
+	index->npoints++;
+	index->dirty = true;
+}
+
+void
+zindex_set_complete(struct zindex *index, uint64_t total_out)
+{
+
+	if (index->complete)
+		return;
+	index->complete = true;
+	index->total_out = total_out;
+	index->dirty = true;
+}
+
+/*
+ * Find the last point at or before output offset 'off', or NULL.
+ */
+const struct zindex_point *
+zindex_lookup(const struct zindex *index, uint64_t off)
+{
+	size_t lo, hi;
+
+	lo = 0;
+	hi = index->npoints;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (index->points[mid].out <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo > 0 ? &index->points[lo - 1] : NULL);
+}
+
+const uint8_t *
+zindex_window(const struct zindex *index, const struct zindex_point *pt)
+{
+
+	if (index->winsize == 0)
+		return (NULL);
+	return (&index->windows[(size_t)(pt - index->points) *
+	    index->winsize]);
+}
+
+/*
+ * Load sidecar 'path' into (empty) 'index', if it exists, describes a 'codec'
+ * stream and matches the size and mtime of 'srcfd'.  A sidecar without
+ * windows (as the gzip writer saves) is also accepted if all of its points
+ * are ZINDEX_RESET ones, leaving 'index->winsize' 0.  A sidecar whose points
+ * don't fit the source (see below) is rejected whole.  Returns 0 on success
+ * and -1 (leaving 'index' untouched) otherwise.
+ */
+int
+zindex_load(struct zindex *index, const char *path, int srcfd, unsigned codec)
+{
+	const struct zindex_point *pts;
+	struct zindex_hdr hdr;
+	struct stat src, sb;
+	uint64_t npoints, i;
+	size_t need, winsize;
+	void *map;
+	int fd;
+
+#if BYTE_ORDER != LITTLE_ENDIAN
+	/* The mapping is used in place; just rebuild the index instead. */
+	(void)index; (void)path; (void)srcfd; (void)codec;
+	return (-1);
+#endif
+
+	if (srcfd < 0 || fstat(srcfd, &src) != 0 || !S_ISREG(src.st_mode))
+		return (-1);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+	if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof hdr ||
+	    pread(fd, &hdr, sizeof hdr, 0) != (ssize_t)sizeof hdr)
+		goto bad;
+
+	if (memcmp(hdr.magic, zindex_magic, sizeof zindex_magic) != 0 ||
+	    le32toh(hdr.version) != ZINDEX_VERSION ||
+	    le32toh(hdr.codec) != codec ||
+	    (le32toh(hdr.winsize) != index->winsize &&
+	    le32toh(hdr.winsize) != 0) ||
+	    le64toh(hdr.src_size) != (uint64_t)src.st_size ||
+	    (int64_t)le64toh(hdr.src_mtime) != (int64_t)src.st_mtim.tv_sec ||
+	    le32toh(hdr.src_mtime_nsec) != (uint32_t)src.st_mtim.tv_nsec)
+		goto bad;
+
+	winsize = le32toh(hdr.winsize);
+	npoints = le64toh(hdr.npoints);
+	if (npoints > (SIZE_MAX - sizeof hdr) /
+	    (sizeof(struct zindex_point) + winsize))
+		goto bad;
+	need = sizeof hdr +
+	    (size_t)npoints * (sizeof(struct zindex_point) + winsize);
+	if ((size_t)sb.st_size != need)
+		goto bad;
+
+	map = mmap(NULL, need, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto bad;
+	close(fd);
+
+	/*
+	 * The points must fit the source, or a restore would go astray (or
+	 * have zlib refuse it): bits in range, offsets within the file and in
+	 * order, and without windows, every point able to do without one.
+	 */
+	pts = (const struct zindex_point *)((char *)map + sizeof hdr);
+	for (i = 0; i < npoints; i++)
+		if (pts[i].bits > 7 ||
+		    ((pts[i].flags & ZINDEX_RESET) != 0 && pts[i].bits != 0) ||
+		    (pts[i].bits != 0 && pts[i].in == 0) ||
+		    pts[i].in > (uint64_t)src.st_size ||
+		    pts[i].base > pts[i].out ||
+		    (i > 0 && (pts[i].out < pts[i - 1].out ||
+		    pts[i].in < pts[i - 1].in)) ||
+		    (winsize != index->winsize &&
+		    (pts[i].flags & ZINDEX_RESET) == 0))
+			break;
+	if (i < npoints || ((le32toh(hdr.flags) & ZINDEX_COMPLETE) != 0 &&
+	    npoints > 0 && pts[npoints - 1].out > le64toh(hdr.total_out))) {
+		munmap(map, need);
+		return (-1);
+	}
+
+	index->winsize = winsize;
+	index->map = map;
+	index->maplen = need;
+	index->points = (void *)((char *)map + sizeof hdr);
+	index->windows = (uint8_t *)map + sizeof hdr +
+	    (size_t)npoints * sizeof(struct zindex_point);
+	index->npoints = index->cap = npoints;
+	index->span = le64toh(hdr.span);
+	index->complete = (le32toh(hdr.flags) & ZINDEX_COMPLETE) != 0;
+	index->total_out = le64toh(hdr.total_out);
+	index->dirty = false;
+	return (0);
+
+bad:
+	close(fd);
+	return (-1);
+}
+
+/*
+ * Write 'index' to sidecar 'path', stamped with the size and mtime of the
+ * indexed file 'srcfd'.  The file is replaced atomically.
+ */
+int
+zindex_save(const struct zindex *index, const char *path, int srcfd,
+    unsigned codec)
+{
+	struct zindex_hdr hdr;
+	struct stat src;
+	char *tmp;
+	FILE *f;
+	size_t i;
+	int fd;
+
+	if (srcfd < 0 || fstat(srcfd, &src) != 0 || !S_ISREG(src.st_mode)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (asprintf(&tmp, "%s.%ld.tmp", path, (long)getpid()) < 0)
+		return (-1);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(tmp);
+		return (-1);
+	}
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, zindex_magic, sizeof zindex_magic);
+	hdr.version = htole32(ZINDEX_VERSION);
+	hdr.codec = htole32(codec);
+	hdr.src_size = htole64((uint64_t)src.st_size);
+	hdr.src_mtime = (int64_t)htole64((uint64_t)src.st_mtim.tv_sec);
+	hdr.src_mtime_nsec = htole32((uint32_t)src.st_mtim.tv_nsec);
+	hdr.winsize = htole32((uint32_t)index->winsize);
+	hdr.span = htole64(index->span);
+	hdr.npoints = htole64(index->npoints);
+	hdr.total_out = htole64(index->complete ? index->total_out : 0);
+	hdr.flags = htole32(index->complete ? ZINDEX_COMPLETE : 0);
+	fwrite(&hdr, sizeof hdr, 1, f);
+
+	for (i = 0; i < index->npoints; i++) {
+		struct zindex_point pt;
+
+		memset(&pt, 0, sizeof pt);
+		pt.out = htole64(index->points[i].out);
+		pt.in = htole64(index->points[i].in);
+		pt.base = htole64(index->points[i].base);
+		pt.crc = htole32(index->points[i].crc);
+		pt.bits = index->points[i].bits;
+		pt.flags = index->points[i].flags;
+		fwrite(&pt, sizeof pt, 1, f);
+	}
+	if (index->winsize != 0 && index->npoints > 0)
+		fwrite(index->windows, index->winsize, index->npoints, f);
+
+	if (ferror(f)) {
+		fclose(f);
+		goto fail;
+	}
+	if (fclose(f) != 0)
+		goto fail;
+	if (rename(tmp, path) != 0)
+		goto fail;
+	free(tmp);
+	return (0);
+
+fail:
+	unlink(tmp);
+	free(tmp);
+	return (-1);
+}
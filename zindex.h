@@ -0,0 +1,73 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZINDEX_H
+#define ZINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Random-access seek index shared by the gzip and zstd readers, plus its
+ * on-disk ("sidecar") representation.
+ *
+ * The sidecar is a fixed header, followed by the point array, followed by
+ * one 'winsize'-byte window per point.  All fields are little-endian and the
+ * point array is laid out exactly as 'struct zindex_point', so on
+ * little-endian hosts a loaded index is used straight out of the mapping.
+ */
+
+#define ZINDEX_GZIP	1
+#define ZINDEX_ZSTD	2
+
+/* Point starts an independent member/frame; no window or bits needed. */
+#define ZINDEX_RESET	0x1
+
+struct zindex_point {
+	uint64_t out;		// Offset in output of checkpoint
+	uint64_t in;		// Offset in input of first full byte
+	uint64_t base;		// Output offset of the containing member/frame
+	uint32_t crc;		// Codec-specific running checksum at 'out'
+	uint8_t bits;		// Bits (1-7) from byte at 'in - 1', or 0
+	uint8_t flags;		// ZINDEX_*
+	uint8_t pad[2];
+};
+
+struct zindex {
+	uint64_t span;		// Minimum output distance between points
+	uint64_t total_out;	// Length of output, if 'complete'
+	size_t winsize;		// Bytes of window per point (may be 0)
+	size_t npoints, cap;
+	struct zindex_point *points;
+	uint8_t *windows;
+
+	/* Non-NULL if 'points' and 'windows' point into a sidecar mapping */
+	void *map;
+	size_t maplen;
+
+	bool complete;		// Points cover the whole stream
+	bool dirty;		// Changed since load
+};
+
+void zindex_init(struct zindex *, uint64_t span, size_t winsize);
+void zindex_free(struct zindex *);
+
+struct zindex_point *zindex_reserve(struct zindex *, uint8_t **windowp);
+void zindex_commit(struct zindex *);
+void zindex_set_complete(struct zindex *, uint64_t total_out);
+
+const struct zindex_point *zindex_lookup(const struct zindex *, uint64_t off);
+const uint8_t *zindex_window(const struct zindex *,
+    const struct zindex_point *);
+
+int zindex_load(struct zindex *, const char *path, int srcfd, unsigned codec);
+int zindex_save(const struct zindex *, const char *path, int srcfd,
+    unsigned codec);
+
+#endif
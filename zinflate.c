@@ -0,0 +1,183 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "zlib.h"
+#ifdef HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "zinflate.h"
+
+/*
+ * zlib: the caller's z_stream is the state.
+ */
+
+static void *
+zinflate_zlib_create(z_stream *strm)
+{
+
+	return (strm);
+}
+
+static void
+zinflate_zlib_destroy(void *strm)
+{
+
+	/* The z_stream belongs to the caller. */
+	(void)strm;
+}
+
+static void
+zinflate_zlib_reset(void *strm)
+{
+	int rc;
+
+	rc = inflateReset(strm);
+	assert(rc == Z_OK);
+}
+
+static int
+zinflate_zlib_inflate(void *state, z_stream *strm)
+{
+
+	assert(state == strm);
+	return (inflate(strm, Z_NO_FLUSH));
+}
+
+const struct zinflate_ops zinflate_zlib = {
+	.name = "zlib",
+	.create = zinflate_zlib_create,
+	.destroy = zinflate_zlib_destroy,
+	.reset = zinflate_zlib_reset,
+	.inflate = zinflate_zlib_inflate,
+};
+
+/*
+ * ISA-L igzip, streaming.  On finishing a stream isal_inflate() hands back
+ * whole bytes it had read ahead into its bit buffer, so the gzip trailer is
+ * still in the input window afterwards, as with zlib.
+ */
+
+#ifdef HAVE_ISAL
+static void *
+zinflate_isal_create(z_stream *strm)
+{
+	struct inflate_state *st;
+
+	(void)strm;
+	st = malloc(sizeof *st);
+	if (st == NULL)
+		return (NULL);
+	isal_inflate_init(st);
+	st->crc_flag = ISAL_DEFLATE;
+	return (st);
+}
+
+static void
+zinflate_isal_destroy(void *st)
+{
+
+	free(st);
+}
+
+static void
+zinflate_isal_reset(void *st_)
+{
+	struct inflate_state *st = st_;
+
+	isal_inflate_reset(st);
+	st->crc_flag = ISAL_DEFLATE;
+}
+
+static int
+zinflate_isal_inflate(void *st_, z_stream *strm)
+{
+	struct inflate_state *st = st_;
+	int rc;
+
+	st->next_in = strm->next_in;
+	st->avail_in = strm->avail_in;
+	st->next_out = strm->next_out;
+	st->avail_out = strm->avail_out;
+
+	rc = isal_inflate(st);
+
+	strm->total_in += st->next_in - strm->next_in;
+	strm->total_out += st->next_out - strm->next_out;
+	strm->next_in = st->next_in;
+	strm->avail_in = st->avail_in;
+	strm->next_out = st->next_out;
+	strm->avail_out = st->avail_out;
+
+	/* ISAL_END_INPUT and ISAL_OUT_OVERFLOW just mean "call again". */
+	if (rc < 0)
+		return (Z_DATA_ERROR);
+	return (st->block_state == ISAL_BLOCK_FINISH ? Z_STREAM_END : Z_OK);
+}
+
+const struct zinflate_ops zinflate_isal = {
+	.name = "isa-l",
+	.create = zinflate_isal_create,
+	.destroy = zinflate_isal_destroy,
+	.reset = zinflate_isal_reset,
+	.inflate = zinflate_isal_inflate,
+};
+#endif
+
+/*
+ * libdeflate, whole buffers only.
+ */
+
+bool
+zinflate_have_whole(void)
+{
+
+#ifdef HAVE_LIBDEFLATE
+	return (true);
+#else
+	return (false);
+#endif
+}
+
+int
+zinflate_whole(const void *in, size_t inlen, void *out, size_t outlen,
+    size_t *inused)
+{
+#ifdef HAVE_LIBDEFLATE
+	struct libdeflate_decompressor *d;
+	enum libdeflate_result r;
+
+	d = libdeflate_alloc_decompressor();
+	if (d == NULL)
+		return (-1);
+	/* With no actual_out_nbytes_ret, anything but exactly 'outlen' fails. */
+	r = libdeflate_deflate_decompress_ex(d, in, inlen, out, outlen, inused,
+	    NULL);
+	libdeflate_free_decompressor(d);
+	return (r == LIBDEFLATE_SUCCESS ? 0 : -1);
+#else
+	(void)in;
+	(void)inlen;
+	(void)out;
+	(void)outlen;
+	(void)inused;
+	return (-1);
+#endif
+}
@@ -0,0 +1,57 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZINFLATE_H
+#define ZINFLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "zlib.h"
+
+/*
+ * Raw deflate backends for zfile.c.  A backend decodes between the
+ * next_in/avail_in and next_out/avail_out windows of a z_stream, as inflate()
+ * does, so the reader's buffer handling is the same whichever is in use.
+ * The z_stream itself always stays a valid (raw) zlib stream as well, since
+ * checkpoints and restores are zlib-only.
+ *
+ * Backends other than zlib are compiled in with -DHAVE_ISAL (Intel ISA-L's
+ * igzip; link -lisal) and -DHAVE_LIBDEFLATE (link -ldeflate).
+ */
+struct zinflate_ops {
+	const char *name;
+	/* Backend state for decoding through 'strm'; NULL on failure */
+	void *(*create)(z_stream *strm);
+	void (*destroy)(void *);
+	/* Start over, for a new deflate stream */
+	void (*reset)(void *);
+	/*
+	 * Decode as much as the windows allow.  Returns Z_OK, Z_STREAM_END
+	 * (having consumed no input past the end of the deflate data), or a
+	 * negative zlib error code.
+	 */
+	int (*inflate)(void *, z_stream *strm);
+};
+
+extern const struct zinflate_ops zinflate_zlib;
+#ifdef HAVE_ISAL
+extern const struct zinflate_ops zinflate_isal;
+#endif
+
+/*
+ * Inflate all of the raw deflate data at 'in' (at most 'inlen' bytes), which
+ * must decode to exactly 'outlen' bytes, in one go.  Returns 0 and the input
+ * used in '*inused', or -1 if the data doesn't match (or libdeflate isn't
+ * compiled in), having written at most 'outlen' bytes to 'out'.
+ */
+int zinflate_whole(const void *in, size_t inlen, void *out, size_t outlen,
+    size_t *inused);
+bool zinflate_have_whole(void);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "zmap.h"
+
+int
+zmap_open(FILE *in, const uint8_t **base, size_t *len)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	fd = fileno(in);
+	if (fd < 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size <= 0 || (uintmax_t)sb.st_size > SIZE_MAX)
+		return (-1);
+
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return (-1);
+
+	/* Hints only; failure is harmless. */
+	(void)madvise(p, sb.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	(void)madvise(p, sb.st_size, MADV_HUGEPAGE);
+#endif
+
+	*base = p;
+	*len = sb.st_size;
+	return (0);
+}
+
+void
+zmap_close(const uint8_t *base, size_t len)
+{
+
+	if (base != NULL)
+		(void)munmap((void *)base, len);
+}
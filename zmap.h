@@ -0,0 +1,30 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZMAP_H
+#define ZMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Read-only mapping of a whole compressed input, so that decoders can point
+ * their input straight at the page cache instead of fread()ing it into a
+ * buffer.
+ *
+ * zmap_open() maps the file underlying 'in' if it is a non-empty regular
+ * file, advising the kernel that it will be read sequentially (and that it
+ * may use huge pages).  Returns 0 on success, or -1 if 'in' can't be mapped;
+ * the caller then just reads it through stdio as usual.  The file must not
+ * shrink while mapped.
+ */
+int zmap_open(FILE *in, const uint8_t **base, size_t *len);
+void zmap_close(const uint8_t *base, size_t len);
+
+#endif
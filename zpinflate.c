@@ -0,0 +1,975 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#endif
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#include "zpinflate.h"
+#include "zpool.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+
+#define KB (1024)
+#define ZP_WINSIZE	(1U << MAX_WBITS)
+/* Output symbols >= ZP_MARKER stand for window byte (sym - ZP_MARKER). */
+#define ZP_MARKER	0x8000
+/* Compressed bytes past its chunk a worker may decode into */
+#define ZP_OVERRUN	(256 * KB)
+
+#define ZP_FASTBITS	10
+#define ZP_MAXBITS	15
+
+/* zpool_job tag */
+#define ZP_FIRST	0x1	// Chunk starts exactly at the deflate stream
+
+/* zpool_job aux[]: start bit, end bit, status */
+enum zp_status {
+	ZP_OK,			// Decoded up to a block boundary past the chunk
+	ZP_FINAL,		// Decoded through the final block
+	ZP_NOSTART,		// No plausible block start found
+	ZP_FAILED,		// Bad data or ran out of input; use zlib
+};
+
+struct zpinflate {
+	struct zpool *pool;
+	size_t chunk;
+
+	/* Input */
+	FILE *in;
+	uint64_t next_off;	// Input offset of the next chunk to queue
+	uint8_t *carry;		// Overlap between consecutive chunks
+	size_t carrylen;
+	bool in_eof;
+
+	/* Where the verified output so far ends, in bits of input */
+	uint64_t pos;
+	bool done;
+
+	/* Last ZP_WINSIZE bytes of output, right-aligned */
+	uint8_t window[ZP_WINSIZE];
+	size_t winlen;
+
+	/* Output ready to be returned */
+	uint8_t *out;
+	size_t outlen, outcap, outpos;
+
+	/* zlib state for chunks that fail speculation */
+	z_stream zs;
+	uint8_t zbuf[64 * KB];
+	uint8_t ibuf[64 * KB];	// Input not (yet) queued for the workers
+	bool truncated;
+	/* Unless the input just ran out: the errno value, and what failed */
+	int error;
+	const char *errmsg;
+};
+
+static const uint16_t zp_lbase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+	59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t zp_lext[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+	5, 5, 5, 5, 0 };
+static const uint16_t zp_dbase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+	513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+	24577 };
+static const uint8_t zp_dext[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+	10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t zp_clorder[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/*
+ * LSB-first bit reader over a memory buffer.  Reads past the end yield zero
+ * bits; callers notice via zp_pos() > zp_limit().
+ */
+struct zp_bits {
+	const uint8_t *buf;
+	size_t len;
+	size_t next;		// Next byte to load (may exceed 'len')
+	uint64_t bitbuf;
+	unsigned cnt;
+};
+
+static inline void
+zp_refill(struct zp_bits *br)
+{
+	uint64_t w;
+
+	if (br->next + 8 <= br->len) {
+		memcpy(&w, br->buf + br->next, sizeof w);
+		br->bitbuf |= le64toh(w) << br->cnt;
+		br->next += (63 - br->cnt) >> 3;
+		br->cnt |= 56;
+		return;
+	}
+	while (br->cnt <= 56) {
+		if (br->next < br->len)
+			br->bitbuf |= (uint64_t)br->buf[br->next] << br->cnt;
+		br->next++;
+		br->cnt += 8;
+	}
+}
+
+static void
+zp_bits_init(struct zp_bits *br, const uint8_t *buf, size_t len, uint64_t bit)
+{
+
+	br->buf = buf;
+	br->len = len;
+	br->next = bit >> 3;
+	br->bitbuf = 0;
+	br->cnt = 0;
+	zp_refill(br);
+	br->bitbuf >>= bit & 7;
+	br->cnt -= bit & 7;
+}
+
+static inline uint64_t
+zp_pos(const struct zp_bits *br)
+{
+
+	return ((uint64_t)br->next * 8 - br->cnt);
+}
+
+static inline bool
+zp_overrun(const struct zp_bits *br)
+{
+
+	return (zp_pos(br) > (uint64_t)br->len * 8);
+}
+
+/* n <= 32 */
+static inline uint32_t
+zp_getbits(struct zp_bits *br, unsigned n)
+{
+	uint32_t v;
+
+	if (br->cnt < n)
+		zp_refill(br);
+	v = (uint32_t)(br->bitbuf & ((1ULL << n) - 1));
+	br->bitbuf >>= n;
+	br->cnt -= n;
+	return (v);
+}
+
+/*
+ * Canonical Huffman code: a direct table for codes of up to ZP_FASTBITS bits
+ * and puff-style counts/symbols for the rest.
+ */
+struct zp_huff {
+	uint16_t fast[1 << ZP_FASTBITS];	// (sym << 4) | len, or 0
+	uint16_t count[ZP_MAXBITS + 1];
+	uint16_t symbol[288];
+};
+
+enum zp_codetype { ZP_CODES, ZP_LENS, ZP_DISTS };
+
+/*
+ * Build 'h' from code lengths; returns -1 for codes zlib would reject.
+ */
+static int
+zp_huff_build(struct zp_huff *h, const uint8_t *lens, unsigned n,
+    enum zp_codetype type)
+{
+	uint16_t offs[ZP_MAXBITS + 2], next[ZP_MAXBITS + 1];
+	unsigned s, len, max, code;
+	int left;
+
+	memset(h->count, 0, sizeof h->count);
+	for (s = 0; s < n; s++)
+		h->count[lens[s]]++;
+
+	max = 0;
+	for (len = 1; len <= ZP_MAXBITS; len++)
+		if (h->count[len] != 0)
+			max = len;
+	if (max == 0) {
+		/* No codes; fine so long as nothing is ever decoded. */
+		memset(h->fast, 0, sizeof h->fast);
+		h->count[0] = 0;
+		return (type == ZP_CODES ? -1 : 0);
+	}
+
+	left = 1;
+	for (len = 1; len <= ZP_MAXBITS; len++) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return (-1);
+	}
+	/* As zlib: incomplete only for a lone one-bit length/distance code */
+	if (left > 0 && (type == ZP_CODES || max != 1))
+		return (-1);
+
+	/* Only now, since most candidate block headers fail the above */
+	memset(h->fast, 0, sizeof h->fast);
+
+	offs[1] = 0;
+	for (len = 1; len <= ZP_MAXBITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (s = 0; s < n; s++)
+		if (lens[s] != 0)
+			h->symbol[offs[lens[s]]++] = s;
+
+	code = 0;
+	h->count[0] = 0;
+	for (len = 1; len <= ZP_MAXBITS; len++) {
+		code = (code + h->count[len - 1]) << 1;
+		next[len] = code;
+	}
+	for (s = 0; s < n; s++) {
+		unsigned l = lens[s], c, rev, i;
+
+		if (l == 0 || l > ZP_FASTBITS) {
+			if (l != 0)
+				next[l]++;
+			continue;
+		}
+		c = next[l]++;
+		rev = 0;
+		for (i = 0; i < l; i++)
+			rev |= ((c >> i) & 1) << (l - 1 - i);
+		for (i = rev; i < (1U << ZP_FASTBITS); i += 1U << l)
+			h->fast[i] = (s << 4) | l;
+	}
+	return (0);
+}
+
+static inline int
+zp_decode(struct zp_bits *br, const struct zp_huff *h)
+{
+	int code, first, count, index;
+	unsigned len, e;
+	uint64_t bits;
+
+	if (br->cnt < ZP_MAXBITS)
+		zp_refill(br);
+	e = h->fast[br->bitbuf & ((1U << ZP_FASTBITS) - 1)];
+	if (e != 0) {
+		br->bitbuf >>= e & 15;
+		br->cnt -= e & 15;
+		return (e >> 4);
+	}
+
+	bits = br->bitbuf;
+	code = first = index = 0;
+	for (len = 1; len <= ZP_MAXBITS; len++) {
+		code |= bits & 1;
+		bits >>= 1;
+		count = h->count[len];
+		if (code - count < first) {
+			br->bitbuf >>= len;
+			br->cnt -= len;
+			return (h->symbol[index + (code - first)]);
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return (-1);
+}
+
+static void
+zp_fixed(struct zp_huff *lencode, struct zp_huff *distcode)
+{
+	uint8_t lens[288];
+	unsigned s;
+
+	for (s = 0; s < 144; s++)
+		lens[s] = 8;
+	for (; s < 256; s++)
+		lens[s] = 9;
+	for (; s < 280; s++)
+		lens[s] = 7;
+	for (; s < 288; s++)
+		lens[s] = 8;
+	(void)zp_huff_build(lencode, lens, 288, ZP_LENS);
+	for (s = 0; s < 30; s++)
+		lens[s] = 5;
+	(void)zp_huff_build(distcode, lens, 30, ZP_DISTS);
+}
+
+/*
+ * Read a dynamic block header (after BFINAL/BTYPE) and build its codes.
+ */
+static int
+zp_dynamic(struct zp_bits *br, struct zp_huff *lencode,
+    struct zp_huff *distcode)
+{
+	uint8_t lens[286 + 30];
+	unsigned nlen, ndist, ncode, i;
+	int sym;
+
+	nlen = zp_getbits(br, 5) + 257;
+	ndist = zp_getbits(br, 5) + 1;
+	ncode = zp_getbits(br, 4) + 4;
+	if (nlen > 286 || ndist > 30)
+		return (-1);
+
+	memset(lens, 0, 19);
+	for (i = 0; i < ncode; i++)
+		lens[zp_clorder[i]] = zp_getbits(br, 3);
+	if (zp_huff_build(lencode, lens, 19, ZP_CODES) != 0)
+		return (-1);
+
+	for (i = 0; i < nlen + ndist;) {
+		unsigned rep, val;
+
+		sym = zp_decode(br, lencode);
+		if (sym < 0)
+			return (-1);
+		if (sym < 16) {
+			lens[i++] = sym;
+			continue;
+		}
+		if (sym == 16) {
+			if (i == 0)
+				return (-1);
+			val = lens[i - 1];
+			rep = 3 + zp_getbits(br, 2);
+		} else if (sym == 17) {
+			val = 0;
+			rep = 3 + zp_getbits(br, 3);
+		} else {
+			val = 0;
+			rep = 11 + zp_getbits(br, 7);
+		}
+		if (i + rep > nlen + ndist)
+			return (-1);
+		while (rep-- > 0)
+			lens[i++] = val;
+	}
+	if (lens[256] == 0)
+		return (-1);
+
+	if (zp_huff_build(lencode, lens, nlen, ZP_LENS) != 0 ||
+	    zp_huff_build(distcode, lens + nlen, ndist, ZP_DISTS) != 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Decode one Huffman block's symbols into job->dst (as uint16_t), starting at
+ * symbol 'n'.  'window' allows references before the start of the output.
+ * Returns the new symbol count, or -1.
+ */
+static ssize_t
+zp_codes(struct zp_bits *br, const struct zp_huff *lencode,
+    const struct zp_huff *distcode, struct zpool_job *job, size_t n,
+    bool window)
+{
+	uint16_t *out = job->dst;
+	unsigned len, dist;
+	int sym;
+
+	for (;;) {
+		if ((n + 258) * sizeof *out > job->dstcap) {
+			if (zpool_reserve(&job->dst, &job->dstcap,
+			    (n + 258) * sizeof *out) != 0)
+				return (-1);
+			out = job->dst;
+		}
+		if (zp_overrun(br))
+			return (-1);
+
+		sym = zp_decode(br, lencode);
+		if (sym < 256) {
+			if (sym < 0)
+				return (-1);
+			out[n++] = sym;
+			continue;
+		}
+		if (sym == 256)
+			return (n);
+
+		sym -= 257;
+		if (sym >= 29)
+			return (-1);
+		len = zp_lbase[sym] + zp_getbits(br, zp_lext[sym]);
+		sym = zp_decode(br, distcode);
+		if (sym < 0 || sym >= 30)
+			return (-1);
+		dist = zp_dbase[sym] + zp_getbits(br, zp_dext[sym]);
+
+		if (dist <= n) {
+			const uint16_t *from = &out[n - dist];
+
+			while (len-- > 0)
+				out[n++] = *from++;
+		} else {
+			if (!window)
+				return (-1);
+			while (len-- > 0) {
+				out[n] = dist <= n ? out[n - dist] :
+				    ZP_MARKER + (ZP_WINSIZE - (dist - n));
+				n++;
+			}
+		}
+	}
+}
+
+static ssize_t
+zp_stored(struct zp_bits *br, struct zpool_job *job, size_t n)
+{
+	uint16_t *out;
+	unsigned len, nlen;
+
+	/* Discard the rest of the current byte */
+	zp_getbits(br, br->cnt & 7);
+	len = zp_getbits(br, 16);
+	nlen = zp_getbits(br, 16);
+	if (len != (~nlen & 0xffff))
+		return (-1);
+
+	if (zpool_reserve(&job->dst, &job->dstcap, (n + len) * sizeof *out))
+		return (-1);
+	out = job->dst;
+	while (len-- > 0)
+		out[n++] = zp_getbits(br, 8);
+	return (zp_overrun(br) ? -1 : (ssize_t)n);
+}
+
+/*
+ * Is there a plausible dynamic block starting at bit 'bit' of the buffer?
+ * Decodes it completely and checks that something sane follows.
+ */
+static bool
+zp_candidate(const uint8_t *buf, size_t len, uint64_t bit,
+    struct zpool_job *job, struct zp_huff *lencode, struct zp_huff *distcode)
+{
+	struct zp_bits br;
+	unsigned hdr;
+
+	zp_bits_init(&br, buf, len, bit);
+
+	/*
+	 * Cheap filter first: non-final dynamic header, sane counts and a
+	 * complete code length code.  Almost all bit offsets fail here.
+	 */
+	if ((br.bitbuf & 7) != 4 || ((br.bitbuf >> 3) & 31) > 29 ||
+	    ((br.bitbuf >> 8) & 31) > 29) {
+		return (false);
+	} else {
+		/* Only 15 of the (up to 19) lengths are in the bit buffer. */
+		uint64_t cl = br.bitbuf >> 17;
+		unsigned i, ncode = ((br.bitbuf >> 13) & 15) + 4, kraft = 0;
+
+		for (i = 0; i < min(ncode, 15U); i++, cl >>= 3)
+			if ((cl & 7) != 0)
+				kraft += 128 >> (cl & 7);
+		if (kraft > 128 || (ncode <= 15 && kraft != 128))
+			return (false);
+	}
+
+	zp_getbits(&br, 3);
+	if (zp_dynamic(&br, lencode, distcode) != 0)
+		return (false);
+	if (zp_codes(&br, lencode, distcode, job, 0, true) < 0)
+		return (false);
+	/* And the next block header must be sane. */
+	hdr = zp_getbits(&br, 3);
+	return ((hdr >> 1) != 3 && !zp_overrun(&br));
+}
+
+/*
+ * Worker: find a block start in the chunk, then decode blocks until one
+ * starts at or after the end of the chunk, or the stream ends.
+ */
+static void
+zp_work(void *ctx, void *arg, struct zpool_job *job)
+{
+	const struct zpinflate *par = arg;
+	struct zp_huff lencode, distcode;
+	struct zp_bits br;
+	uint64_t bit, stop, end;
+	ssize_t n;
+	unsigned hdr;
+	bool first;
+
+	(void)ctx;
+	first = (job->tag & ZP_FIRST) != 0;
+	end = (uint64_t)min(job->srclen, par->chunk) * 8;
+	stop = (uint64_t)par->chunk * 8;
+	job->aux[2] = ZP_NOSTART;
+
+	bit = 0;
+	if (!first) {
+		for (; bit < end; bit++)
+			if (zp_candidate(job->src, job->srclen, bit, job,
+			    &lencode, &distcode))
+				break;
+		if (bit == end)
+			return;
+	}
+	job->aux[0] = job->in_off * 8 + bit;
+	job->aux[2] = ZP_FAILED;
+
+	zp_bits_init(&br, job->src, job->srclen, bit);
+	n = 0;
+	for (;;) {
+		if (zp_pos(&br) >= stop && zp_pos(&br) != bit) {
+			job->aux[2] = ZP_OK;
+			break;
+		}
+		hdr = zp_getbits(&br, 3);
+		switch (hdr >> 1) {
+		case 0:
+			n = zp_stored(&br, job, n);
+			break;
+		case 1:
+			zp_fixed(&lencode, &distcode);
+			n = zp_codes(&br, &lencode, &distcode, job, n, !first);
+			break;
+		case 2:
+			if (zp_dynamic(&br, &lencode, &distcode) != 0)
+				return;
+			n = zp_codes(&br, &lencode, &distcode, job, n, !first);
+			break;
+		default:
+			return;
+		}
+		if (n < 0 || zp_overrun(&br))
+			return;
+		if ((hdr & 1) != 0) {
+			job->aux[2] = ZP_FINAL;
+			break;
+		}
+	}
+	job->aux[1] = job->in_off * 8 + zp_pos(&br);
+	job->dstlen = n * sizeof(uint16_t);
+}
+
+struct zpinflate *
+zpinflate_create(unsigned threads, size_t chunk)
+{
+	struct zpinflate *par;
+
+	par = calloc(1, sizeof *par);
+	if (par == NULL)
+		return (NULL);
+	par->chunk = chunk;
+	par->carry = malloc(ZP_OVERRUN);
+	if (par->carry == NULL ||
+	    inflateInit2(&par->zs, -MAX_WBITS) != Z_OK) {
+		free(par->carry);
+		free(par);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	/* One extra slot so the next chunk is queued while we resolve. */
+	par->pool = zpool_create(threads, threads + 1, zp_work, NULL, NULL,
+	    par);
+	if (par->pool == NULL) {
+		inflateEnd(&par->zs);
+		free(par->carry);
+		free(par);
+		return (NULL);
+	}
+	return (par);
+}
+
+void
+zpinflate_destroy(struct zpinflate *par)
+{
+
+	if (par == NULL)
+		return;
+	zpool_destroy(par->pool);
+	inflateEnd(&par->zs);
+	free(par->carry);
+	free(par->out);
+	free(par);
+}
+
+/*
+ * Begin decoding the raw deflate stream at offset 'off' of 'in', which must
+ * be positioned there.
+ */
+void
+zpinflate_start(struct zpinflate *par, FILE *in, uint64_t off)
+{
+
+	zpool_reset(par->pool);
+	par->in = in;
+	par->next_off = off;
+	par->carrylen = 0;
+	par->in_eof = false;
+	par->pos = off * 8;
+	par->done = false;
+	par->winlen = 0;
+	par->outlen = par->outpos = 0;
+	par->truncated = false;
+	par->error = 0;
+	par->errmsg = NULL;
+}
+
+/* Abandon the current stream. */
+void
+zpinflate_stop(struct zpinflate *par)
+{
+
+	zpool_reset(par->pool);
+	par->in = NULL;
+	par->done = true;
+	par->outlen = par->outpos = 0;
+}
+
+/* Input offset of the first byte after the deflate stream, once done. */
+uint64_t
+zpinflate_end(const struct zpinflate *par)
+{
+
+	return ((par->pos + 7) / 8);
+}
+
+/*
+ * Why zpinflate_read() failed: an errno value, with a description in '*msg',
+ * or 0 if the input simply ended too soon.
+ */
+int
+zpinflate_error(const struct zpinflate *par, const char **msg)
+{
+
+	*msg = par->errmsg;
+	return (par->error);
+}
+
+/* Give up on the stream: reads fail from here on. */
+static void
+zp_fail(struct zpinflate *par, int error, const char *msg)
+{
+
+	if (!par->truncated) {
+		par->error = error;
+		par->errmsg = msg;
+	}
+	par->truncated = true;
+	par->in_eof = true;
+}
+
+/*
+ * Read chunks (overlapping by ZP_OVERRUN) for the workers until the ring is
+ * full or the input ends.
+ */
+static void
+zp_queue(struct zpinflate *par)
+{
+	struct zpool_job *job;
+	size_t want, nb;
+
+	while (!par->in_eof && (job = zpool_slot(par->pool)) != NULL) {
+		want = par->chunk + ZP_OVERRUN;
+		if (zpool_reserve(&job->src, &job->srccap, want) != 0) {
+			zp_fail(par, ENOMEM, "Failed to allocate buffers");
+			return;
+		}
+		memcpy(job->src, par->carry, par->carrylen);
+		nb = fread((uint8_t *)job->src + par->carrylen, 1,
+		    want - par->carrylen, par->in);
+		/* A truncated source just looks like an early end. */
+		if (ferror(par->in) && errno != ENOBUFS) {
+			zp_fail(par, errno, "error read core");
+			return;
+		}
+		job->srclen = par->carrylen + nb;
+		/* Input past the chunk is queued again as the next one. */
+		if (job->srclen <= par->chunk)
+			par->in_eof = true;
+
+		par->carrylen = 0;
+		if (job->srclen > par->chunk) {
+			par->carrylen = job->srclen - par->chunk;
+			memcpy(par->carry, (uint8_t *)job->src + par->chunk,
+			    par->carrylen);
+		}
+		if (job->srclen == 0)
+			break;
+
+		job->in_off = par->next_off;
+		if (par->next_off * 8 == par->pos && par->outlen == 0 &&
+		    par->winlen == 0)
+			job->tag = ZP_FIRST;
+		par->next_off += par->chunk;
+		zpool_submit(par->pool);
+	}
+}
+
+/* Append resolved bytes to the output and slide the window. */
+static int
+zp_emit(struct zpinflate *par, const uint8_t *p, size_t n)
+{
+	size_t keep;
+
+	if (zpool_reserve((void **)&par->out, &par->outcap, par->outlen + n)) {
+		zp_fail(par, ENOMEM, "Failed to allocate buffers");
+		return (-1);
+	}
+	memcpy(par->out + par->outlen, p, n);
+	par->outlen += n;
+
+	if (n >= ZP_WINSIZE) {
+		memcpy(par->window, p + n - ZP_WINSIZE, ZP_WINSIZE);
+		par->winlen = ZP_WINSIZE;
+		return (0);
+	}
+	keep = min(par->winlen, (size_t)ZP_WINSIZE - n);
+	memmove(par->window + ZP_WINSIZE - n - keep,
+	    par->window + ZP_WINSIZE - keep, keep);
+	memcpy(par->window + ZP_WINSIZE - n, p, n);
+	par->winlen = keep + n;
+	return (0);
+}
+
+/*
+ * Translate a worker's symbols to bytes now that the window is known.
+ * Returns -1 if the guess behind them was wrong (or, with par->truncated
+ * set, if out of memory).
+ */
+static int
+zp_resolve(struct zpinflate *par, const struct zpool_job *job)
+{
+	const uint16_t *sym = job->dst;
+	size_t n = job->dstlen / sizeof *sym, i, base, keep;
+	uint8_t *o;
+
+	if (zpool_reserve((void **)&par->out, &par->outcap, par->outlen + n)) {
+		zp_fail(par, ENOMEM, "Failed to allocate buffers");
+		return (-1);
+	}
+	o = par->out + par->outlen;
+	for (i = 0; i < n; i++) {
+		unsigned s = sym[i];
+
+		if (s < ZP_MARKER) {
+			o[i] = s;
+			continue;
+		}
+		if (s - ZP_MARKER < ZP_WINSIZE - par->winlen)
+			return (-1);
+		o[i] = par->window[s - ZP_MARKER];
+	}
+
+	/* Slide the window (zp_emit() without the copy) */
+	if (n >= ZP_WINSIZE) {
+		memcpy(par->window, o + n - ZP_WINSIZE, ZP_WINSIZE);
+		par->winlen = ZP_WINSIZE;
+	} else {
+		keep = min(par->winlen, (size_t)ZP_WINSIZE - n);
+		base = ZP_WINSIZE - n - keep;
+		memmove(par->window + base, par->window + ZP_WINSIZE - keep,
+		    keep);
+		memcpy(par->window + ZP_WINSIZE - n, o, n);
+		par->winlen = keep + n;
+	}
+	par->outlen += n;
+	return (0);
+}
+
+/*
+ * Find input at offset 'off': in a queued chunk if possible, else read it
+ * from the file without disturbing the queueing position.
+ */
+static bool
+zp_src(struct zpinflate *par, uint64_t off, const uint8_t **p, size_t *n)
+{
+	struct zpool_job *job;
+	unsigned i;
+	off_t save;
+
+	for (i = 0; (job = zpool_peek(par->pool, i)) != NULL; i++) {
+		if (off >= job->in_off && off < job->in_off + job->srclen) {
+			*p = (const uint8_t *)job->src + (off - job->in_off);
+			*n = job->srclen - (off - job->in_off);
+			return (true);
+		}
+	}
+	if (par->in_eof)
+		return (false);
+
+	save = ftello(par->in);
+	if (save < 0 || fseeko(par->in, (off_t)off, SEEK_SET) != 0)
+		return (false);
+	*n = fread(par->ibuf, 1, sizeof par->ibuf, par->in);
+	if (ferror(par->in) && errno != ENOBUFS) {
+		zp_fail(par, errno, "error read core");
+		return (false);
+	}
+	clearerr(par->in);
+	if (fseeko(par->in, save, SEEK_SET) != 0) {
+		zp_fail(par, errno, "fseeko");
+		return (false);
+	}
+	*p = par->ibuf;
+	return (*n > 0);
+}
+
+/*
+ * Decode serially with zlib from par->pos to the first block boundary at or
+ * after bit 'target' (or the end of the stream).  Returns -1 if the input
+ * runs out first.
+ */
+static int
+zp_fallback(struct zpinflate *par, uint64_t target)
+{
+	z_stream *zs = &par->zs;
+	const uint8_t *p;
+	uint64_t fed;
+	size_t n;
+	int ret;
+
+	ret = inflateReset(zs);
+	assert(ret == Z_OK);
+
+	fed = par->pos / 8;
+	if (!zp_src(par, fed, &p, &n))
+		return (-1);
+	if ((par->pos & 7) != 0) {
+		ret = inflatePrime(zs, 8 - (par->pos & 7), p[0] >> (par->pos & 7));
+		assert(ret == Z_OK);
+		fed++;
+	}
+	if (par->winlen > 0) {
+		ret = inflateSetDictionary(zs,
+		    par->window + ZP_WINSIZE - par->winlen, par->winlen);
+		assert(ret == Z_OK);
+	}
+	zs->avail_in = 0;
+
+	for (;;) {
+		if (zs->avail_in == 0) {
+			if (!zp_src(par, fed, &p, &n))
+				return (-1);
+			zs->next_in = (Bytef *)p;
+			zs->avail_in = min(n, (size_t)UINT_MAX);
+			fed += zs->avail_in;
+		}
+		zs->next_out = par->zbuf;
+		zs->avail_out = sizeof par->zbuf;
+
+		ret = inflate(zs, Z_BLOCK);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			zp_fail(par, ret == Z_MEM_ERROR ? ENOMEM : EBADMSG,
+			    zError(ret));
+			return (-1);
+		}
+		if (zp_emit(par, par->zbuf, sizeof par->zbuf - zs->avail_out) !=
+		    0)
+			return (-1);
+
+		if (ret == Z_STREAM_END) {
+			par->pos = (fed - zs->avail_in) * 8;
+			par->done = true;
+			return (0);
+		}
+		if ((zs->data_type & 128) != 0 && (zs->data_type & 64) == 0) {
+			uint64_t pos = (fed - zs->avail_in) * 8 -
+			    (zs->data_type & 7);
+
+			if (pos >= target) {
+				par->pos = pos;
+				return (0);
+			}
+		}
+	}
+}
+
+/*
+ * Produce the next stretch of verified output.
+ */
+static int
+zp_advance(struct zpinflate *par)
+{
+	struct zpool_job *job;
+	uint64_t cend;
+
+	for (;;) {
+		zp_queue(par);
+		job = zpool_head(par->pool);
+		if (job == NULL) {
+			/* Out of input before the final block */
+			par->truncated = true;
+			return (-1);
+		}
+		cend = (job->in_off + min(job->srclen, par->chunk)) * 8;
+
+		/* Already decoded past this chunk (e.g. by zp_fallback()). */
+		if (par->pos >= cend) {
+			zpool_release(par->pool);
+			continue;
+		}
+
+		if ((job->aux[2] == ZP_OK || job->aux[2] == ZP_FINAL) &&
+		    job->aux[0] == par->pos && zp_resolve(par, job) == 0) {
+			par->pos = job->aux[1];
+			par->done = job->aux[2] == ZP_FINAL;
+		} else if (par->truncated || zp_fallback(par, cend) != 0) {
+			par->truncated = true;
+			return (-1);
+		}
+		zpool_release(par->pool);
+		return (0);
+	}
+}
+
+/*
+ * Returns up to 'len' bytes of output, 0 once the deflate stream has ended
+ * (see zpinflate_end()), or -1 if the input is truncated or unusable (see
+ * zpinflate_error()).
+ */
+ssize_t
+zpinflate_read(struct zpinflate *par, void *buf, size_t len)
+{
+	size_t total = 0, n;
+
+	while (len > 0) {
+		if (par->outpos == par->outlen) {
+			par->outpos = par->outlen = 0;
+			if (par->done || par->truncated)
+				break;
+			/* Even on truncation, there may be some output. */
+			(void)zp_advance(par);
+			continue;
+		}
+		n = min(len, par->outlen - par->outpos);
+		memcpy(buf, par->out + par->outpos, n);
+		buf = (char *)buf + n;
+		len -= n;
+		total += n;
+		par->outpos += n;
+	}
+	if (total == 0 && par->truncated)
+		return (-1);
+	if (par->done && par->outpos == par->outlen)
+		zpool_reset(par->pool);
+	return (total);
+}
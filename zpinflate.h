@@ -0,0 +1,43 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZPINFLATE_H
+#define ZPINFLATE_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Speculative parallel inflate of a single raw deflate stream (in the manner
+ * of pugz / rapidgzip).
+ *
+ * The compressed input is cut into fixed-size chunks.  A worker per chunk
+ * guesses where the first dynamic-Huffman block at or after the chunk start
+ * begins and decodes from there, emitting 16-bit symbols in which
+ * back-references into the (unknown) preceding 32 kB window are left as
+ * markers.  The consumer then confirms each guess against where the previous
+ * chunk actually ended, substitutes the now-known window for the markers,
+ * and falls back to zlib from the exact position for any chunk whose guess
+ * was wrong.  Output is identical to a serial inflate.
+ */
+
+struct zpinflate;
+
+struct zpinflate *zpinflate_create(unsigned threads, size_t chunk);
+void zpinflate_destroy(struct zpinflate *);
+
+void zpinflate_start(struct zpinflate *, FILE *in, uint64_t off);
+void zpinflate_stop(struct zpinflate *);
+ssize_t zpinflate_read(struct zpinflate *, void *buf, size_t len);
+uint64_t zpinflate_end(const struct zpinflate *);
+int zpinflate_error(const struct zpinflate *, const char **msg);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zpool.h"
+
+struct zpool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv;		// Jobs queued, or shutdown
+	pthread_cond_t done_cv;		// A job completed
+
+	pthread_t *threads;
+	unsigned nthreads;
+
+	struct zpool_job *jobs;
+	unsigned nslots;
+	/*
+	 * Sequence numbers: jobs [drain, fill) are in use by the consumer or
+	 * the workers; [next, fill) are waiting for a worker.
+	 */
+	uint64_t drain, next, fill;
+
+	zpool_work_t *work;
+	zpool_ctx_create_t *ctx_create;
+	zpool_ctx_free_t *ctx_free;
+	void *arg;
+
+	bool shutdown;
+};
+
+static void *
+zpool_worker(void *pool_)
+{
+	struct zpool *pool = pool_;
+	struct zpool_job *job;
+	void *ctx;
+
+	ctx = pool->ctx_create != NULL ? pool->ctx_create(pool->arg) : NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->shutdown && pool->next == pool->fill)
+			pthread_cond_wait(&pool->work_cv, &pool->lock);
+		if (pool->shutdown)
+			break;
+
+		job = &pool->jobs[pool->next % pool->nslots];
+		pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->work(ctx, pool->arg, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->done_cv);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (ctx != NULL && pool->ctx_free != NULL)
+		pool->ctx_free(ctx);
+	return (NULL);
+}
+
+/*
+ * Start 'nthreads' workers around a ring of 'nslots' jobs.  Returns NULL (with
+ * errno set) on failure.
+ */
+struct zpool *
+zpool_create(unsigned nthreads, unsigned nslots, zpool_work_t *work,
+    zpool_ctx_create_t *ctx_create, zpool_ctx_free_t *ctx_free, void *arg)
+{
+	struct zpool *pool;
+	int error;
+
+	assert(nthreads > 0 && nslots > 0);
+
+	pool = calloc(1, sizeof *pool);
+	if (pool == NULL)
+		return (NULL);
+	pool->jobs = calloc(nslots, sizeof *pool->jobs);
+	pool->threads = calloc(nthreads, sizeof *pool->threads);
+	if (pool->jobs == NULL || pool->threads == NULL) {
+		free(pool->jobs);
+		free(pool->threads);
+		free(pool);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	pool->nslots = nslots;
+	pool->work = work;
+	pool->ctx_create = ctx_create;
+	pool->ctx_free = ctx_free;
+	pool->arg = arg;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cv, NULL);
+	pthread_cond_init(&pool->done_cv, NULL);
+
+	for (; pool->nthreads < nthreads; pool->nthreads++) {
+		error = pthread_create(&pool->threads[pool->nthreads], NULL,
+		    zpool_worker, pool);
+		if (error != 0) {
+			zpool_destroy(pool);
+			errno = error;
+			return (NULL);
+		}
+	}
+	return (pool);
+}
+
+void
+zpool_destroy(struct zpool *pool)
+{
+	unsigned i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_cv);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	for (i = 0; i < pool->nslots; i++) {
+		free(pool->jobs[i].src);
+		free(pool->jobs[i].dst);
+	}
+	pthread_cond_destroy(&pool->done_cv);
+	pthread_cond_destroy(&pool->work_cv);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool);
+}
+
+/*
+ * The next free job for the consumer to fill in, or NULL if the ring is full.
+ * Buffers are kept from previous use.
+ */
+struct zpool_job *
+zpool_slot(struct zpool *pool)
+{
+	struct zpool_job *job;
+
+	/* Only the consumer moves 'fill' and 'drain'; no lock needed. */
+	if (pool->fill - pool->drain == pool->nslots)
+		return (NULL);
+
+	job = &pool->jobs[pool->fill % pool->nslots];
+	job->srclen = 0;
+	job->dstlen = 0;
+	job->in_off = 0;
+	job->tag = 0;
+	job->error = NULL;
+	job->error_code = 0;
+	memset(job->aux, 0, sizeof job->aux);
+	job->done = false;
+	return (job);
+}
+
+/* Hand the job returned by zpool_slot() to the workers. */
+void
+zpool_submit(struct zpool *pool)
+{
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fill++;
+	pthread_cond_signal(&pool->work_cv);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the oldest outstanding job to complete and return it, or NULL if
+ * nothing is outstanding.  The job stays valid until zpool_release().
+ */
+struct zpool_job *
+zpool_head(struct zpool *pool)
+{
+	struct zpool_job *job;
+
+	if (pool->drain == pool->fill)
+		return (NULL);
+
+	job = &pool->jobs[pool->drain % pool->nslots];
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->done_cv, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	return (job);
+}
+
+/*
+ * The i'th outstanding job (0 being the head), or NULL.  Only the fields the
+ * consumer filled in may be used, since a worker may still be busy with it.
+ */
+struct zpool_job *
+zpool_peek(struct zpool *pool, unsigned i)
+{
+
+	if (i >= pool->fill - pool->drain)
+		return (NULL);
+	return (&pool->jobs[(pool->drain + i) % pool->nslots]);
+}
+
+/* Done with the job returned by zpool_head(). */
+void
+zpool_release(struct zpool *pool)
+{
+
+	assert(pool->drain < pool->fill);
+	pool->drain++;
+}
+
+/* Wait for outstanding jobs and throw their results away. */
+void
+zpool_reset(struct zpool *pool)
+{
+
+	while (zpool_head(pool) != NULL)
+		zpool_release(pool);
+}
+
+unsigned
+zpool_inflight(const struct zpool *pool)
+{
+
+	return ((unsigned)(pool->fill - pool->drain));
+}
+
+/*
+ * Grow '*buf' (of capacity '*cap') to hold at least 'need' bytes.  Returns 0,
+ * or -1 if out of memory (leaving '*buf' unchanged).
+ */
+int
+zpool_reserve(void **buf, size_t *cap, size_t need)
+{
+	size_t ncap;
+	void *nb;
+
+	if (need <= *cap)
+		return (0);
+	ncap = *cap > 0 ? *cap : 64 * 1024;
+	while (ncap < need)
+		ncap *= 2;
+	nb = realloc(*buf, ncap);
+	if (nb == NULL)
+		return (-1);
+	*buf = nb;
+	*cap = ncap;
+	return (0);
+}
@@ -0,0 +1,61 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZPOOL_H
+#define ZPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ordered work ring: a single consumer fills jobs (typically with a chunk of
+ * compressed input) in order, a pool of worker threads transforms them
+ * concurrently, and the consumer takes the results back in the same order.
+ *
+ * Each worker owns a private context (e.g. a decoder), created once by
+ * 'ctx_create' on that thread.
+ */
+
+struct zpool_job {
+	/* Filled in by the consumer */
+	void *src;
+	size_t srclen, srccap;
+	uint64_t in_off;	// Input offset of 'src'
+	uint64_t tag;		// For the consumer's use
+
+	/* Filled in by the worker */
+	void *dst;
+	size_t dstlen, dstcap;
+	const char *error;	// Non-NULL if the job failed
+	int error_code;		// ... with this errno value (0: bad data)
+	uint64_t aux[3];	// Job-specific results
+
+	bool done;		// Protected by the pool lock
+};
+
+typedef void *zpool_ctx_create_t(void *arg);
+typedef void zpool_ctx_free_t(void *ctx);
+typedef void zpool_work_t(void *ctx, void *arg, struct zpool_job *);
+
+struct zpool *zpool_create(unsigned nthreads, unsigned nslots,
+    zpool_work_t *work, zpool_ctx_create_t *ctx_create,
+    zpool_ctx_free_t *ctx_free, void *arg);
+void zpool_destroy(struct zpool *);
+
+struct zpool_job *zpool_slot(struct zpool *);
+void zpool_submit(struct zpool *);
+struct zpool_job *zpool_head(struct zpool *);
+struct zpool_job *zpool_peek(struct zpool *, unsigned i);
+void zpool_release(struct zpool *);
+void zpool_reset(struct zpool *);
+unsigned zpool_inflight(const struct zpool *);
+
+int zpool_reserve(void **buf, size_t *cap, size_t need);
+
+#endif
@@ -0,0 +1,583 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define ZPREFETCH_URING	1
+#endif
+#endif
+
+#include "zprefetch.h"
+
+#define min(a, b) ({				\
+	__typeof (a) _a = (a);			\
+	__typeof (b) _b = (b);			\
+	_a < _b ? _a : _b; })
+
+/* I/O threads for the pread(2) fallback */
+#define ZPREFETCH_THREADS	4
+
+enum {
+	ZPF_FREE,
+	ZPF_BUSY,		// Read in flight
+	ZPF_DONE,
+};
+
+struct zprefetch_buf {
+	uint8_t *data;
+	size_t len;		// Bytes read so far
+	int error;		// errno if the read failed, else 0
+	int state;
+	uint64_t seq;
+	struct iovec iov;	// io_uring: the part still to be read
+};
+
+struct zprefetch {
+	int fd;
+	size_t bufsz;
+	unsigned nbufs;
+	struct zprefetch_buf *bufs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv;		// Room for reads, or shutdown
+	pthread_cond_t done_cv;		// A read completed
+
+	/*
+	 * Buffer sequence numbers, from 'base' in the file: [head, issued) are
+	 * being read or have been.  The consumer is 'pos' bytes into 'head'.
+	 * Nothing past 'eof_seq', which came up short, is read.
+	 */
+	uint64_t base;
+	uint64_t head, issued, eof_seq;
+	size_t pos;
+	unsigned busy;			// Reads in flight
+	bool stopped;			// Seek or shutdown: issue nothing new
+	bool shutdown;
+
+	pthread_t threads[ZPREFETCH_THREADS];
+	unsigned nthreads;
+
+#ifdef ZPREFETCH_URING
+	bool uring;
+	int ring_error;			// errno once the ring has failed
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+#endif
+};
+
+static uint64_t
+zp_off(const struct zprefetch *zp, const struct zprefetch_buf *b)
+{
+
+	return (zp->base + b->seq * zp->bufsz + b->len);
+}
+
+static bool
+zp_can_issue(const struct zprefetch *zp)
+{
+
+	return (!zp->stopped && zp->issued - zp->head < zp->nbufs &&
+	    zp->issued <= zp->eof_seq);
+}
+
+/* Claim the buffer for the next read.  Called locked. */
+static struct zprefetch_buf *
+zp_claim(struct zprefetch *zp)
+{
+	struct zprefetch_buf *b;
+
+	b = &zp->bufs[zp->issued % zp->nbufs];
+	assert(b->state == ZPF_FREE);
+	b->state = ZPF_BUSY;
+	b->seq = zp->issued++;
+	b->len = 0;
+	b->error = 0;
+	zp->busy++;
+	return (b);
+}
+
+/* A read into 'b' is finished.  Called locked. */
+static void
+zp_complete(struct zprefetch *zp, struct zprefetch_buf *b, int error)
+{
+
+	b->error = error;
+	b->state = ZPF_DONE;
+	zp->busy--;
+	if (b->len < zp->bufsz && b->seq < zp->eof_seq)
+		zp->eof_seq = b->seq;
+}
+
+/*
+ * pread(2) backend
+ */
+
+static void *
+zp_thread(void *zp_)
+{
+	struct zprefetch *zp = zp_;
+	struct zprefetch_buf *b;
+	uint64_t off;
+	ssize_t n;
+	int error;
+
+	pthread_mutex_lock(&zp->lock);
+	for (;;) {
+		while (!zp->shutdown && !zp_can_issue(zp))
+			pthread_cond_wait(&zp->work_cv, &zp->lock);
+		if (zp->shutdown)
+			break;
+
+		b = zp_claim(zp);
+		off = zp_off(zp, b);
+		pthread_mutex_unlock(&zp->lock);
+
+		/* Fill the buffer unless we hit EOF. */
+		error = 0;
+		while (b->len < zp->bufsz) {
+			n = pread(zp->fd, b->data + b->len, zp->bufsz - b->len,
+			    off + b->len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				error = errno;
+			if (n <= 0)
+				break;
+			b->len += n;
+		}
+
+		pthread_mutex_lock(&zp->lock);
+		zp_complete(zp, b, error);
+		pthread_cond_broadcast(&zp->done_cv);
+	}
+	pthread_mutex_unlock(&zp->lock);
+	return (NULL);
+}
+
+/*
+ * io_uring backend, driven from the consumer's thread: no liburing, just the
+ * raw rings.
+ */
+
+#ifdef ZPREFETCH_URING
+static int
+zp_uring_enter(struct zprefetch *zp, unsigned min_complete)
+{
+	int rc;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, zp->ring_fd, zp->to_submit,
+		    min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+		    NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc >= 0) {
+		assert((unsigned)rc <= zp->to_submit);
+		zp->to_submit -= rc;
+	}
+	return (rc < 0 ? -1 : 0);
+}
+
+/* Queue a read of the rest of 'b'. */
+static void
+zp_uring_queue(struct zprefetch *zp, struct zprefetch_buf *b)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	b->iov.iov_base = b->data + b->len;
+	b->iov.iov_len = zp->bufsz - b->len;
+
+	tail = *zp->sq_tail;
+	idx = tail & *zp->sq_mask;
+	sqe = &zp->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = zp->fd;
+	sqe->addr = (uintptr_t)&b->iov;
+	sqe->len = 1;
+	sqe->off = zp_off(zp, b);
+	sqe->user_data = b - zp->bufs;
+	zp->sq_array[idx] = idx;
+	__atomic_store_n(zp->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	zp->to_submit++;
+}
+
+/* Handle whatever has completed. */
+static void
+zp_uring_reap(struct zprefetch *zp)
+{
+	struct zprefetch_buf *b;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+
+	head = *zp->cq_head;
+	tail = __atomic_load_n(zp->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &zp->cqes[head & *zp->cq_mask];
+		b = &zp->bufs[cqe->user_data];
+		if (cqe->res > 0)
+			b->len += cqe->res;
+
+		if ((cqe->res == -EINTR || cqe->res == -EAGAIN ||
+		    (cqe->res > 0 && b->len < zp->bufsz)) && !zp->stopped)
+			zp_uring_queue(zp, b);
+		else
+			zp_complete(zp, b, cqe->res < 0 ? -cqe->res : 0);
+	}
+	__atomic_store_n(zp->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int
+zp_uring_init(struct zprefetch *zp)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+
+	memset(&p, 0, sizeof p);
+	zp->ring_fd = syscall(__NR_io_uring_setup, zp->nbufs, &p);
+	if (zp->ring_fd < 0)
+		return (-1);
+
+	zp->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	zp->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	zp->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = cq = MAP_FAILED;
+	zp->sqes = MAP_FAILED;
+
+	sq = mmap(NULL, zp->sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, zp->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	cq = mmap(NULL, zp->cq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, zp->ring_fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto fail;
+	zp->sqes = mmap(NULL, zp->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, zp->ring_fd, IORING_OFF_SQES);
+	if (zp->sqes == MAP_FAILED)
+		goto fail;
+
+	zp->sq_ring = sq;
+	zp->cq_ring = cq;
+	zp->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	zp->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+	zp->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	zp->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	zp->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	zp->cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+	zp->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	zp->to_submit = 0;
+	zp->uring = true;
+	return (0);
+
+fail:
+	if (zp->sqes != MAP_FAILED)
+		munmap(zp->sqes, zp->sqes_sz);
+	if (cq != MAP_FAILED)
+		munmap(cq, zp->cq_ring_sz);
+	if (sq != MAP_FAILED)
+		munmap(sq, zp->sq_ring_sz);
+	close(zp->ring_fd);
+	return (-1);
+}
+
+/*
+ * The ring itself failed, so there is no way to find out what became of the
+ * reads in flight: fail them, and (see zp_kick()) any issued later.  Called
+ * locked.
+ */
+static void
+zp_uring_fail(struct zprefetch *zp, int error)
+{
+	unsigned i;
+
+	zp->ring_error = error;
+	zp->to_submit = 0;
+	for (i = 0; i < zp->nbufs; i++)
+		if (zp->bufs[i].state == ZPF_BUSY)
+			zp_complete(zp, &zp->bufs[i], error);
+}
+
+static void
+zp_uring_fini(struct zprefetch *zp)
+{
+
+	munmap(zp->sqes, zp->sqes_sz);
+	munmap(zp->cq_ring, zp->cq_ring_sz);
+	munmap(zp->sq_ring, zp->sq_ring_sz);
+	close(zp->ring_fd);
+}
+#endif
+
+/*
+ * Start reads into any free buffers.  Called locked.
+ */
+static void
+zp_kick(struct zprefetch *zp)
+{
+
+#ifdef ZPREFETCH_URING
+	if (zp->uring) {
+		while (zp->ring_error != 0 && zp_can_issue(zp))
+			zp_complete(zp, zp_claim(zp), zp->ring_error);
+		while (zp_can_issue(zp))
+			zp_uring_queue(zp, zp_claim(zp));
+		/* Failure isn't fatal; zp_wait() submits them again. */
+		if (zp->to_submit > 0)
+			(void)zp_uring_enter(zp, 0);
+		return;
+	}
+#endif
+	pthread_cond_broadcast(&zp->work_cv);
+}
+
+/*
+ * Wait for at least one read to complete.  Called locked, with reads in
+ * flight or (with I/O threads) about to be.
+ */
+static void
+zp_wait(struct zprefetch *zp)
+{
+
+#ifdef ZPREFETCH_URING
+	if (zp->uring) {
+		assert(zp->busy > 0);
+		if (zp_uring_enter(zp, 1) != 0) {
+			zp_uring_fail(zp, errno);
+			return;
+		}
+		zp_uring_reap(zp);
+		return;
+	}
+#endif
+	pthread_cond_wait(&zp->done_cv, &zp->lock);
+}
+
+/* Quiesce: let the reads in flight finish, and issue no more.  Locked. */
+static void
+zp_drain(struct zprefetch *zp)
+{
+
+	zp->stopped = true;
+	while (zp->busy > 0)
+		zp_wait(zp);
+}
+
+struct zprefetch *
+zprefetch_create(int fd, size_t bufsz, unsigned nbufs)
+{
+	struct zprefetch *zp;
+	struct stat sb;
+	uint8_t *mem;
+	unsigned i;
+	int error;
+
+	assert(bufsz > 0 && nbufs > 0);
+
+	if (fd < 0 || fstat(fd, &sb) != 0 ||
+	    (!S_ISREG(sb.st_mode) && !S_ISBLK(sb.st_mode))) {
+		errno = ESPIPE;
+		return (NULL);
+	}
+
+	zp = calloc(1, sizeof *zp);
+	if (zp == NULL)
+		return (NULL);
+	zp->bufs = calloc(nbufs, sizeof *zp->bufs);
+	mem = malloc(bufsz * nbufs);
+	if (zp->bufs == NULL || mem == NULL) {
+		free(mem);
+		free(zp->bufs);
+		free(zp);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	for (i = 0; i < nbufs; i++)
+		zp->bufs[i].data = mem + (size_t)i * bufsz;
+	zp->fd = fd;
+	zp->bufsz = bufsz;
+	zp->nbufs = nbufs;
+	zp->eof_seq = UINT64_MAX;
+	pthread_mutex_init(&zp->lock, NULL);
+	pthread_cond_init(&zp->work_cv, NULL);
+	pthread_cond_init(&zp->done_cv, NULL);
+
+#ifdef ZPREFETCH_URING
+	if (zp_uring_init(zp) == 0) {
+		pthread_mutex_lock(&zp->lock);
+		zp_kick(zp);
+		pthread_mutex_unlock(&zp->lock);
+		return (zp);
+	}
+#endif
+
+	for (; zp->nthreads < min(nbufs, (unsigned)ZPREFETCH_THREADS);
+	    zp->nthreads++) {
+		error = pthread_create(&zp->threads[zp->nthreads], NULL,
+		    zp_thread, zp);
+		if (error != 0) {
+			zprefetch_destroy(zp);
+			errno = error;
+			return (NULL);
+		}
+	}
+	return (zp);
+}
+
+void
+zprefetch_destroy(struct zprefetch *zp)
+{
+	unsigned i;
+
+	if (zp == NULL)
+		return;
+
+	pthread_mutex_lock(&zp->lock);
+	zp->shutdown = true;
+	pthread_cond_broadcast(&zp->work_cv);
+#ifdef ZPREFETCH_URING
+	if (zp->uring)
+		zp_drain(zp);
+#endif
+	pthread_mutex_unlock(&zp->lock);
+	for (i = 0; i < zp->nthreads; i++)
+		pthread_join(zp->threads[i], NULL);
+#ifdef ZPREFETCH_URING
+	if (zp->uring)
+		zp_uring_fini(zp);
+#endif
+
+	free(zp->bufs[0].data);
+	free(zp->bufs);
+	pthread_cond_destroy(&zp->done_cv);
+	pthread_cond_destroy(&zp->work_cv);
+	pthread_mutex_destroy(&zp->lock);
+	free(zp);
+}
+
+void
+zprefetch_seek(struct zprefetch *zp, uint64_t off)
+{
+	unsigned i;
+
+	if (off == zprefetch_tell(zp))
+		return;
+
+	pthread_mutex_lock(&zp->lock);
+	zp_drain(zp);
+	for (i = 0; i < zp->nbufs; i++)
+		zp->bufs[i].state = ZPF_FREE;
+	zp->base = off;
+	zp->head = zp->issued = 0;
+	zp->eof_seq = UINT64_MAX;
+	zp->pos = 0;
+	zp->stopped = false;
+	zp_kick(zp);
+	pthread_mutex_unlock(&zp->lock);
+}
+
+uint64_t
+zprefetch_tell(const struct zprefetch *zp)
+{
+
+	/* Only the consumer moves these. */
+	return (zp->base + zp->head * zp->bufsz + zp->pos);
+}
+
+/*
+ * Take up to 'max' bytes of the current buffer, moving on to the next one if
+ * it's used up.
+ */
+static ssize_t
+zp_get(struct zprefetch *zp, const void **ptr, size_t max)
+{
+	struct zprefetch_buf *b;
+	size_t n;
+
+	pthread_mutex_lock(&zp->lock);
+	b = &zp->bufs[zp->head % zp->nbufs];
+	if (b->state == ZPF_DONE && b->seq == zp->head && b->error == 0 &&
+	    zp->pos == zp->bufsz) {
+		b->state = ZPF_FREE;
+		zp->head++;
+		zp->pos = 0;
+		b = &zp->bufs[zp->head % zp->nbufs];
+	}
+	zp_kick(zp);
+
+	while (b->state != ZPF_DONE || b->seq != zp->head)
+		zp_wait(zp);
+	if (b->error != 0) {
+		errno = b->error;
+		pthread_mutex_unlock(&zp->lock);
+		return (-1);
+	}
+
+	n = min(b->len - zp->pos, max);
+	*ptr = b->data + zp->pos;
+	zp->pos += n;
+	pthread_mutex_unlock(&zp->lock);
+	return (n);
+}
+
+ssize_t
+zprefetch_next(struct zprefetch *zp, const void **ptr)
+{
+
+	return (zp_get(zp, ptr, SIZE_MAX));
+}
+
+ssize_t
+zprefetch_read(struct zprefetch *zp, void *buf, size_t len)
+{
+	const void *p;
+	ssize_t n, total;
+
+	total = 0;
+	while (len > 0) {
+		n = zp_get(zp, &p, len);
+		if (n < 0)
+			return (total > 0 ? total : -1);
+		if (n == 0)
+			break;
+		memcpy((char *)buf + total, p, n);
+		total += n;
+		len -= n;
+	}
+	return (total);
+}
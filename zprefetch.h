@@ -0,0 +1,40 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZPREFETCH_H
+#define ZPREFETCH_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous read-ahead of a compressed input: keeps up to 'nbufs' reads of
+ * 'bufsz' bytes in flight ahead of the decoder, so that a cold file on a slow
+ * (e.g. network) device doesn't stall it on every refill.  Reads go through
+ * io_uring where the kernel allows it, and otherwise through a few I/O
+ * threads calling pread(2).  'fd' must be a regular file or block device
+ * (else NULL is returned, with errno ESPIPE); its file offset is not used.
+ *
+ * zprefetch_next() lends out the rest of the current buffer, valid until the
+ * next call; zprefetch_read() copies.  Both return 0 at EOF and -1 (with errno
+ * set) on a read error.  zprefetch_seek() drops the read-ahead and restarts
+ * it at 'off'.
+ */
+struct zprefetch;
+
+struct zprefetch *zprefetch_create(int fd, size_t bufsz, unsigned nbufs);
+void zprefetch_destroy(struct zprefetch *);
+
+void zprefetch_seek(struct zprefetch *, uint64_t off);
+uint64_t zprefetch_tell(const struct zprefetch *);
+ssize_t zprefetch_next(struct zprefetch *, const void **ptr);
+ssize_t zprefetch_read(struct zprefetch *, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zpool.h"
+#include "zrec.h"
+
+#define KB		1024
+#define ZREC_FILEBUF	(128*KB)
+
+struct zrec {
+	zrec_chunk_fn *next;
+	void *src;
+	int delim;
+	bool eof;
+
+	const char *p, *end;	// What is left of the current chunk
+
+	/* A record being put together across chunks */
+	char *stitch;
+	size_t slen, scap;
+
+	/* zrec_file()'s source */
+	FILE *file;
+	char *fbuf;
+};
+
+struct zrec *
+zrec_new(zrec_chunk_fn *next, void *src, int delim)
+{
+	struct zrec *r;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL)
+		return (NULL);
+	r->next = next;
+	r->src = src;
+	r->delim = delim;
+	return (r);
+}
+
+static int
+zrec_zfile_next(void *src, const void **ptr, size_t *len)
+{
+
+	return (zfile_next_chunk(src, ptr, len));
+}
+
+struct zrec *
+zrec_zfile(struct zfile *zf, int delim)
+{
+
+	return (zrec_new(zrec_zfile_next, zf, delim));
+}
+
+static int
+zrec_zstdfile_next(void *src, const void **ptr, size_t *len)
+{
+
+	return (zstdfile_next_chunk(src, ptr, len));
+}
+
+struct zrec *
+zrec_zstdfile(struct zstdfile *zf, int delim)
+{
+
+	return (zrec_new(zrec_zstdfile_next, zf, delim));
+}
+
+static int
+zrec_file_next(void *src, const void **ptr, size_t *len)
+{
+	struct zrec *r = src;
+	size_t n;
+
+	n = fread(r->fbuf, 1, ZREC_FILEBUF, r->file);
+	if (n == 0) {
+		if (!ferror(r->file))
+			return (0);
+		if (errno == 0)
+			errno = EIO;
+		return (-1);
+	}
+	*ptr = r->fbuf;
+	*len = n;
+	return (1);
+}
+
+struct zrec *
+zrec_file(FILE *f, int delim)
+{
+	struct zrec *r;
+
+	r = zrec_new(zrec_file_next, NULL, delim);
+	if (r == NULL)
+		return (NULL);
+	r->src = r;
+	r->file = f;
+	r->fbuf = malloc(ZREC_FILEBUF);
+	if (r->fbuf == NULL) {
+		free(r);
+		return (NULL);
+	}
+	return (r);
+}
+
+void
+zrec_free(struct zrec *r)
+{
+
+	if (r == NULL)
+		return;
+	free(r->stitch);
+	free(r->fbuf);
+	free(r);
+}
+
+/* Add the part of a record at 'p' to those from earlier chunks. */
+static int
+zrec_stitch(struct zrec *r, const char *p, size_t len)
+{
+	void *buf;
+
+	buf = r->stitch;
+	if (zpool_reserve(&buf, &r->scap, r->slen + len) != 0) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	r->stitch = buf;
+	memcpy(r->stitch + r->slen, p, len);
+	r->slen += len;
+	return (0);
+}
+
+int
+zrec_next(struct zrec *r, const void **ptr, size_t *len)
+{
+	const char *q;
+	const void *p;
+	size_t n;
+	int rc;
+
+	/* The last record returned may have been stitched; it's done with. */
+	r->slen = 0;
+	for (;;) {
+		if (r->p < r->end) {
+			q = memchr(r->p, r->delim, r->end - r->p);
+			if (q != NULL && r->slen == 0) {
+				/* Whole in this chunk: lend it out as is. */
+				*ptr = r->p;
+				*len = q - r->p;
+				r->p = q + 1;
+				return (1);
+			}
+			if (zrec_stitch(r, r->p, (q != NULL ? q : r->end) -
+			    r->p) != 0)
+				return (-1);
+			if (q != NULL) {
+				r->p = q + 1;
+				break;
+			}
+			r->p = r->end;
+		}
+
+		if (r->eof)
+			break;
+		rc = r->next(r->src, &p, &n);
+		if (rc < 0)
+			return (-1);
+		if (rc == 0) {
+			r->eof = true;
+			break;
+		}
+		r->p = p;
+		r->end = r->p + n;
+	}
+	/* At the end, only a last record without a delimiter is left. */
+	if (r->eof && r->slen == 0)
+		return (0);
+	*ptr = r->stitch;
+	*len = r->slen;
+	return (1);
+}
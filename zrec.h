@@ -0,0 +1,49 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZREC_H
+#define ZREC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "zfile.h"
+#include "zstdfile.h"
+
+/*
+ * Record (line) scanner over a native reader's output, for callers that
+ * would otherwise getline(3) the stream: records are found with memchr(3)
+ * (vectorized in any modern libc) straight in the chunks the decoder lends
+ * out (see zfile_next_chunk()), and handed back as views into them.  Only
+ * a record that straddles two chunks is copied, into a buffer of the
+ * scanner's that grows to fit the longest such record.
+ *
+ * zrec_next() returns 1 with the next record at '*ptr' (its 'len' bytes
+ * exclude the delimiter), valid until the next call; 0 at the end of the
+ * output; or -1 (with errno set as by the source) on error.  A last record
+ * without a delimiter is returned like any other, and an empty output has
+ * no records.
+ *
+ * The scanner only borrows its source: zrec_free() leaves the zfile,
+ * zstdfile or FILE open, and the caller frees that afterwards (which, for a
+ * zfile or zstdfile, also closes the file under it).
+ * zrec_file() reads a FILE (such as zauto_open() returns for a file that
+ * wasn't compressed) through a buffer of its own instead, which makes one
+ * copy but still skips stdio's per-line work.
+ */
+typedef int zrec_chunk_fn(void *src, const void **ptr, size_t *len);
+
+struct zrec;
+struct zrec *zrec_new(zrec_chunk_fn *next, void *src, int delim);
+struct zrec *zrec_zfile(struct zfile *, int delim);
+struct zrec *zrec_zstdfile(struct zstdfile *, int delim);
+struct zrec *zrec_file(FILE *, int delim);
+int zrec_next(struct zrec *, const void **ptr, size_t *len);
+void zrec_free(struct zrec *);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "zstats.h"
+
+void
+zstats_init(struct zstats_rec *r, bool timed, zstats_hook *hook,
+    void *hook_arg)
+{
+
+	memset(&r->stats, 0, sizeof r->stats);
+	r->timed = timed || hook != NULL;
+	r->hook = hook;
+	r->hook_arg = hook_arg;
+}
+
+uint64_t
+zstats_begin(const struct zstats_rec *r)
+{
+	struct timespec ts;
+
+	if (!r->timed)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void
+zstats_end(struct zstats_rec *r, enum zstats_event ev, uint64_t t0,
+    uint64_t bytes)
+{
+	uint64_t ns;
+
+	ns = r->timed ? zstats_begin(r) - t0 : 0;
+	switch (ev) {
+	case ZSTATS_READ:
+		ZSTATS_ADD(r, in_reads, 1);
+		ZSTATS_ADD(r, in_bytes, bytes);
+		ZSTATS_ADD(r, in_read_ns, ns);
+		break;
+	case ZSTATS_DECODE:
+		ZSTATS_ADD(r, decode_calls, 1);
+		ZSTATS_ADD(r, decode_ns, ns);
+		break;
+	case ZSTATS_SEEK:
+		break;
+	}
+	if (r->hook != NULL)
+		r->hook(r->hook_arg, ev, bytes, ns);
+}
+
+void
+zstats_seek(struct zstats_rec *r, uint64_t from, uint64_t to)
+{
+	uint64_t dist;
+
+	dist = to > from ? to - from : from - to;
+	ZSTATS_ADD(r, seeks, 1);
+	ZSTATS_ADD(r, seek_distance, dist);
+	if (r->hook != NULL)
+		r->hook(r->hook_arg, ZSTATS_SEEK, dist, 0);
+}
+
+void
+zstats_copy(struct zstats *dst, const struct zstats *src)
+{
+	const uint64_t *s = (const uint64_t *)src;
+	uint64_t *d = (uint64_t *)dst;
+	size_t i;
+
+	/* All counters, so it can go field by field. */
+	for (i = 0; i < sizeof *src / sizeof *s; i++)
+		d[i] = __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,83 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZSTATS_H
+#define ZSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counters kept by each decoding stream, for finding where the time goes.
+ * Times are only taken if the stream was opened with 'timing' (or a 'trace'
+ * hook) in its options, and are zero otherwise; the rest are always kept.
+ */
+struct zstats {
+	uint64_t in_bytes;	// Compressed input read from the source
+	uint64_t in_reads;	// ... in this many reads
+	uint64_t in_read_ns;	// ... taking this long
+	uint64_t decode_calls;	// Calls into the decoder
+	uint64_t decode_ns;	// ... taking this long (with waits for workers)
+	uint64_t out_bytes;	// Output handed to the caller
+	uint64_t copy_bytes;	// ... of which copied out of our buffers
+	uint64_t skip_bytes;	// Output decoded only to reach seek targets
+	uint64_t seeks;
+	uint64_t seek_distance;	// Sum of the distances seeked, either way
+	uint64_t jumps;		// Seeks that restarted at a checkpoint
+	uint64_t rewinds;	// Restarts at the start of the input
+	uint64_t cache_bytes;	// Output served from the block cache
+};
+
+/*
+ * Trace hook, called on the decoding thread (the read-ahead thread, with
+ * 'readahead') after each read of the source and each call into the decoder,
+ * with the bytes read or decoded and the time it took, and on each seek, with
+ * its distance and no time.  It must not use the stream.
+ */
+enum zstats_event {
+	ZSTATS_READ,
+	ZSTATS_DECODE,
+	ZSTATS_SEEK,
+};
+
+typedef void zstats_hook(void *arg, enum zstats_event, uint64_t bytes,
+    uint64_t ns);
+
+/*
+ * Copy the counters of 'f', a stream from zopen*(), zstdopen*() or
+ * zauto_open*() (the outermost layer), to '*s'.  Returns -1 with errno EINVAL
+ * if 'f' is not such a stream.  Safe against a read-ahead thread updating
+ * them; the copy is then a moment's snapshot, not a consistent one.
+ */
+int zstats_get(FILE *f, struct zstats *s);
+
+/*
+ * For the readers, which each keep a 'struct zstats_rec' (registered with
+ * their error; see zerror.h).  zstats_begin() starts timing a read or decode
+ * (returning 0 if not timed) and zstats_end() counts it.
+ */
+struct zstats_rec {
+	struct zstats stats;
+	bool timed;
+	zstats_hook *hook;
+	void *hook_arg;
+};
+
+#define	ZSTATS_ADD(rec, field, n)					\
+	__atomic_fetch_add(&(rec)->stats.field, (n), __ATOMIC_RELAXED)
+
+void zstats_init(struct zstats_rec *, bool timed, zstats_hook *hook,
+    void *hook_arg);
+uint64_t zstats_begin(const struct zstats_rec *);
+void zstats_end(struct zstats_rec *, enum zstats_event, uint64_t t0,
+    uint64_t bytes);
+void zstats_seek(struct zstats_rec *, uint64_t from, uint64_t to);
+void zstats_copy(struct zstats *dst, const struct zstats *src);
+
+#endif
@@ -21,20 +21,52 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /*
  * We only use this for ZSTD_MAGICNUMBER, which arguably is frozen since 0.8.0
- * and should be part of the public interface:
+ * and should be part of the public interface (and for the frame header
+ * helpers, ZSTD_d_forceIgnoreChecksum and ZSTD_d_refMultipleDDicts, if
+ * present):
  */
 #define ZSTD_STATIC_LINKING_ONLY	1
 #include <zstd.h>
-
+#include <zstd_errors.h>
+
+#include "zahead.h"
+#include "zcache.h"
+#include "zerror.h"
+#include "zindex.h"
+#include "zmap.h"
+#include "zpool.h"
+#include "zprefetch.h"
+#include "zstats.h"
 #include "zstdfile.h"
+#include "zstdfilew.h"
+
+/*
+ * Seekable format (contrib/seekable_format in the zstd tree): independent
+ * frames followed by a skippable frame holding one entry per frame and this
+ * footer.
+ */
+#define ZSTD_SEEKABLE_MAGICNUMBER	0x8F92EAB1
+#define ZSTD_SEEKTABLE_FOOTER_SIZE	9
+#define ZSTD_SEEKTABLE_CHECKSUM_FLAG	0x80
+#define ZSTD_SEEKTABLE_RESERVED_MASK	0x7c
+
+/* Frame format details needed to find frame boundaries without decoding. */
+#define ZSTD_FHD_CHECKSUM_FLAG		0x04
+#define ZSTD_BLOCK_HEADER_SIZE		3
+#define ZSTD_BLOCK_RLE			1
+#define ZSTD_BLOCK_RESERVED		3
 
 #define min(a, b) ({				\
 	__typeof (a) _a = (a);			\
@@ -53,6 +85,13 @@ static const cookie_io_functions_t zstdfile_io = {
 };
 
 #define KB (1024)
+
+/* Limits for zstdfile_opts.adaptive */
+#define ZSTDFILE_INBUF_MAX	(4 * 1024 * KB)
+#define ZSTDFILE_OUTBUF_MIN	(32*KB)
+/* A full read of the source taking this long means it is slow */
+#define ZSTDFILE_SLOW_READ_NS	(1000 * 1000)
+
 struct zstdfile {
 	FILE *in;		// Source FILE stream
 	uint64_t logic_offset,	// Logical offset in output (forward seeks)
@@ -68,160 +107,1857 @@ struct zstdfile {
 	/* Tracks size of heap-allocated 'inbuf'.*/
 	size_t inbuf_size;
 
+	size_t outbuf_cfg;	// Configured output buffer size
+	bool adaptive;		// See zstdfile_opts
+	bool verify;		// Check frame checksums
+	bool seekable;		// 'in' can be rewound
+	/* Else maybe its start, for rewinds; as in zfile.c */
+	char *replay;
+	size_t replay_len, replay_cap, replay_max;
+	size_t replay_pos;
+
+	/* The whole input, if mapped (zstdfile_opts.use_mmap) */
+	const uint8_t *map;
+	size_t map_len;
+	struct zprefetch *pf;	// Else maybe read through this
+
 	ZSTD_outBuffer obuf;
 	/*
 	 * ibuf.size tracks length of valid data in 'inbuf'.
 	 * ibuf.pos tracks what the decompressor has consumed.
 	 */
 	ZSTD_inBuffer ibuf;
+	/* Input offset of the end of the data in 'inbuf' */
+	uint64_t in_pos;
+
+	/*
+	 * Frame start offsets, from a seekable-format seek table or recorded
+	 * as frames are decoded.  Frames are independent, so decode can
+	 * restart at any of them.
+	 */
+	struct zindex index;
+	char *index_path;	// Save index here on close, if changed
+
+	/*
+	 * Multithreaded mode: whole frames are read on the caller's thread
+	 * and decoded by 'pool', each worker with its own DCtx.  A frame too
+	 * big (or of unknown size) to buffer is decoded on the caller's thread
+	 * instead, streaming through 'decomp' as in serial mode.
+	 */
+	struct zpool *pool;
+	uint64_t mt_in;		// Input offset of the next frame to queue
+	size_t mt_pos;		// Bytes of the head job already returned
+	bool mt_started;	// Head job has been accounted for
+	bool mt_ineof;		// No more frames to queue (for now)
+	bool mt_serial;		// Head job is decoded on our thread
 
 	bool eof;
-	bool truncated;
+	bool truncated;		// Stopped on an error, 'err'
+	bool frame_end;		// Decoder is between frames
+	struct zerror err;
+	struct zerror_reg reg;	// For our FILE, if any
+	struct zstats_rec st;
+	struct zcache_file cache;	// Shared decoded blocks, if enabled
+
+	/* Dictionaries (referenced), and the window cap; see zstdfile_opts */
+	struct zstdfile_dict **dicts;
+	size_t ndicts;
+	unsigned window_log_max;
 };
 
-static void
-zstdfile_init(struct zstdfile *cookie)
+/* A digested dictionary, shared by reference count. */
+struct zstdfile_dict {
+	ZSTD_DDict *ddict;
+	unsigned refs;
+};
+
+static void zstdfile_mt_reset(struct zstdfile *, uint64_t in);
+static int zstdfile_decode(struct zstdfile *, char *dst, size_t dstlen,
+    size_t *ndst);
+
+struct zstdfile_dict *
+zstdfile_dict_create(const void *buf, size_t len)
+{
+	struct zstdfile_dict *d;
+
+	d = malloc(sizeof *d);
+	if (d == NULL)
+		return (NULL);
+	d->ddict = ZSTD_createDDict(buf, len);
+	if (d->ddict == NULL) {
+		free(d);
+		errno = EINVAL;
+		return (NULL);
+	}
+	d->refs = 1;
+	return (d);
+}
+
+struct zstdfile_dict *
+zstdfile_dict_load(const char *path)
+{
+	struct zstdfile_dict *d;
+	struct stat sb;
+	void *buf;
+	FILE *f;
+	int serrno;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (NULL);
+	d = NULL;
+	buf = NULL;
+	if (fstat(fileno(f), &sb) != 0)
+		goto out;
+	buf = malloc(sb.st_size > 0 ? sb.st_size : 1);
+	if (buf == NULL)
+		goto out;
+	if (fread(buf, 1, sb.st_size, f) != (size_t)sb.st_size) {
+		errno = EIO;
+		goto out;
+	}
+	d = zstdfile_dict_create(buf, sb.st_size);
+out:
+	serrno = errno;
+	free(buf);
+	fclose(f);
+	errno = serrno;
+	return (d);
+}
+
+unsigned
+zstdfile_dict_id(const struct zstdfile_dict *d)
+{
+
+	return (ZSTD_getDictID_fromDDict(d->ddict));
+}
+
+void
+zstdfile_dict_free(struct zstdfile_dict *d)
+{
+
+	if (d == NULL ||
+	    __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	ZSTD_freeDDict(d->ddict);
+	free(d);
+}
+
+/* Drop the stream's references to its dictionaries. */
+static void
+zstdfile_dicts_put(struct zstdfile *cookie)
+{
+	size_t i;
+
+	for (i = 0; i < cookie->ndicts; i++)
+		zstdfile_dict_free(cookie->dicts[i]);
+	free(cookie->dicts);
+	cookie->dicts = NULL;
+	cookie->ndicts = 0;
+}
+
+/*
+ * Check the reading options in 'opts' that libzstd may refuse.  Returns -1
+ * with errno set: EINVAL for a window cap out of range, ENOTSUP for several
+ * dictionaries with a libzstd that can't choose between them.
+ */
+static int
+zstdfile_opts_check(const struct zstdfile_opts *opts)
+{
+	ZSTD_bounds b;
+
+	if (opts == NULL)
+		return (0);
+	if (opts->window_log_max != 0) {
+		b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+		if (ZSTD_isError(b.error) ||
+		    (int)opts->window_log_max < b.lowerBound ||
+		    (int)opts->window_log_max > b.upperBound) {
+			errno = EINVAL;
+			return (-1);
+		}
+	}
+#ifndef ZSTD_d_refMultipleDDicts
+	if (opts->ndicts > 1) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+#endif
+	return (0);
+}
+
+/*
+ * Take references to the dictionaries in 'opts' and keep its window cap.
+ * Returns -1 with errno set if zstdfile_opts_check() fails or out of memory.
+ */
+static int
+zstdfile_dicts_get(struct zstdfile *cookie, const struct zstdfile_opts *opts)
+{
+	size_t i;
+
+	cookie->dicts = NULL;
+	cookie->ndicts = 0;
+	cookie->window_log_max = 0;
+	if (opts == NULL)
+		return (0);
+	if (zstdfile_opts_check(opts) != 0)
+		return (-1);
+	cookie->window_log_max = opts->window_log_max;
+
+	if (opts->ndicts == 0)
+		return (0);
+	cookie->dicts = malloc(opts->ndicts * sizeof *cookie->dicts);
+	if (cookie->dicts == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	for (i = 0; i < opts->ndicts; i++) {
+		cookie->dicts[i] = opts->dicts[i];
+		__atomic_add_fetch(&cookie->dicts[i]->refs, 1,
+		    __ATOMIC_RELAXED);
+	}
+	cookie->ndicts = opts->ndicts;
+	return (0);
+}
+
+/* Apply decoding options to 'dctx'. */
+static void
+zstdfile_dctx_apply(ZSTD_DCtx *dctx, bool verify,
+    struct zstdfile_dict *const *dicts, size_t ndicts, unsigned window_log_max)
+{
+	size_t i;
+
+#ifdef ZSTD_d_forceIgnoreChecksum
+	if (!verify)
+		(void)ZSTD_DCtx_setParameter(dctx, ZSTD_d_forceIgnoreChecksum,
+		    ZSTD_d_ignoreChecksum);
+#else
+	(void)verify;
+#endif
+	if (window_log_max != 0)
+		(void)ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+		    window_log_max);
+
+	/*
+	 * One dictionary serves every frame, whatever ID it records (or
+	 * none); several are chosen among by each frame's dictionary ID.
+	 */
+#ifdef ZSTD_d_refMultipleDDicts
+	if (ndicts > 1)
+		(void)ZSTD_DCtx_setParameter(dctx, ZSTD_d_refMultipleDDicts,
+		    ZSTD_rmd_refMultipleDDicts);
+#endif
+	for (i = 0; i < ndicts; i++)
+		(void)ZSTD_DCtx_refDDict(dctx, dicts[i]->ddict);
+}
+
+/* Apply the stream's decoding options to 'dctx'. */
+static void
+zstdfile_dctx_params(const struct zstdfile *cookie, ZSTD_DCtx *dctx)
+{
+
+	zstdfile_dctx_apply(dctx, cookie->verify, cookie->dicts,
+	    cookie->ndicts, cookie->window_log_max);
+}
+
+int
+zstdfile_dctx_setup(ZSTD_DCtx *dctx, const struct zstdfile_opts *opts)
+{
+
+	if (zstdfile_opts_check(opts) != 0)
+		return (-1);
+	if (opts == NULL)
+		return (0);
+	zstdfile_dctx_apply(dctx, opts->verify != ZSTDFILE_VERIFY_OFF,
+	    opts->dicts, opts->ndicts, opts->window_log_max);
+	return (0);
+}
+
+enum zerror_kind
+zstdfile_error_kind(size_t ret, int *codep)
+{
+
+	switch (ZSTD_getErrorCode(ret)) {
+	case ZSTD_error_frameParameter_windowTooLarge:
+	case ZSTD_error_memory_allocation:
+		*codep = ENOMEM;
+		return (ZERROR_NOMEM);
+	case ZSTD_error_checksum_wrong:
+		*codep = EBADMSG;
+		return (ZERROR_CHECKSUM);
+	default:
+		*codep = EBADMSG;
+		return (ZERROR_CORRUPT);
+	}
+}
+
+static void zstdfile_destroy(struct zstdfile *);
+static ssize_t zstdfile_cache_read(struct zstdfile *, char *buf,
+    size_t size, bool *endp);
+
+/*
+ * Start decoding at the beginning of the input, reusing the DCtx and buffers
+ * we already have.  The first 'len' bytes of the input have already been read
+ * from 'in' into 'peek'; they are decoded from there.
+ */
+static void
+zstdfile_start(struct zstdfile *cookie, const void *peek, size_t len)
+{
+	size_t res;
+
+	cookie->logic_offset = 0;
+	cookie->decode_offset = 0;
+	cookie->actual_len = 0;
+
+	res = ZSTD_DCtx_reset(cookie->decomp, ZSTD_reset_session_only);
+	assert(!ZSTD_isError(res));
+
+	cookie->ibuf.pos = cookie->ibuf.size = 0;
+	cookie->obuf.pos = 0;
+
+	cookie->in_pos = 0;
+	/* A mapped or prefetched input is read by offset, not from 'in'. */
+	if (len > 0 && cookie->map == NULL && cookie->pf == NULL) {
+		assert(len <= cookie->inbuf_size);
+		memcpy(cookie->inbuf, peek, len);
+		cookie->ibuf.src = cookie->inbuf;
+		cookie->ibuf.size = len;
+		cookie->in_pos = len;
+	}
+	cookie->outbuf_start = 0;
+	cookie->eof = false;
+	cookie->truncated = false;
+	cookie->frame_end = false;
+
+	if (cookie->pool != NULL)
+		zstdfile_mt_reset(cookie, 0);
+}
+
+/*
+ * Rewind the input (or its replay, if it can't seek) and start over.  Returns
+ * -1 (with errno ESPIPE, and the decoder left as it was) if neither is
+ * possible.
+ */
+static int
+zstdfile_restart(struct zstdfile *cookie)
+{
+
+	if (!cookie->seekable) {
+		if (cookie->replay == NULL) {
+			errno = ESPIPE;
+			return (-1);
+		}
+		cookie->replay_pos = 0;
+		zstdfile_start(cookie, NULL, 0);
+		ZSTATS_ADD(&cookie->st, rewinds, 1);
+		return (0);
+	}
+	if (fseeko(cookie->in, 0, SEEK_SET) != 0)
+		return (-1);
+	clearerr(cookie->in);
+	zstdfile_start(cookie, NULL, 0);
+	ZSTATS_ADD(&cookie->st, rewinds, 1);
+	return (0);
+}
+
+/*
+ * Closed readers go back to a small process-wide pool, DCtx and buffers
+ * intact, so that opening many small files in turn doesn't keep creating
+ * and freeing them.
+ */
+#define ZSTDFILE_POOL_MAX	8
+
+static struct {
+	pthread_mutex_t lock;
+	struct zstdfile *free[ZSTDFILE_POOL_MAX];
+	unsigned n;
+} zstdfile_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct zstdfile *
+zstdfile_pool_get(void)
+{
+	struct zstdfile *cookie;
+
+	cookie = NULL;
+	pthread_mutex_lock(&zstdfile_pool.lock);
+	if (zstdfile_pool.n > 0)
+		cookie = zstdfile_pool.free[--zstdfile_pool.n];
+	pthread_mutex_unlock(&zstdfile_pool.lock);
+	return (cookie);
+}
+
+static void
+zstdfile_dispose(struct zstdfile *cookie)
+{
+
+	ZSTD_freeDCtx(cookie->decomp);
+	free(cookie->inbuf);
+	free(cookie->outbuf);
+	free(cookie);
+}
+
+/*
+ * Get a reader with a DCtx in its default state, from the pool if possible.
+ * Its buffers may be absent or of any size.
+ */
+static struct zstdfile *
+zstdfile_alloc(void)
+{
+	struct zstdfile *cookie;
+	size_t res;
+
+	cookie = zstdfile_pool_get();
+	if (cookie != NULL && cookie->decomp != NULL) {
+		res = ZSTD_DCtx_reset(cookie->decomp,
+		    ZSTD_reset_session_and_parameters);
+		assert(!ZSTD_isError(res));
+		return (cookie);
+	}
+
+	if (cookie == NULL) {
+		cookie = malloc(sizeof(*cookie));
+		if (cookie == NULL)
+			return (NULL);
+		cookie->inbuf = cookie->outbuf = NULL;
+		cookie->inbuf_size = cookie->obuf.size = 0;
+	}
+	/* New, or pooled without its DCtx; see zstdfile_destroy(). */
+	cookie->decomp = ZSTD_createDCtx();
+	if (cookie->decomp == NULL) {
+		zstdfile_dispose(cookie);
+		return (NULL);
+	}
+	return (cookie);
+}
+
+/* Return a reader to the pool, or free it if the pool is full. */
+static void
+zstdfile_release(struct zstdfile *cookie)
+{
+
+	pthread_mutex_lock(&zstdfile_pool.lock);
+	if (zstdfile_pool.n < ZSTDFILE_POOL_MAX) {
+		zstdfile_pool.free[zstdfile_pool.n++] = cookie;
+		cookie = NULL;
+	}
+	pthread_mutex_unlock(&zstdfile_pool.lock);
+	if (cookie != NULL)
+		zstdfile_dispose(cookie);
+}
+
+void
+zstdfile_pool_flush(void)
+{
+	struct zstdfile *cookie;
+
+	while ((cookie = zstdfile_pool_get()) != NULL)
+		zstdfile_dispose(cookie);
+}
+
+/*
+ * Size the buffers per 'opts', keeping those a pooled reader already has if
+ * they are the right size.  Returns -1 if out of memory.
+ */
+static int
+zstdfile_buffers(struct zstdfile *cookie, const struct zstdfile_opts *opts)
+{
+	struct stat sb;
+	size_t insz, outsz;
+
+	insz = ZSTD_DStreamInSize();
+	cookie->outbuf_cfg = ZSTD_DStreamOutSize();
+	cookie->adaptive = false;
+	if (opts != NULL) {
+		if (opts->inbuf_size != 0)
+			insz = opts->inbuf_size;
+		if (opts->outbuf_size != 0)
+			cookie->outbuf_cfg = opts->outbuf_size;
+		cookie->adaptive = opts->adaptive;
+	}
+	outsz = cookie->outbuf_cfg;
+	if (cookie->adaptive) {
+		/* No point reading more than the whole (small) file. */
+		if (fstat(fileno(cookie->in), &sb) == 0 &&
+		    S_ISREG(sb.st_mode) && (uint64_t)sb.st_size < insz)
+			insz = sb.st_size > 0 ? sb.st_size : 1;
+		outsz = min(outsz, (size_t)ZSTDFILE_OUTBUF_MIN);
+	}
+
+	if (cookie->inbuf == NULL || cookie->inbuf_size != insz) {
+		free(cookie->inbuf);
+		cookie->inbuf = malloc(insz);
+		cookie->inbuf_size = cookie->inbuf != NULL ? insz : 0;
+	}
+	if (cookie->outbuf == NULL || cookie->obuf.size != outsz) {
+		free(cookie->outbuf);
+		cookie->outbuf = malloc(outsz);
+		cookie->obuf.size = cookie->outbuf != NULL ? outsz : 0;
+	}
+	cookie->ibuf.src = cookie->inbuf;
+	cookie->obuf.dst = cookie->outbuf;
+	if (cookie->inbuf == NULL || cookie->outbuf == NULL)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Read exactly 'len' bytes at input offset 'off', from the mapping if there
+ * is one.  Returns 0 on success.  Leaves the file position of 'in'
+ * unspecified.
+ */
+static int
+zstdfile_pread(struct zstdfile *cookie, void *buf, size_t len, uint64_t off)
+{
+
+	if (cookie->map != NULL) {
+		if (off > cookie->map_len || len > cookie->map_len - off)
+			return (-1);
+		memcpy(buf, cookie->map + off, len);
+		return (0);
+	}
+	if (fseeko(cookie->in, off, SEEK_SET) != 0 ||
+	    fread(buf, 1, len, cookie->in) != len)
+		return (-1);
+	return (0);
+}
+
+/*
+ * If 'in' is a seekable-format stream, load its seek table into the cookie's
+ * index.  Only a mapped input or a regular file is looked at: any other FILE
+ * that seeks (a nested reader, say) would have to decode its whole input to
+ * find its end.  Leaves the file position of 'in' unspecified.
+ */
+static void
+zstdfile_load_seektable(struct zstdfile *cookie)
+{
+	unsigned char footer[ZSTD_SEEKTABLE_FOOTER_SIZE], hdr[8];
+	unsigned char *table;
+	uint64_t cpos, dpos, tblsz;
+	uint32_t nframes, i;
+	struct stat sb;
+	size_t esz;
+	off_t fsize;
+
+	table = NULL;
+	if (cookie->map != NULL)
+		fsize = cookie->map_len;
+	else {
+		if (fileno(cookie->in) < 0 ||
+		    fstat(fileno(cookie->in), &sb) != 0 || !S_ISREG(sb.st_mode))
+			return;
+		fsize = sb.st_size;
+	}
+	if (fsize < (off_t)(sizeof hdr + sizeof footer))
+		return;
+	if (zstdfile_pread(cookie, footer, sizeof footer,
+	    fsize - sizeof footer) != 0)
+		return;
+	if (le32dec(&footer[5]) != ZSTD_SEEKABLE_MAGICNUMBER ||
+	    (footer[4] & ZSTD_SEEKTABLE_RESERVED_MASK) != 0)
+		return;
+
+	nframes = le32dec(&footer[0]);
+	esz = (footer[4] & ZSTD_SEEKTABLE_CHECKSUM_FLAG) != 0 ? 12 : 8;
+	tblsz = (uint64_t)nframes * esz;
+	if (tblsz + sizeof footer + sizeof hdr > (uint64_t)fsize)
+		return;
+
+	if (zstdfile_pread(cookie, hdr, sizeof hdr,
+	    fsize - sizeof footer - tblsz - sizeof hdr) != 0)
+		return;
+	if ((le32dec(&hdr[0]) & ZSTD_MAGIC_SKIPPABLE_MASK) !=
+	    ZSTD_MAGIC_SKIPPABLE_START ||
+	    le32dec(&hdr[4]) != tblsz + sizeof footer)
+		return;
+
+	table = malloc(tblsz > 0 ? tblsz : 1);
+	if (table == NULL)
+		return;
+	if (zstdfile_pread(cookie, table, tblsz,
+	    fsize - sizeof footer - tblsz) != 0)
+		goto out;
+
+	cpos = dpos = 0;
+	for (i = 0; i < nframes; i++) {
+		struct zindex_point *pt;
+
+		pt = zindex_reserve(&cookie->index, NULL);
+		if (pt == NULL)
+			goto bad;
+		pt->in = cpos;
+		pt->out = dpos;
+		if (esz == 12)
+			pt->crc = le32dec(&table[i * esz + 8]);
+		zindex_commit(&cookie->index);
+
+		cpos += le32dec(&table[i * esz]);
+		dpos += le32dec(&table[i * esz + 4]);
+	}
+
+	/* The frames must account for everything before the seek table. */
+	if (cpos + tblsz + sizeof footer + sizeof hdr != (uint64_t)fsize)
+		goto bad;
+
+	zindex_set_complete(&cookie->index, dpos);
+	cookie->index.dirty = false;
+	goto out;
+
+bad:
+	warnx("ignoring invalid zstd seek table");
+	zindex_free(&cookie->index);
+	zindex_init(&cookie->index, 0, 0);
+out:
+	free(table);
+}
+
+/*
+ * Restart decoding at the frame starting at 'pt'.
+ */
+static int
+zstdfile_index_restore(struct zstdfile *cookie, const struct zindex_point *pt)
+{
+	size_t res;
+
+	if (fseeko(cookie->in, pt->in, SEEK_SET) != 0)
+		return (-1);
+
+	res = ZSTD_DCtx_reset(cookie->decomp, ZSTD_reset_session_only);
+	assert(!ZSTD_isError(res));
+
+	cookie->ibuf.pos = cookie->ibuf.size = 0;
+	cookie->obuf.pos = 0;
+	cookie->outbuf_start = 0;
+	cookie->in_pos = pt->in;
+	if (cookie->pool != NULL)
+		zstdfile_mt_reset(cookie, pt->in);
+
+	cookie->logic_offset = pt->out;
+	cookie->decode_offset = pt->out;
+	cookie->actual_len = pt->out;
+	cookie->eof = false;
+	cookie->truncated = false;
+	cookie->frame_end = false;
+	return (0);
+}
+
+/*
+ * Record a frame starting at output offset 'out' and input offset 'in',
+ * unless we already know about it.
+ */
+static void
+zstdfile_index_add(struct zstdfile *cookie, uint64_t out, uint64_t in)
+{
+	struct zindex *index = &cookie->index;
+	struct zindex_point *pt;
+
+	if (index->complete || (index->npoints > 0 &&
+	    index->points[index->npoints - 1].out >= out))
+		return;
+
+	/* The first frame starts at zero, but we only notice it ends. */
+	if (index->npoints == 0 && out > 0) {
+		pt = zindex_reserve(index, NULL);
+		if (pt == NULL)
+			return;
+		pt->flags = ZINDEX_RESET;
+		zindex_commit(index);
+	}
+
+	pt = zindex_reserve(index, NULL);
+	if (pt == NULL)
+		return;
+	pt->out = pt->base = out;
+	pt->in = in;
+	pt->flags = ZINDEX_RESET;
+	zindex_commit(index);
+}
+
+/*
+ * Keep 'len' more bytes read from an unseekable input for a later rewind, or
+ * give up on that if they don't fit.
+ */
+static void
+zstdfile_replay_add(struct zstdfile *cookie, const void *buf, size_t len)
+{
+	size_t cap;
+	void *nbuf;
+
+	if (len == 0)
+		return;
+	if (len > cookie->replay_max - cookie->replay_len)
+		goto drop;
+	if (cookie->replay_len + len > cookie->replay_cap) {
+		cap = cookie->replay_cap;
+		while (cap < cookie->replay_len + len)
+			cap *= 2;
+		cap = min(cap, cookie->replay_max);
+		nbuf = realloc(cookie->replay, cap);
+		if (nbuf == NULL)
+			goto drop;
+		cookie->replay = nbuf;
+		cookie->replay_cap = cap;
+	}
+	memcpy(cookie->replay + cookie->replay_len, buf, len);
+	cookie->replay_len += len;
+	cookie->replay_pos = cookie->replay_len;
+	return;
+
+drop:
+	free(cookie->replay);
+	cookie->replay = NULL;
+	cookie->replay_len = cookie->replay_pos = 0;
+}
+
+/* Input offset of the next byte to decode, about. */
+static uint64_t
+zstdfile_in_off(const struct zstdfile *cookie)
+{
+
+	if (cookie->pool != NULL && !cookie->mt_serial)
+		return (cookie->mt_in);
+	return (cookie->in_pos - (cookie->ibuf.size - cookie->ibuf.pos));
+}
+
+/* As zfile_fail(). */
+static void __attribute__((__format__(__printf__, 4, 5)))
+zstdfile_fail(struct zstdfile *cookie, enum zerror_kind kind, int code,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	if (cookie->truncated)
+		return;
+	va_start(ap, fmt);
+	zerror_vset(&cookie->err, kind, code, zstdfile_in_off(cookie),
+	    cookie->actual_len, fmt, ap);
+	va_end(ap);
+	cookie->truncated = true;
+}
+
+static void
+zstdfile_fail_input(struct zstdfile *cookie, int code)
+{
+
+	if (cookie->truncated)
+		return;
+	zerror_input(&cookie->err, cookie->pf == NULL ? cookie->in : NULL,
+	    code, zstdfile_in_off(cookie), cookie->actual_len);
+	cookie->truncated = true;
+}
+
+/*
+ * Refill the (empty) input buffer.  Returns the number of bytes read, 0 at
+ * EOF, or -1 if reading the source fails (or it reports truncation).
+ */
+static ssize_t
+zstdfile_fill(struct zstdfile *cookie)
+{
+	struct timespec t0, t1;
+	const void *p;
+	uint64_t t;
+	ssize_t n;
+	size_t nb;
+	char *nbuf;
+
+	assert(cookie->ibuf.pos == cookie->ibuf.size);
+
+	if (cookie->pf != NULL) {
+		/* A no-op unless we have repositioned. */
+		zprefetch_seek(cookie->pf, cookie->in_pos);
+		t = zstats_begin(&cookie->st);
+		n = zprefetch_next(cookie->pf, &p);
+		if (n < 0) {
+			zstdfile_fail_input(cookie, errno);
+			return (-1);
+		}
+		zstats_end(&cookie->st, ZSTATS_READ, t, n);
+		cookie->ibuf.src = p;
+		cookie->ibuf.pos = 0;
+		cookie->ibuf.size = n;
+		cookie->in_pos += n;
+		return (n);
+	}
+
+	if (cookie->map != NULL) {
+		nb = 0;
+		if (cookie->in_pos < cookie->map_len)
+			nb = cookie->map_len - cookie->in_pos;
+		cookie->ibuf.src = cookie->map + cookie->in_pos;
+		cookie->ibuf.pos = 0;
+		cookie->ibuf.size = nb;
+		cookie->in_pos += nb;
+		ZSTATS_ADD(&cookie->st, in_bytes, nb);
+		return (nb);
+	}
+
+	if (cookie->replay_pos < cookie->replay_len) {
+		/* Rewound: the start of the input again, from memory. */
+		nb = cookie->replay_len - cookie->replay_pos;
+		cookie->ibuf.src = cookie->replay + cookie->replay_pos;
+		cookie->ibuf.pos = 0;
+		cookie->ibuf.size = nb;
+		cookie->replay_pos += nb;
+		cookie->in_pos += nb;
+		return (nb);
+	}
+
+	if (cookie->adaptive)
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	t = zstats_begin(&cookie->st);
+	nb = fread(cookie->inbuf, 1, cookie->inbuf_size, cookie->in);
+	zstats_end(&cookie->st, ZSTATS_READ, t, nb);
+	if (ferror(cookie->in)) {
+		/*
+		 * A nested compression stream fails with its own error (ENOBUFS
+		 * if truncated).  Could be a false positive if read(2) returned
+		 * ENOBUFS instead, but I don't see any harm.
+		 */
+		zstdfile_fail_input(cookie, errno);
+		return (-1);
+	}
+	cookie->ibuf.src = cookie->inbuf;
+	cookie->ibuf.pos = 0;
+	cookie->ibuf.size = nb;
+	cookie->in_pos += nb;
+	if (cookie->replay != NULL)
+		zstdfile_replay_add(cookie, cookie->inbuf, nb);
+
+	/* Slow source: ask for more per read next time, if we can. */
+	if (cookie->adaptive && nb == cookie->inbuf_size &&
+	    cookie->inbuf_size < ZSTDFILE_INBUF_MAX) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if ((t1.tv_sec - t0.tv_sec) * 1000000000LL +
+		    (t1.tv_nsec - t0.tv_nsec) >= ZSTDFILE_SLOW_READ_NS) {
+			nbuf = malloc(cookie->inbuf_size * 2);
+			if (nbuf != NULL) {
+				memcpy(nbuf, cookie->inbuf, nb);
+				free(cookie->inbuf);
+				cookie->ibuf.src = cookie->inbuf = nbuf;
+				cookie->inbuf_size *= 2;
+			}
+		}
+	}
+	return (nb);
+}
+
+/* zpool_job tag: the input ended (or failed) inside this frame */
+#define ZSTDFILE_MT_TRUNC	0x1
+/* zpool_job tag: only the frame's header is read; see zstdfile_mt_serial() */
+#define ZSTDFILE_MT_SERIAL	0x2
+/* zpool_job aux[0]: the frame's output size; aux[1]: an error's kind */
+
+/* Largest frame output a worker is given to decode (and buffer whole) */
+#define ZSTDFILE_MT_FRAME_MAX	(4 * 1024 * KB)
+
+static void *
+zstdfile_mt_ctx_create(void *arg)
+{
+	const struct zstdfile *cookie = arg;
+	ZSTD_DCtx *dctx;
+
+	dctx = ZSTD_createDCtx();
+	if (dctx != NULL)
+		zstdfile_dctx_params(cookie, dctx);
+	return (dctx);
+}
+
+static void
+zstdfile_mt_ctx_free(void *ctx)
+{
+
+	ZSTD_freeDCtx(ctx);
+}
+
+/*
+ * Worker: decode the whole frame in job->src into job->dst, which is sized
+ * up front to the frame's output (job->aux[0]) and not grown past it.
+ */
+static void
+zstdfile_mt_decode(void *ctx, void *arg, struct zpool_job *job)
+{
+	ZSTD_DCtx *dctx = ctx;
+	ZSTD_inBuffer ibuf;
+	ZSTD_outBuffer obuf;
+	size_t ret, ipos, opos;
+
+	(void)arg;
+	if (job->error != NULL || (job->tag & ZSTDFILE_MT_SERIAL) != 0)
+		return;
+	if (dctx == NULL) {
+		job->error = "Failed to initialize zstd";
+		job->error_code = ENOMEM;
+		return;
+	}
+
+	ret = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	assert(!ZSTD_isError(ret));
+
+	if (zpool_reserve(&job->dst, &job->dstcap,
+	    job->aux[0] > 0 ? job->aux[0] : 1) != 0) {
+		job->error = "Failed to allocate buffers";
+		job->error_code = ENOMEM;
+		return;
+	}
+
+	ibuf.src = job->src;
+	ibuf.size = job->srclen;
+	ibuf.pos = 0;
+	obuf.dst = job->dst;
+	obuf.size = job->aux[0];
+	obuf.pos = 0;
+	do {
+		ipos = ibuf.pos;
+		opos = obuf.pos;
+		ret = ZSTD_decompressStream(dctx, &obuf, &ibuf);
+		if (ZSTD_isError(ret)) {
+			job->error = ZSTD_getErrorName(ret);
+			job->aux[1] = zstdfile_error_kind(ret,
+			    &job->error_code);
+			return;
+		}
+		job->dstlen = obuf.pos;
+
+		/* Out of input mid-frame: return what we have. */
+		if (ret != 0 && ibuf.pos == ibuf.size &&
+		    (obuf.pos < obuf.size || obuf.pos == opos)) {
+			job->tag |= ZSTDFILE_MT_TRUNC;
+			return;
+		}
+		/* Stuck on a full buffer: there is more than the size said. */
+		if (ret != 0 && ibuf.pos == ipos && obuf.pos == opos) {
+			job->error = "Frame larger than its recorded size";
+			return;
+		}
+	} while (ret != 0 || ibuf.pos < ibuf.size);
+}
+
+/*
+ * Append up to 'len' bytes of input to job->src.  Returns the number of bytes
+ * read (short only at EOF), or -1 if the source reports truncation or fails
+ * (noted in job->error, for the reader to stop at).
+ */
+static ssize_t
+zstdfile_mt_input(struct zstdfile *cookie, struct zpool_job *job, size_t len)
+{
+	uint64_t t;
+	ssize_t n;
+	size_t nb, k;
+	char *dst;
+
+	if (zpool_reserve(&job->src, &job->srccap, job->srclen + len) != 0) {
+		job->error = "Failed to allocate buffers";
+		job->error_code = ENOMEM;
+		return (-1);
+	}
+	if (cookie->map != NULL) {
+		nb = 0;
+		if (cookie->mt_in < cookie->map_len)
+			nb = min(cookie->map_len - cookie->mt_in, len);
+		memcpy((char *)job->src + job->srclen,
+		    cookie->map + cookie->mt_in, nb);
+		job->srclen += nb;
+		cookie->mt_in += nb;
+		ZSTATS_ADD(&cookie->st, in_bytes, nb);
+		return (nb);
+	}
+	if (cookie->pf != NULL) {
+		zprefetch_seek(cookie->pf, cookie->mt_in);
+		t = zstats_begin(&cookie->st);
+		n = zprefetch_read(cookie->pf, (char *)job->src + job->srclen,
+		    len);
+		if (n < 0) {
+			job->error = "error read core";
+			job->error_code = errno;
+			return (-1);
+		}
+		zstats_end(&cookie->st, ZSTATS_READ, t, n);
+		job->srclen += n;
+		cookie->mt_in += n;
+		return (n);
+	}
+	dst = (char *)job->src + job->srclen;
+	/* Bytes peeked at open sit in 'inbuf', which is otherwise unused. */
+	nb = min(cookie->ibuf.size - cookie->ibuf.pos, len);
+	memcpy(dst, (const char *)cookie->ibuf.src + cookie->ibuf.pos, nb);
+	cookie->ibuf.pos += nb;
+	if (cookie->replay_pos < cookie->replay_len) {
+		k = min(cookie->replay_len - cookie->replay_pos, len - nb);
+		memcpy(dst + nb, cookie->replay + cookie->replay_pos, k);
+		cookie->replay_pos += k;
+		nb += k;
+	}
+	t = zstats_begin(&cookie->st);
+	k = fread(dst + nb, 1, len - nb, cookie->in);
+	zstats_end(&cookie->st, ZSTATS_READ, t, k);
+	if (cookie->replay != NULL)
+		zstdfile_replay_add(cookie, dst + nb, k);
+	nb += k;
+	job->srclen += nb;
+	cookie->mt_in += nb;
+	if (ferror(cookie->in)) {
+		/* As in zstdfile_fill(). */
+		if (errno == ENOBUFS)
+			warnx("Error reading core stream, assuming truncated "
+			    "compression stream");
+		else {
+			job->error = "error read core";
+			job->error_code = errno;
+		}
+		return (-1);
+	}
+	return (nb);
+}
+
+/*
+ * Output size of the frame whose header is in 'job', if a worker may decode
+ * it: from its Frame_Content_Size, or else the index (as from a seek table)
+ * where another frame start follows it there.  Returns -1 if neither says,
+ * or the frame is bigger than a worker should buffer.
+ */
+static int
+zstdfile_mt_frame_size(const struct zstdfile *cookie,
+    const struct zpool_job *job, uint64_t *sizep)
+{
+	const struct zindex *index = &cookie->index;
+	unsigned long long fcs;
+	size_t lo, hi, mid;
+
+	fcs = ZSTD_getFrameContentSize(job->src, job->srclen);
+	if (fcs == ZSTD_CONTENTSIZE_ERROR)
+		return (-1);
+	if (fcs == ZSTD_CONTENTSIZE_UNKNOWN) {
+		/* Points are in input order too. */
+		lo = 0;
+		hi = index->npoints;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (index->points[mid].in < job->in_off)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == index->npoints || index->points[lo].in != job->in_off)
+			return (-1);
+		if (lo + 1 < index->npoints)
+			fcs = index->points[lo + 1].out - index->points[lo].out;
+		else if (index->complete)
+			fcs = index->total_out - index->points[lo].out;
+		else
+			return (-1);
+	}
+	if (fcs > ZSTDFILE_MT_FRAME_MAX)
+		return (-1);
+	*sizep = fcs;
+	return (0);
+}
+
+/*
+ * Read the next whole frame from the input into 'job', using only the frame
+ * and block headers to find its end.  Skippable frames are passed over.  A
+ * frame that zstdfile_mt_frame_size() won't size is left after its header,
+ * tagged ZSTDFILE_MT_SERIAL.  Returns 1 on success, 0 at a clean EOF, and -1
+ * if the input ends (or fails) mid-frame; 'job' then holds whatever was read.
+ */
+static int
+zstdfile_mt_readframe(struct zstdfile *cookie, struct zpool_job *job)
+{
+	const unsigned char *p;
+	uint32_t magic, bh;
+	size_t hsz, want, limit;
+	uint64_t size;
+	ssize_t n;
+	bool checksum;
+
+	for (;;) {
+		job->srclen = 0;
+		job->in_off = cookie->mt_in;
+		n = zstdfile_mt_input(cookie, job, 4);
+		if (n <= 0)
+			return (n);
+		if (n != 4)
+			return (-1);
+		magic = le32dec(job->src);
+		if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) !=
+		    ZSTD_MAGIC_SKIPPABLE_START)
+			break;
+		if (zstdfile_mt_input(cookie, job, 4) != 4)
+			return (-1);
+		want = le32dec((char *)job->src + 4);
+		if (zstdfile_mt_input(cookie, job, want) != (ssize_t)want)
+			return (-1);
+	}
+	if (magic != ZSTD_MAGICNUMBER) {
+		job->error = "Unknown frame descriptor";
+		return (1);
+	}
+
+	/* 4 bytes of magic plus the frame header descriptor */
+	if (zstdfile_mt_input(cookie, job, 1) != 1)
+		return (-1);
+	hsz = ZSTD_frameHeaderSize(job->src, job->srclen);
+	if (ZSTD_isError(hsz)) {
+		job->error = ZSTD_getErrorName(hsz);
+		return (1);
+	}
+	want = hsz - job->srclen;
+	if (zstdfile_mt_input(cookie, job, want) != (ssize_t)want)
+		return (-1);
+	checksum = (((unsigned char *)job->src)[4] & ZSTD_FHD_CHECKSUM_FLAG) != 0;
+
+	if (zstdfile_mt_frame_size(cookie, job, &size) != 0) {
+		job->tag |= ZSTDFILE_MT_SERIAL;
+		return (1);
+	}
+	job->aux[0] = size;
+	/* Nor is more input buffered than such a frame can take. */
+	limit = hsz + ZSTD_COMPRESSBOUND(size) + 4;
+
+	do {
+		if (zstdfile_mt_input(cookie, job, ZSTD_BLOCK_HEADER_SIZE) !=
+		    ZSTD_BLOCK_HEADER_SIZE)
+			return (-1);
+		p = (unsigned char *)job->src + job->srclen -
+		    ZSTD_BLOCK_HEADER_SIZE;
+		bh = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+		if (((bh >> 1) & 3) == ZSTD_BLOCK_RESERVED) {
+			job->error = "Corrupted block detected";
+			return (1);
+		}
+		want = ((bh >> 1) & 3) == ZSTD_BLOCK_RLE ? 1 : bh >> 3;
+		if (job->srclen + want > limit) {
+			job->error = "Frame larger than its recorded size";
+			return (1);
+		}
+		if (zstdfile_mt_input(cookie, job, want) != (ssize_t)want)
+			return (-1);
+	} while ((bh & 1) == 0);
+
+	if (checksum && zstdfile_mt_input(cookie, job, 4) != 4)
+		return (-1);
+	return (1);
+}
+
+/*
+ * Keep the workers busy: queue frames until the ring is full or the input
+ * runs out.  Queueing stops too at a frame left to the caller's thread, whose
+ * end is only found by decoding it.
+ */
+static void
+zstdfile_mt_queue(struct zstdfile *cookie)
+{
+	struct zpool_job *job;
+	int rc;
+
+	while (!cookie->mt_ineof && (job = zpool_slot(cookie->pool)) != NULL) {
+		rc = zstdfile_mt_readframe(cookie, job);
+		if (rc == 0) {
+			cookie->mt_ineof = true;
+			break;
+		}
+		if (rc < 0) {
+			job->tag |= ZSTDFILE_MT_TRUNC;
+			cookie->mt_ineof = true;
+		}
+		if ((job->tag & ZSTDFILE_MT_SERIAL) != 0)
+			cookie->mt_ineof = true;
+		zpool_submit(cookie->pool);
+	}
+}
+
+/*
+ * Start decoding the frame whose header 'job' holds on the caller's thread,
+ * with the serial decoder, picking the input up from the start of the frame.
+ */
+static void
+zstdfile_mt_serial_begin(struct zstdfile *cookie, struct zpool_job *job)
+{
+	size_t res;
+
+	res = ZSTD_DCtx_reset(cookie->decomp, ZSTD_reset_session_only);
+	assert(!ZSTD_isError(res));
+	cookie->obuf.pos = 0;
+	cookie->outbuf_start = 0;
+	cookie->frame_end = false;
+	cookie->mt_serial = true;
+	zstdfile_index_add(cookie, cookie->actual_len, job->in_off);
+
+	if (cookie->map != NULL || cookie->pf != NULL) {
+		/* Read by offset: just go back to the frame. */
+		cookie->ibuf.pos = cookie->ibuf.size = 0;
+		cookie->in_pos = job->in_off;
+		return;
+	}
+	/*
+	 * The header came out of 'ibuf' if anything is left there (input is
+	 * taken from it first), and is then just before 'ibuf.pos'.
+	 */
+	cookie->in_pos = cookie->mt_in +
+	    (cookie->ibuf.size - cookie->ibuf.pos);
+	if (cookie->ibuf.pos < cookie->ibuf.size) {
+		assert(cookie->ibuf.pos >= job->srclen);
+		cookie->ibuf.pos -= job->srclen;
+		return;
+	}
+	memcpy(cookie->inbuf, job->src, job->srclen);
+	cookie->ibuf.src = cookie->inbuf;
+	cookie->ibuf.pos = 0;
+	cookie->ibuf.size = job->srclen;
+}
+
+/*
+ * Output of the frame being decoded on the caller's thread, decoding more
+ * once it has been taken.  Returns the length at '*ptr', or 0 once the frame
+ * has failed (cookie->truncated) or ended; the workers then take over again
+ * with the input that follows it.
+ */
+static size_t
+zstdfile_mt_serial(struct zstdfile *cookie, const char **ptr)
+{
+
+	while (cookie->obuf.pos == cookie->outbuf_start) {
+		if (cookie->frame_end) {
+			cookie->mt_in = cookie->in_pos -
+			    (cookie->ibuf.size - cookie->ibuf.pos);
+			/* What is left of 'inbuf' is read from there. */
+			if (cookie->map != NULL || cookie->pf != NULL)
+				cookie->ibuf.pos = cookie->ibuf.size;
+			cookie->frame_end = false;
+			cookie->mt_serial = false;
+			cookie->mt_ineof = false;
+			return (0);
+		}
+		if (zstdfile_decode(cookie, NULL, 0, NULL) < 0)
+			return (0);
+	}
+	*ptr = &cookie->outbuf[cookie->outbuf_start];
+	return (cookie->obuf.pos - cookie->outbuf_start);
+}
+
+/*
+ * Drop any frames in flight; the next frame to queue is at input offset 'in'.
+ */
+static void
+zstdfile_mt_reset(struct zstdfile *cookie, uint64_t in)
+{
+
+	zpool_reset(cookie->pool);
+	cookie->mt_in = in;
+	cookie->mt_pos = 0;
+	cookie->mt_started = false;
+	cookie->mt_ineof = false;
+	cookie->mt_serial = false;
+}
+
+/*
+ * The output the caller has yet to take in multithreaded mode: the rest of
+ * the head job's, or of the frame decoded on the caller's thread.  Sets
+ * '*ptr' and returns its length, to be marked used by zstdfile_mt_take(); it
+ * stays valid until the next call.  Returns 0 with cookie->eof or
+ * cookie->truncated set when done.
+ */
+static size_t
+zstdfile_mt_avail(struct zstdfile *cookie, const char **ptr)
+{
+	struct zpool_job *job;
+	uint64_t t;
+	size_t n;
+	bool trunc;
+
+	for (;;) {
+		zstdfile_mt_queue(cookie);
+
+		t = zstats_begin(&cookie->st);
+		job = zpool_head(cookie->pool);
+		zstats_end(&cookie->st, ZSTATS_DECODE, t,
+		    job != NULL && !cookie->mt_started ? job->dstlen : 0);
+		if (job == NULL) {
+			cookie->eof = true;
+			zindex_set_complete(&cookie->index, cookie->actual_len);
+			zcache_feed_end(&cookie->cache, cookie->actual_len);
+			return (0);
+		}
+		if (job->error != NULL) {
+			zstdfile_fail(cookie, job->aux[1] != ZERROR_NONE ?
+			    (enum zerror_kind)job->aux[1] :
+			    zerror_code_kind(job->error_code),
+			    job->error_code != 0 ? job->error_code : EBADMSG,
+			    "zstd: %s", job->error);
+			return (0);
+		}
+		if ((job->tag & ZSTDFILE_MT_SERIAL) != 0) {
+			if (!cookie->mt_started) {
+				zstdfile_mt_serial_begin(cookie, job);
+				cookie->mt_started = true;
+			}
+			n = zstdfile_mt_serial(cookie, ptr);
+			if (n > 0 || cookie->truncated)
+				return (n);
+		} else {
+			if (!cookie->mt_started) {
+				zstdfile_index_add(cookie, cookie->actual_len,
+				    job->in_off);
+				zcache_feed(&cookie->cache, cookie->actual_len,
+				    job->dst, job->dstlen);
+				cookie->actual_len += job->dstlen;
+				cookie->mt_started = true;
+			}
+			if (cookie->mt_pos < job->dstlen) {
+				*ptr = (char *)job->dst + cookie->mt_pos;
+				return (job->dstlen - cookie->mt_pos);
+			}
+		}
+
+		/* Done with the head job; its output is no longer lent. */
+		trunc = (job->tag & ZSTDFILE_MT_TRUNC) != 0;
+		zpool_release(cookie->pool);
+		cookie->mt_pos = 0;
+		cookie->mt_started = false;
+		if (trunc) {
+			zstdfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+			    "truncated zstd stream");
+			return (0);
+		}
+	}
+}
+
+/* Mark 'n' bytes of what zstdfile_mt_avail() returned as used. */
+static void
+zstdfile_mt_take(struct zstdfile *cookie, size_t n)
+{
+
+	if (cookie->mt_serial)
+		cookie->outbuf_start += n;
+	else
+		cookie->mt_pos += n;
+}
+
+/*
+ * zstdfile_read() for multithreaded mode.  Returns the number of bytes read;
+ * sets cookie->eof or cookie->truncated when done.
+ */
+static ssize_t
+zstdfile_mt_read(struct zstdfile *cookie, char *buf, size_t size)
+{
+	const char *p;
+	ssize_t total = 0;
+	size_t avail, n;
+
+	while (size > 0) {
+		avail = zstdfile_mt_avail(cookie, &p);
+		if (avail == 0)
+			break;
+
+		/* Throw away output up to a pending forward seek. */
+		n = min(cookie->logic_offset - cookie->decode_offset,
+		    (uint64_t)avail);
+		zstdfile_mt_take(cookie, n);
+		cookie->decode_offset += n;
+		ZSTATS_ADD(&cookie->st, skip_bytes, n);
+		p += n;
+		avail -= n;
+
+		n = min(size, avail);
+		memcpy(buf, p, n);
+		ZSTATS_ADD(&cookie->st, copy_bytes, n);
+		zstdfile_mt_take(cookie, n);
+		buf += n;
+		size -= n;
+		total += n;
+		cookie->decode_offset += n;
+		cookie->logic_offset += n;
+	}
+	return (total);
+}
+
+/*
+ * zstdfile_next_chunk() for multithreaded mode: lend whatever is left of the
+ * head job's output (or of the frame decoded on this thread), releasing the
+ * previous job only now that its data is no longer borrowed.  Returns the
+ * length lent; 0 with cookie->eof or cookie->truncated set when done.
+ */
+static size_t
+zstdfile_mt_next(struct zstdfile *cookie, const void **ptr)
+{
+	const char *p;
+	size_t n;
+
+	n = zstdfile_mt_avail(cookie, &p);
+	if (n > 0) {
+		*ptr = p;
+		zstdfile_mt_take(cookie, n);
+	}
+	return (n);
+}
+
+/*
+ * Open zstd-compressed file 'path' as a (forward-)seekable (and rewindable),
+ * read-only stream.
+ *
+ * If 'path' isn't a zstd file, you still get a stream.
+ */
+FILE *
+zstdopenfile(FILE *in, const char *mode, bool *was_zstd)
+{
+
+	return (zstdopenfile_opts(in, mode, NULL, was_zstd));
+}
+
+/*
+ * Allocate and initialize the reader state for zstd-compressed 'in'.  Returns
+ * NULL (with errno set) on failure; 'in' is left open either way.
+ */
+static struct zstdfile *
+zstdfile_create(FILE *in, const struct zstdfile_opts *opts, const void *peek,
+    size_t len)
 {
-	size_t res;
+	struct zstdfile *cookie;
+	off_t pos;
 
-	cookie->logic_offset = 0;
-	cookie->decode_offset = 0;
-	cookie->actual_len = 0;
+	cookie = zstdfile_alloc();
+	if (cookie == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
 
-	cookie->decomp = ZSTD_createDCtx();
-	if (cookie->decomp == NULL) {
-		fprintf(stderr, "Failed to initialize zstd\n");
-		exit(1);
+	cookie->in = in;
+	cookie->index_path = NULL;
+	cookie->pool = NULL;
+	zerror_clear(&cookie->err);
+	cookie->reg.f = NULL;
+	zcache_file_init(&cookie->cache, opts != NULL && opts->cache ? in : NULL,
+	    ZINDEX_ZSTD);
+	zstats_init(&cookie->st, opts != NULL && opts->timing,
+	    opts != NULL ? opts->trace : NULL,
+	    opts != NULL ? opts->trace_arg : NULL);
+	cookie->verify = opts == NULL || opts->verify != ZSTDFILE_VERIFY_OFF;
+	if (zstdfile_dicts_get(cookie, opts) != 0) {
+		zstdfile_release(cookie);
+		return (NULL);
 	}
-	res = ZSTD_initDStream(cookie->decomp);
-	if (ZSTD_isError(res)) {
-		fprintf(stderr, "Failed to initialize decompression stream: %s\n",
-		    ZSTD_getErrorName(res));
-		exit(1);
+	zstdfile_dctx_params(cookie, cookie->decomp);
+	pos = ftello(in);
+	cookie->seekable = pos >= 0;
+	cookie->replay = NULL;
+	cookie->replay_len = cookie->replay_cap = cookie->replay_pos = 0;
+	cookie->replay_max = 0;
+	cookie->map = NULL;
+	if (opts != NULL && opts->use_mmap &&
+	    zmap_open(in, &cookie->map, &cookie->map_len) != 0)
+		cookie->map = NULL;
+	cookie->pf = NULL;
+	if (zstdfile_buffers(cookie, opts) == 0 && len > cookie->inbuf_size) {
+		free(cookie->inbuf);
+		cookie->inbuf = malloc(len);
+		cookie->inbuf_size = cookie->inbuf != NULL ? len : 0;
+	}
+	if (cookie->inbuf == NULL || cookie->outbuf == NULL) {
+		zmap_close(cookie->map, cookie->map_len);
+		zstdfile_dicts_put(cookie);
+		zstdfile_dispose(cookie);
+		errno = ENOMEM;
+		return (NULL);
 	}
 
-	cookie->inbuf_size = ZSTD_DStreamInSize();
-	cookie->ibuf.src = cookie->inbuf = malloc(cookie->inbuf_size);
-	cookie->ibuf.pos = cookie->ibuf.size = 0;
+	zindex_init(&cookie->index, 0, 0);
+	if ((opts == NULL || opts->index_path == NULL ||
+	    zindex_load(&cookie->index, opts->index_path, fileno(in),
+	    ZINDEX_ZSTD) != 0) && cookie->seekable) {
+		zstdfile_load_seektable(cookie);
+		if (ftello(in) != pos && fseeko(in, pos, SEEK_SET) != 0)
+			goto fail;
+	}
 
-	cookie->obuf.size = ZSTD_DStreamOutSize();
-	cookie->obuf.dst = cookie->outbuf = malloc(cookie->obuf.size);
-	cookie->obuf.pos = 0;
+	if (opts != NULL && opts->prefetch > 0 && cookie->map == NULL) {
+		cookie->pf = zprefetch_create(fileno(in), cookie->inbuf_size,
+		    opts->prefetch);
+		if (cookie->pf == NULL && errno != ESPIPE)
+			warn("input prefetch unavailable");
+	}
+	if (opts != NULL && opts->replay > 0 && !cookie->seekable) {
+		cookie->replay_max = opts->replay;
+		cookie->replay_cap = min(cookie->replay_max, cookie->inbuf_size);
+		cookie->replay = malloc(cookie->replay_cap);
+		if (cookie->replay != NULL)
+			zstdfile_replay_add(cookie, peek, len);
+	}
+	zstdfile_start(cookie, peek, len);
+
+	if (opts != NULL && opts->threads > 1) {
+		cookie->pool = zpool_create(opts->threads, 2 * opts->threads,
+		    zstdfile_mt_decode, zstdfile_mt_ctx_create,
+		    zstdfile_mt_ctx_free, cookie);
+		if (cookie->pool == NULL)
+			goto fail;
+		zstdfile_mt_reset(cookie, 0);
+	}
 
-	if (cookie->inbuf == NULL || cookie->outbuf == NULL) {
-		fprintf(stderr, "Failed to allocate buffers\n");
-		exit(1);
+	if (opts != NULL && opts->index_path != NULL && opts->index_save) {
+		cookie->index_path = strdup(opts->index_path);
+		if (cookie->index_path == NULL) {
+			errno = ENOMEM;
+			goto fail;
+		}
 	}
+	return (cookie);
 
-	cookie->outbuf_start = 0;
-	cookie->eof = false;
-	cookie->truncated = false;
+fail:
+	zstdfile_destroy(cookie);
+	return (NULL);
 }
 
+/* Free the reader state.  Does not close the input. */
 static void
-zstdfile_cleanup(struct zstdfile *cookie)
+zstdfile_destroy(struct zstdfile *cookie)
 {
 
-	ZSTD_freeDCtx(cookie->decomp);
-	cookie->decomp = NULL;
+	zerror_unregister(&cookie->reg);
+	zpool_destroy(cookie->pool);
+	zindex_free(&cookie->index);
+	free(cookie->index_path);
+	zmap_close(cookie->map, cookie->map_len);
+	zprefetch_destroy(cookie->pf);
+	free(cookie->replay);
+	zcache_file_free(&cookie->cache);
+	/*
+	 * A reset leaves a DCtx holding on to a set of dictionaries (it only
+	 * clears the current one), so such a DCtx isn't reused.
+	 */
+	if (cookie->ndicts > 1) {
+		ZSTD_freeDCtx(cookie->decomp);
+		cookie->decomp = NULL;
+	}
+	zstdfile_dicts_put(cookie);
+	zstdfile_release(cookie);
+}
 
-	free(cookie->inbuf);
-	free(cookie->outbuf);
-	cookie->ibuf.src = cookie->obuf.dst = cookie->inbuf = cookie->outbuf =
-	    NULL;
+/*
+ * Is 'in' (positioned at its start) zstd-compressed?  Returns 1 if so, with
+ * the magic number read into 'hdr', 0 if not, or -1 if it cannot be read.  As
+ * in zfile_sniff(), what was read is pushed back onto 'in' if it isn't zstd.
+ */
+static int
+zstdfile_sniff(FILE *in, unsigned char hdr[4])
+{
+	size_t nbr;
+
+	nbr = fread(hdr, 1, 4, in);
+	if (ferror(in))
+		return (-1);
+	if (nbr == 4 && le32dec(hdr) == ZSTD_MAGICNUMBER)
+		return (1);
+	while (nbr > 0)
+		if (ungetc(hdr[--nbr], in) == EOF)
+			return (-1);
+	return (0);
+}
+
+/* Put a FILE around a new reader, or destroy it. */
+static FILE *
+zstdfile_fopen(struct zstdfile *cookie, const char *mode,
+    const struct zstdfile_opts *opts)
+{
+	FILE *res;
+
+	if (opts != NULL && opts->readahead > 0)
+		res = zahead_fopencookie(cookie, mode, zstdfile_io,
+		    opts->readahead);
+	else
+		res = fopencookie(cookie, mode, zstdfile_io);
+	if (res == NULL)
+		zstdfile_destroy(cookie);
+	else
+		zerror_register(&cookie->reg, res, &cookie->err,
+		    &cookie->st.stats);
+	return (res);
 }
 
 /*
- * Open zstd-compressed file 'path' as a (forward-)seekable (and rewindable),
- * read-only stream.
- *
- * If 'path' isn't a zstd file, you still get a stream.
+ * As zstdopenfile(), with optional tunables 'opts' (may be NULL).
  */
 FILE *
-zstdopenfile(FILE *in, const char *mode, bool *was_zstd)
+zstdopenfile_opts(FILE *in, const char *mode,
+    const struct zstdfile_opts *opts, bool *was_zstd)
 {
 	unsigned char hdr[4];
 	struct zstdfile *cookie;
 	FILE *res;
-	size_t nbr;
+	int rc;
 
-	cookie = NULL;
-	res = NULL;
+	/* Writes compress (zstdfilew.c). */
 	if (strstr(mode, "w") || strstr(mode, "a")) {
-		errno = EINVAL;
-		goto out;
-	}
-
-	/* Check if file is a compressed stream: */
-	nbr = fread(hdr, 1, sizeof(hdr), in);
-	if (ferror(in)) {
-		goto out;
-	} else if (nbr < sizeof(hdr)) {
-		fprintf(stderr, "File truncated\n");
-		goto out;
+		res = zstdfilew_open(in, mode, opts);
+		if (res != NULL && was_zstd != NULL)
+			*was_zstd = true;
+		return (res);
 	}
 
-	rewind(in);
-
-	/* If not, just return the original FILE */
-	if (le32dec(hdr) != ZSTD_MAGICNUMBER) {
+	/* Check if file is a compressed stream; if not, return it as is. */
+	rc = zstdfile_sniff(in, hdr);
+	if (rc < 0)
+		return (NULL);
+	if (rc == 0) {
 		if (was_zstd != NULL)
 			*was_zstd = false;
 		return (in);
 	}
 
-	cookie = malloc(sizeof(*cookie));
-	if (cookie == NULL) {
-		errno = ENOMEM;
-		goto out;
+	cookie = zstdfile_create(in, opts, hdr, sizeof hdr);
+	if (cookie == NULL)
+		return (NULL);
+
+	res = zstdfile_fopen(cookie, mode, opts);
+	if (res != NULL && was_zstd != NULL)
+		*was_zstd = true;
+	return (res);
+}
+
+/*
+ * As zstdopenfile_opts(), for zstd input whose first 'len' bytes have already
+ * been read into 'peek'.
+ */
+FILE *
+zstdopenfile_peek(FILE *in, const char *mode,
+    const struct zstdfile_opts *opts, const void *peek, size_t len)
+{
+	struct zstdfile *cookie;
+
+	if (strstr(mode, "w") || strstr(mode, "a") || len < 4 ||
+	    le32dec(peek) != ZSTD_MAGICNUMBER) {
+		errno = EINVAL;
+		return (NULL);
 	}
 
-	cookie->in = in;
+	cookie = zstdfile_create(in, opts, peek, len);
+	if (cookie == NULL)
+		return (NULL);
+	return (zstdfile_fopen(cookie, mode, opts));
+}
 
-	zstdfile_init(cookie);
+/*
+ * Native interface: the same reader without a FILE around it.  Returns NULL
+ * with errno EINVAL if 'in' isn't zstd-compressed.  zstdfile_free() closes
+ * 'in'.
+ */
+struct zstdfile *
+zstdfile_new(FILE *in, const struct zstdfile_opts *opts)
+{
+	unsigned char hdr[4];
+	int rc;
 
-	res = fopencookie(cookie, mode, zstdfile_io);
+	rc = zstdfile_sniff(in, hdr);
+	if (rc <= 0) {
+		if (rc == 0)
+			errno = EINVAL;
+		return (NULL);
+	}
+	return (zstdfile_create(in, opts, hdr, sizeof hdr));
+}
 
-out:
-	if (res == NULL) {
-		if (cookie != NULL)
-			zstdfile_cleanup(cookie);
-		free(cookie);
-	} else if (was_zstd != NULL)
-		*was_zstd = true;
-	return (res);
+void
+zstdfile_error(const struct zstdfile *cookie, struct zerror *e)
+{
+
+	*e = cookie->err;
+}
+
+void
+zstdfile_stats(const struct zstdfile *cookie, struct zstats *s)
+{
+
+	zstats_copy(s, &cookie->st.stats);
+}
+
+void
+zstdfile_free(struct zstdfile *cookie)
+{
+	FILE *in = cookie->in;
+
+	if (cookie->index_path != NULL && cookie->index.dirty &&
+	    zindex_save(&cookie->index, cookie->index_path, fileno(in),
+	    ZINDEX_ZSTD) != 0)
+		warn("could not save frame index %s", cookie->index_path);
+	zstdfile_destroy(cookie);
+	fclose(in);
 }
 
 FILE *
 zstdopen(const char *path, const char *mode, bool *was_zstd)
 {
+
+	return (zstdopen_opts(path, mode, NULL, was_zstd));
+}
+
+/*
+ * As zstdopen(), with optional tunables 'opts' (may be NULL).
+ */
+FILE *
+zstdopen_opts(const char *path, const char *mode,
+    const struct zstdfile_opts *opts, bool *was_zstd)
+{
+	struct zstdfile_opts dflt;
+	char *idxpath;
 	FILE *res, *in;
 
 	in = fopen(path, mode);
 	if (in == NULL)
 		return (NULL);
 
-	res = zstdopenfile(in, mode, was_zstd);
+	/* Pick up (and maybe save) the "<path>.idx" sidecar by default. */
+	idxpath = NULL;
+	if (opts == NULL || opts->index_path == NULL) {
+		if (opts != NULL)
+			dflt = *opts;
+		else
+			memset(&dflt, 0, sizeof(dflt));
+		if (asprintf(&idxpath, "%s.idx", path) >= 0) {
+			dflt.index_path = idxpath;
+			opts = &dflt;
+		} else
+			idxpath = NULL;
+	}
+
+	res = zstdopenfile_opts(in, mode, opts, was_zstd);
+	free(idxpath);
 	if (res == NULL)
 		fclose(in);
 	return (res);
 }
 
+/*
+ * Refill the (empty) output buffer.  If 'dst' is non-NULL, decode straight
+ * into it instead (at most 'dstlen' bytes, reported in '*ndst'), leaving the
+ * output buffer empty.
+ *
+ * Returns 1 if it may have produced output, 0 at the end of the stream (with
+ * cookie->eof set) and -1 if the input is truncated.
+ */
+static int
+zstdfile_decode(struct zstdfile *cookie, char *dst, size_t dstlen,
+    size_t *ndst)
+{
+	ZSTD_outBuffer direct, *obuf;
+	enum zerror_kind kind;
+	char *nbuf;
+	uint64_t t;
+	ssize_t rc;
+	size_t ret;
+	int code;
+
+	if (ndst != NULL)
+		*ndst = 0;
+
+	/*
+	 * When ZSTD_decompressStream() returns zero, it indicates the end of a
+	 * complete *Zstd frame,* which is the equivalent of a *zlib stream.*
+	 * zlib frames are called blocks in zstd.  Mind the terminology gap.
+	 *
+	 * Another frame may follow (pzstd, cat a.zst b.zst); the decoder
+	 * picks it up by itself.  Only running out of input between frames is
+	 * a clean EOF.
+	 */
+	if (cookie->frame_end) {
+		if (cookie->ibuf.pos == cookie->ibuf.size) {
+			rc = zstdfile_fill(cookie);
+			if (rc < 0)
+				return (-1);
+			if (rc == 0) {
+				cookie->eof = true;
+				zindex_set_complete(&cookie->index,
+				    cookie->actual_len);
+				zcache_feed_end(&cookie->cache,
+				    cookie->actual_len);
+				return (0);
+			}
+		}
+		zstdfile_index_add(cookie, cookie->actual_len,
+		    cookie->in_pos - (cookie->ibuf.size - cookie->ibuf.pos));
+		cookie->frame_end = false;
+	} else if (cookie->ibuf.pos == cookie->ibuf.size) {
+		/* Read more input if empty */
+		rc = zstdfile_fill(cookie);
+		if (rc < 0)
+			return (-1);
+		if (rc == 0) {
+			zstdfile_fail(cookie, ZERROR_TRUNCATED, ENOBUFS,
+			    "truncated zstd stream");
+			return (-1);
+		}
+	}
+
+	/*
+	 * In adaptive mode, grow the output buffer while decodes keep filling
+	 * it.  Failure to grow is harmless.
+	 */
+	if (dst == NULL && cookie->adaptive &&
+	    cookie->obuf.pos == cookie->obuf.size &&
+	    cookie->obuf.size < cookie->outbuf_cfg) {
+		nbuf = realloc(cookie->outbuf, min(cookie->obuf.size * 2,
+		    cookie->outbuf_cfg));
+		if (nbuf != NULL) {
+			cookie->obuf.dst = cookie->outbuf = nbuf;
+			cookie->obuf.size = min(cookie->obuf.size * 2,
+			    cookie->outbuf_cfg);
+		}
+	}
+
+	/* Reset stream state to beginning of output buffer */
+	cookie->obuf.pos = 0;
+	cookie->outbuf_start = 0;
+
+	obuf = &cookie->obuf;
+	if (dst != NULL) {
+		direct.dst = dst;
+		direct.size = dstlen;
+		direct.pos = 0;
+		obuf = &direct;
+	}
+
+	t = zstats_begin(&cookie->st);
+	ret = ZSTD_decompressStream(cookie->decomp, obuf, &cookie->ibuf);
+	zstats_end(&cookie->st, ZSTATS_DECODE, t, obuf->pos);
+	if (ZSTD_isError(ret)) {
+		kind = zstdfile_error_kind(ret, &code);
+		zstdfile_fail(cookie, kind, code, "zstd: %s (%zu)",
+		    ZSTD_getErrorName(ret), ret);
+		return (-1);
+	}
+
+	zcache_feed(&cookie->cache, cookie->actual_len, obuf->dst, obuf->pos);
+	cookie->actual_len += obuf->pos;
+	if (dst != NULL)
+		*ndst = obuf->pos;
+	if (ret == 0)
+		cookie->frame_end = true;
+	return (1);
+}
+
 // Return number of bytes into buf, 0 on EOF, -1 on error. Update
 // stream offset.
 static ssize_t
 zstdfile_read(void *cookie_, char *buf, size_t size)
 {
 	struct zstdfile *cookie = cookie_;
-	size_t nb, ignorebytes;
+	size_t ignorebytes, direct;
 	ssize_t total = 0;
-	size_t ret;
+	bool end;
+	int rc;
 
 	assert(size <= SSIZE_MAX);
 
 	if (size == 0)
 		return 0;
 
+	/* Before EOF: a cached seek may have left the decoder past it. */
+	if (cookie->cache.on && !cookie->truncated) {
+		total = zstdfile_cache_read(cookie, buf, size, &end);
+		if (total < 0)
+			return -1;
+		buf += total;
+		size -= total;
+		if (size == 0 || end || cookie->eof)
+			goto out;
+	}
+
 	if (cookie->eof)
 		return 0;
 	/*
@@ -233,15 +1969,15 @@ zstdfile_read(void *cookie_, char *buf, size_t size)
 	if (cookie->truncated)
 		goto out;
 
-	ret = 1;
-
+	/* Bytes still to be thrown away for a forward seek */
 	ignorebytes = cookie->logic_offset - cookie->decode_offset;
-	assert(ignorebytes == 0);
 
+	if (cookie->pool != NULL) {
+		total += zstdfile_mt_read(cookie, buf, size);
+		goto out;
+	}
 
 	do {
-		size_t inflated;
-
 		/* Drain output buffer first */
 		while (cookie->obuf.pos > cookie->outbuf_start) {
 			size_t left = cookie->obuf.pos - cookie->outbuf_start;
@@ -253,6 +1989,7 @@ zstdfile_read(void *cookie_, char *buf, size_t size)
 				left -= ignoreskip;
 				cookie->outbuf_start += ignoreskip;
 				cookie->decode_offset += ignoreskip;
+				ZSTATS_ADD(&cookie->st, skip_bytes, ignoreskip);
 			}
 
 			// Ran out of output before we seek()ed up.
@@ -262,6 +1999,7 @@ zstdfile_read(void *cookie_, char *buf, size_t size)
 			toread = min(left, size);
 			memcpy(buf, &cookie->outbuf[cookie->outbuf_start],
 			    toread);
+			ZSTATS_ADD(&cookie->st, copy_bytes, toread);
 
 			buf += toread;
 			size -= toread;
@@ -285,58 +2023,22 @@ zstdfile_read(void *cookie_, char *buf, size_t size)
 		assert(cookie->obuf.pos == cookie->outbuf_start);
 
 		/*
-		 * When ZSTD_decompressStream() returns zero, it indicates the
-		 * end of a complete *Zstd frame,* which is the equivalent of a
-		 * *zlib stream.*  zlib frames are called blocks in zstd.  Mind
-		 * the terminology gap.
+		 * Reads at least as big as the output buffer are decoded in
+		 * place, saving a copy.
 		 */
-		if (ret == 0) {
-			cookie->eof = true;
+		if (size >= cookie->obuf.size && ignorebytes == 0) {
+			rc = zstdfile_decode(cookie, buf, size, &direct);
+			buf += direct;
+			size -= direct;
+			total += direct;
+			cookie->decode_offset += direct;
+			cookie->logic_offset += direct;
+		} else
+			rc = zstdfile_decode(cookie, NULL, 0, NULL);
+		if (rc < 0)
+			goto out;
+		if (rc == 0)
 			break;
-		}
-
-		/* Read more input if empty */
-		if (cookie->ibuf.pos == cookie->ibuf.size) {
-			nb = fread(cookie->inbuf, 1, cookie->inbuf_size,
-			    cookie->in);
-			if (ferror(cookie->in)) {
-				/*
-				 * Handle truncation errors from nested
-				 * compression streams.  Could be a false
-				 * positive if read(2) returned ENOBUFS
-				 * instead, but I don't see any harm.
-				 */
-				if (errno == ENOBUFS) {
-					warnx("Error reading core stream, "
-					    "assuming truncated compression "
-					    "stream");
-					cookie->truncated = true;
-					goto out;
-				} else
-					err(1, "error read core");
-			}
-			if (nb == 0 && feof(cookie->in)) {
-				warnx("truncated zstd stream");
-				cookie->truncated = true;
-				goto out;
-			}
-			cookie->ibuf.pos = 0;
-			cookie->ibuf.size = nb;
-		}
-
-		/* Reset stream state to beginning of output buffer */
-		cookie->obuf.pos = 0;
-		cookie->outbuf_start = 0;
-
-		ret = ZSTD_decompressStream(cookie->decomp, &cookie->obuf,
-		    &cookie->ibuf);
-		if (ZSTD_isError(ret)) {
-			warnx("zstd: %s (%zu)", ZSTD_getErrorName(ret), ret);
-			exit(1);
-		}
-
-		inflated = cookie->obuf.pos;
-		cookie->actual_len += inflated;
 	} while (!ferror(cookie->in) && size > 0);
 
 out:
@@ -344,8 +2046,10 @@ out:
 	/*
 	 * If there's anything left to read, return it as a short read.
 	 */
-	if (total > 0)
+	if (total > 0) {
+		ZSTATS_ADD(&cookie->st, out_bytes, total);
 		return (total);
+	}
 	/*
 	 * If the stream was truncated, report an error (which will translate
 	 * into ferror() on the stream for consumers).  I checked and it seems
@@ -357,72 +2061,274 @@ out:
 		/*
 		 * Other alternatives considered were EFTYPE (does not exist on
 		 * Linux) or EILSEQ (confusing error string in glibc: "Invalid
-		 * or incomplete multibyte or wide character").
+		 * or incomplete multibyte or wide character").  Errors other
+		 * than truncation have their own errno; see zerror.h.
 		 */
-		errno = ENOBUFS;
+		errno = cookie->err.code;
 		cookie->eof = true;
 		return (-1);
 	}
 	return (0);
 }
 
+/*
+ * Native interface: lend the next stretch of output (straight out of the
+ * decoder's buffer, or a worker's), valid until the next call.  Returns 1
+ * with a non-empty chunk, 0 at EOF and -1 (errno ENOBUFS if the input is
+ * truncated, as zstdfile_error() says otherwise) on error.
+ */
+int
+zstdfile_next_chunk(struct zstdfile *cookie, const void **ptr, size_t *len)
+{
+	size_t left;
+
+	assert(cookie->logic_offset == cookie->decode_offset);
+
+	for (;;) {
+		if (cookie->pool != NULL)
+			left = zstdfile_mt_next(cookie, ptr);
+		else {
+			left = cookie->obuf.pos - cookie->outbuf_start;
+			*ptr = &cookie->outbuf[cookie->outbuf_start];
+			cookie->outbuf_start += left;
+		}
+		if (left > 0) {
+			ZSTATS_ADD(&cookie->st, out_bytes, left);
+			*len = left;
+			cookie->decode_offset += left;
+			cookie->logic_offset += left;
+			return (1);
+		}
+		if (cookie->eof)
+			return (0);
+		if (cookie->truncated) {
+			/* As zstdfile_read() */
+			errno = cookie->err.code;
+			cookie->eof = true;
+			return (-1);
+		}
+		if (cookie->pool == NULL && zstdfile_decode(cookie, NULL, 0, NULL) == 0)
+			return (0);
+	}
+}
+
+/*
+ * As zstdfile_pread(), but leaving the file position of 'in' alone, so that
+ * decoding can carry on.  Fails if 'in' has no descriptor to pread(2).
+ */
+static int
+zstdfile_pread_at(struct zstdfile *cookie, void *buf, size_t len,
+    uint64_t off)
+{
+
+	if (cookie->map != NULL)
+		return (zstdfile_pread(cookie, buf, len, off));
+	if (pread(fileno(cookie->in), buf, len, off) != (ssize_t)len)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Find the length of the output without decoding to its end, for SEEK_END and
+ * zstdfile_size(): from a complete index, or else by summing the frames'
+ * Frame_Content_Size fields, stepping over each frame by its block headers
+ * (as zstdfile_mt_readframe() does) from the last frame start we know of.
+ * The frames are added to the index on the way, which is then complete.
+ * Returns -1 with errno ESPIPE if a frame doesn't record its size or the
+ * input can't be read at random; what else is wrong is left to the decoder.
+ */
+static int
+zstdfile_length(struct zstdfile *cookie, uint64_t *lenp)
+{
+	unsigned char hdr[ZSTD_FRAMEHEADERSIZE_MAX], bhdr[ZSTD_BLOCK_HEADER_SIZE];
+	const struct zindex_point *pt;
+	uint64_t in, out, insz, pos;
+	unsigned long long fcs;
+	struct stat sb;
+	uint32_t bh;
+	size_t n, hsz;
+
+	if (cookie->index.complete) {
+		*lenp = cookie->index.total_out;
+		return (0);
+	}
+	if (cookie->eof && !cookie->truncated) {
+		*lenp = cookie->actual_len;
+		return (0);
+	}
+
+	if (cookie->map != NULL)
+		insz = cookie->map_len;
+	else if (fstat(fileno(cookie->in), &sb) == 0 && S_ISREG(sb.st_mode))
+		insz = sb.st_size;
+	else
+		goto unknown;
+
+	in = out = 0;
+	if (cookie->index.npoints > 0) {
+		pt = &cookie->index.points[cookie->index.npoints - 1];
+		in = pt->in;
+		out = pt->out;
+	}
+	while (in < insz) {
+		n = min(sizeof hdr, insz - in);
+		if (n < 8 || zstdfile_pread_at(cookie, hdr, n, in) != 0)
+			goto unknown;
+		if ((le32dec(hdr) & ZSTD_MAGIC_SKIPPABLE_MASK) ==
+		    ZSTD_MAGIC_SKIPPABLE_START) {
+			in += 8 + (uint64_t)le32dec(&hdr[4]);
+			continue;
+		}
+
+		fcs = ZSTD_getFrameContentSize(hdr, n);
+		hsz = ZSTD_frameHeaderSize(hdr, n);
+		if (fcs == ZSTD_CONTENTSIZE_UNKNOWN ||
+		    fcs == ZSTD_CONTENTSIZE_ERROR || ZSTD_isError(hsz))
+			goto unknown;
+		pos = in + hsz;
+		do {
+			if (zstdfile_pread_at(cookie, bhdr, sizeof bhdr,
+			    pos) != 0)
+				goto unknown;
+			bh = bhdr[0] | (bhdr[1] << 8) | ((uint32_t)bhdr[2] << 16);
+			if (((bh >> 1) & 3) == ZSTD_BLOCK_RESERVED)
+				goto unknown;
+			pos += sizeof bhdr +
+			    (((bh >> 1) & 3) == ZSTD_BLOCK_RLE ? 1 : bh >> 3);
+		} while ((bh & 1) == 0);
+		if ((hdr[4] & ZSTD_FHD_CHECKSUM_FLAG) != 0)
+			pos += 4;
+		if (pos > insz)
+			goto unknown;
+
+		zstdfile_index_add(cookie, out, in);
+		in = pos;
+		out += fcs;
+	}
+
+	zindex_set_complete(&cookie->index, out);
+	*lenp = out;
+	return (0);
+
+unknown:
+	errno = ESPIPE;
+	return (-1);
+}
+
+int
+zstdfile_size(struct zstdfile *cookie, uint64_t *lenp)
+{
+
+	return (zstdfile_length(cookie, lenp));
+}
+
+/*
+ * Move the decoder for a seek to 'new_offset' (lazily, if forward) and make
+ * it the logical offset.  Returns -1 if it can't get there.
+ */
+static int
+zstdfile_seek_to(struct zstdfile *cookie, off64_t new_offset)
+{
+
+	/*
+	 * With a seek table, restart at the frame containing the target
+	 * unless it is the one we are already decoding.
+	 */
+	if (new_offset != 0 && cookie->index.npoints > 0) {
+		const struct zindex_point *pt;
+
+		pt = zindex_lookup(&cookie->index, new_offset);
+		if (pt != NULL && (pt->out > cookie->decode_offset ||
+		    (uint64_t)new_offset < cookie->decode_offset)) {
+			if (zstdfile_index_restore(cookie, pt) != 0) {
+				(void)zstdfile_restart(cookie);
+				return (-1);
+			}
+			ZSTATS_ADD(&cookie->st, jumps, 1);
+		}
+	}
+
+	/* Backward seeks to anywhere but 0 are not ok */
+	if (new_offset < (off64_t)cookie->decode_offset && new_offset != 0) {
+		return (-1);
+	}
+
+	if (new_offset == 0 && zstdfile_restart(cookie) != 0) {
+		/* As in zfile_seek(): nothing to redo if nothing decoded. */
+		if (cookie->decode_offset != 0)
+			return (-1);
+	}
+
+	/*
+	 * Forward seeks are lazy: the next read discards output up to here.
+	 * (A seek past EOF thus succeeds, as with lseek(2), and the next read
+	 * returns EOF.)
+	 */
+	cookie->logic_offset = new_offset;
+	return (0);
+}
+
+/*
+ * Serve what the block cache holds of a read at the logical offset, then
+ * move the decoder to where the rest must come from, as zfile_cache_read()
+ * does.  (With workers, output they have ready isn't looked for first.)
+ */
+static ssize_t
+zstdfile_cache_read(struct zstdfile *cookie, char *buf, size_t size,
+    bool *endp)
+{
+	uint64_t off;
+	size_t n;
+
+	*endp = false;
+	off = cookie->logic_offset;
+	if (cookie->pool == NULL && off >= cookie->decode_offset &&
+	    off < cookie->decode_offset + (cookie->obuf.pos -
+	    cookie->outbuf_start))
+		return (0);
+	n = zcache_read(&cookie->cache, off, buf, size, endp);
+	ZSTATS_ADD(&cookie->st, cache_bytes, n);
+	off += n;
+	cookie->logic_offset = off;
+	if (n == size || *endp || off == cookie->decode_offset)
+		return (n);
+
+	if (zstdfile_seek_to(cookie, off) != 0) {
+		if (zstdfile_restart(cookie) != 0)
+			return (-1);
+		cookie->logic_offset = off;
+	}
+	return (n);
+}
+
 static int
 zstdfile_seek(void *cookie_, off64_t *offset_, int whence)
 {
 	struct zstdfile *cookie = cookie_;
 	off64_t new_offset = 0, offset = *offset_;
+	uint64_t len;
 
 	if (whence == SEEK_SET) {
 		new_offset = offset;
 	} else if (whence == SEEK_CUR) {
 		new_offset = (off64_t)cookie->logic_offset + offset;
+	} else if (zstdfile_length(cookie, &len) == 0) {
+		/* The frame starts found then serve as for any other seek. */
+		new_offset = (off64_t)len + offset;
 	} else {
-		/* SEEK_END not ok */
+		/* SEEK_END not ok without decoding to the end */
 		return (-1);
 	}
 
 	if (new_offset < 0)
 		return (-1);
+	zstats_seek(&cookie->st, cookie->logic_offset, new_offset);
 
-	/* Backward seeks to anywhere but 0 are not ok */
-	if (new_offset < (off64_t)cookie->logic_offset && new_offset != 0) {
+	/* Cached targets are served from the cache, as in zfile_seek(). */
+	if (zcache_has(&cookie->cache, new_offset))
+		cookie->logic_offset = new_offset;
+	else if (zstdfile_seek_to(cookie, new_offset) != 0)
 		return (-1);
-	}
-
-	if (new_offset == 0) {
-		/* rewind(3) */
-		zstdfile_cleanup(cookie);
-		rewind(cookie->in);
-		zstdfile_init(cookie);
-	} else if ((uint64_t)new_offset > cookie->logic_offset) {
-		/* Emulate forward seek by skipping ... */
-		char *buf;
-		const size_t bsz = 32*1024;
-		fprintf(stderr, "XXX Seek: Skipping %zu bytes\n",
-		    (uint64_t)new_offset - cookie->logic_offset);
-
-		buf = malloc(bsz);
-		while ((uint64_t)new_offset > cookie->logic_offset) {
-			size_t diff = min(bsz,
-			    (uint64_t)new_offset - cookie->logic_offset);
-			ssize_t err = zstdfile_read(cookie_, buf, diff);
-			if (err < 0) {
-				free(buf);
-				return (-1);
-			}
-
-			/* Seek past EOF gets positioned at EOF */
-			if (err == 0) {
-				assert(cookie->eof);
-				new_offset = cookie->logic_offset;
-				break;
-			}
-		}
-		free(buf);
-	}
-
-	assert(cookie->logic_offset == (uint64_t)new_offset);
-
 	*offset_ = new_offset;
 	return (0);
 }
@@ -430,11 +2336,7 @@ zstdfile_seek(void *cookie_, off64_t *offset_, int whence)
 static int
 zstdfile_close(void *cookie_)
 {
-	struct zstdfile *cookie = cookie_;
-
-	zstdfile_cleanup(cookie);
-	fclose(cookie->in);
-	free(cookie);
 
+	zstdfile_free(cookie_);
 	return 0;
 }
@@ -1,4 +1,207 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zerror.h"
+#include "zstats.h"
+
+/*
+ * Optional tunables for zstdopen_opts() / zstdopenfile_opts().  A zeroed
+ * struct (or a NULL pointer) gives the same behavior as zstdopen() /
+ * zstdopenfile().
+ */
+enum zstdfile_verify {
+	ZSTDFILE_VERIFY_END = 0,
+	ZSTDFILE_VERIFY_OFF,
+	ZSTDFILE_VERIFY_FRAME,
+};
+
+struct zstdfile_opts {
+	/*
+	 * Sidecar file holding a previously saved frame index (see zindex.h).
+	 * It is used instead of decoding to find frames if it matches the
+	 * size and mtime of the input.  zstdopen() and zstdopen_opts() default
+	 * this to "<path>.idx".
+	 */
+	const char *index_path;
+	/* Write the frame index back to 'index_path' on close if it grew. */
+	bool index_save;
+
+	/*
+	 * If greater than one, decode frames in parallel on this many worker
+	 * threads, each with its own DCtx.  Input frames are read on the
+	 * caller's thread and returned in order.  A worker buffers a frame
+	 * whole, so it only gets frames whose output size is known (from the
+	 * frame header, or a seek table) and at most 4 MB, as the seekable
+	 * format and the writer's 'frame_size' give them.  Other frames, such
+	 * as the single one 'zstd -T0' writes, are decoded streaming on the
+	 * caller's thread, and gain nothing.
+	 */
+	unsigned threads;
+	/*
+	 * If non-zero, decompress on a separate thread, keeping up to this
+	 * many 256 kB buffers of output ready ahead of the reader (see
+	 * zahead.h).
+	 */
+	unsigned readahead;
+
+	/*
+	 * Compressed input and decompressed output buffer sizes; 0 selects
+	 * zstd's recommended ZSTD_DStreamInSize() and ZSTD_DStreamOutSize().
+	 */
+	size_t inbuf_size, outbuf_size;
+	/*
+	 * Tune the buffers to the stream, as for zfile_opts: fit the input
+	 * buffer to small files and grow it (up to 4 MB) while the source is
+	 * slow; start the output buffer at 32 kB and grow it up to
+	 * 'outbuf_size' while decodes keep filling it.
+	 */
+	bool adaptive;
+
+	/*
+	 * If the input is a regular file, mmap(2) it whole and point the decoder
+	 * straight at the mapping instead of fread()ing it; otherwise this is
+	 * ignored.  The file must not shrink while open.
+	 */
+	bool use_mmap;
+	/*
+	 * If non-zero and the input is a regular file or block device (and
+	 * not mapped), keep this many reads of 'inbuf_size' bytes in flight
+	 * ahead of the decoder (see zprefetch.h), for cold files on slow
+	 * devices.
+	 */
+	unsigned prefetch;
+	/* Rewinding an input that can't seek, as for zfile_opts. */
+	size_t replay;
+
+	/* Counters and tracing, as for zfile_opts (see zstats.h). */
+	bool timing;
+	zstats_hook *trace;
+	void *trace_arg;
+	/* Use the shared block cache, as for zfile_opts (see zcache.h). */
+	bool cache;
+
+	/*
+	 * Checksum policy.  By default libzstd checks the content checksum
+	 * (XXH64) of each frame that has one as the frame ends, and a
+	 * mismatch is fatal; zstd can't check a frame before its end, so
+	 * ZSTDFILE_VERIFY_END and ZSTDFILE_VERIFY_FRAME are the same.
+	 * ZSTDFILE_VERIFY_OFF skips the hashing altogether.
+	 */
+	enum zstdfile_verify verify;
+
+	/*
+	 * Dictionaries for reading frames compressed with one (see
+	 * zstdfile_dict_create()).  A single dictionary is used for every
+	 * frame; with several, each frame gets the one whose ID it records,
+	 * which needs a libzstd with ZSTD_d_refMultipleDDicts (1.4.9 on) and
+	 * otherwise fails the open with ENOTSUP.  The stream holds its own
+	 * references, so the caller may free its dictionaries once open.
+	 */
+	struct zstdfile_dict *const *dicts;
+	size_t ndicts;
+	/*
+	 * Largest window (log2 bytes) a frame may ask the decoder for, or 0
+	 * for libzstd's default of 27 (128 MB).  Raise it to read archives
+	 * written with 'zstd --long' (up to 31), or lower it to bound memory;
+	 * a frame over the limit fails with ENOMEM (ZERROR_NOMEM).  Values
+	 * libzstd doesn't accept fail the open with EINVAL.
+	 */
+	unsigned window_log_max;
+
+	/*
+	 * Writing (modes "w" and "a", which append frames): compression
+	 * 'level' as for zstd(1), 0 selecting its default (3); 'window_log'
+	 * (0 for the level's default); and 'threads', if greater than 1,
+	 * compresses on that many ZSTD_c_nbWorkers threads.  A non-zero
+	 * 'frame_size' ends the frame and starts another every 'frame_size'
+	 * bytes of input, so that readers can decode frames in parallel and
+	 * restart at any of them.  Frames carry a content checksum unless
+	 * 'verify' is ZSTDFILE_VERIFY_OFF.
+	 */
+	int level;
+	unsigned window_log;
+	uint64_t frame_size;
+};
+
+/*
+ * A digested decompression dictionary, built once (from the dictionary's
+ * bytes, or the file at 'path', as 'zstd --train' writes) and shared by any
+ * number of streams, on any threads.  zstdfile_dict_id() is the ID frames
+ * compressed with it record (0 for a raw content dictionary).
+ * zstdfile_dict_free() drops the caller's reference; open streams keep
+ * theirs.
+ */
+struct zstdfile_dict;
+struct zstdfile_dict *zstdfile_dict_create(const void *buf, size_t len);
+struct zstdfile_dict *zstdfile_dict_load(const char *path);
+unsigned zstdfile_dict_id(const struct zstdfile_dict *);
+void zstdfile_dict_free(struct zstdfile_dict *);
+
 FILE *zstdopen(const char *path, const char *mode, bool *was_zstd);
 FILE *zstdopenfile(FILE *in, const char *mode, bool *was_zstd);
+FILE *zstdopen_opts(const char *path, const char *mode,
+    const struct zstdfile_opts *opts, bool *was_zstd);
+FILE *zstdopenfile_opts(FILE *in, const char *mode,
+    const struct zstdfile_opts *opts, bool *was_zstd);
+
+/*
+ * As zstdopenfile_opts(), for an 'in' whose first 'len' bytes have already
+ * been read into 'peek'; as for zopenfile_peek(), 'in' need not be seekable.
+ * Fails with EINVAL unless they start a zstd frame.
+ */
+FILE *zstdopenfile_peek(FILE *in, const char *mode,
+    const struct zstdfile_opts *opts, const void *peek, size_t len);
+
+/*
+ * Native interface, for callers that only need to look at the output: each
+ * zstdfile_next_chunk() lends a pointer into the decoder's own buffer (or a
+ * worker's), valid until the next call, instead of copying through stdio.
+ * 'readahead' does not apply.
+ *
+ * The zstdfile takes ownership of 'in', and zstdfile_free() fclose()s it.
+ * If zstdfile_new() fails (with EINVAL if 'in' doesn't start a zstd
+ * frame), 'in' stays open and is still the caller's.
+ */
+struct zstdfile;
+struct zstdfile *zstdfile_new(FILE *in, const struct zstdfile_opts *opts);
+int zstdfile_next_chunk(struct zstdfile *, const void **ptr, size_t *len);
+void zstdfile_free(struct zstdfile *);
+
+/* As zfile_error(). */
+void zstdfile_error(const struct zstdfile *, struct zerror *e);
+void zstdfile_stats(const struct zstdfile *, struct zstats *s);
+
+/*
+ * Length of the output, as SEEK_END finds it: from a seek table or complete
+ * index, or else the frames' content sizes (read from their headers, which
+ * leaves the index complete).  Fails with ESPIPE if a frame doesn't record
+ * its size (as streamed 'zstd' output doesn't) or the input isn't a file.
+ */
+int zstdfile_size(struct zstdfile *, uint64_t *len);
+
+/*
+ * Closed readers are kept (up to a few) for reuse by later opens.  This
+ * frees them, e.g. before checking for leaks at exit.
+ */
+void zstdfile_pool_flush(void);
+
+/*
+ * Apply the reading options of 'opts' ('verify', 'dicts', 'window_log_max')
+ * to a caller's own DCtx, for decoding without a stream as zbatch.c does.
+ * The dictionaries must outlive the DCtx's use of them.  Fails as
+ * zstdopen_opts() would for the same options, with errno set.
+ */
+struct ZSTD_DCtx_s;
+int zstdfile_dctx_setup(struct ZSTD_DCtx_s *dctx,
+    const struct zstdfile_opts *opts);
+
+/*
+ * How the readers report libzstd decoding error 'ret': returns the kind,
+ * with the errno in '*codep'.  A frame needing a bigger window than
+ * 'window_log_max' allows is ZERROR_NOMEM (ENOMEM), a frame failing its
+ * checksum ZERROR_CHECKSUM, and anything else ZERROR_CORRUPT (both EBADMSG).
+ */
+enum zerror_kind zstdfile_error_kind(size_t ret, int *codep);
@@ -0,0 +1,305 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#if defined(__FreeBSD__)
+#define _BSD_SOURCE
+#else
+#define _GNU_SOURCE
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#else
+#include <bsd/sys/endian.h>
+#endif
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* For ZSTD_MAGIC_SKIPPABLE_START */
+#define ZSTD_STATIC_LINKING_ONLY	1
+#include <zstd.h>
+
+#include "zstdfile.h"
+#include "zstdfilew.h"
+
+/* Seek table trailer, as read by zstdfile.c (contrib/seekable_format) */
+#define ZSTD_SEEKABLE_MAGICNUMBER	0x8F92EAB1
+#define ZSTD_SEEKTABLE_FOOTER_SIZE	9
+
+struct zstdfilew {
+	FILE *out;
+	ZSTD_CCtx *cctx;
+	void *outbuf;
+	size_t outbuf_size;
+
+	uint64_t frame_size;
+	uint64_t total_in;	// Input so far, for ftell(3)
+	uint64_t frame_in;	// ... and in the current frame
+	uint64_t frame_out;	// Its output so far
+	bool frame_open;
+	bool failed;		// Output failed; refuse further writes
+
+	/*
+	 * With 'frame_size', and unless appending, the frames' sizes, for a
+	 * seek table written at close (as (compressed, decompressed) pairs).
+	 * NULL once a frame doesn't fit an entry.
+	 */
+	uint32_t *table;
+	size_t nframes, table_cap;
+};
+
+static cookie_write_function_t zstdfilew_write;
+static cookie_seek_function_t zstdfilew_seek;
+static cookie_close_function_t zstdfilew_close;
+
+static const cookie_io_functions_t zstdfilew_io = {
+	.read = NULL,
+	.write = zstdfilew_write,
+	.seek = zstdfilew_seek,
+	.close = zstdfilew_close,
+};
+
+static int
+zstdfilew_put(struct zstdfilew *w, const void *buf, size_t len)
+{
+
+	if (len > 0 && fwrite(buf, 1, len, w->out) != len) {
+		w->failed = true;
+		return (-1);
+	}
+	w->frame_out += len;
+	return (0);
+}
+
+/*
+ * Feed 'len' bytes of input to the compressor (none, to end the frame) and
+ * write out what it gives back.
+ */
+static int
+zstdfilew_compress(struct zstdfilew *w, const void *buf, size_t len,
+    ZSTD_EndDirective end)
+{
+	ZSTD_inBuffer ib = { buf, len, 0 };
+	ZSTD_outBuffer ob;
+	size_t rem;
+
+	do {
+		ob.dst = w->outbuf;
+		ob.size = w->outbuf_size;
+		ob.pos = 0;
+		rem = ZSTD_compressStream2(w->cctx, &ob, &ib, end);
+		if (ZSTD_isError(rem)) {
+			warnx("zstd: %s", ZSTD_getErrorName(rem));
+			w->failed = true;
+			errno = EIO;
+			return (-1);
+		}
+		if (zstdfilew_put(w, ob.dst, ob.pos) != 0)
+			return (-1);
+	} while (end == ZSTD_e_continue ? ib.pos < ib.size : rem != 0);
+	return (0);
+}
+
+static int
+zstdfilew_end(struct zstdfilew *w)
+{
+	uint32_t *p;
+
+	if (zstdfilew_compress(w, NULL, 0, ZSTD_e_end) != 0)
+		return (-1);
+	w->frame_open = false;
+
+	if (w->table == NULL)
+		return (0);
+	if (w->frame_out > UINT32_MAX || w->frame_in > UINT32_MAX) {
+		free(w->table);
+		w->table = NULL;
+		return (0);
+	}
+	if (w->nframes == w->table_cap) {
+		p = reallocarray(w->table, 2 * w->table_cap, 2 * sizeof *p);
+		if (p == NULL) {
+			free(w->table);
+			w->table = NULL;
+			return (0);
+		}
+		w->table = p;
+		w->table_cap *= 2;
+	}
+	w->table[2 * w->nframes] = w->frame_out;
+	w->table[2 * w->nframes + 1] = w->frame_in;
+	w->nframes++;
+	return (0);
+}
+
+/* A skippable frame of entries plus the footer, without checksums. */
+static int
+zstdfilew_seek_table(struct zstdfilew *w)
+{
+	unsigned char b[ZSTD_SEEKTABLE_FOOTER_SIZE];
+	size_t i;
+
+	le32enc(&b[0], ZSTD_MAGIC_SKIPPABLE_START | 0xE);
+	le32enc(&b[4], 8 * w->nframes + ZSTD_SEEKTABLE_FOOTER_SIZE);
+	if (zstdfilew_put(w, b, 8) != 0)
+		return (-1);
+	for (i = 0; i < w->nframes; i++) {
+		le32enc(&b[0], w->table[2 * i]);
+		le32enc(&b[4], w->table[2 * i + 1]);
+		if (zstdfilew_put(w, b, 8) != 0)
+			return (-1);
+	}
+	le32enc(&b[0], w->nframes);
+	b[4] = 0;
+	le32enc(&b[5], ZSTD_SEEKABLE_MAGICNUMBER);
+	return (zstdfilew_put(w, b, sizeof b));
+}
+
+static ssize_t
+zstdfilew_write(void *cookie, const char *buf, size_t size)
+{
+	struct zstdfilew *w = cookie;
+	size_t done, n;
+
+	if (w->failed) {
+		errno = EIO;
+		return (-1);
+	}
+	for (done = 0; done < size; done += n) {
+		if (!w->frame_open) {
+			w->frame_open = true;
+			w->frame_in = w->frame_out = 0;
+		}
+		n = size - done;
+		if (w->frame_size != 0 && n > w->frame_size - w->frame_in)
+			n = w->frame_size - w->frame_in;
+		if (zstdfilew_compress(w, buf + done, n, ZSTD_e_continue) != 0)
+			return (-1);
+		w->frame_in += n;
+		w->total_in += n;
+		if (w->frame_in == w->frame_size && zstdfilew_end(w) != 0)
+			return (-1);
+	}
+	return (size);
+}
+
+/* Only ftell(3) works: the offset is in the uncompressed data written. */
+static int
+zstdfilew_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct zstdfilew *w = cookie;
+
+	if (whence != SEEK_CUR || *offset != 0) {
+		errno = ESPIPE;
+		return (-1);
+	}
+	*offset = w->total_in;
+	return (0);
+}
+
+static void
+zstdfilew_free(struct zstdfilew *w)
+{
+
+	ZSTD_freeCCtx(w->cctx);
+	free(w->outbuf);
+	free(w->table);
+	free(w);
+}
+
+static int
+zstdfilew_close(void *cookie)
+{
+	struct zstdfilew *w = cookie;
+	int rc;
+
+	rc = 0;
+	if (!w->failed) {
+		/* Even empty output is a (one-frame) zstd file. */
+		if (w->frame_open || w->total_in == 0)
+			rc = zstdfilew_end(w);
+		if (rc == 0 && w->table != NULL)
+			rc = zstdfilew_seek_table(w);
+	}
+	if (w->failed)
+		rc = -1;
+	if (fclose(w->out) != 0)
+		rc = -1;
+	zstdfilew_free(w);
+	return (rc);
+}
+
+static bool
+zstdfilew_set(struct zstdfilew *w, ZSTD_cParameter param, int value)
+{
+
+	return (!ZSTD_isError(ZSTD_CCtx_setParameter(w->cctx, param, value)));
+}
+
+FILE *
+zstdfilew_open(FILE *out, const char *mode, const struct zstdfile_opts *opts)
+{
+	struct zstdfilew *w;
+	FILE *res;
+
+	if (strchr(mode, 'r') != NULL || strchr(mode, '+') != NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return (NULL);
+	w->out = out;
+	w->cctx = ZSTD_createCCtx();
+	w->outbuf_size = ZSTD_CStreamOutSize();
+	w->outbuf = malloc(w->outbuf_size);
+	if (w->cctx == NULL || w->outbuf == NULL) {
+		zstdfilew_free(w);
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	if (!zstdfilew_set(w, ZSTD_c_checksumFlag, opts == NULL ||
+	    opts->verify != ZSTDFILE_VERIFY_OFF))
+		goto inval;
+	if (opts != NULL) {
+		if ((opts->level != 0 &&
+		    !zstdfilew_set(w, ZSTD_c_compressionLevel, opts->level)) ||
+		    (opts->window_log != 0 &&
+		    !zstdfilew_set(w, ZSTD_c_windowLog, opts->window_log)))
+			goto inval;
+		if (opts->threads > 1 &&
+		    !zstdfilew_set(w, ZSTD_c_nbWorkers, opts->threads))
+			warnx("zstd: no multithreading support, compressing "
+			    "serially");
+		w->frame_size = opts->frame_size;
+	}
+
+	if (w->frame_size != 0 && strchr(mode, 'a') == NULL) {
+		w->table_cap = 16;
+		w->table = calloc(w->table_cap, 2 * sizeof *w->table);
+	}
+
+	res = fopencookie(w, mode, zstdfilew_io);
+	if (res == NULL)
+		zstdfilew_free(w);
+	return (res);
+
+inval:
+	zstdfilew_free(w);
+	errno = EINVAL;
+	return (NULL);
+}
@@ -0,0 +1,25 @@
+/*
+ * Zlib-FILE
+ *
+ * Copyright 2013 Conrad Meyer <cemeyer@uw.edu>
+ *
+ * Released under the terms of the MIT license; see LICENSE.
+ */
+
+#ifndef ZSTDFILEW_H
+#define ZSTDFILEW_H
+
+#include <stdio.h>
+
+#include "zstdfile.h"
+
+/*
+ * The zstd writer behind zstdopenfile_opts() in modes "w" and "a": returns a
+ * write-only stream compressing onto 'out', which it closes when closed
+ * itself.  On failure, NULL is returned (with errno set) and 'out' is left
+ * open.
+ */
+FILE *zstdfilew_open(FILE *out, const char *mode,
+    const struct zstdfile_opts *opts);
+
+#endif